@@ -0,0 +1,1826 @@
+/*
+ * ProFTPD - mod_fsquota cache
+ * Copyright (c) 2013-2021 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_fsquota.h"
+#include "fsquota.h"
+#include "cache.h"
+#include "index.h"
+#include "mounts.h"
+#include "shm.h"
+
+#ifdef HAVE_SYS_STATVFS_H
+# include <sys/statvfs.h>
+#endif
+
+/* Quota values, per filesystem/type/ID.  Failed lookups are cached as well,
+ * so that filesystems without quota support are not queried over and over.
+ */
+struct fsquota_entry {
+  dev_t dev;
+  int type;
+  unsigned long id;
+
+  time_t get_ts;
+  int get_res, get_errno;
+
+  /* Set when the kernel reports a change to this ID's usage; the values are
+   * kept, for use if the refresh is throttled.
+   */
+  int stale;
+  uint64_t kb_total, kb_used, file_total, file_used;
+  uint64_t kb_hard, file_hard;
+
+  time_t enabled_ts;
+  int enabled_res, enabled_errno, enabled;
+
+  /* Whether the usage was last seen below the limits, or over the soft or
+   * hard ones, for noticing transitions; see cache_check_state().
+   */
+  int state;
+};
+
+#define FSQUOTA_CACHE_STATE_UNKNOWN	0
+#define FSQUOTA_CACHE_STATE_BELOW	1
+#define FSQUOTA_CACHE_STATE_SOFT	2
+#define FSQUOTA_CACHE_STATE_HARD	3
+
+/* Free space, per filesystem. */
+struct fsquota_fs_entry {
+  dev_t dev;
+
+  time_t avail_ts;
+  int avail_res, avail_errno;
+  uint64_t kb_avail;
+};
+
+/* The highest FSQuotaWarn threshold announced, per filesystem and type/ID;
+ * kept apart from the entries, so that flushes do not re-announce them.
+ */
+struct fsquota_warned {
+  dev_t dev;
+  int type;
+  unsigned long id;
+  int pct;
+};
+
+static pool *cache_pool = NULL;
+static array_header *cache_entries = NULL;
+static array_header *cache_fs_entries = NULL;
+static array_header *cache_warned = NULL;
+static unsigned int cache_ttl = FSQUOTA_CACHE_DEFAULT_TTL;
+
+/* Token bucket limiting the rate of actual kernel queries; a rate of zero
+ * means no limit.
+ */
+static double cache_query_rate = 0.0;
+static double cache_query_burst = 0.0;
+static double cache_query_tokens = 0.0;
+static struct timeval cache_query_refill_tv;
+
+static struct fsquota_cache_stats cache_stats;
+
+#ifdef PR_USE_MEMCACHE
+/* Optional second-level cache, shared through memcached by every node
+ * serving the same filesystems.  Values are keyed by the filesystem's mount
+ * source (e.g. "server:/export") rather than its device number, which
+ * differs between nodes; they carry a format version and the time of the
+ * query, so that older/newer nodes ignore what they cannot read.
+ *
+ * Only the sources of network filesystems name the same filesystem on every
+ * node; a local source such as /dev/sda1 does not, so the keys of local
+ * filesystems also carry this node's machine ID.
+ */
+static pr_memcache_t *cache_mcache = NULL;
+static unsigned int cache_mcache_ttl = 0;
+static const char *cache_mcache_node = NULL;
+
+static const char *cache_shared_fstypes[] = {
+  "nfs",
+  "nfs4",
+  "cifs",
+  "smb3",
+  "ceph",
+  "fuse.ceph",
+  "fuse.glusterfs",
+  "lustre",
+  "gpfs",
+  "beegfs",
+  NULL
+};
+
+#define FSQUOTA_CACHE_SHARED_VERSION	2
+
+/* Memcached does not accept longer keys. */
+#define FSQUOTA_CACHE_SHARED_MAX_KEYSZ	250
+#endif /* PR_USE_MEMCACHE */
+
+/* The most recently resolved paths, and their devices; a few, so that
+ * comparing several upload volumes does not evict the current directory.
+ */
+#define FSQUOTA_CACHE_NPATHS	16
+
+struct fsquota_path_entry {
+  char path[PR_TUNABLE_PATH_MAX+1];
+  char root[PR_TUNABLE_PATH_MAX+1];
+  dev_t dev;
+  time_t ts;
+
+  /* Whether the mount table agreed with stat(2), as of which version of
+   * the mount table.
+   */
+  int confirmed;
+  unsigned long mounts_gen;
+};
+
+static struct fsquota_path_entry cache_paths[FSQUOTA_CACHE_NPATHS];
+static unsigned int cache_next_path = 0;
+
+/* The session's chroot with any symlinks resolved, as the mount table sees
+ * it; empty if not known.
+ */
+static char cache_root[PR_TUNABLE_PATH_MAX+1];
+
+/* Quota state per filesystem, resolved by the daemon at startup and
+ * inherited by every session, so that sessions need not discover it again:
+ * the mount, which backend serves its quotas, and whether they are on.  The
+ * status is per type; the kernel does not track it per ID.
+ */
+struct fsquota_warm_entry {
+  dev_t dev;
+  const char *path;
+
+  /* From the mount table; NULL if the device is not that of a mount, e.g.
+   * for btrfs subvolumes.
+   */
+  const char *mount_path, *fstype, *source;
+
+  int backend;
+
+  int user_res, user_errno, user_enabled;
+  int group_res, group_errno, group_enabled;
+};
+
+static array_header *cache_warm_entries = NULL;
+
+/* Cleared when the session's cache is flushed, e.g. after quotas are turned
+ * on or off.
+ */
+static int cache_warm_valid = FALSE;
+
+/* The generation of the last ftpdctl flush request applied. */
+static unsigned long cache_flush_gen = 0;
+
+/* When the last flush was applied; shared values stored before then may
+ * predate whatever prompted the flush, e.g. a setquota, and are not used.
+ */
+static time_t cache_flush_ts = 0;
+
+static const char *trace_channel = "fsquota.cache";
+
+static const char *cache_type_str(int type) {
+  switch (type) {
+    case FSQUOTA_TYPE_USER:
+      return "user";
+
+    case FSQUOTA_TYPE_GROUP:
+      return "group";
+
+    case FSQUOTA_TYPE_PROJECT:
+      return "project";
+  }
+
+  return "unknown";
+}
+
+/* The usage index tracks users and groups, not projects. */
+static int cache_indexed(const char *path, int type) {
+  if (type == FSQUOTA_TYPE_PROJECT) {
+    return FALSE;
+  }
+
+  return fsquota_index_covers(path);
+}
+
+/* Counts a lookup, both for this session and daemon-wide. */
+static void cache_count(int stat) {
+  switch (stat) {
+    case FSQUOTA_SHM_STAT_HITS:
+      cache_stats.hits++;
+      break;
+
+    case FSQUOTA_SHM_STAT_QUERIES:
+      cache_stats.queries++;
+      break;
+
+    case FSQUOTA_SHM_STAT_THROTTLED:
+      cache_stats.throttled++;
+      break;
+  }
+
+  (void) fsquota_shm_incr_stat(stat);
+}
+
+static void cache_invalidate_id(int type, unsigned long id) {
+  register int i;
+  struct fsquota_entry *entries;
+  struct fsquota_fs_entry *fs_entries;
+
+  entries = cache_entries->elts;
+  for (i = 0; i < cache_entries->nelts; i++) {
+    if (entries[i].type == type &&
+        entries[i].id == id) {
+      entries[i].stale = TRUE;
+      entries[i].enabled_ts = 0;
+    }
+  }
+
+  fs_entries = cache_fs_entries->elts;
+  for (i = 0; i < cache_fs_entries->nelts; i++) {
+    fs_entries[i].avail_ts = 0;
+  }
+}
+
+/* Applies any flush requests, made via ftpdctl or for kernel quota events,
+ * received since the last lookup.
+ */
+static void cache_check_events(void) {
+  unsigned long gen;
+
+  if (cache_entries == NULL) {
+    return;
+  }
+
+  gen = fsquota_shm_get_flush_gen();
+  while (cache_flush_gen != gen) {
+    int type = 0;
+    unsigned long id = 0;
+
+    cache_flush_gen++;
+    time(&cache_flush_ts);
+
+    if (fsquota_shm_get_flush(cache_flush_gen, &type, &id) < 0 ||
+        type == 0) {
+      (void) fsquota_cache_flush();
+      cache_flush_gen = gen;
+      break;
+    }
+
+    pr_trace_msg(trace_channel, 15,
+      "flush requested for cached %s quota values for ID %lu",
+      cache_type_str(type), id);
+    cache_invalidate_id(type, id);
+  }
+}
+
+static int cache_get_dev(const char *path, dev_t *dev) {
+  register unsigned int i;
+  struct stat st;
+  struct fsquota_path_entry *pe;
+  const struct fsquota_mount *mount = NULL;
+  const char *root, *real_path;
+  char buf[PR_TUNABLE_PATH_MAX+1];
+  unsigned long mounts_gen;
+  time_t now;
+
+  if (cache_entries == NULL) {
+    errno = EPERM;
+    return -1;
+  }
+
+  if (cache_root[0] != '\0') {
+    root = cache_root;
+
+  } else {
+    root = (session.chroot_path != NULL ? session.chroot_path : "");
+  }
+
+  /* A page of Display variables all look up the same path; resolve each
+   * path once.  The same path names a different file after a chroot, so the
+   * chroot is part of the key.
+   *
+   * A path whose device the mount table confirmed is kept until the mount
+   * table changes; any other path, e.g. through a symlink to another
+   * filesystem, is resolved again once per TTL.
+   */
+  time(&now);
+  mounts_gen = fsquota_mounts_get_generation();
+
+  for (i = 0; i < FSQUOTA_CACHE_NPATHS; i++) {
+    pe = &(cache_paths[i]);
+    if (pe->ts != 0 &&
+        strcmp(pe->path, path) == 0 &&
+        strcmp(pe->root, root) == 0) {
+      if ((pe->confirmed && pe->mounts_gen == mounts_gen) ||
+          (now - pe->ts) < (time_t) cache_ttl) {
+        *dev = pe->dev;
+        return 0;
+      }
+
+      break;
+    }
+  }
+
+  if (stat(path, &st) < 0) {
+    int xerrno = errno;
+
+    pr_trace_msg(trace_channel, 7,
+      "stat(2) error on '%s': %s", path, strerror(xerrno));
+
+    errno = xerrno;
+    return -1;
+  }
+
+  *dev = st.st_dev;
+
+  /* The mount table has the mount points as seen from outside of the
+   * chroot, and does not resolve symlinks; a path is only trusted to stay
+   * on its filesystem if the table agrees with stat(2).
+   */
+  real_path = (*path == '/' ? path : NULL);
+  if (real_path != NULL &&
+      *root != '\0' &&
+      strcmp(root, "/") != 0) {
+    int len;
+
+    len = snprintf(buf, sizeof(buf), "%s%s", root, path);
+    real_path = (len > 0 && (size_t) len < sizeof(buf) ? buf : NULL);
+  }
+
+  if (real_path != NULL) {
+    mount = fsquota_mounts_lookup(real_path);
+  }
+
+  if (i == FSQUOTA_CACHE_NPATHS) {
+    pe = &(cache_paths[cache_next_path]);
+    cache_next_path = (cache_next_path + 1) % FSQUOTA_CACHE_NPATHS;
+  }
+
+  sstrncpy(pe->path, path, sizeof(pe->path));
+  sstrncpy(pe->root, root, sizeof(pe->root));
+  pe->dev = st.st_dev;
+  pe->ts = now;
+  pe->confirmed = (mount != NULL && mount->dev == st.st_dev);
+  pe->mounts_gen = mounts_gen;
+
+  if (mount != NULL &&
+      pe->confirmed == FALSE) {
+    pr_trace_msg(trace_channel, 9,
+      "'%s' is not on the filesystem mounted at '%s' (e.g. due to a "
+      "symlink), resolving it again once per TTL", path, mount->path);
+  }
+
+  return 0;
+}
+
+/* Publishes freshly looked-up/updated values: every lookup adds a sample to
+ * the usage trend for the type/ID, and the session's own user quota values
+ * are kept for ftpdctl to sort sessions by quota pressure.
+ */
+static void cache_publish(dev_t dev, int type, unsigned long id,
+    uint64_t kb_total, uint64_t kb_used, uint64_t file_total,
+    uint64_t file_used) {
+  if (fsquota_shm_trend_add(dev, type, id, kb_total, kb_used, file_total,
+      file_used) < 0 &&
+      errno == EAGAIN) {
+    pr_trace_msg(trace_channel, 19,
+      "skipped busy %s usage trend for ID %lu", cache_type_str(type), id);
+  }
+
+  if (type != FSQUOTA_TYPE_USER ||
+      id != (unsigned long) session.uid) {
+    return;
+  }
+
+  (void) fsquota_shm_session_update(kb_total, kb_used, file_total, file_used);
+}
+
+/* Generates an event when the entry's usage crosses its limits, in either
+ * direction, so that other modules can react without querying the quotas
+ * themselves.  Usage is over a soft limit once it exceeds it, and over a
+ * hard limit once it reaches it, since the kernel allows no more.  A
+ * session's first look at usage which is already over them also counts.
+ */
+static void cache_check_state(struct fsquota_entry *entry) {
+  struct fsquota_event event;
+  int state;
+  const char *event_name;
+
+  if ((entry->kb_hard > 0 && entry->kb_used >= entry->kb_hard) ||
+      (entry->file_hard > 0 && entry->file_used >= entry->file_hard)) {
+    state = FSQUOTA_CACHE_STATE_HARD;
+    event_name = FSQUOTA_EVENT_HARD_LIMIT_EXCEEDED;
+
+  } else if ((entry->kb_total > 0 && entry->kb_used > entry->kb_total) ||
+      (entry->file_total > 0 && entry->file_used > entry->file_total)) {
+    state = FSQUOTA_CACHE_STATE_SOFT;
+    event_name = FSQUOTA_EVENT_SOFT_LIMIT_EXCEEDED;
+
+  } else {
+    state = FSQUOTA_CACHE_STATE_BELOW;
+    event_name = FSQUOTA_EVENT_BELOW_LIMIT;
+  }
+
+  if (state == entry->state) {
+    return;
+  }
+
+  if (entry->state == FSQUOTA_CACHE_STATE_UNKNOWN &&
+      state == FSQUOTA_CACHE_STATE_BELOW) {
+    entry->state = state;
+    return;
+  }
+
+  entry->state = state;
+
+  memset(&event, 0, sizeof(event));
+  event.dev = entry->dev;
+  event.type = entry->type;
+  event.id = entry->id;
+  event.kb_total = entry->kb_total;
+  event.kb_hard = entry->kb_hard;
+  event.kb_used = entry->kb_used;
+  event.file_total = entry->file_total;
+  event.file_hard = entry->file_hard;
+  event.file_used = entry->file_used;
+
+  pr_trace_msg(trace_channel, 9,
+    "%s ID %lu: %lu of %lu (hard %lu) KB, %lu of %lu (hard %lu) files, "
+    "generating '%s' event", cache_type_str(entry->type), entry->id,
+    (unsigned long) entry->kb_used, (unsigned long) entry->kb_total,
+    (unsigned long) entry->kb_hard, (unsigned long) entry->file_used,
+    (unsigned long) entry->file_total, (unsigned long) entry->file_hard,
+    event_name);
+
+  /* Done last, since listeners may look up other values, adding entries. */
+  pr_event_generate(event_name, &event);
+}
+
+static struct fsquota_entry *cache_entry_lookup(dev_t dev, int type,
+    unsigned long id) {
+  register int i;
+  struct fsquota_entry *entries, *entry;
+
+  entries = cache_entries->elts;
+  for (i = 0; i < cache_entries->nelts; i++) {
+    if (entries[i].dev == dev &&
+        entries[i].type == type &&
+        entries[i].id == id) {
+      return &(entries[i]);
+    }
+  }
+
+  entry = push_array(cache_entries);
+  memset(entry, 0, sizeof(struct fsquota_entry));
+  entry->dev = dev;
+  entry->type = type;
+  entry->id = id;
+
+  return entry;
+}
+
+static struct fsquota_entry *cache_entry_get(const char *path, int type,
+    unsigned long id) {
+  dev_t dev;
+
+  cache_check_events();
+
+  if (cache_get_dev(path, &dev) < 0) {
+    return NULL;
+  }
+
+  return cache_entry_lookup(dev, type, id);
+}
+
+static struct fsquota_fs_entry *cache_fs_entry_get(const char *path) {
+  register int i;
+  struct fsquota_fs_entry *entries, *entry;
+  dev_t dev;
+
+  cache_check_events();
+
+  if (cache_get_dev(path, &dev) < 0) {
+    return NULL;
+  }
+
+  entries = cache_fs_entries->elts;
+  for (i = 0; i < cache_fs_entries->nelts; i++) {
+    if (entries[i].dev == dev) {
+      return &(entries[i]);
+    }
+  }
+
+  entry = push_array(cache_fs_entries);
+  memset(entry, 0, sizeof(struct fsquota_fs_entry));
+  entry->dev = dev;
+
+  return entry;
+}
+
+/* Returns TRUE if a missing or expired entry may be refreshed from the
+ * kernel, or FALSE if the FSQuotaQueryRate budget is exhausted and any
+ * cached value must be used instead.
+ */
+static int cache_allow_query(void) {
+  struct timeval now;
+  double elapsed;
+
+  if (cache_query_rate <= 0.0) {
+    return TRUE;
+  }
+
+  gettimeofday(&now, NULL);
+  elapsed = (double) (now.tv_sec - cache_query_refill_tv.tv_sec) +
+    ((double) (now.tv_usec - cache_query_refill_tv.tv_usec) / 1000000.0);
+  if (elapsed > 0.0) {
+    cache_query_tokens += (elapsed * cache_query_rate);
+    if (cache_query_tokens > cache_query_burst) {
+      cache_query_tokens = cache_query_burst;
+    }
+  }
+  cache_query_refill_tv = now;
+
+  if (cache_query_tokens >= 1.0) {
+    cache_query_tokens -= 1.0;
+    return TRUE;
+  }
+
+  cache_count(FSQUOTA_SHM_STAT_THROTTLED);
+  pr_trace_msg(trace_channel, 9,
+    "quota query rate exceeded, using cached values (%lu of %lu queries "
+    "throttled)", cache_stats.throttled,
+    cache_stats.throttled + cache_stats.queries);
+  return FALSE;
+}
+
+int fsquota_cache_init(pool *p, unsigned int ttl) {
+  if (p == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (cache_pool != NULL) {
+    destroy_pool(cache_pool);
+  }
+
+  cache_pool = make_sub_pool(p);
+  pr_pool_tag(cache_pool, MOD_FSQUOTA_VERSION ": Cache Pool");
+
+  cache_entries = make_array(cache_pool, 4, sizeof(struct fsquota_entry));
+  cache_fs_entries = make_array(cache_pool, 1,
+    sizeof(struct fsquota_fs_entry));
+  cache_warned = make_array(cache_pool, 0, sizeof(struct fsquota_warned));
+  cache_ttl = ttl;
+  cache_flush_gen = fsquota_shm_get_flush_gen();
+  memset(cache_paths, 0, sizeof(cache_paths));
+  cache_root[0] = '\0';
+
+  memset(&cache_stats, 0, sizeof(cache_stats));
+  return 0;
+}
+
+#ifdef PR_USE_MEMCACHE
+/* Returns the key for the given entry, or NULL if there is none. */
+static const char *cache_shared_key(pool *p, struct fsquota_entry *entry) {
+  register unsigned int i;
+  const struct fsquota_mount *mount;
+  const char *key;
+  char buf[64];
+
+  mount = fsquota_mounts_get_dev(entry->dev);
+  if (mount == NULL) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  memset(buf, '\0', sizeof(buf));
+  snprintf(buf, sizeof(buf)-1, ":%d:%lu", entry->type, entry->id);
+
+  key = pstrcat(p, mount->source, buf, NULL);
+
+  for (i = 0; cache_shared_fstypes[i] != NULL; i++) {
+    if (strcmp(mount->fstype, cache_shared_fstypes[i]) == 0) {
+      break;
+    }
+  }
+
+  if (cache_shared_fstypes[i] == NULL) {
+    key = pstrcat(p, cache_mcache_node, ":", key, NULL);
+  }
+
+  if (strlen(key) > FSQUOTA_CACHE_SHARED_MAX_KEYSZ) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+
+  return key;
+}
+
+/* Fills in the entry from the shared cache, if it has fresh values. */
+static int cache_shared_get(struct fsquota_entry *entry) {
+  pool *tmp_pool;
+  const char *key;
+  char *value, buf[256];
+  size_t valuesz = 0;
+  uint32_t flags = 0;
+  unsigned int version = 0;
+  unsigned long ts = 0;
+  unsigned long long kb_total = 0, kb_used = 0, file_total = 0, file_used = 0;
+  unsigned long long kb_hard = 0, file_hard = 0;
+
+  if (cache_mcache == NULL) {
+    errno = ENOSYS;
+    return -1;
+  }
+
+  tmp_pool = make_sub_pool(cache_pool);
+
+  key = cache_shared_key(tmp_pool, entry);
+  if (key == NULL) {
+    int xerrno = errno;
+
+    destroy_pool(tmp_pool);
+
+    errno = xerrno;
+    return -1;
+  }
+
+  value = pr_memcache_kget(cache_mcache, &fsquota_module, key, strlen(key),
+    &valuesz, &flags);
+  if (value == NULL ||
+      valuesz == 0 ||
+      valuesz >= sizeof(buf)) {
+    pr_trace_msg(trace_channel, 19, "no shared values for '%s'", key);
+    destroy_pool(tmp_pool);
+
+    errno = ENOENT;
+    return -1;
+  }
+
+  memset(buf, '\0', sizeof(buf));
+  memcpy(buf, value, valuesz);
+
+  if (sscanf(buf, "%u %lu %llu %llu %llu %llu %llu %llu", &version, &ts,
+      &kb_total, &kb_used, &file_total, &file_used, &kb_hard,
+      &file_hard) != 8 ||
+      version != FSQUOTA_CACHE_SHARED_VERSION) {
+    pr_trace_msg(trace_channel, 9,
+      "ignoring shared values for '%s' of unknown format", key);
+    destroy_pool(tmp_pool);
+
+    errno = ENOENT;
+    return -1;
+  }
+
+  if ((time_t) ts + (time_t) cache_mcache_ttl < time(NULL)) {
+    pr_trace_msg(trace_channel, 19, "ignoring expired shared values for '%s'",
+      key);
+    destroy_pool(tmp_pool);
+
+    errno = ENOENT;
+    return -1;
+  }
+
+  /* Entries created after a flush are otherwise not stale, and would be
+   * refilled with the values the flush was meant to discard.  The kernel's
+   * values, once queried, replace them.
+   */
+  if ((time_t) ts <= cache_flush_ts) {
+    pr_trace_msg(trace_channel, 19,
+      "ignoring shared values for '%s' stored before the last flush", key);
+    destroy_pool(tmp_pool);
+
+    errno = ENOENT;
+    return -1;
+  }
+
+  pr_trace_msg(trace_channel, 19, "using shared values for '%s'", key);
+  destroy_pool(tmp_pool);
+
+  entry->get_res = 0;
+  entry->get_errno = 0;
+  entry->kb_total = kb_total;
+  entry->kb_used = kb_used;
+  entry->file_total = file_total;
+  entry->file_used = file_used;
+  entry->kb_hard = kb_hard;
+  entry->file_hard = file_hard;
+
+  return 0;
+}
+
+/* Shares the entry's values with the other nodes. */
+static void cache_shared_set(struct fsquota_entry *entry) {
+  pool *tmp_pool;
+  const char *key;
+  char value[256];
+  int valuesz;
+
+  if (cache_mcache == NULL) {
+    return;
+  }
+
+  tmp_pool = make_sub_pool(cache_pool);
+
+  key = cache_shared_key(tmp_pool, entry);
+  if (key == NULL) {
+    destroy_pool(tmp_pool);
+    return;
+  }
+
+  memset(value, '\0', sizeof(value));
+  valuesz = snprintf(value, sizeof(value)-1,
+    "%u %lu %llu %llu %llu %llu %llu %llu", FSQUOTA_CACHE_SHARED_VERSION,
+    (unsigned long) time(NULL), (unsigned long long) entry->kb_total,
+    (unsigned long long) entry->kb_used,
+    (unsigned long long) entry->file_total,
+    (unsigned long long) entry->file_used,
+    (unsigned long long) entry->kb_hard,
+    (unsigned long long) entry->file_hard);
+
+  if (pr_memcache_kset(cache_mcache, &fsquota_module, key, strlen(key), value,
+      (size_t) valuesz, cache_mcache_ttl, 0) < 0) {
+    pr_trace_msg(trace_channel, 9, "error sharing values for '%s': %s", key,
+      strerror(errno));
+
+  } else {
+    pr_trace_msg(trace_channel, 19, "shared values for '%s'", key);
+  }
+
+  destroy_pool(tmp_pool);
+}
+#endif /* PR_USE_MEMCACHE */
+
+#ifdef PR_USE_MEMCACHE
+/* Returns an ID unique to this node: the machine ID, if there is one, else
+ * the host name.  Must be called before chroot.
+ */
+static const char *cache_get_node_id(pool *p) {
+  char buf[256];
+  FILE *fh;
+
+  memset(buf, '\0', sizeof(buf));
+
+  fh = fopen("/etc/machine-id", "r");
+  if (fh != NULL) {
+    char *ptr;
+
+    if (fgets(buf, sizeof(buf)-1, fh) == NULL) {
+      buf[0] = '\0';
+    }
+    (void) fclose(fh);
+
+    ptr = strchr(buf, '\n');
+    if (ptr != NULL) {
+      *ptr = '\0';
+    }
+  }
+
+  if (buf[0] == '\0' &&
+      gethostname(buf, sizeof(buf)-1) < 0) {
+    return NULL;
+  }
+
+  return pstrdup(p, buf);
+}
+#endif /* PR_USE_MEMCACHE */
+
+int fsquota_cache_set_shared(pool *p, unsigned int ttl) {
+#ifdef PR_USE_MEMCACHE
+  pr_memcache_t *mcache;
+
+  if (p == NULL ||
+      ttl == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  mcache = pr_memcache_conn_get();
+  if (mcache == NULL) {
+    int xerrno = errno;
+
+    pr_trace_msg(trace_channel, 3,
+      "unable to connect to memcached servers: %s", strerror(xerrno));
+
+    errno = xerrno;
+    return -1;
+  }
+
+  (void) pr_memcache_conn_set_namespace(mcache, &fsquota_module,
+    "mod_fsquota.");
+
+  /* Keys are made from the mount sources. */
+  if (fsquota_mounts_open(p) < 0) {
+    return -1;
+  }
+
+  cache_mcache_node = cache_get_node_id(p);
+  if (cache_mcache_node == NULL) {
+    int xerrno = errno;
+
+    pr_trace_msg(trace_channel, 3,
+      "unable to identify this node for shared quota values: %s",
+      strerror(xerrno));
+
+    errno = xerrno;
+    return -1;
+  }
+
+  cache_mcache = mcache;
+  cache_mcache_ttl = ttl;
+  return 0;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif /* PR_USE_MEMCACHE */
+}
+
+int fsquota_cache_set_rate(double rate, unsigned int burst) {
+  if (rate < 0.0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  cache_query_rate = rate;
+  cache_query_burst = (double) (burst > 0 ? burst : 1);
+
+  /* Start with a full bucket. */
+  cache_query_tokens = cache_query_burst;
+  gettimeofday(&cache_query_refill_tv, NULL);
+
+  return 0;
+}
+
+int fsquota_cache_get_stats(struct fsquota_cache_stats *stats) {
+  if (stats == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memcpy(stats, &cache_stats, sizeof(struct fsquota_cache_stats));
+  return 0;
+}
+
+int fsquota_cache_free(void) {
+  if (cache_pool != NULL) {
+    destroy_pool(cache_pool);
+    cache_pool = NULL;
+    cache_entries = NULL;
+    cache_fs_entries = NULL;
+  }
+
+  return 0;
+}
+
+/* Returns the state resolved by the daemon for the given filesystem, or
+ * NULL if there is none.
+ */
+static const struct fsquota_warm_entry *cache_warm_get(dev_t dev) {
+  register int i;
+  struct fsquota_warm_entry *warm_entries;
+
+  if (cache_warm_valid == FALSE ||
+      cache_warm_entries == NULL) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  warm_entries = cache_warm_entries->elts;
+  for (i = 0; i < cache_warm_entries->nelts; i++) {
+    if (warm_entries[i].dev == dev) {
+      return &(warm_entries[i]);
+    }
+  }
+
+  errno = ENOENT;
+  return NULL;
+}
+
+/* Fills in the entry's quota status from the state resolved by the daemon,
+ * if there is any for its filesystem.
+ */
+static int cache_warm_apply(struct fsquota_entry *entry, time_t now) {
+  const struct fsquota_warm_entry *warm;
+
+  warm = cache_warm_get(entry->dev);
+  if (warm == NULL) {
+    return -1;
+  }
+
+  switch (entry->type) {
+    case FSQUOTA_TYPE_USER:
+      entry->enabled_res = warm->user_res;
+      entry->enabled_errno = warm->user_errno;
+      entry->enabled = warm->user_enabled;
+      break;
+
+    case FSQUOTA_TYPE_GROUP:
+      entry->enabled_res = warm->group_res;
+      entry->enabled_errno = warm->group_errno;
+      entry->enabled = warm->group_enabled;
+      break;
+
+    default:
+      errno = ENOENT;
+      return -1;
+  }
+
+  entry->enabled_ts = now;
+  return 0;
+}
+
+/* Spares the backend lookups for the entry's filesystem from checking which
+ * backend serves it, if the daemon has already found out.
+ */
+static void cache_warm_set_backend(struct fsquota_entry *entry) {
+  const struct fsquota_warm_entry *warm;
+
+  warm = cache_warm_get(entry->dev);
+  if (warm != NULL) {
+    (void) fsquota_backend_set_known(warm->backend);
+  }
+}
+
+static const char *cache_backend_str(int backend) {
+  switch (backend) {
+    case FSQUOTA_BACKEND_QUOTACTL:
+      return "quotactl";
+
+    case FSQUOTA_BACKEND_BTRFS:
+      return "btrfs qgroups";
+
+    default:
+      break;
+  }
+
+  return "unknown";
+}
+
+int fsquota_cache_warmup(pool *p, const char *path) {
+  struct fsquota_warm_entry *warm;
+  const struct fsquota_mount *mount;
+  struct stat st;
+  int enabled;
+
+  if (p == NULL ||
+      path == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (stat(path, &st) < 0) {
+    int xerrno = errno;
+
+    pr_trace_msg(trace_channel, 3, "unable to warm up '%s': %s", path,
+      strerror(xerrno));
+
+    errno = xerrno;
+    return -1;
+  }
+
+  if (cache_warm_entries == NULL) {
+    cache_warm_entries = make_array(p, 1, sizeof(struct fsquota_warm_entry));
+
+  } else {
+    register int i;
+    struct fsquota_warm_entry *warm_entries;
+
+    warm_entries = cache_warm_entries->elts;
+    for (i = 0; i < cache_warm_entries->nelts; i++) {
+      if (warm_entries[i].dev == st.st_dev) {
+        pr_trace_msg(trace_channel, 15,
+          "'%s' is on the same filesystem as '%s', already warmed up", path,
+          warm_entries[i].path);
+        return 0;
+      }
+    }
+  }
+
+  warm = push_array(cache_warm_entries);
+  memset(warm, 0, sizeof(struct fsquota_warm_entry));
+  warm->dev = st.st_dev;
+  warm->path = pstrdup(p, path);
+
+  /* The mount table is the daemon's only for the warm-up, so its values are
+   * copied.
+   */
+  mount = fsquota_mounts_get_dev(st.st_dev);
+  if (mount != NULL) {
+    warm->mount_path = pstrdup(p, mount->path);
+    warm->fstype = pstrdup(p, mount->fstype);
+    warm->source = pstrdup(p, mount->source);
+  }
+
+  warm->backend = fsquota_backend_get(path);
+  (void) fsquota_backend_set_known(warm->backend);
+
+  enabled = FALSE;
+  warm->user_res = fsquota_user_enabled(path, 0, &enabled);
+  warm->user_errno = (warm->user_res < 0 ? errno : 0);
+  warm->user_enabled = enabled;
+
+  enabled = FALSE;
+  warm->group_res = fsquota_group_enabled(path, 0, &enabled);
+  warm->group_errno = (warm->group_res < 0 ? errno : 0);
+  warm->group_enabled = enabled;
+
+  (void) fsquota_backend_set_known(FSQUOTA_BACKEND_UNKNOWN);
+  cache_warm_valid = TRUE;
+
+  pr_trace_msg(trace_channel, 9,
+    "warmed up '%s' (device %lu, %s %s on %s, %s): user quotas %s, "
+    "group quotas %s", path, (unsigned long) st.st_dev,
+    warm->fstype != NULL ? warm->fstype : "unknown filesystem",
+    warm->source != NULL ? warm->source : "-",
+    warm->mount_path != NULL ? warm->mount_path : "-",
+    cache_backend_str(warm->backend),
+    warm->user_res < 0 ? strerror(warm->user_errno) :
+      warm->user_enabled ? "on" : "off",
+    warm->group_res < 0 ? strerror(warm->group_errno) :
+      warm->group_enabled ? "on" : "off");
+  return 0;
+}
+
+int fsquota_cache_warmup_mounts(pool *p) {
+  register int i;
+  pool *tmp_pool;
+  const array_header *mounts;
+  array_header *paths;
+  struct fsquota_mount **mount_elts;
+  char **path_elts;
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  mounts = fsquota_mounts_get_list();
+  if (mounts == NULL) {
+    return -1;
+  }
+
+  /* Warming up may read the mount table anew, so the paths are copied
+   * first.
+   */
+  tmp_pool = make_sub_pool(p);
+  paths = make_array(tmp_pool, 1, sizeof(char *));
+
+  mount_elts = mounts->elts;
+  for (i = 0; i < mounts->nelts; i++) {
+    if (fsquota_mounts_have_quotas(mount_elts[i])) {
+      *((char **) push_array(paths)) = pstrdup(tmp_pool, mount_elts[i]->path);
+    }
+  }
+
+  path_elts = paths->elts;
+  for (i = 0; i < paths->nelts; i++) {
+    pr_signals_handle();
+    (void) fsquota_cache_warmup(p, path_elts[i]);
+  }
+
+  destroy_pool(tmp_pool);
+  return 0;
+}
+
+int fsquota_cache_clear_warmup(void) {
+  cache_warm_entries = NULL;
+  cache_warm_valid = FALSE;
+  return 0;
+}
+
+int fsquota_cache_enabled(const char *path, int type, unsigned long id,
+    int *enabled) {
+  struct fsquota_entry *entry;
+  time_t now;
+
+  if (path == NULL ||
+      enabled == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Usage in indexed trees is always tracked. */
+  if (cache_indexed(path, type)) {
+    *enabled = TRUE;
+    return 0;
+  }
+
+  entry = cache_entry_get(path, type, id);
+  if (entry == NULL) {
+    return -1;
+  }
+
+  time(&now);
+  if (entry->enabled_ts != 0 &&
+      (now - entry->enabled_ts) < (time_t) cache_ttl) {
+    cache_count(FSQUOTA_SHM_STAT_HITS);
+    pr_trace_msg(trace_channel, 19,
+      "using cached %s quota status for ID %lu", cache_type_str(type), id);
+
+  } else if (cache_warm_apply(entry, now) == 0) {
+    cache_count(FSQUOTA_SHM_STAT_HITS);
+    pr_trace_msg(trace_channel, 19,
+      "using daemon-resolved %s quota status for ID %lu",
+      cache_type_str(type), id);
+
+  } else if (cache_allow_query() == FALSE) {
+    if (entry->enabled_ts == 0) {
+      errno = EAGAIN;
+      return -1;
+    }
+
+  } else {
+    int res, status = FALSE;
+
+    switch (type) {
+      case FSQUOTA_TYPE_USER:
+        res = fsquota_user_enabled(path, (uid_t) id, &status);
+        break;
+
+      case FSQUOTA_TYPE_GROUP:
+        res = fsquota_group_enabled(path, (gid_t) id, &status);
+        break;
+
+      case FSQUOTA_TYPE_PROJECT:
+        res = fsquota_project_enabled(path, id, &status);
+        break;
+
+      default:
+        errno = EINVAL;
+        return -1;
+    }
+
+    cache_count(FSQUOTA_SHM_STAT_QUERIES);
+    entry->enabled_res = res;
+    entry->enabled_errno = (res < 0 ? errno : 0);
+    entry->enabled = status;
+    entry->enabled_ts = now;
+  }
+
+  if (entry->enabled_res < 0) {
+    errno = entry->enabled_errno;
+    return -1;
+  }
+
+  *enabled = entry->enabled;
+  return 0;
+}
+
+/* Queries the kernel for the entry's values, if they are missing or have
+ * expired.
+ */
+static int cache_entry_refresh(struct fsquota_entry *entry, const char *path) {
+  time_t now;
+  int res;
+  uint64_t total_kb = 0, used_kb = 0, total_files = 0, used_files = 0;
+  uint64_t hard_kb = 0, hard_files = 0;
+
+  time(&now);
+  if (entry->get_ts != 0 &&
+      entry->stale == FALSE &&
+      (now - entry->get_ts) < (time_t) cache_ttl) {
+    cache_count(FSQUOTA_SHM_STAT_HITS);
+    pr_trace_msg(trace_channel, 19,
+      "using cached %s quota values for ID %lu", cache_type_str(entry->type),
+      entry->id);
+    return 0;
+  }
+
+#ifdef PR_USE_MEMCACHE
+  /* Values the kernel has reported as changed are not taken from the shared
+   * cache; the fresh values are shared instead.
+   */
+  if (entry->stale == FALSE &&
+      cache_shared_get(entry) == 0) {
+    cache_count(FSQUOTA_SHM_STAT_HITS);
+    entry->get_ts = now;
+
+    cache_publish(entry->dev, entry->type, entry->id, entry->kb_total,
+      entry->kb_used, entry->file_total, entry->file_used);
+    cache_check_state(entry);
+    return 0;
+  }
+#endif /* PR_USE_MEMCACHE */
+
+  if (cache_allow_query() == FALSE) {
+    if (entry->get_ts == 0) {
+      errno = EAGAIN;
+      return -1;
+    }
+
+    return 0;
+  }
+
+  cache_warm_set_backend(entry);
+
+  switch (entry->type) {
+    case FSQUOTA_TYPE_USER:
+      res = fsquota_user_get(path, (uid_t) entry->id, &total_kb, &used_kb,
+        &total_files, &used_files, &hard_kb, &hard_files);
+      break;
+
+    case FSQUOTA_TYPE_GROUP:
+      res = fsquota_group_get(path, (gid_t) entry->id, &total_kb, &used_kb,
+        &total_files, &used_files, &hard_kb, &hard_files);
+      break;
+
+    case FSQUOTA_TYPE_PROJECT:
+      res = fsquota_project_get(path, entry->id, &total_kb, &used_kb,
+        &total_files, &used_files, &hard_kb, &hard_files);
+      break;
+
+    default:
+      (void) fsquota_backend_set_known(FSQUOTA_BACKEND_UNKNOWN);
+      errno = EINVAL;
+      return -1;
+  }
+
+  (void) fsquota_backend_set_known(FSQUOTA_BACKEND_UNKNOWN);
+  cache_count(FSQUOTA_SHM_STAT_QUERIES);
+  entry->get_res = res;
+  entry->get_errno = (res < 0 ? errno : 0);
+  entry->kb_total = total_kb;
+  entry->kb_used = used_kb;
+  entry->file_total = total_files;
+  entry->file_used = used_files;
+  entry->kb_hard = hard_kb;
+  entry->file_hard = hard_files;
+  entry->get_ts = now;
+  entry->stale = FALSE;
+
+  if (res == 0) {
+#ifdef PR_USE_MEMCACHE
+    cache_shared_set(entry);
+#endif /* PR_USE_MEMCACHE */
+    cache_publish(entry->dev, entry->type, entry->id, total_kb, used_kb,
+      total_files, used_files);
+    cache_check_state(entry);
+  }
+
+  return 0;
+}
+
+int fsquota_cache_get(const char *path, int type, unsigned long id,
+    uint64_t *kb_total, uint64_t *kb_used, uint64_t *file_total,
+    uint64_t *file_used) {
+  struct fsquota_entry *entry;
+
+  if (path == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* The usage index is already in memory, and is kept current; there is
+   * nothing to cache.
+   */
+  if (cache_indexed(path, type)) {
+    uint64_t total_kb = 0, used_kb = 0, total_files = 0, used_files = 0;
+    dev_t dev;
+
+    if (fsquota_index_get(path, type, id, &total_kb, &used_kb, &total_files,
+        &used_files) < 0) {
+      return -1;
+    }
+
+    if (cache_get_dev(path, &dev) == 0) {
+      cache_publish(dev, type, id, total_kb, used_kb, total_files,
+        used_files);
+    }
+
+    if (kb_total != NULL) {
+      *kb_total = total_kb;
+    }
+
+    if (kb_used != NULL) {
+      *kb_used = used_kb;
+    }
+
+    if (file_total != NULL) {
+      *file_total = total_files;
+    }
+
+    if (file_used != NULL) {
+      *file_used = used_files;
+    }
+
+    return 0;
+  }
+
+  entry = cache_entry_get(path, type, id);
+  if (entry == NULL) {
+    return -1;
+  }
+
+  if (cache_entry_refresh(entry, path) < 0) {
+    return -1;
+  }
+
+  if (entry->get_res < 0) {
+    errno = entry->get_errno;
+    return -1;
+  }
+
+  if (kb_total != NULL) {
+    *kb_total = entry->kb_total;
+  }
+
+  if (kb_used != NULL) {
+    *kb_used = entry->kb_used;
+  }
+
+  if (file_total != NULL) {
+    *file_total = entry->file_total;
+  }
+
+  if (file_used != NULL) {
+    *file_used = entry->file_used;
+  }
+
+  return 0;
+}
+
+int fsquota_cache_get_ids(const char *path, int type, unsigned int nids,
+    struct fsquota_values *values) {
+  register unsigned int i;
+  dev_t dev;
+
+  if (path == NULL ||
+      values == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (cache_indexed(path, type)) {
+    for (i = 0; i < nids; i++) {
+      values[i].res = fsquota_index_get(path, type, values[i].id,
+        &(values[i].kb_total), &(values[i].kb_used), &(values[i].file_total),
+        &(values[i].file_used));
+      values[i].xerrno = (values[i].res < 0 ? errno : 0);
+    }
+
+    return 0;
+  }
+
+  cache_check_events();
+
+  /* All of the IDs share the same filesystem, so it only needs to be
+   * resolved once; only the IDs whose entries are missing or expired are
+   * then queried.
+   */
+  if (cache_get_dev(path, &dev) < 0) {
+    return -1;
+  }
+
+  for (i = 0; i < nids; i++) {
+    struct fsquota_entry *entry;
+
+    entry = cache_entry_lookup(dev, type, values[i].id);
+    if (cache_entry_refresh(entry, path) < 0) {
+      return -1;
+    }
+
+    values[i].res = entry->get_res;
+    values[i].xerrno = entry->get_errno;
+    values[i].kb_total = entry->kb_total;
+    values[i].kb_used = entry->kb_used;
+    values[i].file_total = entry->file_total;
+    values[i].file_used = entry->file_used;
+  }
+
+  return 0;
+}
+
+int fsquota_cache_invalidate(dev_t dev, int type, unsigned long id) {
+  register int i;
+  struct fsquota_entry *entries;
+  struct fsquota_fs_entry *fs_entries;
+  int found = FALSE;
+
+  if (cache_entries == NULL) {
+    errno = EPERM;
+    return -1;
+  }
+
+  entries = cache_entries->elts;
+  for (i = 0; i < cache_entries->nelts; i++) {
+    if (entries[i].dev == dev &&
+        entries[i].type == type &&
+        entries[i].id == id) {
+      entries[i].stale = TRUE;
+      entries[i].enabled_ts = 0;
+      found = TRUE;
+    }
+  }
+
+  /* A change in usage is a change in free space, too. */
+  fs_entries = cache_fs_entries->elts;
+  for (i = 0; i < cache_fs_entries->nelts; i++) {
+    if (fs_entries[i].dev == dev) {
+      fs_entries[i].avail_ts = 0;
+    }
+  }
+
+  if (found == FALSE) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  pr_trace_msg(trace_channel, 15,
+    "invalidated cached %s quota values for ID %lu", cache_type_str(type), id);
+  return 0;
+}
+
+int fsquota_cache_flush(void) {
+  if (cache_entries == NULL) {
+    errno = EPERM;
+    return -1;
+  }
+
+  clear_array(cache_entries);
+  clear_array(cache_fs_entries);
+  cache_warm_valid = FALSE;
+  memset(cache_paths, 0, sizeof(cache_paths));
+  time(&cache_flush_ts);
+
+  pr_trace_msg(trace_channel, 15, "%s", "flushed all cached quota values");
+  return 0;
+}
+
+int fsquota_cache_set_root(const char *root) {
+  if (root == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  sstrncpy(cache_root, root, sizeof(cache_root));
+  memset(cache_paths, 0, sizeof(cache_paths));
+  return 0;
+}
+
+int fsquota_cache_expire(const char *path, int type, unsigned long id) {
+  dev_t dev;
+
+  if (path == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (cache_get_dev(path, &dev) < 0) {
+    return -1;
+  }
+
+  return fsquota_cache_invalidate(dev, type, id);
+}
+
+static uint64_t cache_add_delta(uint64_t val, int64_t delta) {
+  if (delta < 0 &&
+      (uint64_t) -delta > val) {
+    return 0;
+  }
+
+  return val + delta;
+}
+
+int fsquota_cache_add_used(const char *path, int type, unsigned long id,
+    int64_t kb_delta, int64_t file_delta) {
+  struct fsquota_entry *entry;
+
+  if (path == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (cache_indexed(path, type)) {
+    return 0;
+  }
+
+  entry = cache_entry_get(path, type, id);
+  if (entry == NULL) {
+    return -1;
+  }
+
+  if (entry->get_ts == 0 ||
+      entry->get_res < 0) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  /* The next lookup queries the kernel anyway, which has counted the
+   * change already.
+   */
+  if (entry->stale) {
+    errno = ESTALE;
+    return -1;
+  }
+
+  /* The adjusted values are only this session's estimate; other nodes are
+   * only given what the kernel reported.
+   */
+  entry->kb_used = cache_add_delta(entry->kb_used, kb_delta);
+  entry->file_used = cache_add_delta(entry->file_used, file_delta);
+
+  cache_publish(entry->dev, type, id, entry->kb_total, entry->kb_used,
+    entry->file_total, entry->file_used);
+
+  pr_trace_msg(trace_channel, 17,
+    "adjusted cached %s usage for ID %lu: %lu KB, %lu files",
+    cache_type_str(type), id, (unsigned long) entry->kb_used,
+    (unsigned long) entry->file_used);
+
+  cache_check_state(entry);
+  return 0;
+}
+
+int fsquota_cache_peek(const char *path, int type, unsigned long id,
+    uint64_t *kb_total, uint64_t *kb_used, uint64_t *file_total,
+    uint64_t *file_used) {
+  struct fsquota_entry *entry;
+
+  if (path == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (cache_indexed(path, type)) {
+    return fsquota_index_get(path, type, id, kb_total, kb_used, file_total,
+      file_used);
+  }
+
+  entry = cache_entry_get(path, type, id);
+  if (entry == NULL) {
+    return -1;
+  }
+
+  if (entry->get_ts == 0) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  if (entry->get_res < 0) {
+    errno = entry->get_errno;
+    return -1;
+  }
+
+  if (kb_total != NULL) {
+    *kb_total = entry->kb_total;
+  }
+
+  if (kb_used != NULL) {
+    *kb_used = entry->kb_used;
+  }
+
+  if (file_total != NULL) {
+    *file_total = entry->file_total;
+  }
+
+  if (file_used != NULL) {
+    *file_used = entry->file_used;
+  }
+
+  return 0;
+}
+
+static struct fsquota_warned *cache_warned_get(const char *path, int type,
+    unsigned long id, int create) {
+  register int i;
+  struct fsquota_warned *elts, *warned;
+  dev_t dev;
+
+  if (cache_warned == NULL) {
+    errno = EPERM;
+    return NULL;
+  }
+
+  if (cache_get_dev(path, &dev) < 0) {
+    return NULL;
+  }
+
+  elts = cache_warned->elts;
+  for (i = 0; i < cache_warned->nelts; i++) {
+    if (elts[i].dev == dev &&
+        elts[i].type == type &&
+        elts[i].id == id) {
+      return &(elts[i]);
+    }
+  }
+
+  if (create == FALSE) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  warned = push_array(cache_warned);
+  warned->dev = dev;
+  warned->type = type;
+  warned->id = id;
+  warned->pct = -1;
+
+  return warned;
+}
+
+int fsquota_cache_get_warned(const char *path, int type, unsigned long id,
+    int *pct) {
+  struct fsquota_warned *warned;
+
+  if (path == NULL ||
+      pct == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  warned = cache_warned_get(path, type, id, FALSE);
+  if (warned == NULL) {
+    if (errno != ENOENT) {
+      return -1;
+    }
+
+    *pct = -1;
+    return 0;
+  }
+
+  *pct = warned->pct;
+  return 0;
+}
+
+int fsquota_cache_set_warned(const char *path, int type, unsigned long id,
+    int pct) {
+  struct fsquota_warned *warned;
+
+  if (path == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  warned = cache_warned_get(path, type, id, TRUE);
+  if (warned == NULL) {
+    return -1;
+  }
+
+  warned->pct = pct;
+  return 0;
+}
+
+int fsquota_cache_get_trend(const char *path, int type, unsigned long id,
+    struct fsquota_shm_trend *trend) {
+  dev_t dev;
+
+  if (path == NULL ||
+      trend == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (cache_get_dev(path, &dev) < 0) {
+    return -1;
+  }
+
+  return fsquota_shm_trend_get(dev, type, id, trend);
+}
+
+int fsquota_cache_get_avail(const char *path, uint64_t *kb_avail) {
+  struct fsquota_fs_entry *entry;
+  time_t now;
+
+  if (path == NULL ||
+      kb_avail == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  entry = cache_fs_entry_get(path);
+  if (entry == NULL) {
+    return -1;
+  }
+
+  time(&now);
+  if (entry->avail_ts != 0 &&
+      (now - entry->avail_ts) < (time_t) cache_ttl) {
+    cache_count(FSQUOTA_SHM_STAT_HITS);
+    pr_trace_msg(trace_channel, 19, "using cached free space for '%s'", path);
+
+  } else if (cache_allow_query() == FALSE) {
+    if (entry->avail_ts == 0) {
+      errno = EAGAIN;
+      return -1;
+    }
+
+  } else {
+#ifdef HAVE_SYS_STATVFS_H
+    struct statvfs fs;
+
+    if (statvfs(path, &fs) < 0) {
+      entry->avail_res = -1;
+      entry->avail_errno = errno;
+
+      pr_trace_msg(trace_channel, 7,
+        "statvfs(2) error on '%s': %s", path, strerror(errno));
+
+    } else {
+      entry->avail_res = 0;
+      entry->avail_errno = 0;
+      entry->kb_avail = (((uint64_t) fs.f_bavail * fs.f_frsize) / 1024);
+    }
+#else
+    entry->avail_res = -1;
+    entry->avail_errno = ENOSYS;
+#endif /* HAVE_SYS_STATVFS_H */
+
+    cache_count(FSQUOTA_SHM_STAT_QUERIES);
+    entry->avail_ts = now;
+  }
+
+  if (entry->avail_res < 0) {
+    errno = entry->avail_errno;
+    return -1;
+  }
+
+  *kb_avail = entry->kb_avail;
+  return 0;
+}
+
+/* Lowers the given headroom to whatever remains below the given quota
+ * limit; a limit of zero means no limit.
+ */
+static void cache_clamp_headroom(uint64_t *kb_avail, uint64_t kb_total,
+    uint64_t kb_used) {
+  uint64_t kb_left = 0;
+
+  if (kb_total == 0) {
+    return;
+  }
+
+  if (kb_total > kb_used) {
+    kb_left = kb_total - kb_used;
+  }
+
+  if (kb_left < *kb_avail) {
+    *kb_avail = kb_left;
+  }
+}
+
+int fsquota_cache_get_headroom(const char *path, uid_t uid,
+    const gid_t *gids, unsigned int ngids, uint64_t *kb_avail) {
+  register unsigned int i;
+  uint64_t kb_total = 0, kb_used = 0;
+
+  if (path == NULL ||
+      (gids == NULL && ngids > 0) ||
+      kb_avail == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (fsquota_cache_get_avail(path, kb_avail) < 0) {
+    return -1;
+  }
+
+  if (fsquota_cache_get(path, FSQUOTA_TYPE_USER, (unsigned long) uid,
+      &kb_total, &kb_used, NULL, NULL) == 0) {
+    cache_clamp_headroom(kb_avail, kb_total, kb_used);
+  }
+
+  if (ngids > 0) {
+    pool *tmp_pool;
+    struct fsquota_values *values;
+
+    tmp_pool = make_sub_pool(cache_pool);
+    values = pcalloc(tmp_pool, sizeof(struct fsquota_values) * ngids);
+    for (i = 0; i < ngids; i++) {
+      values[i].id = (unsigned long) gids[i];
+    }
+
+    /* The most constrained group bounds the headroom. */
+    if (fsquota_cache_get_ids(path, FSQUOTA_TYPE_GROUP, ngids, values) == 0) {
+      for (i = 0; i < ngids; i++) {
+        if (values[i].res == 0) {
+          cache_clamp_headroom(kb_avail, values[i].kb_total,
+            values[i].kb_used);
+        }
+      }
+    }
+
+    destroy_pool(tmp_pool);
+  }
+
+  return 0;
+}
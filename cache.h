@@ -0,0 +1,172 @@
+/*
+ * ProFTPD - mod_fsquota cache API
+ * Copyright (c) 2013-2021 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_fsquota.h"
+
+#ifndef MOD_FSQUOTA_CACHE_H
+#define MOD_FSQUOTA_CACHE_H
+
+/* Default number of seconds for which cached quota values are used. */
+#define FSQUOTA_CACHE_DEFAULT_TTL	5
+
+int fsquota_cache_init(pool *p, unsigned int ttl);
+int fsquota_cache_free(void);
+
+/* Shares looked-up values with other nodes through the memcached servers
+ * configured for proftpd, keeping them there for the given number of
+ * seconds.  Reads the mount table, so it must be called before chroot.
+ * Fails with ENOSYS if proftpd was built without memcache support.
+ */
+int fsquota_cache_set_shared(pool *p, unsigned int ttl);
+
+/* Records the mount of the filesystem holding the given path, the backend
+ * serving its quotas, and whether user/group quotas are enabled on it, for
+ * sessions to inherit; called by the daemon, with the mount table open.
+ */
+int fsquota_cache_warmup(pool *p, const char *path);
+
+/* Warms up every filesystem whose mount options show quotas. */
+int fsquota_cache_warmup_mounts(pool *p);
+int fsquota_cache_clear_warmup(void);
+
+/* Limits the kernel queries made to refresh missing/expired entries to the
+ * given rate per second, allowing bursts of up to the given number of
+ * queries.  Once the budget is exhausted, expired values are served as-is.
+ * A rate of zero removes the limit.
+ */
+int fsquota_cache_set_rate(double rate, unsigned int burst);
+
+struct fsquota_cache_stats {
+  /* Lookups answered from fresh cache entries. */
+  unsigned long hits;
+
+  /* Lookups which queried the kernel. */
+  unsigned long queries;
+
+  /* Lookups which would have queried the kernel, but were throttled. */
+  unsigned long throttled;
+};
+
+int fsquota_cache_get_stats(struct fsquota_cache_stats *stats);
+
+/* Returns the quota status for the given type/ID on the filesystem holding
+ * the given path, consulting the kernel only if there is no fresh entry.
+ */
+int fsquota_cache_enabled(const char *path, int type, unsigned long id,
+  int *enabled);
+
+/* Returns the quota values for the given type/ID on the filesystem holding
+ * the given path, consulting the kernel only if there is no fresh entry.
+ */
+int fsquota_cache_get(const char *path, int type, unsigned long id,
+  uint64_t *kb_total, uint64_t *kb_used, uint64_t *file_total,
+  uint64_t *file_used);
+
+/* Quota values for a single ID, as returned by fsquota_cache_get_ids(). */
+struct fsquota_values {
+  unsigned long id;
+
+  /* The result, and errno, of the lookup for this ID. */
+  int res, xerrno;
+
+  uint64_t kb_total, kb_used, file_total, file_used;
+};
+
+/* Returns the quota values for each of the given IDs, all of the same type,
+ * on the filesystem holding the given path.  The caller sets the id field of
+ * each element; a failed lookup for one ID is reported in its res/xerrno
+ * fields, rather than failing the entire call.
+ */
+int fsquota_cache_get_ids(const char *path, int type, unsigned int nids,
+  struct fsquota_values *values);
+
+/* Sets the session's chroot, with any symlinks resolved, for mapping paths
+ * to filesystems through the mount table.  Called as the session chroots.
+ */
+int fsquota_cache_set_root(const char *root);
+
+/* Marks the cached values for the given type/ID on the filesystem holding
+ * the given path as stale, e.g. once another module has seen a transfer
+ * change the usage, so that the next lookup queries the kernel.  Returns -1
+ * with ENOENT if there is no such entry.
+ */
+int fsquota_cache_expire(const char *path, int type, unsigned long id);
+
+/* Adds the given deltas to the usage values of a cached entry, e.g. after an
+ * upload, without querying the kernel.  Usage in indexed trees is already
+ * kept current, and is left alone.  Returns -1 with ENOENT if there is no
+ * such entry, and ESTALE if the entry is to be queried again anyway.
+ */
+int fsquota_cache_add_used(const char *path, int type, unsigned long id,
+  int64_t kb_delta, int64_t file_delta);
+
+/* Returns the cached quota values for the given type/ID on the filesystem
+ * holding the given path, however old, without querying the kernel.  Returns
+ * -1 with ENOENT if there are no such values.
+ */
+int fsquota_cache_peek(const char *path, int type, unsigned long id,
+  uint64_t *kb_total, uint64_t *kb_used, uint64_t *file_total,
+  uint64_t *file_used);
+
+/* Returns, and records, the highest FSQuotaWarn threshold already announced
+ * for the given type/ID on the filesystem holding the given path; -1 if
+ * none.  Flushing the cache does not forget them.
+ */
+int fsquota_cache_get_warned(const char *path, int type, unsigned long id,
+  int *pct);
+int fsquota_cache_set_warned(const char *path, int type, unsigned long id,
+  int pct);
+
+/* Returns the usage trend for the given type/ID on the filesystem holding
+ * the given path, as sampled by the lookups of all sessions.  Returns -1 with
+ * ENOENT if there is no such trend.
+ */
+struct fsquota_shm_trend;
+int fsquota_cache_get_trend(const char *path, int type, unsigned long id,
+  struct fsquota_shm_trend *trend);
+
+/* Marks the cached values for the given type/ID on the given device as
+ * stale, so that the next lookup queries the kernel.  Returns -1 with
+ * ENOENT if there is no such entry.
+ */
+int fsquota_cache_invalidate(dev_t dev, int type, unsigned long id);
+
+/* Discards all cached values, including the quota status resolved by the
+ * daemon.
+ */
+int fsquota_cache_flush(void);
+
+/* Returns the free space, in KB, available to unprivileged users on the
+ * filesystem holding the given path.
+ */
+int fsquota_cache_get_avail(const char *path, uint64_t *kb_avail);
+
+/* Returns the space, in KB, which the given user, in the given groups, can
+ * still write to the filesystem holding the given path: the smallest of the
+ * free space and the space left below the user's quota and each group's.
+ */
+int fsquota_cache_get_headroom(const char *path, uid_t uid,
+  const gid_t *gids, unsigned int ngids, uint64_t *kb_avail);
+
+#endif /* MOD_FSQUOTA_CACHE_H */
@@ -27,12 +27,291 @@
 
 static const char *trace_channel = "fsquota";
 
+/* Set while the backend of the paths being looked up is already known. */
+static int fsquota_known_backend = FSQUOTA_BACKEND_UNKNOWN;
+
 #if defined(LINUX)
+# if defined(HAVE_LINUX_BTRFS_H)
+#  ifndef BTRFS_SUPER_MAGIC
+#   define BTRFS_SUPER_MAGIC		0x9123683E
+#  endif
+
+#  ifndef BTRFS_FIRST_FREE_OBJECTID
+#   define BTRFS_FIRST_FREE_OBJECTID	256ULL
+#  endif
+
+/* Btrfs has no per-user quotas; usage is tracked per subvolume, by qgroups.
+ * Where each home is a subvolume, the level-0 qgroup of the subvolume holding
+ * a path is, in effect, that user's quota.
+ *
+ * The qgroup values are read from sysfs (Linux 5.9 and later), which is
+ * readable without privileges, unlike the quota tree itself.  The session
+ * may be chrooted by the time the values are needed, so the sysfs directory
+ * is opened beforehand.  Each subvolume has its own st_dev, so the cache
+ * already keeps these values per subvolume.
+ */
+static int btrfs_sysfs_fd = -1;
+
+static int btrfs_is_btrfs(const char *path) {
+  struct statfs sfs;
+
+  if (statfs(path, &sfs) < 0) {
+    return FALSE;
+  }
+
+  return ((uint32_t) sfs.f_type == (uint32_t) BTRFS_SUPER_MAGIC);
+}
+
+static int linux_is_btrfs(const char *path) {
+  if (fsquota_known_backend != FSQUOTA_BACKEND_UNKNOWN) {
+    return (fsquota_known_backend == FSQUOTA_BACKEND_BTRFS);
+  }
+
+  return btrfs_is_btrfs(path);
+}
+
+/* Returns the sysfs name of the qgroup for the subvolume holding the path,
+ * i.e. "<fsid>/qgroups/0_<subvolid>".
+ */
+static int btrfs_get_qgroup(const char *path, char *buf, size_t bufsz) {
+  int fd, res, xerrno;
+  struct btrfs_ioctl_ino_lookup_args lookup;
+  struct btrfs_ioctl_fs_info_args info;
+  unsigned char *u;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+
+  /* Looking up the subvolume root inode itself is allowed for anyone, and
+   * yields the ID of the subvolume holding the opened file.
+   */
+  memset(&lookup, 0, sizeof(lookup));
+  lookup.treeid = 0;
+  lookup.objectid = BTRFS_FIRST_FREE_OBJECTID;
+
+  res = ioctl(fd, BTRFS_IOC_INO_LOOKUP, &lookup);
+  if (res == 0) {
+    memset(&info, 0, sizeof(info));
+    res = ioctl(fd, BTRFS_IOC_FS_INFO, &info);
+  }
+  xerrno = errno;
+
+  (void) close(fd);
+
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 9,
+      "btrfs: error looking up subvolume for path '%s': %s", path,
+      strerror(xerrno));
+
+    errno = xerrno;
+    return -1;
+  }
+
+  u = info.fsid;
+  snprintf(buf, bufsz-1,
+    "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x"
+    "/qgroups/0_%llu", u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7], u[8],
+    u[9], u[10], u[11], u[12], u[13], u[14], u[15],
+    (unsigned long long) lookup.treeid);
+
+  return 0;
+}
+
+/* Reads a qgroup value; a value of "none" means no limit, reported as
+ * zero.
+ */
+static int btrfs_read_value(int dirfd, const char *name, uint64_t *val) {
+  int fd;
+  ssize_t len;
+  char buf[64];
+
+  fd = openat(dirfd, name, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+
+  memset(buf, '\0', sizeof(buf));
+  len = read(fd, buf, sizeof(buf)-1);
+  (void) close(fd);
+
+  if (len < 0) {
+    return -1;
+  }
+
+  if (strncmp(buf, "none", 4) == 0) {
+    *val = 0;
+
+  } else {
+    *val = (uint64_t) strtoull(buf, NULL, 10);
+  }
+
+  return 0;
+}
+
+static int btrfs_qgroup_dir(const char *path) {
+  int dirfd, xerrno;
+  char qgroup[PR_TUNABLE_PATH_MAX];
+
+  if (btrfs_sysfs_fd < 0) {
+    pr_trace_msg(trace_channel, 9,
+      "btrfs: unable to read qgroup for path '%s': sysfs not available", path);
+    errno = ENOSYS;
+    return -1;
+  }
+
+  memset(qgroup, '\0', sizeof(qgroup));
+  if (btrfs_get_qgroup(path, qgroup, sizeof(qgroup)) < 0) {
+    return -1;
+  }
+
+  dirfd = openat(btrfs_sysfs_fd, qgroup, O_RDONLY|O_DIRECTORY);
+  if (dirfd < 0) {
+    xerrno = errno;
+
+    /* Most likely, quotas are not enabled on this filesystem. */
+    pr_trace_msg(trace_channel, 9,
+      "btrfs: unable to read qgroup '%s' for path '%s': %s", qgroup, path,
+      strerror(xerrno));
+
+    errno = xerrno;
+    return -1;
+  }
+
+  return dirfd;
+}
+
+static int btrfs_qgroup_enabled(const char *path, int *enabled) {
+  int dirfd;
+
+  dirfd = btrfs_qgroup_dir(path);
+  if (dirfd < 0) {
+    if (errno == ENOENT) {
+      *enabled = FALSE;
+      return 0;
+    }
+
+    return -1;
+  }
+
+  (void) close(dirfd);
+  *enabled = TRUE;
+  return 0;
+}
+
+static int btrfs_qgroup_get(const char *path, uint64_t *kb_total,
+    uint64_t *kb_used, uint64_t *file_total, uint64_t *file_used,
+    uint64_t *kb_hard, uint64_t *file_hard) {
+  int dirfd, res, xerrno;
+  uint64_t used = 0, limit = 0;
+
+  dirfd = btrfs_qgroup_dir(path);
+  if (dirfd < 0) {
+    return -1;
+  }
+
+  /* Prefer the referenced limit; fall back to the exclusive limit, if that
+   * is the only one set.
+   */
+  res = btrfs_read_value(dirfd, "max_referenced", &limit);
+  if (res == 0 &&
+      limit == 0) {
+    uint64_t excl_limit = 0;
+
+    if (btrfs_read_value(dirfd, "max_exclusive", &excl_limit) == 0 &&
+        excl_limit > 0) {
+      limit = excl_limit;
+      res = btrfs_read_value(dirfd, "exclusive", &used);
+
+    } else {
+      res = btrfs_read_value(dirfd, "referenced", &used);
+    }
+
+  } else if (res == 0) {
+    res = btrfs_read_value(dirfd, "referenced", &used);
+  }
+  xerrno = errno;
+
+  (void) close(dirfd);
+
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 9,
+      "btrfs: error reading qgroup values for path '%s': %s", path,
+      strerror(xerrno));
+
+    errno = xerrno;
+    return -1;
+  }
+
+  /* Qgroup limits are hard limits; there are no soft ones. */
+  if (kb_total != NULL) {
+    *kb_total = limit / 1024;
+  }
+
+  if (kb_hard != NULL) {
+    *kb_hard = limit / 1024;
+  }
+
+  if (kb_used != NULL) {
+    *kb_used = used / 1024;
+  }
+
+  /* Qgroups do not count files. */
+  if (file_total != NULL) {
+    *file_total = 0;
+  }
+
+  if (file_used != NULL) {
+    *file_used = 0;
+  }
+
+  if (file_hard != NULL) {
+    *file_hard = 0;
+  }
+
+  return 0;
+}
+# endif /* HAVE_LINUX_BTRFS_H */
+
+# if !defined(Q_QUOTASTAT) && defined(Q_GETFMT)
+/* Linux has no Q_QUOTASTAT; the quota format can only be read while quotas
+ * of the given type are on.
+ */
+static int linux_quota_on(const char *path, int type, int *enabled) {
+  uint32_t fmt = 0;
+
+  if (quotactl(QCMD(Q_GETFMT, type), path, 0, (caddr_t) &fmt) < 0) {
+    if (errno != ESRCH) {
+      return -1;
+    }
+
+    *enabled = FALSE;
+    return 0;
+  }
+
+  *enabled = TRUE;
+  return 0;
+}
+# endif /* !Q_QUOTASTAT and Q_GETFMT */
+
 static int linux_user_enabled(const char *path, uid_t uid, int *enabled) {
   int res = -1;
 
-# ifdef Q_QUOTASTAT
+# if defined(HAVE_LINUX_BTRFS_H)
+  if (linux_is_btrfs(path)) {
+    return btrfs_qgroup_enabled(path, enabled);
+  }
+# endif /* HAVE_LINUX_BTRFS_H */
+
+# if defined(Q_QUOTASTAT)
   res = quotactl(QCMD(Q_QUOTASTAT, USRQUOTA), path, uid, enabled);
+# elif defined(Q_GETFMT)
+  res = linux_quota_on(path, USRQUOTA, enabled);
+# else
+  errno = ENOSYS;
+# endif /* Q_QUOTASTAT */
+
   if (res < 0) {
     int xerrno = errno;
 
@@ -42,42 +321,43 @@ static int linux_user_enabled(const char *path, uid_t uid, int *enabled) {
 
     errno = xerrno;
   }
-# else
-  errno = ENOSYS; 
-# endif /* Q_QUOTASTAT */
 
   return res;
 }
 
 static int linux_user_get(const char *path, uid_t uid, uint64_t *kb_total,
-    uint64_t *kb_used, uint64_t *file_total, uint64_t *file_used) {
+    uint64_t *kb_used, uint64_t *file_total, uint64_t *file_used,
+    uint64_t *kb_hard, uint64_t *file_hard) {
   int res, xerrno;
-  struct stat st;
   struct dqblk dq;
 
-  /* We need to stat the directory, in order to find out the block size. */
-  res = stat(path, &st);
-  xerrno = errno;
-
-  if (res < 0) {
-    pr_trace_msg(trace_channel, 7,
-      "stat(2) error on '%s': %s", path, strerror(xerrno));
-
-    errno = xerrno;
-    return -1;
+# if defined(HAVE_LINUX_BTRFS_H)
+  if (linux_is_btrfs(path)) {
+    return btrfs_qgroup_get(path, kb_total, kb_used, file_total, file_used,
+      kb_hard, file_hard);
   }
+# endif /* HAVE_LINUX_BTRFS_H */
 
   res = quotactl(QCMD(Q_GETQUOTA, USRQUOTA), path, uid, &dq);
   xerrno = errno;
 
   if (res == 0) {
+    /* Linux reports limits in 1KB blocks, and current usage in bytes,
+     * regardless of the filesystem block size.
+     */
     if (dq.dqb_valid & QIF_BLIMITS) {
       if (kb_total != NULL) {
-        *kb_total = ((dq.dqb_bsoftlimit * st.st_blksize) / 1024);
+        *kb_total = (uint64_t) dq.dqb_bsoftlimit;
+      }
+
+      if (kb_hard != NULL) {
+        *kb_hard = (uint64_t) dq.dqb_bhardlimit;
       }
+    }
 
+    if (dq.dqb_valid & QIF_SPACE) {
       if (kb_used != NULL) {
-        *kb_used = ((dq.dqb_curspace * st.st_blksize) / 1024);
+        *kb_used = (uint64_t) (dq.dqb_curspace / 1024);
       }
     }
 
@@ -86,6 +366,10 @@ static int linux_user_get(const char *path, uid_t uid, uint64_t *kb_total,
         *file_total = (uint64_t) dq.dqb_isoftlimit;
       }
 
+      if (file_hard != NULL) {
+        *file_hard = (uint64_t) dq.dqb_ihardlimit;
+      }
+
       if (file_used != NULL) {
         *file_used = (uint64_t) dq.dqb_curinodes;
       }
@@ -105,8 +389,22 @@ static int linux_user_get(const char *path, uid_t uid, uint64_t *kb_total,
 static int linux_group_enabled(const char *path, gid_t gid, int *enabled) {
   int res = -1;
 
-# ifdef Q_QUOTASTAT
+# if defined(HAVE_LINUX_BTRFS_H)
+  /* Btrfs qgroups belong to subvolumes, not groups. */
+  if (linux_is_btrfs(path)) {
+    *enabled = FALSE;
+    return 0;
+  }
+# endif /* HAVE_LINUX_BTRFS_H */
+
+# if defined(Q_QUOTASTAT)
   res = quotactl(QCMD(Q_QUOTASTAT, GRPQUOTA), path, gid, enabled);
+# elif defined(Q_GETFMT)
+  res = linux_quota_on(path, GRPQUOTA, enabled);
+# else
+  errno = ENOSYS;
+# endif /* Q_QUOTASTAT */
+
   if (res < 0) {
     int xerrno = errno;
 
@@ -116,42 +414,159 @@ static int linux_group_enabled(const char *path, gid_t gid, int *enabled) {
 
     errno = xerrno;
   }
-# else
-  errno = ENOSYS; 
-# endif /* Q_QUOTASTAT */
 
   return res;
 }
 
 static int linux_group_get(const char *path, gid_t gid, uint64_t *kb_total,
-    uint64_t *kb_used, uint64_t *file_total, uint64_t *file_used) {
+    uint64_t *kb_used, uint64_t *file_total, uint64_t *file_used,
+    uint64_t *kb_hard, uint64_t *file_hard) {
   int res, xerrno;
-  struct stat st;
   struct dqblk dq;
 
-  /* We need to stat the directory, in order to find out the block size. */
-  res = stat(path, &st);
+# if defined(HAVE_LINUX_BTRFS_H)
+  if (linux_is_btrfs(path)) {
+    pr_trace_msg(trace_channel, 9,
+      "btrfs: no group quotas for GID %lu, path '%s'", (unsigned long) gid,
+      path);
+    errno = ENOSYS;
+    return -1;
+  }
+# endif /* HAVE_LINUX_BTRFS_H */
+
+  res = quotactl(QCMD(Q_GETQUOTA, GRPQUOTA), path, gid, &dq);
   xerrno = errno;
 
+  if (res == 0) {
+    /* Linux reports limits in 1KB blocks, and current usage in bytes,
+     * regardless of the filesystem block size.
+     */
+    if (dq.dqb_valid & QIF_BLIMITS) {
+      if (kb_total != NULL) {
+        *kb_total = (uint64_t) dq.dqb_bsoftlimit;
+      }
+
+      if (kb_hard != NULL) {
+        *kb_hard = (uint64_t) dq.dqb_bhardlimit;
+      }
+    }
+
+    if (dq.dqb_valid & QIF_SPACE) {
+      if (kb_used != NULL) {
+        *kb_used = (uint64_t) (dq.dqb_curspace / 1024);
+      }
+    }
+
+    if (dq.dqb_valid & QIF_INODES) {
+      if (file_total != NULL) {
+        *file_total = (uint64_t) dq.dqb_isoftlimit;
+      }
+
+      if (file_hard != NULL) {
+        *file_hard = (uint64_t) dq.dqb_ihardlimit;
+      }
+
+      if (file_used != NULL) {
+        *file_used = (uint64_t) dq.dqb_curinodes;
+      }
+    }
+
+  } else {
+    pr_trace_msg(trace_channel, 9,
+      "Linux: error obtaining group quotas for GID %lu, path '%s': %s",
+      (unsigned long) gid, path, strerror(xerrno));
+
+    errno = xerrno;
+  }
+
+  return res;
+}
+
+# if defined(HAVE_LINUX_FS_H) && defined(FS_IOC_FSGETXATTR)
+#  ifndef PRJQUOTA
+#   define PRJQUOTA	2
+#  endif
+
+static int linux_project_get_id(const char *path, unsigned long *id) {
+  int fd, res, xerrno;
+  struct fsxattr fsx;
+
+  fd = open(path, O_RDONLY|O_NONBLOCK);
+  if (fd < 0) {
+    xerrno = errno;
+
+    pr_trace_msg(trace_channel, 9,
+      "Linux: unable to open '%s' for project ID: %s", path, strerror(xerrno));
+
+    errno = xerrno;
+    return -1;
+  }
+
+  memset(&fsx, 0, sizeof(fsx));
+  res = ioctl(fd, FS_IOC_FSGETXATTR, &fsx);
+  xerrno = errno;
+  (void) close(fd);
+
   if (res < 0) {
-    pr_trace_msg(trace_channel, 7,
-      "stat(2) error on '%s': %s", path, strerror(xerrno));
+    pr_trace_msg(trace_channel, 9,
+      "Linux: error obtaining project ID of '%s': %s", path, strerror(xerrno));
 
     errno = xerrno;
     return -1;
   }
 
-  res = quotactl(QCMD(Q_GETQUOTA, GRPQUOTA), path, gid, &dq);
+  *id = (unsigned long) fsx.fsx_projid;
+  return 0;
+}
+
+static int linux_project_enabled(const char *path, unsigned long id,
+    int *enabled) {
+  int res = -1;
+
+#  if defined(Q_QUOTASTAT)
+  res = quotactl(QCMD(Q_QUOTASTAT, PRJQUOTA), path, id, enabled);
+#  elif defined(Q_GETFMT)
+  res = linux_quota_on(path, PRJQUOTA, enabled);
+#  else
+  errno = ENOSYS;
+#  endif /* Q_QUOTASTAT */
+
+  if (res < 0) {
+    int xerrno = errno;
+
+    pr_trace_msg(trace_channel, 9,
+      "Linux: error checking project quota status for ID %lu, path '%s': %s",
+      id, path, strerror(xerrno));
+
+    errno = xerrno;
+  }
+
+  return res;
+}
+
+static int linux_project_get(const char *path, unsigned long id,
+    uint64_t *kb_total, uint64_t *kb_used, uint64_t *file_total,
+    uint64_t *file_used, uint64_t *kb_hard, uint64_t *file_hard) {
+  int res, xerrno;
+  struct dqblk dq;
+
+  res = quotactl(QCMD(Q_GETQUOTA, PRJQUOTA), path, id, &dq);
   xerrno = errno;
 
   if (res == 0) {
     if (dq.dqb_valid & QIF_BLIMITS) {
       if (kb_total != NULL) {
-        *kb_total = ((dq.dqb_bsoftlimit * st.st_blksize) / 1024);
+        *kb_total = (uint64_t) dq.dqb_bsoftlimit;
       }
 
+      if (kb_hard != NULL) {
+        *kb_hard = (uint64_t) dq.dqb_bhardlimit;
+      }
+    }
+
+    if (dq.dqb_valid & QIF_SPACE) {
       if (kb_used != NULL) {
-        *kb_used = ((dq.dqb_curspace * st.st_blksize) / 1024);
+        *kb_used = (uint64_t) (dq.dqb_curspace / 1024);
       }
     }
 
@@ -160,6 +575,10 @@ static int linux_group_get(const char *path, gid_t gid, uint64_t *kb_total,
         *file_total = (uint64_t) dq.dqb_isoftlimit;
       }
 
+      if (file_hard != NULL) {
+        *file_hard = (uint64_t) dq.dqb_ihardlimit;
+      }
+
       if (file_used != NULL) {
         *file_used = (uint64_t) dq.dqb_curinodes;
       }
@@ -167,14 +586,15 @@ static int linux_group_get(const char *path, gid_t gid, uint64_t *kb_total,
 
   } else {
     pr_trace_msg(trace_channel, 9,
-      "Linux: error obtaining group quotas for GID %lu, path '%s': %s",
-      (unsigned long) gid, path, strerror(xerrno));
+      "Linux: error obtaining project quotas for ID %lu, path '%s': %s",
+      id, path, strerror(xerrno));
 
     errno = xerrno;
   }
 
   return res;
 }
+# endif /* HAVE_LINUX_FS_H and FS_IOC_FSGETXATTR */
 #endif /* Linux */
 
 #if defined(FREEBSD7) || defined(FREEBSD8) || defined(FREEBSD9) || \
@@ -185,7 +605,8 @@ static int freebsd_user_enabled(const char *path, uid_t uid, int *enabled) {
 }
 
 static int freebsd_user_get(const char *path, uid_t uid, uint64_t *kb_total,
-    uint64_t *kb_used, uint64_t *file_total, uint64_t *file_used) {
+    uint64_t *kb_used, uint64_t *file_total, uint64_t *file_used,
+    uint64_t *kb_hard, uint64_t *file_hard) {
   int res, xerrno;
   struct stat st;
   struct dqblk dq;
@@ -208,6 +629,10 @@ static int freebsd_user_get(const char *path, uid_t uid, uint64_t *kb_total,
       *kb_total = ((dq.dqb_bsoftlimit * st.st_blksize) / 1024);
     }
 
+    if (kb_hard != NULL) {
+      *kb_hard = ((dq.dqb_bhardlimit * st.st_blksize) / 1024);
+    }
+
     if (kb_used != NULL) {
       *kb_used = ((dq.dqb_curblocks * st.st_blksize) / 1024);
     }
@@ -216,6 +641,10 @@ static int freebsd_user_get(const char *path, uid_t uid, uint64_t *kb_total,
       *file_total = (uint64_t) dq.dqb_isoftlimit;
     }
 
+    if (file_hard != NULL) {
+      *file_hard = (uint64_t) dq.dqb_ihardlimit;
+    }
+
     if (file_used != NULL) {
       *file_used = (uint64_t) dq.dqb_curinodes;
     }
@@ -237,7 +666,8 @@ static int freebsd_group_enabled(const char *path, gid_t gid, int *enabled) {
 }
 
 static int freebsd_group_get(const char *path, gid_t gid, uint64_t *kb_total,
-    uint64_t *kb_used, uint64_t *file_total, uint64_t *file_used) {
+    uint64_t *kb_used, uint64_t *file_total, uint64_t *file_used,
+    uint64_t *kb_hard, uint64_t *file_hard) {
   int res, xerrno;
   struct stat st;
   struct dqblk dq;
@@ -262,6 +692,10 @@ static int freebsd_group_get(const char *path, gid_t gid, uint64_t *kb_total,
       *kb_total = ((dq.dqb_bsoftlimit * st.st_blksize) / 1024);
     }
 
+    if (kb_hard != NULL) {
+      *kb_hard = ((dq.dqb_bhardlimit * st.st_blksize) / 1024);
+    }
+
     if (kb_used != NULL) {
       *kb_used = ((dq.dqb_curblocks * st.st_blksize) / 1024);
     }
@@ -270,6 +704,10 @@ static int freebsd_group_get(const char *path, gid_t gid, uint64_t *kb_total,
       *file_total = (uint64_t) dq.dqb_isoftlimit;
     }
 
+    if (file_hard != NULL) {
+      *file_hard = (uint64_t) dq.dqb_ihardlimit;
+    }
+
     if (file_used != NULL) {
       *file_used = (uint64_t) dq.dqb_curinodes;
     }
@@ -314,7 +752,8 @@ static int darwin_user_enabled(const char *path, uid_t uid, int *enabled) {
 }
 
 static int darwin_user_get(const char *path, uid_t uid, uint64_t *kb_total,
-    uint64_t *kb_used, uint64_t *file_total, uint64_t *file_used) {
+    uint64_t *kb_used, uint64_t *file_total, uint64_t *file_used,
+    uint64_t *kb_hard, uint64_t *file_hard) {
   int res, xerrno;
   struct dqblk dq;
 
@@ -326,6 +765,10 @@ static int darwin_user_get(const char *path, uid_t uid, uint64_t *kb_total,
       *kb_total = (dq.dqb_bsoftlimit / 1024);
     }
 
+    if (kb_hard != NULL) {
+      *kb_hard = (dq.dqb_bhardlimit / 1024);
+    }
+
     if (kb_used != NULL) {
       *kb_used = (dq.dqb_curbytes / 1024);
     }
@@ -334,6 +777,10 @@ static int darwin_user_get(const char *path, uid_t uid, uint64_t *kb_total,
       *file_total = (uint64_t) dq.dqb_isoftlimit;
     }
 
+    if (file_hard != NULL) {
+      *file_hard = (uint64_t) dq.dqb_ihardlimit;
+    }
+
     if (file_used != NULL) {
       *file_used = (uint64_t) dq.dqb_curinodes;
     }
@@ -375,7 +822,8 @@ static int darwin_group_enabled(const char *path, gid_t gid, int *enabled) {
 }
 
 static int darwin_group_get(const char *path, gid_t gid, uint64_t *kb_total,
-    uint64_t *kb_used, uint64_t *file_total, uint64_t *file_used) {
+    uint64_t *kb_used, uint64_t *file_total, uint64_t *file_used,
+    uint64_t *kb_hard, uint64_t *file_hard) {
   int res, xerrno;
   struct dqblk dq;
 
@@ -387,6 +835,10 @@ static int darwin_group_get(const char *path, gid_t gid, uint64_t *kb_total,
       *kb_total = (dq.dqb_bsoftlimit / 1024);
     }
 
+    if (kb_hard != NULL) {
+      *kb_hard = (dq.dqb_bhardlimit / 1024);
+    }
+
     if (kb_used != NULL) {
       *kb_used = (dq.dqb_curbytes / 1024);
     }
@@ -395,6 +847,10 @@ static int darwin_group_get(const char *path, gid_t gid, uint64_t *kb_total,
       *file_total = (uint64_t) dq.dqb_isoftlimit;
     }
 
+    if (file_hard != NULL) {
+      *file_hard = (uint64_t) dq.dqb_ihardlimit;
+    }
+
     if (file_used != NULL) {
       *file_used = (uint64_t) dq.dqb_curinodes;
     }
@@ -418,7 +874,8 @@ static int solaris_user_enabled(const char *path, uid_t uid, int *enabled) {
 }
 
 static int solaris_user_get(const char *path, uid_t uid, uint64_t *kb_total,
-    uint64_t *kb_used, uint64_t *file_total, uint64_t *file_used) {
+    uint64_t *kb_used, uint64_t *file_total, uint64_t *file_used,
+    uint64_t *kb_hard, uint64_t *file_hard) {
   int res, fd, xerrno;
   struct stat st;
   struct dqblk dq;
@@ -459,6 +916,10 @@ static int solaris_user_get(const char *path, uid_t uid, uint64_t *kb_total,
       *kb_total = ((dq.dqb_bsoftlimit * st.st_blksize) / 1024);
     }
 
+    if (kb_hard != NULL) {
+      *kb_hard = ((dq.dqb_bhardlimit * st.st_blksize) / 1024);
+    }
+
     if (kb_used != NULL) {
       *kb_used = ((dq.dqb_curblocks * st.st_blksize) / 1024);
     }
@@ -467,6 +928,10 @@ static int solaris_user_get(const char *path, uid_t uid, uint64_t *kb_total,
       *file_total = (uint64_t) dq.dqb_fsoftlimit;
     }
 
+    if (file_hard != NULL) {
+      *file_hard = (uint64_t) dq.dqb_fhardlimit;
+    }
+
     if (file_used != NULL) {
       *file_used = (uint64_t) dq.dqb_curfiles;
     }
@@ -490,7 +955,8 @@ static int solaris_group_enabled(const char *path, gid_t gid, int *enabled) {
 }
 
 static int solaris_group_get(const char *path, gid_t gid, uint64_t *kb_total,
-    uint64_t *kb_used, uint64_t *file_total, uint64_t *file_used) {
+    uint64_t *kb_used, uint64_t *file_total, uint64_t *file_used,
+    uint64_t *kb_hard, uint64_t *file_hard) {
   /* Solaris doesn't support group quotas. */
   errno = ENOSYS;
   return -1;
@@ -499,6 +965,102 @@ static int solaris_group_get(const char *path, gid_t gid, uint64_t *kb_total,
 
 /* XXX NFS */
 
+int fsquota_backend_init(void) {
+#if defined(LINUX) && defined(HAVE_LINUX_BTRFS_H)
+  if (btrfs_sysfs_fd < 0) {
+    btrfs_sysfs_fd = open("/sys/fs/btrfs", O_RDONLY|O_DIRECTORY);
+    if (btrfs_sysfs_fd < 0) {
+      pr_trace_msg(trace_channel, 9,
+        "btrfs: unable to open /sys/fs/btrfs: %s", strerror(errno));
+
+    } else {
+      (void) fcntl(btrfs_sysfs_fd, F_SETFD, FD_CLOEXEC);
+    }
+  }
+#endif
+
+  return 0;
+}
+
+int fsquota_backend_get(const char *path) {
+  if (path == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+#if defined(LINUX) && defined(HAVE_LINUX_BTRFS_H)
+  if (btrfs_is_btrfs(path)) {
+    return FSQUOTA_BACKEND_BTRFS;
+  }
+#endif
+
+  return FSQUOTA_BACKEND_QUOTACTL;
+}
+
+int fsquota_backend_set_known(int backend) {
+  switch (backend) {
+    case FSQUOTA_BACKEND_UNKNOWN:
+    case FSQUOTA_BACKEND_QUOTACTL:
+    case FSQUOTA_BACKEND_BTRFS:
+      fsquota_known_backend = backend;
+      return 0;
+
+    default:
+      break;
+  }
+
+  errno = EINVAL;
+  return -1;
+}
+
+/* Only Linux, for XFS and ext4, has project quotas which can be queried
+ * like user/group quotas.
+ */
+#if defined(LINUX) && defined(HAVE_LINUX_FS_H) && defined(FS_IOC_FSGETXATTR)
+# define FSQUOTA_HAVE_PROJECTS
+#endif
+
+int fsquota_project_get_id(const char *path, unsigned long *id) {
+#ifdef FSQUOTA_HAVE_PROJECTS
+  return linux_project_get_id(path, id);
+#else
+  pr_trace_msg(trace_channel, 3,
+    "getting project IDs for platform '%s' not implemented", PR_PLATFORM);
+
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+int fsquota_project_enabled(const char *path, unsigned long id,
+    int *enabled) {
+#ifdef FSQUOTA_HAVE_PROJECTS
+  return linux_project_enabled(path, id, enabled);
+#else
+  pr_trace_msg(trace_channel, 3,
+    "checking project quota status for platform '%s' not implemented",
+    PR_PLATFORM);
+
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+int fsquota_project_get(const char *path, unsigned long id,
+    uint64_t *kb_total, uint64_t *kb_used, uint64_t *file_total,
+    uint64_t *file_used, uint64_t *kb_hard, uint64_t *file_hard) {
+#ifdef FSQUOTA_HAVE_PROJECTS
+  return linux_project_get(path, id, kb_total, kb_used, file_total,
+    file_used, kb_hard, file_hard);
+#else
+  pr_trace_msg(trace_channel, 3,
+    "getting project quota for platform '%s' not implemented", PR_PLATFORM);
+
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
 int fsquota_user_enabled(const char *path, uid_t uid, int *enabled) {
   int res = -1;
 
@@ -556,21 +1118,26 @@ int fsquota_group_enabled(const char *path, gid_t gid, int *enabled) {
 }
 
 int fsquota_user_get(const char *path, uid_t uid, uint64_t *kb_total,
-    uint64_t *kb_used, uint64_t *file_total, uint64_t *file_used) {
+    uint64_t *kb_used, uint64_t *file_total, uint64_t *file_used,
+    uint64_t *kb_hard, uint64_t *file_hard) {
   int res = -1;
 
 #if defined(LINUX)
-  res = linux_user_get(path, uid, kb_total, kb_used, file_total, file_used);
+  res = linux_user_get(path, uid, kb_total, kb_used, file_total,
+    file_used, kb_hard, file_hard);
 
 #elif defined(FREEBSD7) || defined(FREEBSD8) || defined(FREEBSD9) || \
       defined(FREEBSD10)
-  res = freebsd_user_get(path, uid, kb_total, kb_used, file_total, file_used);
+  res = freebsd_user_get(path, uid, kb_total, kb_used, file_total,
+    file_used, kb_hard, file_hard);
 
 #elif defined(DARWIN9) || defined(DARWIN10) || defined(DARWIN11)
-  res = darwin_user_get(path, uid, kb_total, kb_used, file_total, file_used);
+  res = darwin_user_get(path, uid, kb_total, kb_used, file_total,
+    file_used, kb_hard, file_hard);
 
 #elif defined(SOLARIS2)
-  res = solaris_user_get(path, uid, kb_total, kb_used, file_total, file_used);
+  res = solaris_user_get(path, uid, kb_total, kb_used, file_total,
+    file_used, kb_hard, file_hard);
 
 #else
   pr_trace_msg(trace_channel, 3,
@@ -585,21 +1152,26 @@ int fsquota_user_get(const char *path, uid_t uid, uint64_t *kb_total,
 }
 
 int fsquota_group_get(const char *path, gid_t gid, uint64_t *kb_total,
-    uint64_t *kb_used, uint64_t *file_total, uint64_t *file_used) {
+    uint64_t *kb_used, uint64_t *file_total, uint64_t *file_used,
+    uint64_t *kb_hard, uint64_t *file_hard) {
   int res = -1;
 
 #if defined(LINUX)
-  res = linux_group_get(path, gid, kb_total, kb_used, file_total, file_used);
+  res = linux_group_get(path, gid, kb_total, kb_used, file_total,
+    file_used, kb_hard, file_hard);
 
 #elif defined(FREEBSD7) || defined(FREEBSD8) || defined(FREEBSD9) || \
       defined(FREEBSD10)
-  res = freebsd_group_get(path, gid, kb_total, kb_used, file_total, file_used);
+  res = freebsd_group_get(path, gid, kb_total, kb_used, file_total,
+    file_used, kb_hard, file_hard);
 
 #elif defined(DARWIN9) || defined(DARWIN10) || defined(DARWIN11)
-  res = darwin_group_get(path, gid, kb_total, kb_used, file_total, file_used);
+  res = darwin_group_get(path, gid, kb_total, kb_used, file_total,
+    file_used, kb_hard, file_hard);
 
 #elif defined(SOLARIS2)
-  res = solaris_group_get(path, gid, kb_total, kb_used, file_total, file_used);
+  res = solaris_group_get(path, gid, kb_total, kb_used, file_total,
+    file_used, kb_hard, file_hard);
 
 #else
   pr_trace_msg(trace_channel, 3,
@@ -44,17 +44,68 @@
 # include <xfs/xqm.h>
 #endif
 
+#ifdef HAVE_SYS_VFS_H
+# include <sys/vfs.h>
+#endif
+
+#ifdef HAVE_LINUX_MAGIC_H
+# include <linux/magic.h>
+#endif
+
+#ifdef HAVE_LINUX_BTRFS_H
+# include <linux/btrfs.h>
+#endif
+
+#ifdef HAVE_LINUX_FS_H
+# include <linux/fs.h>
+#endif
+
 #ifndef MOD_FSQUOTA_FSQUOTA_H
 #define MOD_FSQUOTA_FSQUOTA_H
 
+/* Opens anything the platform lookups need from outside of the session's
+ * eventual chroot; called at session start, before any chroot.
+ */
+int fsquota_backend_init(void);
+
+#define FSQUOTA_BACKEND_UNKNOWN		0
+#define FSQUOTA_BACKEND_QUOTACTL	1
+#define FSQUOTA_BACKEND_BTRFS		2
+
+/* Returns which of the above serves the quotas of the given path. */
+int fsquota_backend_get(const char *path);
+
+/* Tells the lookups which follow that their paths are served by the given
+ * backend, as returned earlier by fsquota_backend_get(), so that they need
+ * not check again; FSQUOTA_BACKEND_UNKNOWN has them check each time.
+ */
+int fsquota_backend_set_known(int backend);
+
 int fsquota_group_enabled(const char *path, gid_t gid, int *enabled);
 
+/* The totals are the soft limits, and the hard limits are returned
+ * separately; where only one limit is kept, e.g. by btrfs qgroups, it is
+ * returned as both.
+ */
 int fsquota_group_get(const char *path, gid_t gid, uint64_t *kb_total,
-  uint64_t *kb_used, uint64_t *file_total, uint64_t *file_used);
+  uint64_t *kb_used, uint64_t *file_total, uint64_t *file_used,
+  uint64_t *kb_hard, uint64_t *file_hard);
+
+/* Returns the project ID assigned to the given directory, e.g. by
+ * xfs_quota(8) or chattr(1) -p.
+ */
+int fsquota_project_get_id(const char *path, unsigned long *id);
+
+int fsquota_project_enabled(const char *path, unsigned long id, int *enabled);
+
+int fsquota_project_get(const char *path, unsigned long id,
+  uint64_t *kb_total, uint64_t *kb_used, uint64_t *file_total,
+  uint64_t *file_used, uint64_t *kb_hard, uint64_t *file_hard);
 
 int fsquota_user_enabled(const char *path, uid_t uid, int *enabled);
 
 int fsquota_user_get(const char *path, uid_t uid, uint64_t *kb_total,
-  uint64_t *kb_used, uint64_t *file_total, uint64_t *file_used);
+  uint64_t *kb_used, uint64_t *file_total, uint64_t *file_used,
+  uint64_t *kb_hard, uint64_t *file_hard);
 
 #endif /* MOD_FSQUOTA_FSQUOTA_H */
@@ -0,0 +1,920 @@
+/*
+ * ProFTPD - mod_fsquota usage index
+ * Copyright (c) 2013-2021 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_fsquota.h"
+#include "cache.h"
+#include "index.h"
+
+/* For filesystems without kernel quota support, the usage index keeps
+ * per-(UID, GID) byte and file counts for a tree in a memory-mapped file.
+ * The index is seeded once, by a scan of the tree split across several
+ * processes, and then kept current by the sessions as they change files;
+ * lookups never touch the tree itself.
+ *
+ * The index file is a header, followed by an open-addressed table of slots.
+ * Updates are serialized with fcntl(2) locks on the index file; lookups are
+ * not locked.
+ *
+ * While a scan runs, the sessions cannot tell which of their changes the
+ * scanners will see, so they only count them; a scan during which the tree
+ * changed is done again, up to FSQUOTA_INDEX_MAX_SCANS times.
+ */
+
+#define FSQUOTA_INDEX_MAGIC		0x46535149
+#define FSQUOTA_INDEX_VERSION		2
+#define FSQUOTA_INDEX_NSLOTS		16384
+#define FSQUOTA_INDEX_MAX_SCANS		3
+
+#define FSQUOTA_INDEX_STATE_NEW		0
+#define FSQUOTA_INDEX_STATE_SCANNING	1
+#define FSQUOTA_INDEX_STATE_SEEDED	2
+
+struct index_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t nslots;
+  uint32_t state;
+  int64_t scan_started;
+  int64_t scan_finished;
+  int64_t scan_pid;
+  uint32_t scan_changes;
+  uint32_t padding;
+  char root[PR_TUNABLE_PATH_MAX];
+};
+
+struct index_slot {
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t in_use;
+  uint32_t padding;
+  uint64_t bytes;
+  uint64_t files;
+};
+
+struct fsquota_index {
+  const char *root;
+  size_t rootlen;
+  const char *path;
+  int fd;
+  size_t mapsz;
+  struct index_header *hdr;
+  struct index_slot *slots;
+};
+
+static pool *index_pool = NULL;
+static array_header *indexes = NULL;
+
+static uint64_t index_user_kb_total = 0, index_user_file_total = 0;
+static uint64_t index_group_kb_total = 0, index_group_file_total = 0;
+
+static const char *trace_channel = "fsquota.index";
+
+static int index_lock(struct fsquota_index *idx, int lock_type) {
+  struct flock lock;
+
+  lock.l_type = lock_type;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = 0;
+  lock.l_len = 0;
+
+  while (fcntl(idx->fd, F_SETLKW, &lock) < 0) {
+    int xerrno = errno;
+
+    if (xerrno == EINTR) {
+      pr_signals_handle();
+      continue;
+    }
+
+    pr_trace_msg(trace_channel, 3, "error locking index '%s': %s", idx->path,
+      strerror(xerrno));
+
+    errno = xerrno;
+    return -1;
+  }
+
+  return 0;
+}
+
+static struct index_slot *index_slot_get(struct index_slot *slots,
+    uint32_t nslots, uid_t uid, gid_t gid, int create) {
+  register uint32_t i;
+  uint32_t start;
+
+  start = (((uint32_t) uid * 2654435761U) ^ ((uint32_t) gid * 40503U)) %
+    nslots;
+
+  for (i = 0; i < nslots; i++) {
+    struct index_slot *slot;
+
+    slot = &(slots[(start + i) % nslots]);
+    if (slot->in_use == 0) {
+      if (create == FALSE) {
+        errno = ENOENT;
+        return NULL;
+      }
+
+      slot->uid = (uint32_t) uid;
+      slot->gid = (uint32_t) gid;
+      slot->bytes = slot->files = 0;
+      slot->in_use = 1;
+      return slot;
+    }
+
+    if (slot->uid == (uint32_t) uid &&
+        slot->gid == (uint32_t) gid) {
+      return slot;
+    }
+  }
+
+  errno = ENOSPC;
+  return NULL;
+}
+
+static void index_slot_adjust(struct index_slot *slot, int64_t bytes,
+    int64_t files) {
+  if (bytes < 0 &&
+      (uint64_t) -bytes > slot->bytes) {
+    slot->bytes = 0;
+
+  } else {
+    slot->bytes += bytes;
+  }
+
+  if (files < 0 &&
+      (uint64_t) -files > slot->files) {
+    slot->files = 0;
+
+  } else {
+    slot->files += files;
+  }
+}
+
+/* Scanning */
+
+static void index_scan_account(struct index_slot *slots, uint32_t nslots,
+    struct stat *st, pr_table_t *links) {
+  struct index_slot *slot;
+
+  /* Files with multiple links are only counted once. */
+  if (!S_ISDIR(st->st_mode) &&
+      st->st_nlink > 1) {
+    char key[64];
+
+    memset(key, '\0', sizeof(key));
+    snprintf(key, sizeof(key)-1, "%lu", (unsigned long) st->st_ino);
+
+    if (pr_table_get(links, key, NULL) != NULL) {
+      return;
+    }
+
+    (void) pr_table_add_dup(links, key, "", 0);
+  }
+
+  slot = index_slot_get(slots, nslots, st->st_uid, st->st_gid, TRUE);
+  if (slot != NULL) {
+    index_slot_adjust(slot, (int64_t) st->st_blocks * 512, 1);
+  }
+}
+
+static void index_scan_dir(pool *p, const char *dir, dev_t dev,
+    struct index_slot *slots, uint32_t nslots, pr_table_t *links) {
+  DIR *dirh;
+  struct dirent *dent;
+  pool *dir_pool;
+
+  dirh = opendir(dir);
+  if (dirh == NULL) {
+    pr_trace_msg(trace_channel, 5, "unable to scan '%s': %s", dir,
+      strerror(errno));
+    return;
+  }
+
+  dir_pool = make_sub_pool(p);
+
+  while ((dent = readdir(dirh)) != NULL) {
+    char *path;
+    struct stat st;
+
+    if (strcmp(dent->d_name, ".") == 0 ||
+        strcmp(dent->d_name, "..") == 0) {
+      continue;
+    }
+
+    path = pdircat(dir_pool, dir, dent->d_name, NULL);
+    if (lstat(path, &st) < 0) {
+      continue;
+    }
+
+    /* Stay on the filesystem of the indexed tree. */
+    if (st.st_dev != dev) {
+      continue;
+    }
+
+    index_scan_account(slots, nslots, &st, links);
+
+    if (S_ISDIR(st.st_mode)) {
+      index_scan_dir(dir_pool, path, dev, slots, nslots, links);
+    }
+  }
+
+  closedir(dirh);
+  destroy_pool(dir_pool);
+}
+
+static int index_merge(struct fsquota_index *idx, struct index_slot *slots,
+    uint32_t nslots) {
+  register uint32_t i;
+
+  if (index_lock(idx, F_WRLCK) < 0) {
+    return -1;
+  }
+
+  for (i = 0; i < nslots; i++) {
+    struct index_slot *slot;
+
+    if (slots[i].in_use == 0) {
+      continue;
+    }
+
+    slot = index_slot_get(idx->slots, idx->hdr->nslots, slots[i].uid,
+      slots[i].gid, TRUE);
+    if (slot == NULL) {
+      pr_trace_msg(trace_channel, 1, "index '%s' is full", idx->path);
+      break;
+    }
+
+    index_slot_adjust(slot, (int64_t) slots[i].bytes,
+      (int64_t) slots[i].files);
+  }
+
+  (void) index_lock(idx, F_UNLCK);
+  return 0;
+}
+
+/* The top-level directories of the tree are dealt out among the scanner
+ * processes; each tallies its share privately, then merges its tallies into
+ * the index.
+ */
+static int index_scan_tree(pool *p, struct fsquota_index *idx,
+    unsigned int nscanners) {
+  register unsigned int i;
+  DIR *dirh;
+  struct dirent *dent;
+  struct stat st;
+  struct index_slot *slots;
+  uint32_t nslots;
+  array_header *subdirs;
+  pr_table_t *links;
+  pid_t *pids;
+
+  nslots = idx->hdr->nslots;
+  slots = pcalloc(p, sizeof(struct index_slot) * nslots);
+  links = pr_table_alloc(p, 0);
+  subdirs = make_array(p, 16, sizeof(char *));
+
+  if (lstat(idx->root, &st) < 0) {
+    pr_log_pri(PR_LOG_WARNING, MOD_FSQUOTA_VERSION
+      ": unable to scan '%s': %s", idx->root, strerror(errno));
+    return -1;
+  }
+
+  index_scan_account(slots, nslots, &st, links);
+
+  dirh = opendir(idx->root);
+  if (dirh == NULL) {
+    pr_log_pri(PR_LOG_WARNING, MOD_FSQUOTA_VERSION
+      ": unable to scan '%s': %s", idx->root, strerror(errno));
+    return -1;
+  }
+
+  while ((dent = readdir(dirh)) != NULL) {
+    char *path;
+    struct stat sub_st;
+
+    if (strcmp(dent->d_name, ".") == 0 ||
+        strcmp(dent->d_name, "..") == 0) {
+      continue;
+    }
+
+    path = pdircat(p, idx->root, dent->d_name, NULL);
+    if (lstat(path, &sub_st) < 0 ||
+        sub_st.st_dev != st.st_dev) {
+      continue;
+    }
+
+    if (S_ISDIR(sub_st.st_mode)) {
+      *((char **) push_array(subdirs)) = path;
+
+    } else {
+      index_scan_account(slots, nslots, &sub_st, links);
+    }
+  }
+
+  closedir(dirh);
+
+  if (nscanners > (unsigned int) subdirs->nelts) {
+    nscanners = subdirs->nelts;
+  }
+
+  pids = pcalloc(p, sizeof(pid_t) * (nscanners > 0 ? nscanners : 1));
+
+  for (i = 0; i < nscanners; i++) {
+    pids[i] = fork();
+
+    if (pids[i] == 0) {
+      register int j;
+      struct index_slot *scanner_slots;
+      pr_table_t *scanner_links;
+
+      scanner_slots = pcalloc(p, sizeof(struct index_slot) * nslots);
+      scanner_links = pr_table_alloc(p, 0);
+
+      for (j = i; j < subdirs->nelts; j += nscanners) {
+        char *path;
+        struct stat sub_st;
+
+        path = ((char **) subdirs->elts)[j];
+        if (lstat(path, &sub_st) < 0) {
+          continue;
+        }
+
+        index_scan_account(scanner_slots, nslots, &sub_st, scanner_links);
+        index_scan_dir(p, path, st.st_dev, scanner_slots, nslots,
+          scanner_links);
+      }
+
+      (void) index_merge(idx, scanner_slots, nslots);
+      _exit(0);
+    }
+
+    if (pids[i] < 0) {
+      pr_log_pri(PR_LOG_WARNING, MOD_FSQUOTA_VERSION
+        ": unable to fork scanner for '%s': %s", idx->root, strerror(errno));
+
+      /* Scan the remaining directories ourselves. */
+      for (; i < nscanners; i++) {
+        register int j;
+
+        pids[i] = 0;
+        for (j = i; j < subdirs->nelts; j += nscanners) {
+          char *path;
+          struct stat sub_st;
+
+          path = ((char **) subdirs->elts)[j];
+          if (lstat(path, &sub_st) < 0) {
+            continue;
+          }
+
+          index_scan_account(slots, nslots, &sub_st, links);
+          index_scan_dir(p, path, st.st_dev, slots, nslots, links);
+        }
+      }
+
+      break;
+    }
+  }
+
+  (void) index_merge(idx, slots, nslots);
+
+  for (i = 0; i < nscanners; i++) {
+    int status;
+
+    if (pids[i] <= 0) {
+      continue;
+    }
+
+    while (waitpid(pids[i], &status, 0) < 0) {
+      if (errno != EINTR) {
+        break;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* Runs in a process forked from the daemon; scans the tree until a scan
+ * completes without the tree changing meanwhile.
+ */
+static void index_scan(pool *p, struct fsquota_index *idx,
+    unsigned int nscanners) {
+  register unsigned int pass;
+
+  for (pass = 1; pass <= FSQUOTA_INDEX_MAX_SCANS; pass++) {
+    pool *pass_pool;
+    uint32_t changes;
+    int res;
+
+    pass_pool = make_sub_pool(p);
+    res = index_scan_tree(pass_pool, idx, nscanners);
+    destroy_pool(pass_pool);
+
+    if (res < 0) {
+      return;
+    }
+
+    if (index_lock(idx, F_WRLCK) < 0) {
+      return;
+    }
+
+    changes = idx->hdr->scan_changes;
+    if (changes == 0 ||
+        pass == FSQUOTA_INDEX_MAX_SCANS) {
+      if (changes > 0) {
+        pr_log_pri(PR_LOG_NOTICE, MOD_FSQUOTA_VERSION
+          ": '%s' changed during each of %u scans; its usage index may be "
+          "off by those changes", idx->root, pass);
+      }
+
+      idx->hdr->state = FSQUOTA_INDEX_STATE_SEEDED;
+      idx->hdr->scan_finished = (int64_t) time(NULL);
+      idx->hdr->scan_pid = 0;
+      idx->hdr->scan_changes = 0;
+      (void) index_lock(idx, F_UNLCK);
+      return;
+    }
+
+    pr_trace_msg(trace_channel, 5,
+      "'%s' changed %lu times during scan, scanning again", idx->root,
+      (unsigned long) changes);
+
+    memset(idx->slots, 0, sizeof(struct index_slot) * idx->hdr->nslots);
+    idx->hdr->scan_changes = 0;
+    idx->hdr->scan_started = (int64_t) time(NULL);
+    (void) index_lock(idx, F_UNLCK);
+  }
+}
+
+/* Maps a session path, which may be relative to a chroot, to the indexed
+ * tree holding it.
+ */
+static struct fsquota_index *index_get(const char *path) {
+  register int i;
+  struct fsquota_index *idxs;
+  char buf[PR_TUNABLE_PATH_MAX+1];
+
+  if (indexes == NULL ||
+      path == NULL) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  memset(buf, '\0', sizeof(buf));
+  if (session.chroot_path != NULL &&
+      strcmp(session.chroot_path, "/") != 0) {
+    snprintf(buf, sizeof(buf)-1, "%s%s", session.chroot_path, path);
+
+  } else {
+    sstrncpy(buf, path, sizeof(buf));
+  }
+
+  idxs = indexes->elts;
+  for (i = 0; i < indexes->nelts; i++) {
+    if (idxs[i].rootlen == 1 ||
+        (strncmp(buf, idxs[i].root, idxs[i].rootlen) == 0 &&
+         (buf[idxs[i].rootlen] == '/' ||
+          buf[idxs[i].rootlen] == '\0'))) {
+      return &(idxs[i]);
+    }
+  }
+
+  errno = ENOENT;
+  return NULL;
+}
+
+int fsquota_index_open(pool *p, const char *root, const char *path,
+    unsigned int nscanners) {
+  int fd, need_scan = FALSE, xerrno;
+  size_t mapsz;
+  void *map;
+  struct stat st;
+  struct fsquota_index *idx;
+  char *index_root;
+
+  if (p == NULL ||
+      root == NULL ||
+      path == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (index_pool == NULL) {
+    index_pool = make_sub_pool(p);
+    pr_pool_tag(index_pool, MOD_FSQUOTA_VERSION ": Index Pool");
+
+    indexes = make_array(index_pool, 1, sizeof(struct fsquota_index));
+  }
+
+  /* The same index may be configured for several vhosts. */
+  if (indexes->nelts > 0) {
+    register int i;
+    struct fsquota_index *idxs;
+
+    idxs = indexes->elts;
+    for (i = 0; i < indexes->nelts; i++) {
+      if (strcmp(idxs[i].path, path) == 0) {
+        return 0;
+      }
+    }
+  }
+
+  index_root = pstrdup(index_pool, root);
+  if (strlen(index_root) > 1 &&
+      index_root[strlen(index_root)-1] == '/') {
+    index_root[strlen(index_root)-1] = '\0';
+  }
+
+  fd = open(path, O_RDWR|O_CREAT, 0600);
+  if (fd < 0) {
+    xerrno = errno;
+
+    pr_log_pri(PR_LOG_WARNING, MOD_FSQUOTA_VERSION
+      ": unable to open FSQuotaUsageIndex '%s': %s", path, strerror(xerrno));
+
+    errno = xerrno;
+    return -1;
+  }
+
+  mapsz = sizeof(struct index_header) +
+    (sizeof(struct index_slot) * FSQUOTA_INDEX_NSLOTS);
+
+  if (fstat(fd, &st) < 0 ||
+      ((size_t) st.st_size < mapsz &&
+       ftruncate(fd, (off_t) mapsz) < 0)) {
+    xerrno = errno;
+
+    pr_log_pri(PR_LOG_WARNING, MOD_FSQUOTA_VERSION
+      ": unable to size FSQuotaUsageIndex '%s': %s", path, strerror(xerrno));
+
+    (void) close(fd);
+    errno = xerrno;
+    return -1;
+  }
+
+  map = mmap(NULL, mapsz, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    xerrno = errno;
+
+    pr_log_pri(PR_LOG_WARNING, MOD_FSQUOTA_VERSION
+      ": unable to map FSQuotaUsageIndex '%s': %s", path, strerror(xerrno));
+
+    (void) close(fd);
+    errno = xerrno;
+    return -1;
+  }
+
+  idx = push_array(indexes);
+  idx->root = index_root;
+  idx->rootlen = strlen(index_root);
+  idx->path = pstrdup(index_pool, path);
+  idx->fd = fd;
+  idx->mapsz = mapsz;
+  idx->hdr = map;
+  idx->slots = (struct index_slot *) (idx->hdr + 1);
+
+  if (index_lock(idx, F_WRLCK) < 0) {
+    return -1;
+  }
+
+  /* An index for a different tree/layout, or one whose scanner died, is
+   * started over.
+   */
+  if (idx->hdr->magic != FSQUOTA_INDEX_MAGIC ||
+      idx->hdr->version != FSQUOTA_INDEX_VERSION ||
+      idx->hdr->nslots != FSQUOTA_INDEX_NSLOTS ||
+      strcmp(idx->hdr->root, index_root) != 0 ||
+      (idx->hdr->state == FSQUOTA_INDEX_STATE_SCANNING &&
+       (idx->hdr->scan_pid <= 0 ||
+        kill((pid_t) idx->hdr->scan_pid, 0) < 0)) ||
+      idx->hdr->state == FSQUOTA_INDEX_STATE_NEW) {
+    memset(map, 0, mapsz);
+    idx->hdr->magic = FSQUOTA_INDEX_MAGIC;
+    idx->hdr->version = FSQUOTA_INDEX_VERSION;
+    idx->hdr->nslots = FSQUOTA_INDEX_NSLOTS;
+    sstrncpy(idx->hdr->root, index_root, sizeof(idx->hdr->root));
+
+    idx->hdr->state = FSQUOTA_INDEX_STATE_SCANNING;
+    idx->hdr->scan_started = (int64_t) time(NULL);
+    need_scan = TRUE;
+  }
+
+  if (need_scan) {
+    pid_t pid;
+
+    pid = fork();
+    if (pid == 0) {
+      pool *scan_pool;
+
+      scan_pool = make_sub_pool(index_pool);
+      index_scan(scan_pool, idx, nscanners);
+      _exit(0);
+    }
+
+    if (pid < 0) {
+      pr_log_pri(PR_LOG_WARNING, MOD_FSQUOTA_VERSION
+        ": unable to fork scanner for '%s': %s", index_root,
+        strerror(errno));
+      idx->hdr->state = FSQUOTA_INDEX_STATE_NEW;
+
+    } else {
+      idx->hdr->scan_pid = (int64_t) pid;
+      pr_log_debug(DEBUG2, MOD_FSQUOTA_VERSION
+        ": scanning '%s' for FSQuotaUsageIndex '%s' (PID %lu)", index_root,
+        path, (unsigned long) pid);
+    }
+  }
+
+  (void) index_lock(idx, F_UNLCK);
+  return 0;
+}
+
+int fsquota_index_close(void) {
+  if (indexes != NULL) {
+    register int i;
+    struct fsquota_index *idxs;
+
+    idxs = indexes->elts;
+    for (i = 0; i < indexes->nelts; i++) {
+      (void) munmap(idxs[i].hdr, idxs[i].mapsz);
+      (void) close(idxs[i].fd);
+    }
+  }
+
+  if (index_pool != NULL) {
+    destroy_pool(index_pool);
+    index_pool = NULL;
+    indexes = NULL;
+  }
+
+  return 0;
+}
+
+int fsquota_index_set_limits(int type, uint64_t kb_total,
+    uint64_t file_total) {
+  switch (type) {
+    case FSQUOTA_TYPE_USER:
+      index_user_kb_total = kb_total;
+      index_user_file_total = file_total;
+      break;
+
+    case FSQUOTA_TYPE_GROUP:
+      index_group_kb_total = kb_total;
+      index_group_file_total = file_total;
+      break;
+
+    default:
+      errno = EINVAL;
+      return -1;
+  }
+
+  return 0;
+}
+
+int fsquota_index_covers(const char *path) {
+  return (index_get(path) != NULL);
+}
+
+int fsquota_index_get(const char *path, int type, unsigned long id,
+    uint64_t *kb_total, uint64_t *kb_used, uint64_t *file_total,
+    uint64_t *file_used) {
+  register uint32_t i;
+  struct fsquota_index *idx;
+  uint64_t bytes = 0, files = 0;
+
+  idx = index_get(path);
+  if (idx == NULL) {
+    return -1;
+  }
+
+  if (idx->hdr->state != FSQUOTA_INDEX_STATE_SEEDED) {
+    pr_trace_msg(trace_channel, 9, "index for '%s' not yet seeded",
+      idx->root);
+    errno = EAGAIN;
+    return -1;
+  }
+
+  for (i = 0; i < idx->hdr->nslots; i++) {
+    struct index_slot *slot;
+
+    slot = &(idx->slots[i]);
+    if (slot->in_use == 0) {
+      continue;
+    }
+
+    if ((type == FSQUOTA_TYPE_USER && slot->uid == (uint32_t) id) ||
+        (type == FSQUOTA_TYPE_GROUP && slot->gid == (uint32_t) id)) {
+      bytes += slot->bytes;
+      files += slot->files;
+    }
+  }
+
+  if (kb_total != NULL) {
+    *kb_total = (type == FSQUOTA_TYPE_USER ? index_user_kb_total :
+      index_group_kb_total);
+  }
+
+  if (kb_used != NULL) {
+    *kb_used = (bytes / 1024);
+  }
+
+  if (file_total != NULL) {
+    *file_total = (type == FSQUOTA_TYPE_USER ? index_user_file_total :
+      index_group_file_total);
+  }
+
+  if (file_used != NULL) {
+    *file_used = files;
+  }
+
+  return 0;
+}
+
+int fsquota_index_get_image(const char *path,
+    struct fsquota_index_image *image) {
+  struct stat st;
+
+  if (path == NULL ||
+      image == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(image, 0, sizeof(struct fsquota_index_image));
+
+  if (lstat(path, &st) < 0) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+
+    return -1;
+  }
+
+  image->exists = TRUE;
+  image->uid = st.st_uid;
+  image->gid = st.st_gid;
+  image->bytes = (uint64_t) st.st_blocks * 512;
+  image->nlink = (unsigned long) st.st_nlink;
+  image->is_dir = S_ISDIR(st.st_mode) ? TRUE : FALSE;
+
+  return 0;
+}
+
+int fsquota_index_update(const char *path,
+    const struct fsquota_index_image *pre,
+    const struct fsquota_index_image *post) {
+  struct fsquota_index *idx;
+  struct index_slot *slot;
+
+  if (pre == NULL ||
+      post == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  idx = index_get(path);
+  if (idx == NULL) {
+    return -1;
+  }
+
+  if (index_lock(idx, F_WRLCK) < 0) {
+    return -1;
+  }
+
+  if (idx->hdr->state != FSQUOTA_INDEX_STATE_SEEDED) {
+    idx->hdr->scan_changes++;
+    (void) index_lock(idx, F_UNLCK);
+
+    pr_trace_msg(trace_channel, 9,
+      "index for '%s' not yet seeded, leaving change to '%s' to the scan",
+      idx->root, path);
+    return 0;
+  }
+
+  /* Removing one of several links to a file frees nothing. */
+  if (pre->exists &&
+      !(post->exists == FALSE && pre->is_dir == FALSE && pre->nlink > 1)) {
+    slot = index_slot_get(idx->slots, idx->hdr->nslots, pre->uid, pre->gid,
+      TRUE);
+    if (slot != NULL) {
+      index_slot_adjust(slot, -((int64_t) pre->bytes), -1);
+    }
+  }
+
+  if (post->exists) {
+    slot = index_slot_get(idx->slots, idx->hdr->nslots, post->uid, post->gid,
+      TRUE);
+    if (slot != NULL) {
+      index_slot_adjust(slot, (int64_t) post->bytes, 1);
+    }
+  }
+
+  (void) index_lock(idx, F_UNLCK);
+
+  pr_trace_msg(trace_channel, 17,
+    "updated index for '%s' (%s%lu bytes, %s%lu bytes)", path,
+    pre->exists ? "-" : "", (unsigned long) pre->bytes,
+    post->exists ? "+" : "", (unsigned long) post->bytes);
+  return 0;
+}
+
+int fsquota_index_update_tree(const char *path, const char *dir, int added) {
+  register uint32_t i;
+  struct fsquota_index *idx;
+  struct index_slot *slots;
+  struct stat st;
+  pr_table_t *links;
+  pool *tree_pool;
+  uint32_t nslots;
+  int64_t sign;
+
+  if (dir == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  idx = index_get(path);
+  if (idx == NULL) {
+    return -1;
+  }
+
+  if (lstat(dir, &st) < 0) {
+    return -1;
+  }
+
+  nslots = idx->hdr->nslots;
+
+  tree_pool = make_sub_pool(index_pool);
+  pr_pool_tag(tree_pool, MOD_FSQUOTA_VERSION ": Index Tree Pool");
+
+  slots = pcalloc(tree_pool, sizeof(struct index_slot) * nslots);
+  links = pr_table_alloc(tree_pool, 0);
+
+  index_scan_account(slots, nslots, &st, links);
+  if (S_ISDIR(st.st_mode)) {
+    index_scan_dir(tree_pool, dir, st.st_dev, slots, nslots, links);
+  }
+
+  if (index_lock(idx, F_WRLCK) < 0) {
+    int xerrno = errno;
+
+    destroy_pool(tree_pool);
+    errno = xerrno;
+    return -1;
+  }
+
+  if (idx->hdr->state != FSQUOTA_INDEX_STATE_SEEDED) {
+    idx->hdr->scan_changes++;
+    (void) index_lock(idx, F_UNLCK);
+
+    destroy_pool(tree_pool);
+    return 0;
+  }
+
+  sign = (added ? 1 : -1);
+
+  for (i = 0; i < nslots; i++) {
+    struct index_slot *slot;
+
+    if (slots[i].in_use == 0) {
+      continue;
+    }
+
+    slot = index_slot_get(idx->slots, nslots, slots[i].uid, slots[i].gid,
+      TRUE);
+    if (slot == NULL) {
+      pr_trace_msg(trace_channel, 1, "index '%s' is full", idx->path);
+      break;
+    }
+
+    index_slot_adjust(slot, sign * (int64_t) slots[i].bytes,
+      sign * (int64_t) slots[i].files);
+  }
+
+  (void) index_lock(idx, F_UNLCK);
+  destroy_pool(tree_pool);
+
+  pr_trace_msg(trace_channel, 17, "%s tree '%s' %s index for '%s'",
+    added ? "added" : "removed", dir, added ? "to" : "from", path);
+  return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * ProFTPD - mod_fsquota usage index API
+ * Copyright (c) 2013-2021 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_fsquota.h"
+
+#ifndef MOD_FSQUOTA_INDEX_H
+#define MOD_FSQUOTA_INDEX_H
+
+/* Default number of processes used for scanning a tree. */
+#define FSQUOTA_INDEX_DEFAULT_SCANNERS		4
+
+/* The ownership and disk usage of a single path, before or after a
+ * command changes it.
+ */
+struct fsquota_index_image {
+  int exists;
+  uid_t uid;
+  gid_t gid;
+  uint64_t bytes;
+  unsigned long nlink;
+  int is_dir;
+};
+
+/* Opens (creating if need be) the index file for the given tree; if the
+ * index has not been seeded yet, a background scan of the tree is started.
+ * Called by the daemon, so that sessions inherit the mapped indexes.
+ */
+int fsquota_index_open(pool *p, const char *root, const char *path,
+  unsigned int nscanners);
+int fsquota_index_close(void);
+
+/* Sets the limits reported (and optionally enforced) for users/groups in
+ * indexed trees; zero means no limit.
+ */
+int fsquota_index_set_limits(int type, uint64_t kb_total,
+  uint64_t file_total);
+
+/* Returns TRUE if the given session path lies in an indexed tree. */
+int fsquota_index_covers(const char *path);
+
+/* Returns the usage of the given type/ID within the indexed tree holding
+ * the given path.  Fails with ENOENT if the path is not in an indexed tree,
+ * and EAGAIN if the tree is still being scanned.
+ */
+int fsquota_index_get(const char *path, int type, unsigned long id,
+  uint64_t *kb_total, uint64_t *kb_used, uint64_t *file_total,
+  uint64_t *file_used);
+
+/* Records the given path's current ownership and usage. */
+int fsquota_index_get_image(const char *path,
+  struct fsquota_index_image *image);
+
+/* Applies the change from the pre-image to the post-image of a path to the
+ * indexed tree holding that path.  Changes made while the tree is still being
+ * scanned are left to the scan.
+ */
+int fsquota_index_update(const char *path,
+  const struct fsquota_index_image *pre,
+  const struct fsquota_index_image *post);
+
+/* Adds (or removes) the usage of the entire tree at the given directory to
+ * (or from) the indexed tree holding the given path, e.g. when a directory
+ * is renamed into (or out of) an indexed tree.
+ */
+int fsquota_index_update_tree(const char *path, const char *dir, int added);
+
+#endif /* MOD_FSQUOTA_INDEX_H */
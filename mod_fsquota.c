@@ -27,6 +27,31 @@
 
 #include "mod_fsquota.h"
 #include "fsquota.h"
+#include "cache.h"
+#include "index.h"
+#include "mounts.h"
+#include "netlink.h"
+#include "shm.h"
+
+#ifdef PR_USE_CTRLS
+# include "mod_ctrls.h"
+#endif /* PR_USE_CTRLS */
+#include "quotatab.h"
+
+#ifdef HAVE_LINUX_FALLOC_H
+# include <linux/falloc.h>
+#endif
+
+#ifdef HAVE_SYS_STATVFS_H
+# include <sys/statvfs.h>
+#endif
+
+/* Space announced by ALLO is reserved by preallocating the upload, without
+ * changing its size, so that the upload's size is only what was sent.
+ */
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+# define FSQUOTA_HAVE_RESERVE
+#endif
 
 module fsquota_module;
 
@@ -34,18 +59,98 @@ static int fsquota_authenticated = FALSE;
 static int fsquota_engine = FALSE;
 
 static unsigned long fsquota_opts = 0UL;
-#define FSQUOTA_SHOW_QUOTA	0x001
+#define FSQUOTA_SHOW_QUOTA		0x001
+#define FSQUOTA_ENFORCE_USAGE_LIMITS	0x002
+#define FSQUOTA_NETLINK_EVENTS		0x004
+
+static unsigned int fsquota_cache_ttl = FSQUOTA_CACHE_DEFAULT_TTL;
+
+/* The session's primary and supplementary groups; the primary group is
+ * always first.
+ */
+static struct fsquota_values *fsquota_group_values = NULL;
+static unsigned int fsquota_group_nvalues = 0;
+
+/* The session's groups, the primary group first, without duplicates. */
+static array_header *fsquota_gids = NULL;
+
+/* The project ID assigned to the session's home directory, and the path by
+ * which the session looks it up; the path is NULL if there is no project.
+ */
+static unsigned long fsquota_project_id = 0;
+static const char *fsquota_project_path = NULL;
+
+/* Home directories and their project IDs, from the FSQuotaProjects map;
+ * read before any chroot.
+ */
+struct fsquota_project {
+  unsigned long id;
+  const char *path;
+};
+
+static array_header *fsquota_project_map = NULL;
+
+/* FSQuotaWarn thresholds, in percent, ascending.  The highest threshold
+ * already announced is kept by the cache, per filesystem and type/ID, so
+ * that each crossing is announced once.
+ */
+static int *fsquota_warn_pcts = NULL;
+static unsigned int fsquota_warn_npcts = 0;
+
+/* The size announced by the last ALLO, to be reserved by the next upload. */
+static off_t fsquota_allo_size = 0;
+
+#ifdef FSQUOTA_HAVE_RESERVE
+/* The directory for whose opens the reservation is made, during an upload,
+ * and the open handler of the FS which would otherwise serve them; NULL for
+ * the system open(2).
+ */
+static const char *fsquota_reserve_dir = NULL;
+static int (*fsquota_reserve_next_open)(pr_fh_t *, const char *, int) = NULL;
+
+/* Set once space has been preallocated for the current upload. */
+static int fsquota_reserved = FALSE;
+#endif /* FSQUOTA_HAVE_RESERVE */
+
+/* The path, and its state, before the current command changed it; used for
+ * keeping usage indexes current.
+ */
+static char fsquota_pre_path[PR_TUNABLE_PATH_MAX+1];
+static struct fsquota_index_image fsquota_pre_image;
+static struct fsquota_index_image fsquota_pre_src_image;
+
+/* The state of an upload's target before and after the upload, recorded
+ * only if the target is in an indexed tree; an upload changes the usage by
+ * the difference.  Elsewhere, the change is derived from the transfer, so
+ * that uploads cost no additional syscalls.
+ */
+static struct fsquota_index_image fsquota_xfer_pre_image;
+static struct fsquota_index_image fsquota_xfer_post_image;
+static int fsquota_xfer_imaged = FALSE;
 
 static pool *fsquota_pool = NULL;
 
+/* Used by the daemon, e.g. for ftpdctl lookups. */
+static pool *fsquota_daemon_pool = NULL;
+
+/* The daemon's timer for reading the kernel's quota events, in seconds. */
+#define FSQUOTA_NETLINK_INTERVAL	1
+static int fsquota_netlink_timerno = -1;
+
+#ifdef PR_USE_CTRLS
+static ctrls_acttab_t fsquota_acttab[];
+#endif /* PR_USE_CTRLS */
+
 static const char *trace_channel = "fsquota";
 
-/* Variable handlers
- */
+#ifndef C_AVBL
+# define C_AVBL		"AVBL"
+#endif
 
-/* XXX Future enhancement: keep per-path table with struct of all values,
- * user and group, to save on system calls for each individual Display
- * variables.
+/* Variable handlers
+ *
+ * All of the values come from the cache, so that rendering a Display file
+ * with many variables costs a single quota lookup per type.
  */
 
 static const char *format_file_str(pool *p, uint64_t file) {
@@ -82,6 +187,224 @@ static const char *format_kb_str(pool *p, uint64_t kb) {
   return pstrndup(p, buf, len);
 }
 
+static const char *format_values_str(pool *p, uint64_t kb_total,
+    uint64_t kb_used, uint64_t file_total, uint64_t file_used) {
+  return pstrcat(p, format_kb_str(p, kb_used), " of ",
+    kb_total > 0 ? format_kb_str(p, kb_total) : _("unlimited"), ", ",
+    format_file_str(p, file_used), " of ",
+    file_total > 0 ? format_file_str(p, file_total) : _("unlimited"),
+    _(" files"), NULL);
+}
+
+/* Returns the fraction, in percent, of the more constrained of the given
+ * limits which is used; or -1 if there are no limits.
+ */
+static int fsquota_pct_used(uint64_t kb_total, uint64_t kb_used,
+    uint64_t file_total, uint64_t file_used) {
+  int pct = -1;
+
+  if (kb_total > 0) {
+    pct = (int) ((kb_used * 100) / kb_total);
+  }
+
+  if (file_total > 0) {
+    int file_pct;
+
+    file_pct = (int) ((file_used * 100) / file_total);
+    if (file_pct > pct) {
+      pct = file_pct;
+    }
+  }
+
+  return pct;
+}
+
+static const char *fsquota_group_name(pool *p, gid_t gid) {
+  register int i;
+  gid_t *gids;
+  char **groups;
+
+  if (gid == session.gid &&
+      session.group != NULL) {
+    return session.group;
+  }
+
+  if (session.gids != NULL &&
+      session.groups != NULL &&
+      session.gids->nelts == session.groups->nelts) {
+    gids = session.gids->elts;
+    groups = session.groups->elts;
+
+    for (i = 0; i < session.gids->nelts; i++) {
+      if (gids[i] == gid) {
+        return groups[i];
+      }
+    }
+  }
+
+  return psprintf(p, "%lu", (unsigned long) gid);
+}
+
+static const array_header *fsquota_get_gids(void) {
+  register int i;
+  gid_t *gids;
+
+  if (fsquota_gids != NULL) {
+    return fsquota_gids;
+  }
+
+  fsquota_gids = make_array(fsquota_pool, 4, sizeof(gid_t));
+  *((gid_t *) push_array(fsquota_gids)) = session.gid;
+
+  if (session.gids == NULL) {
+    return fsquota_gids;
+  }
+
+  gids = session.gids->elts;
+  for (i = 0; i < session.gids->nelts; i++) {
+    register int j;
+    gid_t *seen;
+    int found = FALSE;
+
+    seen = fsquota_gids->elts;
+    for (j = 0; j < fsquota_gids->nelts; j++) {
+      if (seen[j] == gids[i]) {
+        found = TRUE;
+        break;
+      }
+    }
+
+    if (found == FALSE) {
+      *((gid_t *) push_array(fsquota_gids)) = gids[i];
+    }
+  }
+
+  return fsquota_gids;
+}
+
+/* Returns the space the session can still write to the filesystem holding
+ * the given path, below the user's quota and that of every one of the
+ * session's groups.
+ */
+static int fsquota_get_headroom(const char *path, uint64_t *kb_avail) {
+  const array_header *gids;
+
+  gids = fsquota_get_gids();
+  return fsquota_cache_get_headroom(path, session.uid, gids->elts,
+    (unsigned int) gids->nelts, kb_avail);
+}
+
+/* Looks up the quotas of all of the session's groups, in one pass over the
+ * cache for the filesystem of the current directory.
+ */
+static int fsquota_get_groups(void) {
+  if (fsquota_group_values == NULL) {
+    register int i;
+    const array_header *gids;
+    gid_t *elts;
+
+    gids = fsquota_get_gids();
+    elts = gids->elts;
+
+    fsquota_group_values = pcalloc(fsquota_pool,
+      sizeof(struct fsquota_values) * gids->nelts);
+    for (i = 0; i < gids->nelts; i++) {
+      fsquota_group_values[i].id = (unsigned long) elts[i];
+    }
+
+    fsquota_group_nvalues = (unsigned int) gids->nelts;
+  }
+
+  return fsquota_cache_get_ids(pr_fs_getcwd(), FSQUOTA_TYPE_GROUP,
+    fsquota_group_nvalues, fsquota_group_values);
+}
+
+/* Returns the most constrained of the session's groups, i.e. the one with
+ * the least space left below its limit.  Groups without any limits only
+ * count if no group has one; ties go to the primary group.
+ */
+static struct fsquota_values *fsquota_get_constrained_group(void) {
+  register unsigned int i;
+  struct fsquota_values *constrained = NULL;
+  uint64_t constrained_kb_left = 0;
+  int xerrno = ENOENT;
+
+  if (fsquota_get_groups() < 0) {
+    return NULL;
+  }
+
+  for (i = 0; i < fsquota_group_nvalues; i++) {
+    struct fsquota_values *values;
+    uint64_t kb_left = (uint64_t) -1;
+
+    values = &(fsquota_group_values[i]);
+    if (values->res < 0) {
+      if (i == 0) {
+        xerrno = values->xerrno;
+      }
+
+      continue;
+    }
+
+    if (values->kb_total > 0) {
+      kb_left = (values->kb_total > values->kb_used ?
+        values->kb_total - values->kb_used : 0);
+    }
+
+    if (constrained == NULL ||
+        kb_left < constrained_kb_left) {
+      constrained = values;
+      constrained_kb_left = kb_left;
+    }
+  }
+
+  if (constrained == NULL) {
+    errno = xerrno;
+  }
+
+  return constrained;
+}
+
+static int fsquota_group_get_values(uint64_t *kb_total, uint64_t *kb_used,
+    uint64_t *file_total, uint64_t *file_used) {
+  struct fsquota_values *values;
+
+  values = fsquota_get_constrained_group();
+  if (values == NULL) {
+    return -1;
+  }
+
+  if (kb_total != NULL) {
+    *kb_total = values->kb_total;
+  }
+
+  if (kb_used != NULL) {
+    *kb_used = values->kb_used;
+  }
+
+  if (file_total != NULL) {
+    *file_total = values->file_total;
+  }
+
+  if (file_used != NULL) {
+    *file_used = values->file_used;
+  }
+
+  return 0;
+}
+
+/* Group values which could not be looked up are shown as "none" when the
+ * filesystem has no group quotas at all, e.g. btrfs, whose qgroups belong to
+ * subvolumes; otherwise as "unavailable".
+ */
+static const char *fsquota_group_unavailable_str(int xerrno) {
+  if (xerrno == ENOSYS) {
+    return "none";
+  }
+
+  return "unavailable";
+}
+
 static const char *fsquota_group_enabled_str(void *data, size_t datasz) {
   const char *status = "unknown";
 
@@ -90,9 +413,18 @@ static const char *fsquota_group_enabled_str(void *data, size_t datasz) {
   }
 
   if (fsquota_authenticated == TRUE) {
+    struct fsquota_values *values;
+    unsigned long gid = (unsigned long) session.gid;
     int enabled = -1, res;
 
-    res = fsquota_group_enabled(pr_fs_getcwd(), session.gid, &enabled);
+    /* That of the group whose values the other variables show. */
+    values = fsquota_get_constrained_group();
+    if (values != NULL) {
+      gid = values->id;
+    }
+
+    res = fsquota_cache_enabled(pr_fs_getcwd(), FSQUOTA_TYPE_GROUP, gid,
+      &enabled);
     if (res < 0) {
       status = "unavailable";
 
@@ -107,6 +439,31 @@ static const char *fsquota_group_enabled_str(void *data, size_t datasz) {
   return status;
 }
 
+static const char *fsquota_group_name_str(void *data, size_t datasz) {
+  const char *name = "unknown";
+
+  if (fsquota_engine == FALSE) {
+    return name;
+  }
+
+  if (fsquota_authenticated == TRUE) {
+    struct fsquota_values *values;
+
+    values = fsquota_get_constrained_group();
+    if (values == NULL) {
+      name = fsquota_group_unavailable_str(errno);
+
+    } else {
+      name = fsquota_group_name(fsquota_pool, (gid_t) values->id);
+    }
+
+  } else {
+    name = "unavailable";
+  }
+
+  return name;
+}
+
 static const char *fsquota_group_total_files_str(void *data, size_t datasz) {
   const char *total = "unknown";
 
@@ -118,10 +475,9 @@ static const char *fsquota_group_total_files_str(void *data, size_t datasz) {
     int res;
     uint64_t file_total = 0;
 
-    res = fsquota_group_get(pr_fs_getcwd(), session.gid, NULL, NULL,
-      &file_total, NULL);
+    res = fsquota_group_get_values(NULL, NULL, &file_total, NULL);
     if (res < 0) {
-      total = "unavailable";
+      total = fsquota_group_unavailable_str(errno);
 
     } else {
       total = format_file_str(fsquota_pool, file_total);
@@ -145,10 +501,9 @@ static const char *fsquota_group_total_kb_str(void *data, size_t datasz) {
     int res;
     uint64_t kb_total = 0;
 
-    res = fsquota_group_get(pr_fs_getcwd(), session.gid, &kb_total,
-      NULL, NULL, NULL);
+    res = fsquota_group_get_values(&kb_total, NULL, NULL, NULL);
     if (res < 0) {
-      total = "unavailable";
+      total = fsquota_group_unavailable_str(errno);
 
     } else {
       total = format_kb_str(fsquota_pool, kb_total);
@@ -172,10 +527,9 @@ static const char *fsquota_group_used_files_str(void *data, size_t datasz) {
     int res;
     uint64_t file_used = 0;
 
-    res = fsquota_group_get(pr_fs_getcwd(), session.gid, NULL, NULL,
-      NULL, &file_used);
+    res = fsquota_group_get_values(NULL, NULL, NULL, &file_used);
     if (res < 0) {
-      used = "unavailable";
+      used = fsquota_group_unavailable_str(errno);
 
     } else {
       used = format_file_str(fsquota_pool, file_used);
@@ -199,10 +553,9 @@ static const char *fsquota_group_used_kb_str(void *data, size_t datasz) {
     int res;
     uint64_t kb_used = 0;
 
-    res = fsquota_group_get(pr_fs_getcwd(), session.gid, NULL, &kb_used,
-      NULL, NULL);
+    res = fsquota_group_get_values(NULL, &kb_used, NULL, NULL);
     if (res < 0) {
-      used = "unavailable";
+      used = fsquota_group_unavailable_str(errno);
 
     } else {
       used = format_kb_str(fsquota_pool, kb_used);
@@ -225,7 +578,8 @@ static const char *fsquota_user_enabled_str(void *data, size_t datasz) {
   if (fsquota_authenticated == TRUE) {
     int enabled = -1, res;
 
-    res = fsquota_user_enabled(pr_fs_getcwd(), session.uid, &enabled);
+    res = fsquota_cache_enabled(pr_fs_getcwd(), FSQUOTA_TYPE_USER,
+      session.uid, &enabled);
     if (res < 0) {
       status = "unavailable";
 
@@ -251,8 +605,8 @@ static const char *fsquota_user_total_files_str(void *data, size_t datasz) {
     int res;
     uint64_t file_total = 0;
 
-    res = fsquota_user_get(pr_fs_getcwd(), session.uid, NULL, NULL,
-      &file_total, NULL);
+    res = fsquota_cache_get(pr_fs_getcwd(), FSQUOTA_TYPE_USER,
+      session.uid, NULL, NULL, &file_total, NULL);
     if (res < 0) {
       total = "unavailable";
 
@@ -278,8 +632,8 @@ static const char *fsquota_user_total_kb_str(void *data, size_t datasz) {
     int res;
     uint64_t kb_total = 0;
 
-    res = fsquota_user_get(pr_fs_getcwd(), session.uid, &kb_total,
-      NULL, NULL, NULL);
+    res = fsquota_cache_get(pr_fs_getcwd(), FSQUOTA_TYPE_USER,
+      session.uid, &kb_total, NULL, NULL, NULL);
     if (res < 0) {
       total = "unavailable";
 
@@ -305,8 +659,8 @@ static const char *fsquota_user_used_files_str(void *data, size_t datasz) {
     int res;
     uint64_t file_used = 0;
 
-    res = fsquota_user_get(pr_fs_getcwd(), session.gid, NULL, NULL,
-      NULL, &file_used);
+    res = fsquota_cache_get(pr_fs_getcwd(), FSQUOTA_TYPE_USER,
+      session.uid, NULL, NULL, NULL, &file_used);
     if (res < 0) {
       used = "unavailable";
 
@@ -332,8 +686,8 @@ static const char *fsquota_user_used_kb_str(void *data, size_t datasz) {
     int res;
     uint64_t kb_used = 0;
 
-    res = fsquota_user_get(pr_fs_getcwd(), session.uid, NULL, &kb_used,
-      NULL, NULL);
+    res = fsquota_cache_get(pr_fs_getcwd(), FSQUOTA_TYPE_USER,
+      session.uid, NULL, &kb_used, NULL, NULL);
     if (res < 0) {
       used = "unavailable";
 
@@ -348,147 +702,3047 @@ static const char *fsquota_user_used_kb_str(void *data, size_t datasz) {
   return used;
 }
 
-/* Configuration handlers
- */
+static const char *format_rate_str(pool *p, double rate, int kb) {
+  const char *sign = "+";
+  uint64_t val;
 
-/* usage: FSQuotaEngine on|off */
-MODRET set_fsquotaengine(cmd_rec *cmd) {
-  int bool = 1;
-  config_rec *c;
+  if (rate < 0.0) {
+    sign = "-";
+    rate = -rate;
+  }
 
-  CHECK_ARGS(cmd, 1);
-  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+  val = (uint64_t) (rate + 0.5);
+  return pstrcat(p, sign,
+    kb ? format_kb_str(p, val) : format_file_str(p, val), "/hour", NULL);
+}
 
-  bool = get_boolean(cmd, 1);
-  if (bool == -1)
-    CONF_ERROR(cmd, "expected Boolean parameter");
+/* Looks up the given type's values, which adds a sample to their usage
+ * trend, then returns that trend.
+ */
+static int fsquota_get_trend(int type, struct fsquota_shm_trend *trend) {
+  unsigned long id;
 
-  c = add_config_param(cmd->argv[0], 1, NULL);
-  c->argv[0] = pcalloc(c->pool, sizeof(int));
-  *((int *) c->argv[0]) = bool;
+  if (type == FSQUOTA_TYPE_GROUP) {
+    struct fsquota_values *values;
 
-  return PR_HANDLED(cmd);
-}
+    values = fsquota_get_constrained_group();
+    if (values == NULL) {
+      return -1;
+    }
 
-/* usage: FSQuotaOptions opt1 ... optN */
-MODRET set_fsquotaoptions(cmd_rec *cmd) {
-  register unsigned int i;
-  unsigned long opts = 0UL;
-  config_rec *c;
+    id = values->id;
 
-  if (cmd->argc < 2) {
-    CONF_ERROR(cmd, "wrong number of parameters");
+  } else {
+    if (fsquota_cache_get(pr_fs_getcwd(), type, session.uid, NULL, NULL,
+        NULL, NULL) < 0) {
+      return -1;
+    }
+
+    id = (unsigned long) session.uid;
   }
 
-  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+  return fsquota_cache_get_trend(pr_fs_getcwd(), type, id, trend);
+}
 
-  for (i = 1; i < cmd->argc; i++) {
-    if (strcmp(cmd->argv[i], "ShowQuota") == 0) {
-      opts |= FSQUOTA_SHOW_QUOTA;
+static const char *fsquota_rate_str(int type, int kb) {
+  struct fsquota_shm_trend trend;
+  double kb_rate = 0.0, file_rate = 0.0;
 
-    } else {
-      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "unsupported FSQuotaOption: ",
-        cmd->argv[i], NULL));
-    }
+  if (fsquota_engine == FALSE) {
+    return "unknown";
   }
 
-  c = add_config_param(cmd->argv[0], 1, NULL);
-  c->argv[0] = palloc(c->pool, sizeof(unsigned long));
-  *((unsigned long *) c->argv[0]) = opts;
+  if (fsquota_authenticated == FALSE ||
+      fsquota_get_trend(type, &trend) < 0 ||
+      fsquota_shm_trend_rate(&trend, &kb_rate, &file_rate) < 0) {
+    return "unavailable";
+  }
 
-  return PR_HANDLED(cmd);
+  return format_rate_str(fsquota_pool, kb ? kb_rate : file_rate, kb);
 }
 
-/* Command handlers
- */
+static const char *fsquota_eta_str(int type) {
+  struct fsquota_shm_trend trend;
+  long secs = -1;
 
-MODRET fsquota_post_pass(cmd_rec *cmd) {
   if (fsquota_engine == FALSE) {
-    return PR_DECLINED(cmd);
+    return "unknown";
   }
 
-  fsquota_authenticated = TRUE;
-  return PR_DECLINED(cmd);
-}
-
-MODRET fsquota_site(cmd_rec *cmd) {
+  if (fsquota_authenticated == FALSE ||
+      fsquota_get_trend(type, &trend) < 0 ||
+      fsquota_shm_trend_eta(&trend, time(NULL), &secs) < 0) {
+    return "unavailable";
+  }
 
-  /* Make sure it's a valid SITE FSQUOTA command */
-  if (cmd->argc < 2) {
-    return PR_DECLINED(cmd);
+  if (secs < 0) {
+    return "never";
   }
 
-  if (strncasecmp(cmd->argv[1], "FSQUOTA", 8) == 0) {
-    char *cmd_name;
-    int res, enabled = FALSE;
+  return format_file_str(fsquota_pool, (uint64_t) secs);
+}
 
-    if (fsquota_authenticated == FALSE) {
-      pr_response_send(R_530, _("Please login with USER and PASS"));
-      return PR_ERROR(cmd);
-    }
+static const char *fsquota_group_eta_str(void *data, size_t datasz) {
+  return fsquota_eta_str(FSQUOTA_TYPE_GROUP);
+}
 
-    if (fsquota_engine == FALSE) {
-      pr_response_add_err(R_500, _("'SITE FSQUOTA' not understood."));
-      return PR_ERROR(cmd);
-    }
+static const char *fsquota_group_rate_files_str(void *data, size_t datasz) {
+  return fsquota_rate_str(FSQUOTA_TYPE_GROUP, FALSE);
+}
 
-    /* Is showing of the user's fsquota barred by configuration? */
-    if (!(fsquota_opts & FSQUOTA_SHOW_QUOTA)) {
-      pr_response_add_err(R_500, _("'SITE FSQUOTA' not understood."));
-      return PR_ERROR(cmd);
-    }
+static const char *fsquota_group_rate_kb_str(void *data, size_t datasz) {
+  return fsquota_rate_str(FSQUOTA_TYPE_GROUP, TRUE);
+}
 
-    /* Check for <Limit> restrictions. */
-    cmd_name = cmd->argv[0];
-    pr_cmd_set_name(cmd, "SITE_FSQUOTA");
-    if (!dir_check(cmd->tmp_pool, cmd, "NONE", session.cwd, NULL)) {
-      int xerrno = EPERM;
+static const char *fsquota_user_eta_str(void *data, size_t datasz) {
+  return fsquota_eta_str(FSQUOTA_TYPE_USER);
+}
 
-      pr_cmd_set_name(cmd, cmd_name);
-      pr_response_add_err(R_550, "%s: %s", cmd->arg, strerror(xerrno));
+static const char *fsquota_user_rate_files_str(void *data, size_t datasz) {
+  return fsquota_rate_str(FSQUOTA_TYPE_USER, FALSE);
+}
 
-      errno = xerrno;
-      return PR_ERROR(cmd);
-    }
-    pr_cmd_set_name(cmd, cmd_name);
+static const char *fsquota_user_rate_kb_str(void *data, size_t datasz) {
+  return fsquota_rate_str(FSQUOTA_TYPE_USER, TRUE);
+}
 
-    /* Log that the user requested their quota. */
-    pr_log_debug(DEBUG10, MOD_FSQUOTA_VERSION
-      ": SITE FSQUOTA requested by user %s", session.user);
+static int fsquota_project_get_values(uint64_t *kb_total, uint64_t *kb_used,
+    uint64_t *file_total, uint64_t *file_used) {
+  if (fsquota_project_path == NULL) {
+    errno = ENOENT;
+    return -1;
+  }
 
-    /* If fsquota are not in use, no need to do anything. */
-    res = fsquota_user_enabled(pr_fs_getcwd(), session.uid, &enabled);
-    if (res < 0 ||
-        enabled != TRUE) {
-      pr_response_add(R_202, _("No filesystem quotas in effect"));
-      return PR_HANDLED(cmd);
-    }
+  return fsquota_cache_get(fsquota_project_path, FSQUOTA_TYPE_PROJECT,
+    fsquota_project_id, kb_total, kb_used, file_total, file_used);
+}
 
-    /* XXX Implement */
+static const char *fsquota_project_enabled_str(void *data, size_t datasz) {
+  const char *status = "unknown";
 
-    /* Add one final line to preserve the spacing. */
-    pr_response_add(R_DUP,
-      _("Please contact %s if these entries are inaccurate"),
-      cmd->server->ServerAdmin ? cmd->server->ServerAdmin : _("ftp-admin"));
+  if (fsquota_engine == FALSE) {
+    return status;
+  }
 
-    return PR_HANDLED(cmd);
+  if (fsquota_authenticated == TRUE &&
+      fsquota_project_path != NULL) {
+    int enabled = -1, res;
 
-  } else if (strncasecmp(cmd->argv[1], "HELP", 5) == 0) {
-    if (fsquota_engine == TRUE) {
-      /* Add a description of SITE FSQUOTA to the output. */
-      pr_response_add(R_214, "FSQUOTA");
+    res = fsquota_cache_enabled(fsquota_project_path, FSQUOTA_TYPE_PROJECT,
+      fsquota_project_id, &enabled);
+    if (res < 0) {
+      status = "unavailable";
+
+    } else {
+      status = (enabled ? "true" : "false");
     }
+
+  } else {
+    status = "unavailable";
   }
 
-  return PR_DECLINED(cmd);
+  return status;
 }
 
-/* Event handlers
- */
+static const char *fsquota_project_id_str(void *data, size_t datasz) {
+  const char *id = "unknown";
 
-/* Initialization routines
+  if (fsquota_engine == FALSE) {
+    return id;
+  }
+
+  if (fsquota_authenticated == TRUE &&
+      fsquota_project_path != NULL) {
+    id = format_file_str(fsquota_pool, (uint64_t) fsquota_project_id);
+
+  } else {
+    id = "unavailable";
+  }
+
+  return id;
+}
+
+static const char *fsquota_project_total_files_str(void *data,
+    size_t datasz) {
+  const char *total = "unknown";
+
+  if (fsquota_engine == FALSE) {
+    return total;
+  }
+
+  if (fsquota_authenticated == TRUE) {
+    uint64_t file_total = 0;
+
+    if (fsquota_project_get_values(NULL, NULL, &file_total, NULL) < 0) {
+      total = "unavailable";
+
+    } else {
+      total = format_file_str(fsquota_pool, file_total);
+    }
+
+  } else {
+    total = "unavailable";
+  }
+
+  return total;
+}
+
+static const char *fsquota_project_total_kb_str(void *data, size_t datasz) {
+  const char *total = "unknown";
+
+  if (fsquota_engine == FALSE) {
+    return total;
+  }
+
+  if (fsquota_authenticated == TRUE) {
+    uint64_t kb_total = 0;
+
+    if (fsquota_project_get_values(&kb_total, NULL, NULL, NULL) < 0) {
+      total = "unavailable";
+
+    } else {
+      total = format_kb_str(fsquota_pool, kb_total);
+    }
+
+  } else {
+    total = "unavailable";
+  }
+
+  return total;
+}
+
+static const char *fsquota_project_used_files_str(void *data, size_t datasz) {
+  const char *used = "unknown";
+
+  if (fsquota_engine == FALSE) {
+    return used;
+  }
+
+  if (fsquota_authenticated == TRUE) {
+    uint64_t file_used = 0;
+
+    if (fsquota_project_get_values(NULL, NULL, NULL, &file_used) < 0) {
+      used = "unavailable";
+
+    } else {
+      used = format_file_str(fsquota_pool, file_used);
+    }
+
+  } else {
+    used = "unavailable";
+  }
+
+  return used;
+}
+
+static const char *fsquota_project_used_kb_str(void *data, size_t datasz) {
+  const char *used = "unknown";
+
+  if (fsquota_engine == FALSE) {
+    return used;
+  }
+
+  if (fsquota_authenticated == TRUE) {
+    uint64_t kb_used = 0;
+
+    if (fsquota_project_get_values(NULL, &kb_used, NULL, NULL) < 0) {
+      used = "unavailable";
+
+    } else {
+      used = format_kb_str(fsquota_pool, kb_used);
+    }
+
+  } else {
+    used = "unavailable";
+  }
+
+  return used;
+}
+
+/* Controls handlers
+ */
+
+#ifdef PR_USE_CTRLS
+static int fsquota_ctrls_stats(pr_ctrls_t *ctrl) {
+  unsigned long hits = 0, queries = 0, throttled = 0;
+
+  if (fsquota_shm_get_stats(&hits, &queries, &throttled) < 0) {
+    pr_ctrls_add_response(ctrl, "fsquota: unable to read statistics: %s",
+      strerror(errno));
+    return -1;
+  }
+
+  pr_ctrls_add_response(ctrl, "cache hits: %lu", hits);
+  pr_ctrls_add_response(ctrl, "kernel queries: %lu", queries);
+  pr_ctrls_add_response(ctrl, "throttled queries: %lu", throttled);
+  pr_ctrls_add_response(ctrl, "flush requests: %lu",
+    fsquota_shm_get_flush_gen());
+  return 0;
+}
+
+static int fsquota_ctrls_flush(pr_ctrls_t *ctrl, int reqargc,
+    char **reqargv) {
+  int type = 0;
+  unsigned long id = 0;
+
+  if (reqargc > 1) {
+    pr_ctrls_add_response(ctrl, "fsquota: usage: flush [user]");
+    return -1;
+  }
+
+  if (reqargc == 1) {
+    uid_t uid;
+
+    uid = pr_auth_name2uid(ctrl->ctrls_tmp_pool, reqargv[0]);
+    if (uid == (uid_t) -1) {
+      pr_ctrls_add_response(ctrl, "fsquota: unknown user '%s'", reqargv[0]);
+      return -1;
+    }
+
+    type = FSQUOTA_TYPE_USER;
+    id = (unsigned long) uid;
+  }
+
+  /* The sessions, and the daemon's own cache, apply the request on their
+   * next lookup.
+   */
+  if (fsquota_shm_request_flush(type, id) < 0) {
+    pr_ctrls_add_response(ctrl, "fsquota: unable to flush: %s",
+      strerror(errno));
+    return -1;
+  }
+
+  if (reqargc == 1) {
+    pr_ctrls_add_response(ctrl, "fsquota: flushed cached quotas for user %s",
+      reqargv[0]);
+
+  } else {
+    pr_ctrls_add_response(ctrl, "fsquota: flushed all cached quotas");
+  }
+
+  return 0;
+}
+
+static int fsquota_ctrls_lookup(pr_ctrls_t *ctrl, int reqargc,
+    char **reqargv) {
+  struct passwd *pw;
+  const char *path, *group;
+  int res, xerrno;
+  uint64_t kb_total = 0, kb_used = 0, file_total = 0, file_used = 0;
+
+  if (reqargc < 1 ||
+      reqargc > 2) {
+    pr_ctrls_add_response(ctrl, "fsquota: usage: lookup user [path]");
+    return -1;
+  }
+
+  pw = pr_auth_getpwnam(ctrl->ctrls_tmp_pool, reqargv[0]);
+  if (pw == NULL) {
+    pr_ctrls_add_response(ctrl, "fsquota: unknown user '%s'", reqargv[0]);
+    return -1;
+  }
+
+  path = (reqargc == 2 ? reqargv[1] : pw->pw_dir);
+
+  PRIVS_ROOT
+  res = fsquota_cache_get(path, FSQUOTA_TYPE_USER, (unsigned long) pw->pw_uid,
+    &kb_total, &kb_used, &file_total, &file_used);
+  xerrno = errno;
+  PRIVS_RELINQUISH
+
+  if (res < 0) {
+    pr_ctrls_add_response(ctrl, "user %s (UID %lu) on %s: %s", reqargv[0],
+      (unsigned long) pw->pw_uid, path, strerror(xerrno));
+
+  } else {
+    pr_ctrls_add_response(ctrl, "user %s (UID %lu) on %s: %s", reqargv[0],
+      (unsigned long) pw->pw_uid, path,
+      format_values_str(ctrl->ctrls_tmp_pool, kb_total, kb_used, file_total,
+        file_used));
+  }
+
+  group = pr_auth_gid2name(ctrl->ctrls_tmp_pool, pw->pw_gid);
+
+  PRIVS_ROOT
+  res = fsquota_cache_get(path, FSQUOTA_TYPE_GROUP,
+    (unsigned long) pw->pw_gid, &kb_total, &kb_used, &file_total, &file_used);
+  xerrno = errno;
+  PRIVS_RELINQUISH
+
+  if (res < 0) {
+    pr_ctrls_add_response(ctrl, "group %s (GID %lu) on %s: %s", group,
+      (unsigned long) pw->pw_gid, path, strerror(xerrno));
+
+  } else {
+    pr_ctrls_add_response(ctrl, "group %s (GID %lu) on %s: %s", group,
+      (unsigned long) pw->pw_gid, path,
+      format_values_str(ctrl->ctrls_tmp_pool, kb_total, kb_used, file_total,
+        file_used));
+  }
+
+  return 0;
+}
+
+static int fsquota_session_pct_used(const struct fsquota_shm_session *sess) {
+  return fsquota_pct_used(sess->kb_total, sess->kb_used, sess->file_total,
+    sess->file_used);
+}
+
+static int fsquota_session_cmp(const void *a, const void *b) {
+  int pct_a, pct_b;
+
+  pct_a = fsquota_session_pct_used(a);
+  pct_b = fsquota_session_pct_used(b);
+
+  /* Most used first. */
+  if (pct_a != pct_b) {
+    return pct_a > pct_b ? -1 : 1;
+  }
+
+  return 0;
+}
+
+static int fsquota_ctrls_sessions(pr_ctrls_t *ctrl, int reqargc,
+    char **reqargv) {
+  register int i;
+  array_header *sessions;
+  struct fsquota_shm_session *elts;
+  int count = -1;
+  time_t now;
+
+  if (reqargc > 1) {
+    pr_ctrls_add_response(ctrl, "fsquota: usage: sessions [count]");
+    return -1;
+  }
+
+  if (reqargc == 1) {
+    char *ptr = NULL;
+
+    count = (int) strtol(reqargv[0], &ptr, 10);
+    if (ptr && *ptr) {
+      pr_ctrls_add_response(ctrl, "fsquota: badly formatted count: '%s'",
+        reqargv[0]);
+      return -1;
+    }
+  }
+
+  sessions = fsquota_shm_get_sessions(ctrl->ctrls_tmp_pool);
+  if (sessions == NULL) {
+    pr_ctrls_add_response(ctrl, "fsquota: unable to read sessions: %s",
+      strerror(errno));
+    return -1;
+  }
+
+  if (sessions->nelts == 0) {
+    pr_ctrls_add_response(ctrl, "fsquota: no sessions with quota values");
+    return 0;
+  }
+
+  elts = sessions->elts;
+  qsort(elts, sessions->nelts, sizeof(struct fsquota_shm_session),
+    fsquota_session_cmp);
+
+  time(&now);
+
+  for (i = 0; i < sessions->nelts; i++) {
+    struct fsquota_shm_session *sess;
+    const char *user, *pct_str, *headroom_str;
+    int pct;
+
+    if (count >= 0 &&
+        i >= count) {
+      break;
+    }
+
+    sess = &(elts[i]);
+    user = pr_auth_uid2name(ctrl->ctrls_tmp_pool, sess->uid);
+
+    pct = fsquota_session_pct_used(sess);
+    if (pct >= 0) {
+      pct_str = pstrcat(ctrl->ctrls_tmp_pool,
+        format_file_str(ctrl->ctrls_tmp_pool, (uint64_t) pct), "% used", NULL);
+
+    } else {
+      pct_str = "no limits";
+    }
+
+    if (sess->kb_total > 0) {
+      headroom_str = format_kb_str(ctrl->ctrls_tmp_pool,
+        sess->kb_total > sess->kb_used ? sess->kb_total - sess->kb_used : 0);
+
+    } else {
+      headroom_str = _("unlimited");
+    }
+
+    pr_ctrls_add_response(ctrl,
+      "pid %lu user %s (UID %lu): %s, %s left (%s), %lu secs ago",
+      (unsigned long) sess->pid, user, (unsigned long) sess->uid, pct_str,
+      headroom_str, format_values_str(ctrl->ctrls_tmp_pool, sess->kb_total,
+        sess->kb_used, sess->file_total, sess->file_used),
+      (unsigned long) (now - sess->updated));
+  }
+
+  return 0;
+}
+
+/* Orders trends by how soon they reach their limits; trends which never
+ * will, or whose rate is not known yet, come last.
+ */
+static long fsquota_trend_eta(const struct fsquota_shm_trend *trend,
+    time_t now) {
+  long secs = -1;
+
+  if (fsquota_shm_trend_eta(trend, now, &secs) < 0) {
+    return -2;
+  }
+
+  return secs;
+}
+
+static time_t fsquota_trend_now = 0;
+
+static int fsquota_trend_cmp(const void *a, const void *b) {
+  long eta_a, eta_b;
+
+  eta_a = fsquota_trend_eta(a, fsquota_trend_now);
+  eta_b = fsquota_trend_eta(b, fsquota_trend_now);
+
+  if (eta_a == eta_b) {
+    return 0;
+  }
+
+  if (eta_a < 0 ||
+      eta_b < 0) {
+    return eta_a > eta_b ? -1 : 1;
+  }
+
+  return eta_a < eta_b ? -1 : 1;
+}
+
+static int fsquota_ctrls_trends(pr_ctrls_t *ctrl, int reqargc,
+    char **reqargv) {
+  register int i;
+  array_header *trends;
+  struct fsquota_shm_trend *elts;
+  int count = -1;
+
+  if (reqargc > 1) {
+    pr_ctrls_add_response(ctrl, "fsquota: usage: trends [count]");
+    return -1;
+  }
+
+  if (reqargc == 1) {
+    char *ptr = NULL;
+
+    count = (int) strtol(reqargv[0], &ptr, 10);
+    if (ptr && *ptr) {
+      pr_ctrls_add_response(ctrl, "fsquota: badly formatted count: '%s'",
+        reqargv[0]);
+      return -1;
+    }
+  }
+
+  trends = fsquota_shm_get_trends(ctrl->ctrls_tmp_pool);
+  if (trends == NULL) {
+    pr_ctrls_add_response(ctrl, "fsquota: unable to read trends: %s",
+      strerror(errno));
+    return -1;
+  }
+
+  if (trends->nelts == 0) {
+    pr_ctrls_add_response(ctrl, "fsquota: no usage trends");
+    return 0;
+  }
+
+  time(&fsquota_trend_now);
+
+  elts = trends->elts;
+  qsort(elts, trends->nelts, sizeof(struct fsquota_shm_trend),
+    fsquota_trend_cmp);
+
+  for (i = 0; i < trends->nelts; i++) {
+    struct fsquota_shm_trend *trend;
+    struct fsquota_shm_sample *last;
+    const char *name, *rate_str, *eta_str;
+    double kb_rate = 0.0, file_rate = 0.0;
+    long eta;
+
+    if (count >= 0 &&
+        i >= count) {
+      break;
+    }
+
+    trend = &(elts[i]);
+    last = &(trend->samples[trend->nsamples-1]);
+
+    switch (trend->type) {
+      case FSQUOTA_TYPE_USER:
+        name = pstrcat(ctrl->ctrls_tmp_pool, "user ",
+          pr_auth_uid2name(ctrl->ctrls_tmp_pool, (uid_t) trend->id),
+          " (UID ", format_file_str(ctrl->ctrls_tmp_pool, trend->id), ")",
+          NULL);
+        break;
+
+      case FSQUOTA_TYPE_GROUP:
+        name = pstrcat(ctrl->ctrls_tmp_pool, "group ",
+          pr_auth_gid2name(ctrl->ctrls_tmp_pool, (gid_t) trend->id),
+          " (GID ", format_file_str(ctrl->ctrls_tmp_pool, trend->id), ")",
+          NULL);
+        break;
+
+      default:
+        name = pstrcat(ctrl->ctrls_tmp_pool, "project ",
+          format_file_str(ctrl->ctrls_tmp_pool, trend->id), NULL);
+        break;
+    }
+
+    if (fsquota_shm_trend_rate(trend, &kb_rate, &file_rate) == 0) {
+      rate_str = pstrcat(ctrl->ctrls_tmp_pool,
+        format_rate_str(ctrl->ctrls_tmp_pool, kb_rate, TRUE), ", ",
+        format_rate_str(ctrl->ctrls_tmp_pool, file_rate, FALSE), _(" files"),
+        NULL);
+
+    } else {
+      rate_str = "rate unknown";
+    }
+
+    eta = fsquota_trend_eta(trend, fsquota_trend_now);
+    if (eta >= 0) {
+      eta_str = pstrcat(ctrl->ctrls_tmp_pool, "full in ",
+        format_file_str(ctrl->ctrls_tmp_pool, (uint64_t) eta), " secs", NULL);
+
+    } else {
+      eta_str = (eta == -1 ? "not filling" : "time to full unknown");
+    }
+
+    pr_ctrls_add_response(ctrl, "%s on device %lu: %s; %s; %s", name,
+      (unsigned long) trend->dev,
+      format_values_str(ctrl->ctrls_tmp_pool, trend->kb_total, last->kb_used,
+        trend->file_total, last->file_used), rate_str, eta_str);
+  }
+
+  return 0;
+}
+
+/* usage: fsquota stats|flush [user]|lookup user [path]|sessions [count]|
+ *   trends [count]
+ */
+static int fsquota_handle_fsquota(pr_ctrls_t *ctrl, int reqargc,
+    char **reqargv) {
+
+  if (!pr_ctrls_check_acl(ctrl, fsquota_acttab, "fsquota")) {
+    pr_ctrls_add_response(ctrl, "access denied");
+    return -1;
+  }
+
+  if (reqargc == 0 ||
+      reqargv == NULL) {
+    pr_ctrls_add_response(ctrl, "fsquota: missing parameters");
+    return -1;
+  }
+
+  if (strcmp(reqargv[0], "stats") == 0) {
+    return fsquota_ctrls_stats(ctrl);
+  }
+
+  if (strcmp(reqargv[0], "flush") == 0) {
+    return fsquota_ctrls_flush(ctrl, reqargc - 1, reqargv + 1);
+  }
+
+  if (strcmp(reqargv[0], "lookup") == 0) {
+    return fsquota_ctrls_lookup(ctrl, reqargc - 1, reqargv + 1);
+  }
+
+  if (strcmp(reqargv[0], "sessions") == 0) {
+    return fsquota_ctrls_sessions(ctrl, reqargc - 1, reqargv + 1);
+  }
+
+  if (strcmp(reqargv[0], "trends") == 0) {
+    return fsquota_ctrls_trends(ctrl, reqargc - 1, reqargv + 1);
+  }
+
+  pr_ctrls_add_response(ctrl, "fsquota: unknown action: '%s'", reqargv[0]);
+  return -1;
+}
+#endif /* PR_USE_CTRLS */
+
+/* Configuration handlers
+ */
+
+/* usage: FSQuotaCacheTTL secs */
+MODRET set_fsquotacachettl(cmd_rec *cmd) {
+  int ttl;
+  config_rec *c;
+
+  CHECK_ARGS(cmd, 1);
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  ttl = atoi(cmd->argv[1]);
+  if (ttl < 0) {
+    CONF_ERROR(cmd, "TTL must be greater than or equal to zero");
+  }
+
+  c = add_config_param(cmd->argv[0], 1, NULL);
+  c->argv[0] = palloc(c->pool, sizeof(unsigned int));
+  *((unsigned int *) c->argv[0]) = ttl;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: FSQuotaControlsACLs actions|all allow|deny user|group list */
+MODRET set_fsquotactrlsacls(cmd_rec *cmd) {
+#ifdef PR_USE_CTRLS
+  char *bad_action = NULL, **actions = NULL;
+
+  CHECK_ARGS(cmd, 4);
+  CHECK_CONF(cmd, CONF_ROOT);
+
+  actions = pr_ctrls_parse_acl(cmd->tmp_pool, cmd->argv[1]);
+
+  if (strcmp(cmd->argv[2], "allow") != 0 &&
+      strcmp(cmd->argv[2], "deny") != 0) {
+    CONF_ERROR(cmd, "second parameter must be 'allow' or 'deny'");
+  }
+
+  if (strcmp(cmd->argv[3], "user") != 0 &&
+      strcmp(cmd->argv[3], "group") != 0) {
+    CONF_ERROR(cmd, "third parameter must be 'user' or 'group'");
+  }
+
+  bad_action = pr_ctrls_set_module_acls(fsquota_acttab, fsquota_daemon_pool,
+    actions, cmd->argv[2], cmd->argv[3], cmd->argv[4]);
+  if (bad_action != NULL) {
+    CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, ": unknown action: '",
+      bad_action, "'", NULL));
+  }
+
+  return PR_HANDLED(cmd);
+#else
+  CONF_ERROR(cmd, "requires Controls support (--enable-ctrls)");
+#endif /* PR_USE_CTRLS */
+}
+
+/* usage: FSQuotaEngine on|off */
+MODRET set_fsquotaengine(cmd_rec *cmd) {
+  int bool = 1;
+  config_rec *c;
+
+  CHECK_ARGS(cmd, 1);
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  bool = get_boolean(cmd, 1);
+  if (bool == -1)
+    CONF_ERROR(cmd, "expected Boolean parameter");
+
+  c = add_config_param(cmd->argv[0], 1, NULL);
+  c->argv[0] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = bool;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: FSQuotaMemcache on|off [ttl] */
+MODRET set_fsquotamemcache(cmd_rec *cmd) {
+  int engine, ttl = 0;
+  config_rec *c;
+
+  if (cmd->argc < 2 ||
+      cmd->argc > 3) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  engine = get_boolean(cmd, 1);
+  if (engine == -1) {
+    CONF_ERROR(cmd, "expected Boolean parameter");
+  }
+
+  if (cmd->argc == 3) {
+    ttl = atoi(cmd->argv[2]);
+    if (ttl <= 0) {
+      CONF_ERROR(cmd, "TTL must be greater than zero");
+    }
+  }
+
+  c = add_config_param(cmd->argv[0], 2, NULL, NULL);
+  c->argv[0] = pcalloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = engine;
+  c->argv[1] = palloc(c->pool, sizeof(unsigned int));
+  *((unsigned int *) c->argv[1]) = ttl;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: FSQuotaOptions opt1 ... optN */
+MODRET set_fsquotaoptions(cmd_rec *cmd) {
+  register unsigned int i;
+  unsigned long opts = 0UL;
+  config_rec *c;
+
+  if (cmd->argc < 2) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  for (i = 1; i < cmd->argc; i++) {
+    if (strcmp(cmd->argv[i], "ShowQuota") == 0) {
+      opts |= FSQUOTA_SHOW_QUOTA;
+
+    } else if (strcmp(cmd->argv[i], "EnforceUsageLimits") == 0) {
+      opts |= FSQUOTA_ENFORCE_USAGE_LIMITS;
+
+    } else if (strcmp(cmd->argv[i], "NetlinkEvents") == 0) {
+      opts |= FSQUOTA_NETLINK_EVENTS;
+
+    } else {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "unsupported FSQuotaOption: ",
+        cmd->argv[i], NULL));
+    }
+  }
+
+  c = add_config_param(cmd->argv[0], 1, NULL);
+  c->argv[0] = palloc(c->pool, sizeof(unsigned long));
+  *((unsigned long *) c->argv[0]) = opts;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: FSQuotaProjects xattr|map-file */
+MODRET set_fsquotaprojects(cmd_rec *cmd) {
+  CHECK_ARGS(cmd, 1);
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  if (strcasecmp(cmd->argv[1], "xattr") != 0 &&
+      *((char *) cmd->argv[1]) != '/') {
+    CONF_ERROR(cmd, pstrcat(cmd->tmp_pool,
+      "expected 'xattr' or an absolute path: ", cmd->argv[1], NULL));
+  }
+
+  (void) add_config_param_str(cmd->argv[0], 1, cmd->argv[1]);
+  return PR_HANDLED(cmd);
+}
+
+/* usage: FSQuotaQueryRate queries-per-sec [burst] */
+MODRET set_fsquotaqueryrate(cmd_rec *cmd) {
+  double rate;
+  int burst = 1;
+  char *ptr = NULL;
+  config_rec *c;
+
+  if (cmd->argc < 2 ||
+      cmd->argc > 3) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  rate = strtod(cmd->argv[1], &ptr);
+  if (ptr == NULL ||
+      *ptr != '\0' ||
+      rate < 0.0) {
+    CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "invalid query rate: ",
+      cmd->argv[1], NULL));
+  }
+
+  if (cmd->argc == 3) {
+    burst = atoi(cmd->argv[2]);
+    if (burst < 1) {
+      CONF_ERROR(cmd, "burst must be greater than zero");
+    }
+
+  } else if (rate > 1.0) {
+    burst = (int) rate;
+  }
+
+  c = add_config_param(cmd->argv[0], 2, NULL, NULL);
+  c->argv[0] = palloc(c->pool, sizeof(double));
+  *((double *) c->argv[0]) = rate;
+  c->argv[1] = palloc(c->pool, sizeof(unsigned int));
+  *((unsigned int *) c->argv[1]) = burst;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: FSQuotaWarmup path1 ... pathN */
+MODRET set_fsquotawarmup(cmd_rec *cmd) {
+  register unsigned int i;
+  config_rec *c;
+
+  if (cmd->argc < 2) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  c = add_config_param(cmd->argv[0], cmd->argc - 1, NULL);
+  for (i = 1; i < cmd->argc; i++) {
+    char *path;
+
+    path = cmd->argv[i];
+    if (*path != '/') {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool,
+        "path must be an absolute path: ", path, NULL));
+    }
+
+    c->argv[i-1] = pstrdup(c->pool, path);
+  }
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: FSQuotaWarn pct1[%] ... pctN[%] */
+MODRET set_fsquotawarn(cmd_rec *cmd) {
+  register unsigned int i, j;
+  config_rec *c;
+  int *pcts;
+
+  if (cmd->argc < 2) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  c = add_config_param(cmd->argv[0], 2, NULL, NULL);
+  pcts = palloc(c->pool, sizeof(int) * (cmd->argc - 1));
+
+  for (i = 1; i < cmd->argc; i++) {
+    char *ptr = NULL;
+    long pct;
+
+    pct = strtol(cmd->argv[i], &ptr, 10);
+    if (ptr != NULL &&
+        *ptr == '%') {
+      ptr++;
+    }
+
+    if (ptr == NULL ||
+        *ptr != '\0' ||
+        pct < 1 ||
+        pct > 100) {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "invalid percentage: ",
+        cmd->argv[i], NULL));
+    }
+
+    /* Kept in ascending order. */
+    for (j = i - 1; j > 0 && pcts[j-1] > (int) pct; j--) {
+      pcts[j] = pcts[j-1];
+    }
+
+    pcts[j] = (int) pct;
+  }
+
+  c->argv[0] = pcts;
+  c->argv[1] = palloc(c->pool, sizeof(unsigned int));
+  *((unsigned int *) c->argv[1]) = cmd->argc - 1;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: FSQuotaUploadVolumes spool-dir volume1 ... volumeN */
+MODRET set_fsquotauploadvolumes(cmd_rec *cmd) {
+  register unsigned int i;
+  config_rec *c;
+
+  if (cmd->argc < 3) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  c = add_config_param(cmd->argv[0], cmd->argc - 1, NULL);
+  for (i = 1; i < cmd->argc; i++) {
+    char *path;
+    size_t len;
+
+    path = cmd->argv[i];
+    if (*path != '/') {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool,
+        "path must be an absolute path: ", path, NULL));
+    }
+
+    path = pstrdup(c->pool, path);
+    len = strlen(path);
+    while (len > 1 &&
+           path[len-1] == '/') {
+      path[--len] = '\0';
+    }
+
+    c->argv[i-1] = path;
+  }
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: FSQuotaUsageIndex root index-file [scanners] */
+MODRET set_fsquotausageindex(cmd_rec *cmd) {
+  int scanners = FSQUOTA_INDEX_DEFAULT_SCANNERS;
+  char *root, *path;
+  config_rec *c;
+
+  if (cmd->argc < 3 ||
+      cmd->argc > 4) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  root = cmd->argv[1];
+  if (*root != '/') {
+    CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "root must be an absolute path: ",
+      root, NULL));
+  }
+
+  path = cmd->argv[2];
+  if (*path != '/') {
+    CONF_ERROR(cmd, pstrcat(cmd->tmp_pool,
+      "index file must be an absolute path: ", path, NULL));
+  }
+
+  if (cmd->argc == 4) {
+    scanners = atoi(cmd->argv[3]);
+    if (scanners < 1) {
+      CONF_ERROR(cmd, "number of scanners must be greater than zero");
+    }
+  }
+
+  c = add_config_param(cmd->argv[0], 3, NULL, NULL, NULL);
+  c->argv[0] = pstrdup(c->pool, root);
+  c->argv[1] = pstrdup(c->pool, path);
+  c->argv[2] = palloc(c->pool, sizeof(unsigned int));
+  *((unsigned int *) c->argv[2]) = scanners;
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: FSQuotaUsageLimit user|group kb [files] */
+MODRET set_fsquotausagelimit(cmd_rec *cmd) {
+  int type;
+  uint64_t kb_total, file_total = 0;
+  char *ptr = NULL;
+  config_rec *c;
+
+  if (cmd->argc < 3 ||
+      cmd->argc > 4) {
+    CONF_ERROR(cmd, "wrong number of parameters");
+  }
+
+  CHECK_CONF(cmd, CONF_ROOT|CONF_VIRTUAL|CONF_GLOBAL);
+
+  if (strcasecmp(cmd->argv[1], "user") == 0) {
+    type = FSQUOTA_TYPE_USER;
+
+  } else if (strcasecmp(cmd->argv[1], "group") == 0) {
+    type = FSQUOTA_TYPE_GROUP;
+
+  } else {
+    CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "unsupported limit type: ",
+      cmd->argv[1], NULL));
+  }
+
+  kb_total = strtoull(cmd->argv[2], &ptr, 10);
+  if (ptr == NULL ||
+      *ptr != '\0') {
+    CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "invalid KB limit: ",
+      cmd->argv[2], NULL));
+  }
+
+  if (cmd->argc == 4) {
+    ptr = NULL;
+    file_total = strtoull(cmd->argv[3], &ptr, 10);
+    if (ptr == NULL ||
+        *ptr != '\0') {
+      CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, "invalid file limit: ",
+        cmd->argv[3], NULL));
+    }
+  }
+
+  c = add_config_param(cmd->argv[0], 3, NULL, NULL, NULL);
+  c->argv[0] = palloc(c->pool, sizeof(int));
+  *((int *) c->argv[0]) = type;
+  c->argv[1] = palloc(c->pool, sizeof(uint64_t));
+  *((uint64_t *) c->argv[1]) = kb_total;
+  c->argv[2] = palloc(c->pool, sizeof(uint64_t));
+  *((uint64_t *) c->argv[2]) = file_total;
+
+  return PR_HANDLED(cmd);
+}
+
+/* Command handlers
+ */
+
+/* Returns the path which the given command changes. */
+static const char *fsquota_get_cmd_path(cmd_rec *cmd) {
+#if PROFTPD_VERSION_NUMBER >= 0x0001030501
+  const char *path;
+
+  /* mod_xfer records where uploads actually land, including STOU's
+   * generated name.
+   */
+  path = pr_table_get(cmd->notes, "mod_xfer.store-path", NULL);
+  if (path != NULL) {
+    return path;
+  }
+#endif
+
+  if (cmd->argc < 2) {
+    return NULL;
+  }
+
+  return dir_best_path(cmd->tmp_pool, cmd->arg);
+}
+
+static int fsquota_usage_exceeded(const char *path) {
+  register int i;
+  const array_header *gids;
+  gid_t *elts;
+  uint64_t kb_total = 0, kb_used = 0, file_total = 0, file_used = 0;
+
+  if (fsquota_index_get(path, FSQUOTA_TYPE_USER, (unsigned long) session.uid,
+      &kb_total, &kb_used, &file_total, &file_used) == 0) {
+    if ((kb_total > 0 && kb_used >= kb_total) ||
+        (file_total > 0 && file_used >= file_total)) {
+      return TRUE;
+    }
+  }
+
+  gids = fsquota_get_gids();
+  elts = gids->elts;
+
+  for (i = 0; i < gids->nelts; i++) {
+    kb_total = kb_used = file_total = file_used = 0;
+
+    if (fsquota_index_get(path, FSQUOTA_TYPE_GROUP, (unsigned long) elts[i],
+        &kb_total, &kb_used, &file_total, &file_used) == 0) {
+      if ((kb_total > 0 && kb_used >= kb_total) ||
+          (file_total > 0 && file_used >= file_total)) {
+        return TRUE;
+      }
+    }
+  }
+
+  return FALSE;
+}
+
+/* Returns the session's view of the given real path, or NULL if the path is
+ * outside of the session's chroot.
+ */
+static const char *fsquota_session_path(pool *p, const char *path) {
+  size_t rootlen;
+
+  if (session.chroot_path == NULL ||
+      strcmp(session.chroot_path, "/") == 0) {
+    return path;
+  }
+
+  rootlen = strlen(session.chroot_path);
+  if (strncmp(path, session.chroot_path, rootlen) != 0) {
+    return NULL;
+  }
+
+  if (path[rootlen] == '\0') {
+    return "/";
+  }
+
+  if (path[rootlen] != '/') {
+    return NULL;
+  }
+
+  return pstrdup(p, path + rootlen);
+}
+
+/* Redirects uploads into the FSQuotaUploadVolumes spool directory to the
+ * volume with the most room left for the session's user and group, judged
+ * by the cached quota and free space values.
+ */
+MODRET fsquota_pre_stor_volume(cmd_rec *cmd) {
+  register unsigned int i;
+  config_rec *c;
+  const char *path, *spool, *best = NULL;
+  char *name;
+  uint64_t best_kb = 0;
+
+  if (fsquota_engine == FALSE ||
+      fsquota_authenticated == FALSE ||
+      cmd->argc < 2) {
+    return PR_DECLINED(cmd);
+  }
+
+  c = find_config(main_server->conf, CONF_PARAM, "FSQuotaUploadVolumes",
+    FALSE);
+  if (c == NULL) {
+    return PR_DECLINED(cmd);
+  }
+
+  spool = fsquota_session_path(cmd->tmp_pool, c->argv[0]);
+  if (spool == NULL) {
+    return PR_DECLINED(cmd);
+  }
+
+  /* Only files directly in the spool directory are redirected; the volumes
+   * need not have the same subdirectories.
+   */
+  path = dir_best_path(cmd->tmp_pool, cmd->arg);
+  if (path == NULL) {
+    return PR_DECLINED(cmd);
+  }
+
+  name = strrchr(path, '/');
+  if (name == NULL ||
+      name[1] == '\0') {
+    return PR_DECLINED(cmd);
+  }
+
+  if (name == path) {
+    if (strcmp(spool, "/") != 0) {
+      return PR_DECLINED(cmd);
+    }
+
+  } else if (strlen(spool) != (size_t) (name - path) ||
+             strncmp(path, spool, name - path) != 0) {
+    return PR_DECLINED(cmd);
+  }
+
+  name++;
+
+  for (i = 1; i < c->argc; i++) {
+    const char *volume;
+    uint64_t kb_avail = 0;
+
+    volume = fsquota_session_path(cmd->tmp_pool, c->argv[i]);
+    if (volume == NULL) {
+      continue;
+    }
+
+    if (fsquota_get_headroom(volume, &kb_avail) < 0) {
+      pr_trace_msg(trace_channel, 5,
+        "unable to get headroom of upload volume '%s': %s", volume,
+        strerror(errno));
+      continue;
+    }
+
+    pr_trace_msg(trace_channel, 17, "upload volume '%s' has %lu KB left",
+      volume, (unsigned long) kb_avail);
+
+    if (best == NULL ||
+        kb_avail > best_kb) {
+      best = volume;
+      best_kb = kb_avail;
+    }
+  }
+
+  if (best == NULL) {
+    return PR_DECLINED(cmd);
+  }
+
+  path = pdircat(cmd->pool, best, name, NULL);
+  pr_log_debug(DEBUG5, MOD_FSQUOTA_VERSION
+    ": redirecting upload of '%s' to '%s' (%lu KB left)", cmd->arg, path,
+    (unsigned long) best_kb);
+
+  cmd->arg = (char *) path;
+  cmd->argv[1] = (char *) path;
+  cmd->argc = 2;
+
+  return PR_DECLINED(cmd);
+}
+
+/* usage: ALLO size [R max-record-size]
+ *
+ * Refuses an announced upload which would not fit below the session's quotas,
+ * and otherwise remembers its size so that the upload can reserve it.
+ */
+MODRET fsquota_pre_allo(cmd_rec *cmd) {
+  uint64_t kb_avail = 0, size_kb;
+  off_t size;
+  char *ptr = NULL;
+
+  fsquota_allo_size = 0;
+
+  if (fsquota_engine == FALSE ||
+      fsquota_authenticated == FALSE ||
+      cmd->argc < 2) {
+    return PR_DECLINED(cmd);
+  }
+
+  size = (off_t) strtoull(cmd->argv[1], &ptr, 10);
+  if (ptr == NULL ||
+      *ptr != '\0' ||
+      size <= 0) {
+    /* mod_xfer reports the syntax error. */
+    return PR_DECLINED(cmd);
+  }
+
+  size_kb = ((uint64_t) size + 1023) / 1024;
+
+  if (fsquota_get_headroom(pr_fs_getcwd(), &kb_avail) == 0 &&
+      size_kb > kb_avail) {
+    int xerrno = EDQUOT;
+
+    pr_log_debug(DEBUG4, MOD_FSQUOTA_VERSION
+      ": ALLO of %lu KB denied: only %lu KB left", (unsigned long) size_kb,
+      (unsigned long) kb_avail);
+    pr_response_add_err(R_552, "%s: %s", cmd->arg, strerror(xerrno));
+
+    errno = xerrno;
+    return PR_ERROR(cmd);
+  }
+
+  fsquota_allo_size = size;
+  return PR_DECLINED(cmd);
+}
+
+/* Adds up the space allocated to the given file or tree, in one pass,
+ * without following symlinks.
+ */
+static int fsquota_tree_size(pool *p, const char *path, uint64_t *bytes) {
+  struct stat st;
+  void *dirh;
+  struct dirent *dent;
+  pool *dir_pool;
+
+  pr_signals_handle();
+
+  if (pr_fsio_lstat(path, &st) < 0) {
+    return -1;
+  }
+
+  *bytes += (uint64_t) st.st_blocks * 512;
+
+  if (!S_ISDIR(st.st_mode)) {
+    return 0;
+  }
+
+  dirh = pr_fsio_opendir(path);
+  if (dirh == NULL) {
+    return -1;
+  }
+
+  dir_pool = make_sub_pool(p);
+
+  while ((dent = pr_fsio_readdir(dirh)) != NULL) {
+    if (strcmp(dent->d_name, ".") == 0 ||
+        strcmp(dent->d_name, "..") == 0) {
+      continue;
+    }
+
+    if (fsquota_tree_size(dir_pool, pdircat(dir_pool, path, dent->d_name,
+        NULL), bytes) < 0) {
+      int xerrno = errno;
+
+      pr_fsio_closedir(dirh);
+      destroy_pool(dir_pool);
+
+      errno = xerrno;
+      return -1;
+    }
+  }
+
+  pr_fsio_closedir(dirh);
+  destroy_pool(dir_pool);
+  return 0;
+}
+
+/* usage: SITE CPTO path
+ *        SITE COPY src dst
+ *
+ * Refuses a server-side copy by mod_copy whose source would not fit below
+ * the session's quotas on the destination filesystem, before any data is
+ * written.
+ */
+MODRET fsquota_pre_site_copy(cmd_rec *cmd) {
+  const char *src, *dst, *ptr;
+  char *dst_dir;
+  uint64_t kb_avail = 0, size = 0, size_kb;
+
+  if (fsquota_engine == FALSE ||
+      fsquota_authenticated == FALSE ||
+      cmd->argc < 3) {
+    return PR_DECLINED(cmd);
+  }
+
+  if (strncasecmp(cmd->argv[1], "CPTO", 5) == 0) {
+    src = pr_table_get(session.notes, "mod_copy.cpfr-path", NULL);
+    if (src == NULL) {
+      /* mod_copy reports the missing CPFR. */
+      return PR_DECLINED(cmd);
+    }
+
+    /* The destination may contain spaces. */
+    ptr = cmd->arg + strlen(cmd->argv[1]);
+    while (isspace((int) *ptr)) {
+      ptr++;
+    }
+
+    dst = ptr;
+
+  } else if (strncasecmp(cmd->argv[1], "COPY", 5) == 0) {
+    if (cmd->argc != 4) {
+      return PR_DECLINED(cmd);
+    }
+
+    src = dir_best_path(cmd->tmp_pool, cmd->argv[2]);
+    dst = cmd->argv[3];
+
+  } else {
+    return PR_DECLINED(cmd);
+  }
+
+  dst = dir_best_path(cmd->tmp_pool, dst);
+  if (src == NULL ||
+      dst == NULL) {
+    return PR_DECLINED(cmd);
+  }
+
+  if (fsquota_tree_size(cmd->tmp_pool, src, &size) < 0) {
+    /* mod_copy reports the unreadable source. */
+    pr_trace_msg(trace_channel, 9, "unable to size copy source '%s': %s",
+      src, strerror(errno));
+    return PR_DECLINED(cmd);
+  }
+
+  size_kb = (size + 1023) / 1024;
+
+  /* The destination usually does not exist yet; its directory does. */
+  if (fsquota_get_headroom(dst, &kb_avail) < 0) {
+    dst_dir = pstrdup(cmd->tmp_pool, dst);
+    ptr = strrchr(dst_dir, '/');
+    if (ptr == NULL) {
+      return PR_DECLINED(cmd);
+    }
+
+    if (ptr == dst_dir) {
+      dst_dir[1] = '\0';
+
+    } else {
+      dst_dir[ptr - dst_dir] = '\0';
+    }
+
+    if (fsquota_get_headroom(dst_dir, &kb_avail) < 0) {
+      return PR_DECLINED(cmd);
+    }
+  }
+
+  if (size_kb > kb_avail) {
+    int xerrno = EDQUOT;
+
+    pr_log_debug(DEBUG4, MOD_FSQUOTA_VERSION
+      ": copy of '%s' (%lu KB) to '%s' denied: only %lu KB left", src,
+      (unsigned long) size_kb, dst, (unsigned long) kb_avail);
+    pr_response_add_err(R_552, "%s: %s", dst, strerror(xerrno));
+
+    errno = xerrno;
+    return PR_ERROR(cmd);
+  }
+
+  pr_trace_msg(trace_channel, 15,
+    "copy of '%s' (%lu KB) to '%s' fits in %lu KB left", src,
+    (unsigned long) size_kb, dst, (unsigned long) kb_avail);
+  return PR_DECLINED(cmd);
+}
+
+#ifdef FSQUOTA_HAVE_RESERVE
+static int fsquota_reserve_next(pr_fh_t *fh, const char *path, int flags) {
+  if (fsquota_reserve_next_open != NULL) {
+    return (fsquota_reserve_next_open)(fh, path, flags);
+  }
+
+  return open(path, flags, PR_OPEN_MODE);
+}
+
+/* Opens files for uploads, preallocating the space announced by ALLO to the
+ * file being created.  The open(2) has already truncated the file, so the
+ * preallocation survives.  Running out of space fails the open, i.e. the
+ * upload fails before any data is sent; a file created by the open is
+ * removed again, while an existing file stays truncated.
+ */
+static int fsquota_reserve_open(pr_fh_t *fh, const char *path, int flags) {
+  int fd, created = FALSE;
+
+  if (!(flags & O_CREAT) ||
+      fsquota_allo_size <= 0) {
+    return fsquota_reserve_next(fh, path, flags);
+  }
+
+  /* Learn whether the upload creates the file, so that a failed reservation
+   * does not leave an empty file behind.
+   */
+  fd = fsquota_reserve_next(fh, path, flags|O_EXCL);
+  if (fd >= 0) {
+    created = TRUE;
+
+  } else if (errno == EEXIST &&
+             !(flags & O_EXCL)) {
+    fd = fsquota_reserve_next(fh, path, flags);
+  }
+
+  if (fd < 0) {
+    return fd;
+  }
+
+  if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, fsquota_allo_size) < 0) {
+    int xerrno = errno;
+
+    if (xerrno == EDQUOT ||
+        xerrno == ENOSPC) {
+      pr_log_debug(DEBUG4, MOD_FSQUOTA_VERSION
+        ": unable to reserve %" PR_LU " bytes for '%s': %s",
+        (pr_off_t) fsquota_allo_size, path, strerror(xerrno));
+
+      (void) close(fd);
+      fsquota_allo_size = 0;
+
+      if (created &&
+          pr_fsio_unlink(path) < 0) {
+        pr_trace_msg(trace_channel, 3, "error removing '%s': %s", path,
+          strerror(errno));
+      }
+
+      errno = xerrno;
+      return -1;
+    }
+
+    /* Not every filesystem can preallocate; the upload goes ahead. */
+    pr_trace_msg(trace_channel, 9,
+      "unable to preallocate %" PR_LU " bytes for '%s': %s",
+      (pr_off_t) fsquota_allo_size, path, strerror(xerrno));
+
+  } else {
+    pr_trace_msg(trace_channel, 9, "preallocated %" PR_LU " bytes for '%s'",
+      (pr_off_t) fsquota_allo_size, path);
+    fsquota_reserved = TRUE;
+  }
+
+  fsquota_allo_size = 0;
+  return fd;
+}
+#endif /* FSQUOTA_HAVE_RESERVE */
+
+/* Arranges for an upload following ALLO to reserve the announced space, by
+ * interposing on opens in the upload's directory for the duration of the
+ * upload.
+ */
+MODRET fsquota_pre_stor_reserve(cmd_rec *cmd) {
+#ifdef FSQUOTA_HAVE_RESERVE
+  const char *path;
+  char *dir, *ptr;
+  pr_fs_t *fs, *next;
+  int exact = FALSE;
+
+  if (fsquota_engine == FALSE ||
+      fsquota_allo_size <= 0) {
+    return PR_DECLINED(cmd);
+  }
+
+  if (pr_cmd_cmp(cmd, PR_CMD_STOU_ID) == 0 ||
+      cmd->argc < 2) {
+    path = pr_fs_getcwd();
+    dir = pstrdup(fsquota_pool, path);
+
+  } else {
+    path = dir_best_path(cmd->tmp_pool, cmd->arg);
+    if (path == NULL) {
+      return PR_DECLINED(cmd);
+    }
+
+    dir = pstrdup(fsquota_pool, path);
+    ptr = strrchr(dir, '/');
+    if (ptr == NULL) {
+      return PR_DECLINED(cmd);
+    }
+
+    if (ptr == dir) {
+      ptr[1] = '\0';
+
+    } else {
+      *ptr = '\0';
+    }
+  }
+
+  /* Opens are handed to the FS which would otherwise serve them, e.g.
+   * mod_vroot's, skipping FSes without an open handler the same way that
+   * pr_fsio_open() does.
+   */
+  fsquota_reserve_next_open = NULL;
+  for (next = pr_get_fs(dir, &exact); next != NULL; next = next->fs_next) {
+    if (next->open != NULL) {
+      fsquota_reserve_next_open = next->open;
+      break;
+    }
+  }
+
+  fs = pr_register_fs(fsquota_pool, "fsquota", dir);
+  if (fs == NULL) {
+    pr_trace_msg(trace_channel, 3,
+      "unable to register FS for reserving space in '%s': %s", dir,
+      strerror(errno));
+    fsquota_reserve_next_open = NULL;
+    return PR_DECLINED(cmd);
+  }
+
+  fs->open = fsquota_reserve_open;
+  fsquota_reserve_dir = dir;
+
+  pr_fs_clear_cache2(dir);
+#endif /* FSQUOTA_HAVE_RESERVE */
+
+  return PR_DECLINED(cmd);
+}
+
+static void fsquota_reserve_done(cmd_rec *cmd) {
+  fsquota_allo_size = 0;
+
+#ifdef FSQUOTA_HAVE_RESERVE
+  if (fsquota_reserved) {
+    const char *path;
+    struct stat st;
+
+    /* Release whatever the client announced but did not send; truncating a
+     * file to its own size frees the blocks past its end.
+     */
+    path = fsquota_get_cmd_path(cmd);
+    if (path != NULL &&
+        pr_fsio_stat(path, &st) == 0 &&
+        S_ISREG(st.st_mode)) {
+      if (pr_fsio_truncate(path, st.st_size) < 0) {
+        pr_trace_msg(trace_channel, 3,
+          "error releasing unused space of '%s': %s", path, strerror(errno));
+      }
+    }
+
+    fsquota_reserved = FALSE;
+  }
+
+  if (fsquota_reserve_dir != NULL) {
+    if (pr_unregister_fs(fsquota_reserve_dir) < 0) {
+      pr_trace_msg(trace_channel, 3, "error unregistering FS for '%s': %s",
+        fsquota_reserve_dir, strerror(errno));
+    }
+
+    pr_fs_clear_cache2(fsquota_reserve_dir);
+    fsquota_reserve_dir = NULL;
+    fsquota_reserve_next_open = NULL;
+  }
+#endif /* FSQUOTA_HAVE_RESERVE */
+}
+
+/* Records the state of the path about to be changed, for updating the usage
+ * index and the cached usage afterward; and, if configured, refuses commands
+ * which would add to usage already at its limit.
+ */
+MODRET fsquota_pre_update(cmd_rec *cmd) {
+  const char *path;
+  int is_stou, is_upload;
+
+  if (fsquota_engine == FALSE) {
+    return PR_DECLINED(cmd);
+  }
+
+  fsquota_pre_path[0] = '\0';
+  memset(&fsquota_pre_image, 0, sizeof(fsquota_pre_image));
+  memset(&fsquota_pre_src_image, 0, sizeof(fsquota_pre_src_image));
+  memset(&fsquota_xfer_pre_image, 0, sizeof(fsquota_xfer_pre_image));
+  memset(&fsquota_xfer_post_image, 0, sizeof(fsquota_xfer_post_image));
+  fsquota_xfer_imaged = FALSE;
+
+  /* STOU's file name is not chosen yet; it will not exist beforehand. */
+  is_stou = (pr_cmd_cmp(cmd, PR_CMD_STOU_ID) == 0);
+  if (is_stou) {
+    path = pr_fs_getcwd();
+
+  } else {
+    path = fsquota_get_cmd_path(cmd);
+  }
+
+  if (path == NULL) {
+    return PR_DECLINED(cmd);
+  }
+
+  is_upload = (pr_cmd_cmp(cmd, PR_CMD_STOR_ID) == 0 ||
+    pr_cmd_cmp(cmd, PR_CMD_APPE_ID) == 0);
+
+  if (pr_cmd_cmp(cmd, PR_CMD_RNTO_ID) == 0 &&
+      session.xfer.path != NULL) {
+    /* Moves within an indexed tree do not change its usage, but moves into
+     * or out of one do.
+     */
+    if (fsquota_index_covers(session.xfer.path) !=
+        fsquota_index_covers(path)) {
+      (void) fsquota_index_get_image(session.xfer.path,
+        &fsquota_pre_src_image);
+    }
+  }
+
+  if (fsquota_index_covers(path) == FALSE) {
+    if (fsquota_pre_src_image.exists) {
+      sstrncpy(fsquota_pre_path, path, sizeof(fsquota_pre_path));
+    }
+
+    return PR_DECLINED(cmd);
+  }
+
+  if ((fsquota_opts & FSQUOTA_ENFORCE_USAGE_LIMITS) &&
+      (is_stou ||
+       is_upload ||
+       pr_cmd_cmp(cmd, PR_CMD_MKD_ID) == 0 ||
+       pr_cmd_cmp(cmd, PR_CMD_XMKD_ID) == 0)) {
+    if (fsquota_usage_exceeded(path)) {
+      int xerrno = EDQUOT;
+
+      pr_log_debug(DEBUG4, MOD_FSQUOTA_VERSION
+        ": %s denied: FSQuotaUsageLimit reached", (char *) cmd->argv[0]);
+      pr_response_add_err(R_552, "%s: %s",
+        cmd->arg != NULL && *cmd->arg != '\0' ? cmd->arg : path,
+        strerror(xerrno));
+
+      errno = xerrno;
+      return PR_ERROR(cmd);
+    }
+  }
+
+  if (is_stou) {
+    /* The actual path is only known afterward. */
+    sstrncpy(fsquota_pre_path, path, sizeof(fsquota_pre_path));
+    return PR_DECLINED(cmd);
+  }
+
+  if (fsquota_index_get_image(path, &fsquota_pre_image) < 0) {
+    pr_trace_msg(trace_channel, 3, "unable to record state of '%s': %s",
+      path, strerror(errno));
+    return PR_DECLINED(cmd);
+  }
+
+  if (is_upload) {
+    fsquota_xfer_pre_image = fsquota_pre_image;
+    fsquota_xfer_imaged = TRUE;
+  }
+
+  sstrncpy(fsquota_pre_path, path, sizeof(fsquota_pre_path));
+  return PR_DECLINED(cmd);
+}
+
+/* Applies the change made by the command, successful or not, to the usage
+ * index.
+ */
+static void fsquota_update_index(cmd_rec *cmd, int succeeded) {
+  const char *path;
+  struct fsquota_index_image post;
+
+  memset(&post, 0, sizeof(post));
+
+  path = fsquota_get_cmd_path(cmd);
+  if (path == NULL) {
+    return;
+  }
+
+  if (pr_cmd_cmp(cmd, PR_CMD_RNTO_ID) == 0) {
+    if (succeeded &&
+        session.xfer.path != NULL &&
+        fsquota_pre_src_image.exists) {
+      struct fsquota_index_image none;
+
+      memset(&none, 0, sizeof(none));
+
+      /* A directory takes everything beneath it along, as found now at its
+       * new path.
+       */
+      if (fsquota_pre_src_image.is_dir) {
+        if (fsquota_index_covers(session.xfer.path)) {
+          (void) fsquota_index_update_tree(session.xfer.path, path, FALSE);
+
+        } else {
+          (void) fsquota_index_update_tree(path, path, TRUE);
+        }
+
+      } else if (fsquota_index_covers(session.xfer.path)) {
+        (void) fsquota_index_update(session.xfer.path,
+          &fsquota_pre_src_image, &none);
+
+      } else {
+        (void) fsquota_index_update(path, &none, &fsquota_pre_src_image);
+      }
+    }
+
+    /* The target now holds the renamed file, which is already accounted
+     * for; only an overwritten target changes the usage.
+     */
+    if (succeeded) {
+      post.exists = FALSE;
+
+    } else {
+      post = fsquota_pre_image;
+    }
+
+  } else if (fsquota_index_get_image(path, &post) < 0) {
+    pr_trace_msg(trace_channel, 3, "unable to record state of '%s': %s",
+      path, strerror(errno));
+    return;
+  }
+
+  if (fsquota_xfer_imaged) {
+    fsquota_xfer_post_image = post;
+  }
+
+  if (fsquota_index_covers(path) &&
+      fsquota_index_update(path, &fsquota_pre_image, &post) < 0) {
+    pr_trace_msg(trace_channel, 3, "unable to update usage index for '%s': %s",
+      path, strerror(errno));
+  }
+}
+
+static void fsquota_add_note(cmd_rec *cmd, const char *key, uint64_t val) {
+  const char *str;
+
+  str = format_file_str(cmd->pool, val);
+  if (pr_table_add(cmd->notes, key, (void *) str, 0) < 0) {
+    if (errno != EEXIST) {
+      pr_trace_msg(trace_channel, 3, "error stashing '%s' note: %s", key,
+        strerror(errno));
+    }
+  }
+}
+
+static void fsquota_add_type_notes(cmd_rec *cmd, const char *path, int type,
+    unsigned long id, int refresh) {
+  const char *prefix;
+  uint64_t kb_total = 0, kb_used = 0, file_total = 0, file_used = 0;
+  int res;
+
+  /* Only if nothing has looked up these values yet, or they are known to be
+   * stale, is the kernel asked.
+   */
+  if (refresh) {
+    res = fsquota_cache_get(path, type, id, &kb_total, &kb_used, &file_total,
+      &file_used);
+
+  } else {
+    res = fsquota_cache_peek(path, type, id, &kb_total, &kb_used, &file_total,
+      &file_used);
+    if (res < 0 &&
+        errno == ENOENT) {
+      res = fsquota_cache_get(path, type, id, &kb_total, &kb_used,
+        &file_total, &file_used);
+    }
+  }
+
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 17,
+      "no %s quota values for ID %lu, skipping notes",
+      type == FSQUOTA_TYPE_USER ? "user" : "group", id);
+    return;
+  }
+
+  prefix = (type == FSQUOTA_TYPE_USER ? "fsquota.user." : "fsquota.group.");
+
+  fsquota_add_note(cmd, pstrcat(cmd->tmp_pool, prefix, "kb.used", NULL),
+    kb_used);
+  fsquota_add_note(cmd, pstrcat(cmd->tmp_pool, prefix, "files.used", NULL),
+    file_used);
+
+  /* Without a limit, there is no meaningful remainder; the notes are left
+   * unset, which logs as "-".
+   */
+  if (kb_total > 0) {
+    fsquota_add_note(cmd, pstrcat(cmd->tmp_pool, prefix, "kb.total", NULL),
+      kb_total);
+    fsquota_add_note(cmd, pstrcat(cmd->tmp_pool, prefix, "kb.avail", NULL),
+      kb_total > kb_used ? kb_total - kb_used : 0);
+  }
+
+  if (file_total > 0) {
+    fsquota_add_note(cmd, pstrcat(cmd->tmp_pool, prefix, "files.total", NULL),
+      file_total);
+    fsquota_add_note(cmd, pstrcat(cmd->tmp_pool, prefix, "files.avail", NULL),
+      file_total > file_used ? file_total - file_used : 0);
+  }
+}
+
+/* Returns the directory holding the file changed by the given command. */
+static const char *fsquota_get_cmd_dir(cmd_rec *cmd) {
+  const char *path;
+  char *dir, *ptr;
+
+  path = fsquota_get_cmd_path(cmd);
+  if (path == NULL) {
+    return NULL;
+  }
+
+  dir = pstrdup(cmd->tmp_pool, path);
+  ptr = strrchr(dir, '/');
+  if (ptr == NULL) {
+    return pr_fs_getcwd();
+  }
+
+  if (ptr == dir) {
+    ptr++;
+  }
+
+  *ptr = '\0';
+  return dir;
+}
+
+/* Publishes the owner's post-upload usage as command notes, for logging via
+ * e.g. %{note:fsquota.user.kb.used}.  The cached values, of the filesystem
+ * the file landed on, are adjusted by the upload rather than queried again,
+ * so once cached this costs no quota queries.  Values already marked stale,
+ * e.g. by mod_quotatab's tally write, are left to be queried afresh instead.
+ */
+static void fsquota_set_xfer_notes(cmd_rec *cmd, const char *dir) {
+  const char *path;
+  int64_t kb_delta, file_delta;
+  uid_t uid;
+  gid_t gid;
+  int stale_user = FALSE, stale_group = FALSE;
+
+  if (fsquota_authenticated == FALSE) {
+    return;
+  }
+
+  path = fsquota_get_cmd_path(cmd);
+  if (path == NULL) {
+    return;
+  }
+
+  if (fsquota_xfer_imaged) {
+    if (fsquota_xfer_post_image.exists == FALSE) {
+      pr_trace_msg(trace_channel, 3,
+        "'%s' does not exist after upload, skipping notes", path);
+      return;
+    }
+
+    uid = fsquota_xfer_post_image.uid;
+    gid = fsquota_xfer_post_image.gid;
+
+    /* An overwritten or appended file only adds what it grew by. */
+    kb_delta = ((int64_t) fsquota_xfer_post_image.bytes -
+      (int64_t) fsquota_xfer_pre_image.bytes) / 1024;
+    file_delta = (fsquota_xfer_pre_image.exists ? 0 : 1);
+
+  } else {
+    const char *modified = NULL;
+
+    /* The file belongs to the session, unless UserOwner/GroupOwner say
+     * otherwise.
+     */
+    uid = (session.fsuid != (uid_t) -1 ? session.fsuid : session.uid);
+    gid = (session.fsgid != (gid_t) -1 ? session.fsgid : session.gid);
+
+    kb_delta = (int64_t) ((session.xfer.total_bytes + 1023) / 1024);
+    file_delta = 1;
+
+#if PROFTPD_VERSION_NUMBER >= 0x0001030501
+    modified = pr_table_get(cmd->notes, "mod_xfer.file-modified", NULL);
+#endif
+
+    if (modified != NULL &&
+        strcmp(modified, "true") == 0) {
+      file_delta = 0;
+
+      /* The size of the overwritten file is not known, so neither is the
+       * change; the cached values are queried afresh.
+       */
+      if (pr_cmd_cmp(cmd, PR_CMD_APPE_ID) != 0) {
+        (void) fsquota_cache_expire(dir, FSQUOTA_TYPE_USER,
+          (unsigned long) uid);
+        (void) fsquota_cache_expire(dir, FSQUOTA_TYPE_GROUP,
+          (unsigned long) gid);
+      }
+    }
+  }
+
+  if (fsquota_cache_add_used(dir, FSQUOTA_TYPE_USER, (unsigned long) uid,
+      kb_delta, file_delta) < 0 &&
+      errno == ESTALE) {
+    stale_user = TRUE;
+  }
+
+  if (fsquota_cache_add_used(dir, FSQUOTA_TYPE_GROUP, (unsigned long) gid,
+      kb_delta, file_delta) < 0 &&
+      errno == ESTALE) {
+    stale_group = TRUE;
+  }
+
+  fsquota_add_type_notes(cmd, dir, FSQUOTA_TYPE_USER, (unsigned long) uid,
+    stale_user);
+  fsquota_add_type_notes(cmd, dir, FSQUOTA_TYPE_GROUP, (unsigned long) gid,
+    stale_group);
+}
+
+/* Announces, as an informational line of the current response, the highest
+ * FSQuotaWarn threshold which the given type's usage has newly crossed.
+ * Only values already cached are used; nothing is queried.
+ */
+static void fsquota_warn_type(const char *path, int type, unsigned long id) {
+  register unsigned int i;
+  uint64_t kb_total = 0, kb_used = 0, file_total = 0, file_used = 0;
+  int pct, crossed = -1, warned_pct = -1;
+
+  if (fsquota_cache_peek(path, type, id, &kb_total, &kb_used, &file_total,
+      &file_used) < 0 ||
+      fsquota_cache_get_warned(path, type, id, &warned_pct) < 0) {
+    return;
+  }
+
+  pct = fsquota_pct_used(kb_total, kb_used, file_total, file_used);
+
+  for (i = 0; i < fsquota_warn_npcts; i++) {
+    if (pct >= fsquota_warn_pcts[i]) {
+      crossed = fsquota_warn_pcts[i];
+    }
+  }
+
+  /* Dropping below a threshold re-arms it. */
+  if (crossed != warned_pct) {
+    (void) fsquota_cache_set_warned(path, type, id, crossed);
+  }
+
+  if (crossed <= warned_pct) {
+    return;
+  }
+
+  if (type == FSQUOTA_TYPE_USER) {
+    pr_response_add(R_DUP, _("Warning: user quota %d%% used (%s)"), pct,
+      format_values_str(fsquota_pool, kb_total, kb_used, file_total,
+        file_used));
+
+  } else {
+    pr_response_add(R_DUP, _("Warning: group %s quota %d%% used (%s)"),
+      fsquota_group_name(fsquota_pool, (gid_t) id), pct,
+      format_values_str(fsquota_pool, kb_total, kb_used, file_total,
+        file_used));
+  }
+}
+
+/* Returns the session's group with the highest cached quota usage, in
+ * percent, on the filesystem holding the given path; nothing is queried.
+ */
+static unsigned long fsquota_warn_get_group(const char *path) {
+  register int i;
+  const array_header *gids;
+  gid_t *elts;
+  unsigned long gid;
+  int max_pct = -1;
+
+  gids = fsquota_get_gids();
+  elts = gids->elts;
+  gid = (unsigned long) elts[0];
+
+  for (i = 0; i < gids->nelts; i++) {
+    uint64_t kb_total = 0, kb_used = 0, file_total = 0, file_used = 0;
+    int pct;
+
+    if (fsquota_cache_peek(path, FSQUOTA_TYPE_GROUP, (unsigned long) elts[i],
+        &kb_total, &kb_used, &file_total, &file_used) < 0) {
+      continue;
+    }
+
+    pct = fsquota_pct_used(kb_total, kb_used, file_total, file_used);
+    if (pct > max_pct) {
+      max_pct = pct;
+      gid = (unsigned long) elts[i];
+    }
+  }
+
+  return gid;
+}
+
+static void fsquota_warn(const char *path) {
+  if (fsquota_warn_npcts == 0 ||
+      fsquota_authenticated == FALSE) {
+    return;
+  }
+
+  fsquota_warn_type(path, FSQUOTA_TYPE_USER, (unsigned long) session.uid);
+  fsquota_warn_type(path, FSQUOTA_TYPE_GROUP, fsquota_warn_get_group(path));
+}
+
+/* Runs as a LOG_CMD handler, so that the values cached while rendering any
+ * DisplayLogin/DisplayChdir file are seen.
+ */
+MODRET fsquota_log_warn(cmd_rec *cmd) {
+  if (fsquota_engine == FALSE) {
+    return PR_DECLINED(cmd);
+  }
+
+  fsquota_warn(pr_fs_getcwd());
+  return PR_DECLINED(cmd);
+}
+
+MODRET fsquota_post_update(cmd_rec *cmd) {
+  if (fsquota_engine == FALSE) {
+    return PR_DECLINED(cmd);
+  }
+
+  /* Any unused reservation is released first, so that it is not counted
+   * as part of the upload.
+   */
+  if (pr_cmd_cmp(cmd, PR_CMD_STOR_ID) == 0 ||
+      pr_cmd_cmp(cmd, PR_CMD_STOU_ID) == 0) {
+    fsquota_reserve_done(cmd);
+  }
+
+  if (fsquota_pre_path[0] != '\0') {
+    fsquota_update_index(cmd, TRUE);
+    fsquota_pre_path[0] = '\0';
+  }
+
+  if (pr_cmd_cmp(cmd, PR_CMD_STOR_ID) == 0 ||
+      pr_cmd_cmp(cmd, PR_CMD_APPE_ID) == 0 ||
+      pr_cmd_cmp(cmd, PR_CMD_STOU_ID) == 0) {
+    const char *dir;
+
+    dir = fsquota_get_cmd_dir(cmd);
+    if (dir != NULL) {
+      fsquota_set_xfer_notes(cmd, dir);
+      fsquota_warn(dir);
+    }
+  }
+
+  return PR_DECLINED(cmd);
+}
+
+MODRET fsquota_post_update_err(cmd_rec *cmd) {
+  if (fsquota_engine == FALSE) {
+    return PR_DECLINED(cmd);
+  }
+
+  if (pr_cmd_cmp(cmd, PR_CMD_STOR_ID) == 0 ||
+      pr_cmd_cmp(cmd, PR_CMD_STOU_ID) == 0) {
+    fsquota_reserve_done(cmd);
+  }
+
+  if (fsquota_pre_path[0] != '\0') {
+    fsquota_update_index(cmd, FALSE);
+    fsquota_pre_path[0] = '\0';
+  }
+
+  return PR_DECLINED(cmd);
+}
+
+/* Reads a map of project IDs to directories, in the "id:path" format of
+ * /etc/projects.
+ */
+static int fsquota_read_project_map(const char *path) {
+  pr_fh_t *fh;
+  char buf[PR_TUNABLE_BUFFER_SIZE];
+  int xerrno;
+
+  fh = pr_fsio_open(path, O_RDONLY);
+  xerrno = errno;
+
+  if (fh == NULL) {
+    errno = xerrno;
+    return -1;
+  }
+
+  fsquota_project_map = make_array(fsquota_pool, 0,
+    sizeof(struct fsquota_project));
+
+  memset(buf, '\0', sizeof(buf));
+  while (pr_fsio_gets(buf, sizeof(buf)-1, fh) != NULL) {
+    struct fsquota_project *project;
+    char *ptr, *id_ptr = NULL;
+    unsigned long id;
+    size_t len;
+
+    pr_signals_handle();
+
+    len = strlen(buf);
+    while (len > 0 &&
+           (buf[len-1] == '\n' || buf[len-1] == '\r' || buf[len-1] == '/')) {
+      buf[--len] = '\0';
+    }
+
+    if (buf[0] == '#' ||
+        buf[0] == '\0') {
+      continue;
+    }
+
+    ptr = strchr(buf, ':');
+    if (ptr == NULL ||
+        ptr[1] != '/') {
+      pr_trace_msg(trace_channel, 3, "ignoring malformed line in '%s': %s",
+        path, buf);
+      continue;
+    }
+
+    *ptr = '\0';
+    id = strtoul(buf, &id_ptr, 10);
+    if (id_ptr == NULL ||
+        *id_ptr != '\0') {
+      pr_trace_msg(trace_channel, 3, "ignoring malformed ID in '%s': %s",
+        path, buf);
+      continue;
+    }
+
+    project = push_array(fsquota_project_map);
+    project->id = id;
+    project->path = pstrdup(fsquota_pool, ptr + 1);
+  }
+
+  pr_fsio_close(fh);
+
+  pr_trace_msg(trace_channel, 9, "read %d projects from '%s'",
+    fsquota_project_map->nelts, path);
+  return 0;
+}
+
+/* Finds the project ID of the session's home directory, i.e. the directory
+ * the session starts in, from the map if one is configured, or else from the
+ * directory itself.
+ */
+static void fsquota_resolve_project(void) {
+  config_rec *c;
+  const char *home;
+  int res = -1;
+
+  c = find_config(main_server->conf, CONF_PARAM, "FSQuotaProjects", FALSE);
+  if (c == NULL) {
+    return;
+  }
+
+  home = pr_fs_getcwd();
+
+  if (fsquota_project_map != NULL) {
+    register int i;
+    struct fsquota_project *projects;
+    const char *real_home = home;
+
+    /* The map names real paths, not those in the chroot. */
+    if (session.chroot_path != NULL) {
+      real_home = (strcmp(home, "/") == 0 ? session.chroot_path :
+        pdircat(fsquota_pool, session.chroot_path, home, NULL));
+    }
+
+    projects = fsquota_project_map->elts;
+    for (i = 0; i < fsquota_project_map->nelts; i++) {
+      if (strcmp(projects[i].path, real_home) == 0) {
+        fsquota_project_id = projects[i].id;
+        res = 0;
+        break;
+      }
+    }
+
+    if (res < 0) {
+      pr_trace_msg(trace_channel, 5, "no project mapped for home '%s'",
+        real_home);
+    }
+
+  } else {
+    res = fsquota_project_get_id(home, &fsquota_project_id);
+    if (res < 0) {
+      pr_trace_msg(trace_channel, 5,
+        "unable to get project ID of home '%s': %s", home, strerror(errno));
+
+    } else if (fsquota_project_id == 0) {
+      /* Project 0 is the default for every file, not a real project. */
+      pr_trace_msg(trace_channel, 5, "no project assigned to home '%s'",
+        home);
+      res = -1;
+    }
+  }
+
+  if (res == 0) {
+    pr_trace_msg(trace_channel, 8, "using project ID %lu for home '%s'",
+      fsquota_project_id, home);
+    fsquota_project_path = pstrdup(fsquota_pool, home);
+  }
+}
+
+MODRET fsquota_post_pass(cmd_rec *cmd) {
+  if (fsquota_engine == FALSE) {
+    return PR_DECLINED(cmd);
+  }
+
+  fsquota_authenticated = TRUE;
+  fsquota_resolve_project();
+
+  if (fsquota_shm_session_add(session.uid) < 0) {
+    pr_trace_msg(trace_channel, 3,
+      "unable to publish quota values for session: %s", strerror(errno));
+  }
+
+  return PR_DECLINED(cmd);
+}
+
+/* usage: AVBL [path] */
+MODRET fsquota_avbl(cmd_rec *cmd) {
+  const char *path;
+  struct stat st;
+  uint64_t kb_avail = 0;
+  int res;
+
+  if (fsquota_engine == FALSE) {
+    return PR_DECLINED(cmd);
+  }
+
+  if (cmd->argc == 1) {
+    path = pr_fs_getcwd();
+
+  } else {
+    path = dir_best_path(cmd->tmp_pool, cmd->arg);
+    if (path == NULL) {
+      int xerrno = ENOENT;
+
+      pr_response_add_err(R_550, "%s: %s", cmd->arg, strerror(xerrno));
+
+      errno = xerrno;
+      return PR_ERROR(cmd);
+    }
+  }
+
+  if (!dir_check(cmd->tmp_pool, cmd, cmd->group, path, NULL)) {
+    int xerrno = EACCES;
+
+    pr_response_add_err(R_550, "%s: %s",
+      cmd->argc > 1 ? cmd->arg : path, strerror(xerrno));
+
+    errno = xerrno;
+    return PR_ERROR(cmd);
+  }
+
+  /* The FS stat cache is good enough to tell a directory; clients may poll
+   * AVBL, which should not cost a fresh stat(2) each time.
+   */
+  res = pr_fsio_stat(path, &st);
+  if (res == 0 &&
+      !S_ISDIR(st.st_mode)) {
+    res = -1;
+    errno = ENOTDIR;
+  }
+
+  if (res == 0) {
+    res = fsquota_get_headroom(path, &kb_avail);
+  }
+
+  if (res < 0) {
+    int xerrno = errno;
+
+    pr_response_add_err(R_550, "%s: %s",
+      cmd->argc > 1 ? cmd->arg : path, strerror(xerrno));
+
+    errno = xerrno;
+    return PR_ERROR(cmd);
+  }
+
+  pr_trace_msg(trace_channel, 8, "AVBL for '%s': %lu KB available", path,
+    (unsigned long) kb_avail);
+
+  pr_response_add(R_213, "%" PR_LU, (pr_off_t) (kb_avail * 1024));
+  return PR_HANDLED(cmd);
+}
+
+/* FNV-1a, over the bytes of the given value. */
+static uint64_t fsquota_hash_value(uint64_t hash, uint64_t val) {
+  register unsigned int i;
+
+  for (i = 0; i < sizeof(uint64_t); i++) {
+    hash ^= (val & 0xff);
+    hash *= 0x100000001b3ULL;
+    val >>= 8;
+  }
+
+  return hash;
+}
+
+static char *fsquota_kv_append(pool *p, char *str, const char *key,
+    uint64_t val) {
+  char buf[64];
+
+  memset(buf, '\0', sizeof(buf));
+  snprintf(buf, sizeof(buf)-1, "%s=%lu", key, (unsigned long) val);
+
+  if (str == NULL) {
+    return pstrdup(p, buf);
+  }
+
+  return pstrcat(p, str, " ", buf, NULL);
+}
+
+static char *fsquota_kv_append_values(pool *p, char *str, const char *prefix,
+    uint64_t kb_total, uint64_t kb_used, uint64_t file_total,
+    uint64_t file_used) {
+  str = fsquota_kv_append(p, str, pstrcat(p, prefix, ".kb.used", NULL),
+    kb_used);
+  str = fsquota_kv_append(p, str, pstrcat(p, prefix, ".kb.total", NULL),
+    kb_total);
+  str = fsquota_kv_append(p, str, pstrcat(p, prefix, ".files.used", NULL),
+    file_used);
+  str = fsquota_kv_append(p, str, pstrcat(p, prefix, ".files.total", NULL),
+    file_total);
+  return str;
+}
+
+/* usage: SITE FSQUOTA MACHINE [token]
+ *
+ * Reports the cached quota snapshot as a single line of key=value pairs,
+ * led by a token identifying the snapshot.  If the client's token still
+ * matches, the reply is just "unchanged"; since the snapshot comes from the
+ * cache, polling this way costs no kernel queries within the cache TTL.
+ */
+static modret_t *fsquota_site_machine(cmd_rec *cmd) {
+  register unsigned int i;
+  char *kv = NULL, token[32];
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  uint64_t kb_total = 0, kb_used = 0, file_total = 0, file_used = 0;
+  uint64_t kb_avail = 0;
+  struct fsquota_values *group;
+
+  if (fsquota_cache_get(pr_fs_getcwd(), FSQUOTA_TYPE_USER, session.uid,
+      &kb_total, &kb_used, &file_total, &file_used) == 0) {
+    kv = fsquota_kv_append(cmd->tmp_pool, kv, "user", session.uid);
+    kv = fsquota_kv_append_values(cmd->tmp_pool, kv, "user", kb_total,
+      kb_used, file_total, file_used);
+
+    hash = fsquota_hash_value(hash, FSQUOTA_TYPE_USER);
+    hash = fsquota_hash_value(hash, session.uid);
+    hash = fsquota_hash_value(hash, kb_total);
+    hash = fsquota_hash_value(hash, kb_used);
+    hash = fsquota_hash_value(hash, file_total);
+    hash = fsquota_hash_value(hash, file_used);
+  }
+
+  group = fsquota_get_constrained_group();
+  if (group != NULL) {
+    for (i = 0; i < fsquota_group_nvalues; i++) {
+      struct fsquota_values *values;
+
+      values = &(fsquota_group_values[i]);
+      if (values->res < 0) {
+        continue;
+      }
+
+      hash = fsquota_hash_value(hash, FSQUOTA_TYPE_GROUP);
+      hash = fsquota_hash_value(hash, values->id);
+      hash = fsquota_hash_value(hash, values->kb_total);
+      hash = fsquota_hash_value(hash, values->kb_used);
+      hash = fsquota_hash_value(hash, values->file_total);
+      hash = fsquota_hash_value(hash, values->file_used);
+    }
+
+    kv = fsquota_kv_append(cmd->tmp_pool, kv, "group", group->id);
+    kv = fsquota_kv_append_values(cmd->tmp_pool, kv, "group",
+      group->kb_total, group->kb_used, group->file_total, group->file_used);
+  }
+
+  if (fsquota_get_headroom(pr_fs_getcwd(), &kb_avail) == 0) {
+    kv = fsquota_kv_append(cmd->tmp_pool, kv, "avail.kb", kb_avail);
+    hash = fsquota_hash_value(hash, kb_avail);
+  }
+
+  memset(token, '\0', sizeof(token));
+  snprintf(token, sizeof(token)-1, "%08lx%08lx",
+    (unsigned long) ((hash >> 32) & 0xffffffff),
+    (unsigned long) (hash & 0xffffffff));
+
+  if (cmd->argc > 3 &&
+      strcasecmp(cmd->argv[3], token) == 0) {
+    pr_response_add(R_200, "unchanged token=%s", token);
+    return PR_HANDLED(cmd);
+  }
+
+  if (kv != NULL) {
+    pr_response_add(R_200, "token=%s %s", token, kv);
+
+  } else {
+    pr_response_add(R_200, "token=%s", token);
+  }
+
+  return PR_HANDLED(cmd);
+}
+
+/* usage: SITE FSQUOTA FACTS path1 ... pathN
+ *
+ * Reports quota facts for the given directories, in the RFC 3659 fact
+ * syntax used by MLST/MLSD, so that a client can annotate a listing with
+ * a single command:
+ *
+ *  200-Start of quota facts
+ *   x.quota.avail=1048576;x.quota.used=2048;x.quota.limit=10485760; /dir
+ *  200 End of quota facts
+ *
+ * The values come from the per-filesystem cache, so that any number of
+ * directories costs at most one quota lookup per distinct filesystem.  A
+ * directory whose values are unavailable, or which the client may not list
+ * (as for AVBL), is listed without facts.
+ */
+static modret_t *fsquota_site_facts(cmd_rec *cmd) {
+  register unsigned int i;
+
+  if (cmd->argc < 4) {
+    pr_response_add_err(R_501, _("Invalid number of parameters"));
+    return PR_ERROR(cmd);
+  }
+
+  pr_response_add(R_200, _("Start of quota facts"));
+
+  for (i = 3; i < cmd->argc; i++) {
+    const char *path, *facts = "";
+    struct stat st;
+    uint64_t kb_avail = 0, kb_total = 0, kb_used = 0;
+
+    path = dir_best_path(cmd->tmp_pool, cmd->argv[i]);
+    if (path == NULL ||
+        !dir_check(cmd->tmp_pool, cmd, G_DIRS, path, NULL) ||
+        pr_fsio_stat(path, &st) < 0 ||
+        !S_ISDIR(st.st_mode)) {
+      pr_response_add(R_DUP, " %s", cmd->argv[i]);
+      continue;
+    }
+
+    if (fsquota_get_headroom(path, &kb_avail) == 0) {
+      facts = pstrcat(cmd->tmp_pool, facts, "x.quota.avail=",
+        format_file_str(cmd->tmp_pool, kb_avail * 1024), ";", NULL);
+    }
+
+    if (fsquota_cache_get(path, FSQUOTA_TYPE_USER, session.uid, &kb_total,
+        &kb_used, NULL, NULL) == 0) {
+      facts = pstrcat(cmd->tmp_pool, facts, "x.quota.used=",
+        format_file_str(cmd->tmp_pool, kb_used * 1024), ";", NULL);
+
+      if (kb_total > 0) {
+        facts = pstrcat(cmd->tmp_pool, facts, "x.quota.limit=",
+          format_file_str(cmd->tmp_pool, kb_total * 1024), ";", NULL);
+      }
+    }
+
+    if (*facts == '\0') {
+      pr_response_add(R_DUP, " %s", cmd->argv[i]);
+
+    } else {
+      pr_response_add(R_DUP, " %s %s", facts, cmd->argv[i]);
+    }
+  }
+
+  pr_response_add(R_200, _("End of quota facts"));
+  return PR_HANDLED(cmd);
+}
+
+MODRET fsquota_site(cmd_rec *cmd) {
+
+  /* Make sure it's a valid SITE FSQUOTA command */
+  if (cmd->argc < 2) {
+    return PR_DECLINED(cmd);
+  }
+
+  if (strncasecmp(cmd->argv[1], "FSQUOTA", 8) == 0) {
+    register unsigned int i;
+    char *cmd_name;
+    int res;
+    uint64_t kb_total = 0, kb_used = 0, file_total = 0, file_used = 0;
+    struct fsquota_values *group;
+    int group_xerrno;
+
+    if (fsquota_authenticated == FALSE) {
+      pr_response_send(R_530, _("Please login with USER and PASS"));
+      return PR_ERROR(cmd);
+    }
+
+    if (fsquota_engine == FALSE) {
+      pr_response_add_err(R_500, _("'SITE FSQUOTA' not understood."));
+      return PR_ERROR(cmd);
+    }
+
+    /* Is showing of the user's fsquota barred by configuration? */
+    if (!(fsquota_opts & FSQUOTA_SHOW_QUOTA)) {
+      pr_response_add_err(R_500, _("'SITE FSQUOTA' not understood."));
+      return PR_ERROR(cmd);
+    }
+
+    /* Check for <Limit> restrictions. */
+    cmd_name = cmd->argv[0];
+    pr_cmd_set_name(cmd, "SITE_FSQUOTA");
+    if (!dir_check(cmd->tmp_pool, cmd, "NONE", session.cwd, NULL)) {
+      int xerrno = EPERM;
+
+      pr_cmd_set_name(cmd, cmd_name);
+      pr_response_add_err(R_550, "%s: %s", cmd->arg, strerror(xerrno));
+
+      errno = xerrno;
+      return PR_ERROR(cmd);
+    }
+    pr_cmd_set_name(cmd, cmd_name);
+
+    /* Log that the user requested their quota. */
+    pr_log_debug(DEBUG10, MOD_FSQUOTA_VERSION
+      ": SITE FSQUOTA requested by user %s", session.user);
+
+    if (cmd->argc > 2 &&
+        strcasecmp(cmd->argv[2], "MACHINE") == 0) {
+      return fsquota_site_machine(cmd);
+    }
+
+    if (cmd->argc > 2 &&
+        strcasecmp(cmd->argv[2], "FACTS") == 0) {
+      return fsquota_site_facts(cmd);
+    }
+
+    res = fsquota_cache_get(pr_fs_getcwd(), FSQUOTA_TYPE_USER, session.uid,
+      &kb_total, &kb_used, &file_total, &file_used);
+    group = fsquota_get_constrained_group();
+    group_xerrno = errno;
+
+    /* If fsquota are not in use, no need to do anything. */
+    if (res < 0 &&
+        group == NULL) {
+      pr_response_add(R_202, _("No filesystem quotas in effect"));
+      return PR_HANDLED(cmd);
+    }
+
+    pr_response_add(R_200,
+      _("The current filesystem quotas for this session are [current/limit]:"));
+
+    if (res == 0) {
+      pr_response_add(R_DUP, _("User %s: %s"), session.user,
+        format_values_str(cmd->tmp_pool, kb_total, kb_used, file_total,
+          file_used));
+
+    } else {
+      pr_response_add(R_DUP, _("User %s: unavailable"), session.user);
+    }
+
+    if (group != NULL) {
+      pr_response_add(R_DUP, _("Most constrained group %s: %s"),
+        fsquota_group_name(cmd->tmp_pool, (gid_t) group->id),
+        format_values_str(cmd->tmp_pool, group->kb_total, group->kb_used,
+          group->file_total, group->file_used));
+
+      if (fsquota_group_nvalues > 1) {
+        pr_response_add(R_DUP, _("Groups:"));
+
+        for (i = 0; i < fsquota_group_nvalues; i++) {
+          struct fsquota_values *values;
+          const char *name;
+
+          values = &(fsquota_group_values[i]);
+          name = fsquota_group_name(cmd->tmp_pool, (gid_t) values->id);
+
+          if (values->res < 0) {
+            pr_response_add(R_DUP, "  %s: %s", name,
+              fsquota_group_unavailable_str(values->xerrno));
+            continue;
+          }
+
+          pr_response_add(R_DUP, "  %s: %s", name,
+            format_values_str(cmd->tmp_pool, values->kb_total,
+              values->kb_used, values->file_total, values->file_used));
+        }
+      }
+
+    } else {
+      pr_response_add(R_DUP, _("Groups: %s"),
+        group_xerrno == ENOSYS ?
+          _("none, this filesystem has no group quotas") : _("unavailable"));
+    }
+
+    /* Add one final line to preserve the spacing. */
+    pr_response_add(R_DUP,
+      _("Please contact %s if these entries are inaccurate"),
+      cmd->server->ServerAdmin ? cmd->server->ServerAdmin : _("ftp-admin"));
+
+    return PR_HANDLED(cmd);
+
+  } else if (strncasecmp(cmd->argv[1], "HELP", 5) == 0) {
+    if (fsquota_engine == TRUE) {
+      /* Add a description of SITE FSQUOTA to the output. */
+      pr_response_add(R_214, "FSQUOTA [MACHINE [token]|FACTS path ...]");
+    }
+  }
+
+  return PR_DECLINED(cmd);
+}
+
+/* Hook handlers
+ */
+
+#ifdef HAVE_SYS_STATVFS_H
+/* Narrows the given space/file headroom to what is left below the given
+ * limits, if any.
+ */
+static void fsquota_clamp_left(uint64_t *kb_left, uint64_t *files_left,
+    uint64_t kb_total, uint64_t kb_used, uint64_t file_total,
+    uint64_t file_used) {
+  if (kb_total > 0) {
+    uint64_t left;
+
+    left = (kb_total > kb_used ? kb_total - kb_used : 0);
+    if (left < *kb_left) {
+      *kb_left = left;
+    }
+  }
+
+  if (file_total > 0) {
+    uint64_t left;
+
+    left = (file_total > file_used ? file_total - file_used : 0);
+    if (left < *files_left) {
+      *files_left = left;
+    }
+  }
+}
+
+/* usage: pr_stash_get_symbol2(PR_SYM_HOOK, "fsquota_statvfs", ...)
+ *
+ * Called by other modules, e.g. mod_sftp for the statvfs@openssh.com
+ * extension, with cmd->argv[0] being the path and cmd->argv[1] a pointer to
+ * the struct statvfs already filled in for that path.  The available
+ * blocks and files are lowered to what the session's user and groups have
+ * left below their quotas, using the cached values, so that clients see the
+ * same headroom as AVBL reports.  Declines if no quota applies.
+ */
+MODRET fsquota_statvfs(cmd_rec *cmd) {
+  register int i;
+  const char *path;
+  struct statvfs *fs;
+  const array_header *gids;
+  gid_t *elts;
+  struct fsquota_values *values;
+  uint64_t kb_total = 0, kb_used = 0, file_total = 0, file_used = 0;
+  uint64_t kb_left = (uint64_t) -1, files_left = (uint64_t) -1;
+  unsigned long frsize;
+
+  if (fsquota_engine == FALSE ||
+      fsquota_authenticated == FALSE) {
+    return PR_DECLINED(cmd);
+  }
+
+  if (cmd->argc != 2) {
+    return PR_DECLINED(cmd);
+  }
+
+  path = cmd->argv[0];
+  fs = cmd->argv[1];
+
+  if (fsquota_cache_get(path, FSQUOTA_TYPE_USER, session.uid, &kb_total,
+      &kb_used, &file_total, &file_used) == 0) {
+    fsquota_clamp_left(&kb_left, &files_left, kb_total, kb_used, file_total,
+      file_used);
+  }
+
+  gids = fsquota_get_gids();
+  elts = gids->elts;
+
+  values = pcalloc(cmd->tmp_pool,
+    sizeof(struct fsquota_values) * gids->nelts);
+  for (i = 0; i < gids->nelts; i++) {
+    values[i].id = (unsigned long) elts[i];
+  }
+
+  if (fsquota_cache_get_ids(path, FSQUOTA_TYPE_GROUP,
+      (unsigned int) gids->nelts, values) == 0) {
+    for (i = 0; i < gids->nelts; i++) {
+      if (values[i].res == 0) {
+        fsquota_clamp_left(&kb_left, &files_left, values[i].kb_total,
+          values[i].kb_used, values[i].file_total, values[i].file_used);
+      }
+    }
+  }
+
+  if (kb_left == (uint64_t) -1 &&
+      files_left == (uint64_t) -1) {
+    return PR_DECLINED(cmd);
+  }
+
+  frsize = fs->f_frsize ? fs->f_frsize : fs->f_bsize;
+  if (frsize > 0 &&
+      kb_left < (uint64_t) -1) {
+    uint64_t blocks_left;
+
+    blocks_left = (kb_left * 1024) / frsize;
+    if (blocks_left < (uint64_t) fs->f_bavail) {
+      fs->f_bavail = (fsblkcnt_t) blocks_left;
+    }
+  }
+
+  if (files_left < (uint64_t) fs->f_favail) {
+    fs->f_favail = (fsfilcnt_t) files_left;
+  }
+
+  pr_trace_msg(trace_channel, 15,
+    "clamped statvfs for '%s' to %lu available blocks, %lu available files",
+    path, (unsigned long) fs->f_bavail, (unsigned long) fs->f_favail);
+
+  return PR_HANDLED(cmd);
+}
+#endif /* HAVE_SYS_STATVFS_H */
+
+/* Event handlers
+ */
+
+/* Generated just before the session chroots, while the chroot directory's
+ * real path can still be resolved.
+ */
+static void fsquota_chroot_ev(const void *event_data, void *user_data) {
+  const char *path;
+  char buf[PR_TUNABLE_PATH_MAX+1];
+
+  path = event_data;
+  if (path == NULL) {
+    return;
+  }
+
+  memset(buf, '\0', sizeof(buf));
+  if (realpath(path, buf) == NULL) {
+    pr_trace_msg(trace_channel, 3, "unable to resolve chroot '%s': %s", path,
+      strerror(errno));
+    return;
+  }
+
+  if (strcmp(buf, path) != 0) {
+    pr_trace_msg(trace_channel, 9, "chroot '%s' resolves to '%s'", path, buf);
+  }
+
+  (void) fsquota_cache_set_root(buf);
+}
+
+static void fsquota_exit_ev(const void *event_data, void *user_data) {
+  struct fsquota_cache_stats stats;
+
+  (void) fsquota_mounts_close();
+  (void) fsquota_shm_session_remove();
+
+  if (fsquota_cache_get_stats(&stats) == 0) {
+    pr_trace_msg(trace_channel, 8,
+      "cache statistics: %lu hits, %lu kernel queries, %lu throttled",
+      stats.hits, stats.queries, stats.throttled);
+  }
+}
+
+static int fsquota_netlink_timer_cb(CALLBACK_FRAME) {
+  (void) fsquota_netlink_handle();
+
+  /* Always restart the timer. */
+  return 1;
+}
+
+/* Subscribes the daemon to the kernel's quota events, if any server uses
+ * them; the events are read periodically, rather than by every session on
+ * every lookup, and passed on to the sessions as flush requests.
+ */
+static void fsquota_netlink_start(void) {
+  if (fsquota_netlink_open() < 0) {
+    pr_log_debug(DEBUG1, MOD_FSQUOTA_VERSION
+      ": unable to listen for kernel quota events: %s", strerror(errno));
+    return;
+  }
+
+  fsquota_netlink_timerno = pr_timer_add(FSQUOTA_NETLINK_INTERVAL, -1,
+    &fsquota_module, fsquota_netlink_timer_cb, "FSQuota kernel quota events");
+  if (fsquota_netlink_timerno < 0) {
+    pr_log_debug(DEBUG1, MOD_FSQUOTA_VERSION
+      ": unable to add timer for kernel quota events: %s", strerror(errno));
+    (void) fsquota_netlink_close();
+  }
+}
+
+static void fsquota_netlink_stop(void) {
+  if (fsquota_netlink_timerno > 0) {
+    (void) pr_timer_remove(fsquota_netlink_timerno, &fsquota_module);
+    fsquota_netlink_timerno = -1;
+  }
+
+  (void) fsquota_netlink_close();
+}
+
+#if defined(PR_SHARED_MODULE)
+static void fsquota_mod_unload_ev(const void *event_data, void *user_data) {
+  if (strcmp("mod_fsquota.c", (const char *) event_data) == 0) {
+    pr_event_unregister(&fsquota_module, NULL, NULL);
+    (void) fsquota_quotatab_free();
+
+#ifdef PR_USE_CTRLS
+    (void) pr_ctrls_unregister(&fsquota_module, "fsquota");
+#endif /* PR_USE_CTRLS */
+
+    fsquota_netlink_stop();
+    (void) fsquota_shm_free();
+
+    if (fsquota_daemon_pool != NULL) {
+      destroy_pool(fsquota_daemon_pool);
+      fsquota_daemon_pool = NULL;
+    }
+  }
+}
+#endif /* PR_SHARED_MODULE */
+
+/* Resolves the quota state of the filesystems holding the given server's
+ * absolute DefaultRoot, FSQuotaUploadVolumes, and FSQuotaWarmup paths.  Home
+ * directories ("~") are only known at login; unless their filesystems are
+ * listed using FSQuotaWarmup, every filesystem mounted with quotas is
+ * warmed up for them.
+ */
+static void fsquota_warmup_server(server_rec *s) {
+  register unsigned int i;
+  config_rec *c;
+  int have_homes = FALSE;
+
+  PRIVS_ROOT
+
+  c = find_config(s->conf, CONF_PARAM, "DefaultRoot", FALSE);
+  while (c != NULL) {
+    const char *path;
+
+    pr_signals_handle();
+
+    path = c->argv[0];
+    if (*path == '/') {
+      (void) fsquota_cache_warmup(fsquota_daemon_pool, path);
+
+    } else if (*path == '~') {
+      have_homes = TRUE;
+    }
+
+    c = find_config_next(c, c->next, CONF_PARAM, "DefaultRoot", FALSE);
+  }
+
+  c = find_config(s->conf, CONF_PARAM, "FSQuotaUploadVolumes", FALSE);
+  if (c != NULL) {
+    for (i = 1; i < c->argc; i++) {
+      (void) fsquota_cache_warmup(fsquota_daemon_pool, c->argv[i]);
+    }
+  }
+
+  c = find_config(s->conf, CONF_PARAM, "FSQuotaWarmup", FALSE);
+  if (c != NULL) {
+    for (i = 0; i < c->argc; i++) {
+      (void) fsquota_cache_warmup(fsquota_daemon_pool, c->argv[i]);
+    }
+
+  } else if (have_homes) {
+    (void) fsquota_cache_warmup_mounts(fsquota_daemon_pool);
+  }
+
+  PRIVS_RELINQUISH
+}
+
+static void fsquota_postparse_ev(const void *event_data, void *user_data) {
+  server_rec *s;
+  config_rec *c;
+  unsigned int ttl = FSQUOTA_CACHE_DEFAULT_TTL;
+  int netlink_events = FALSE;
+
+  /* The daemon keeps a cache of its own, for ftpdctl lookups. */
+  c = find_config(main_server->conf, CONF_PARAM, "FSQuotaCacheTTL", FALSE);
+  if (c != NULL) {
+    ttl = *((unsigned int *) c->argv[0]);
+  }
+
+  if (fsquota_cache_init(fsquota_daemon_pool, ttl) < 0) {
+    pr_log_debug(DEBUG1, MOD_FSQUOTA_VERSION
+      ": error initializing daemon cache: %s", strerror(errno));
+  }
+
+  /* The indexes are opened by the daemon, so that the scans are started
+   * only once, and every session inherits the mappings.
+   */
+  (void) fsquota_index_close();
+
+  /* Likewise, the quota status of the filesystems which sessions will use is
+   * resolved here once, rather than by every session at login.
+   */
+  (void) fsquota_cache_clear_warmup();
+  (void) fsquota_backend_init();
+
+  /* Sessions read the mount table themselves, before chroot; the daemon
+   * only needs it for the warm-up.
+   */
+  if (fsquota_mounts_open(fsquota_daemon_pool) < 0 &&
+      errno != ENOSYS) {
+    pr_log_debug(DEBUG3, MOD_FSQUOTA_VERSION
+      ": unable to read mount table: %s", strerror(errno));
+  }
+
+  for (s = (server_rec *) server_list->xas_list; s; s = s->next) {
+    c = find_config(s->conf, CONF_PARAM, "FSQuotaEngine", FALSE);
+    if (c == NULL ||
+        *((int *) c->argv[0]) == FALSE) {
+      continue;
+    }
+
+    c = find_config(s->conf, CONF_PARAM, "FSQuotaUsageIndex", FALSE);
+    while (c != NULL) {
+      pr_signals_handle();
+
+      if (fsquota_index_open(permanent_pool, c->argv[0], c->argv[1],
+          *((unsigned int *) c->argv[2])) < 0) {
+        pr_log_debug(DEBUG1, MOD_FSQUOTA_VERSION
+          ": error opening FSQuotaUsageIndex '%s' for '%s': %s",
+          (char *) c->argv[1], (char *) c->argv[0], strerror(errno));
+      }
+
+      c = find_config_next(c, c->next, CONF_PARAM, "FSQuotaUsageIndex",
+        FALSE);
+    }
+
+    c = find_config(s->conf, CONF_PARAM, "FSQuotaOptions", FALSE);
+    while (c != NULL) {
+      pr_signals_handle();
+
+      if (*((unsigned long *) c->argv[0]) & FSQUOTA_NETLINK_EVENTS) {
+        netlink_events = TRUE;
+      }
+
+      c = find_config_next(c, c->next, CONF_PARAM, "FSQuotaOptions", FALSE);
+    }
+
+    fsquota_warmup_server(s);
+  }
+
+  (void) fsquota_mounts_close();
+
+  /* On restart, the options may have changed. */
+  fsquota_netlink_stop();
+  if (netlink_events) {
+    fsquota_netlink_start();
+  }
+}
+
+/* Initialization routines
  */
 
+static int fsquota_init(void) {
+  fsquota_daemon_pool = make_sub_pool(permanent_pool);
+  pr_pool_tag(fsquota_daemon_pool, MOD_FSQUOTA_VERSION);
+
+  /* Shared with, and updated by, all sessions. */
+  (void) fsquota_shm_init();
+
+#ifdef PR_USE_CTRLS
+  {
+    register unsigned int i;
+
+    for (i = 0; fsquota_acttab[i].act_action; i++) {
+      fsquota_acttab[i].act_acl = pcalloc(fsquota_daemon_pool,
+        sizeof(ctrls_acl_t));
+      pr_ctrls_init_acl(fsquota_acttab[i].act_acl);
+
+      if (pr_ctrls_register(&fsquota_module, fsquota_acttab[i].act_action,
+          fsquota_acttab[i].act_desc, fsquota_acttab[i].act_cb) < 0) {
+        pr_log_pri(PR_LOG_NOTICE, MOD_FSQUOTA_VERSION
+          ": error registering '%s' control: %s",
+          fsquota_acttab[i].act_action, strerror(errno));
+      }
+    }
+  }
+#endif /* PR_USE_CTRLS */
+
+#if defined(PR_SHARED_MODULE)
+  pr_event_register(&fsquota_module, "core.module-unload",
+    fsquota_mod_unload_ev, NULL);
+#endif /* PR_SHARED_MODULE */
+
+  pr_event_register(&fsquota_module, "core.postparse", fsquota_postparse_ev,
+    NULL);
+
+  if (fsquota_quotatab_init() < 0 &&
+      errno != ENOSYS) {
+    return -1;
+  }
+
+  return 0;
+}
+
 static int fsquota_sess_init(void) {
   config_rec *c;
   int res;
@@ -550,6 +3804,15 @@ static int fsquota_sess_init(void) {
       strerror(errno));
   }
 
+  res = pr_var_set(fsquota_pool, "%{fsquota.group.name}",
+    "Name of most constrained group", PR_VAR_TYPE_FUNC,
+    (void *) fsquota_group_name_str, NULL, 0);
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 8,
+      "error registering %%{fsquota.group.name} variable: %s",
+      strerror(errno));
+  }
+
   res = pr_var_set(fsquota_pool, "%{fsquota.group.kb.total}",
     "Maximum number of KB on disk for group", PR_VAR_TYPE_FUNC,
     (void *) fsquota_group_total_kb_str, NULL, 0);
@@ -586,6 +3849,114 @@ static int fsquota_sess_init(void) {
       strerror(errno));
   }
 
+  res = pr_var_set(fsquota_pool, "%{fsquota.project.enabled}",
+    "Project quotas enabled", PR_VAR_TYPE_FUNC,
+    (void *) fsquota_project_enabled_str, NULL, 0);
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 8,
+      "error registering %%{fsquota.project.enabled} variable: %s",
+      strerror(errno));
+  }
+
+  res = pr_var_set(fsquota_pool, "%{fsquota.project.id}",
+    "Project ID of home directory", PR_VAR_TYPE_FUNC,
+    (void *) fsquota_project_id_str, NULL, 0);
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 8,
+      "error registering %%{fsquota.project.id} variable: %s",
+      strerror(errno));
+  }
+
+  res = pr_var_set(fsquota_pool, "%{fsquota.project.kb.total}",
+    "Maximum number of KB allowed on disk for project", PR_VAR_TYPE_FUNC,
+    (void *) fsquota_project_total_kb_str, NULL, 0);
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 8,
+      "error registering %%{fsquota.project.kb.total} variable: %s",
+      strerror(errno));
+  }
+
+  res = pr_var_set(fsquota_pool, "%{fsquota.project.kb.used}",
+    "Current number of KB on disk for project", PR_VAR_TYPE_FUNC,
+    (void *) fsquota_project_used_kb_str, NULL, 0);
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 8,
+      "error registering %%{fsquota.project.kb.used} variable: %s",
+      strerror(errno));
+  }
+
+  res = pr_var_set(fsquota_pool, "%{fsquota.project.files.total}",
+    "Maximum number of files allowed on disk for project", PR_VAR_TYPE_FUNC,
+    (void *) fsquota_project_total_files_str, NULL, 0);
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 8,
+      "error registering %%{fsquota.project.files.total} variable: %s",
+      strerror(errno));
+  }
+
+  res = pr_var_set(fsquota_pool, "%{fsquota.project.files.used}",
+    "Current number of files on disk for project", PR_VAR_TYPE_FUNC,
+    (void *) fsquota_project_used_files_str, NULL, 0);
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 8,
+      "error registering %%{fsquota.project.files.used} variable: %s",
+      strerror(errno));
+  }
+
+  res = pr_var_set(fsquota_pool, "%{fsquota.user.kb.rate}",
+    "Rate of change of bytes on disk for user, per hour", PR_VAR_TYPE_FUNC,
+    (void *) fsquota_user_rate_kb_str, NULL, 0);
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 8,
+      "error registering %%{fsquota.user.kb.rate} variable: %s",
+      strerror(errno));
+  }
+
+  res = pr_var_set(fsquota_pool, "%{fsquota.user.files.rate}",
+    "Rate of change of files on disk for user, per hour", PR_VAR_TYPE_FUNC,
+    (void *) fsquota_user_rate_files_str, NULL, 0);
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 8,
+      "error registering %%{fsquota.user.files.rate} variable: %s",
+      strerror(errno));
+  }
+
+  res = pr_var_set(fsquota_pool, "%{fsquota.user.eta}",
+    "Seconds until user quota is reached, at the current rate", PR_VAR_TYPE_FUNC,
+    (void *) fsquota_user_eta_str, NULL, 0);
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 8,
+      "error registering %%{fsquota.user.eta} variable: %s",
+      strerror(errno));
+  }
+
+  res = pr_var_set(fsquota_pool, "%{fsquota.group.kb.rate}",
+    "Rate of change of bytes on disk for group, per hour", PR_VAR_TYPE_FUNC,
+    (void *) fsquota_group_rate_kb_str, NULL, 0);
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 8,
+      "error registering %%{fsquota.group.kb.rate} variable: %s",
+      strerror(errno));
+  }
+
+  res = pr_var_set(fsquota_pool, "%{fsquota.group.files.rate}",
+    "Rate of change of files on disk for group, per hour", PR_VAR_TYPE_FUNC,
+    (void *) fsquota_group_rate_files_str, NULL, 0);
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 8,
+      "error registering %%{fsquota.group.files.rate} variable: %s",
+      strerror(errno));
+  }
+
+  res = pr_var_set(fsquota_pool, "%{fsquota.group.eta}",
+    "Seconds until group quota is reached, at the current rate", PR_VAR_TYPE_FUNC,
+    (void *) fsquota_group_eta_str, NULL, 0);
+  if (res < 0) {
+    pr_trace_msg(trace_channel, 8,
+      "error registering %%{fsquota.group.eta} variable: %s",
+      strerror(errno));
+  }
+
   c = find_config(main_server->conf, CONF_PARAM, "FSQuotaEngine", FALSE);
   if (c) {
     fsquota_engine = *((int *) c->argv[0]);
@@ -610,22 +3981,180 @@ static int fsquota_sess_init(void) {
     c = find_config_next(c, c->next, CONF_PARAM, "FSQuotaOptions", FALSE);
   }
 
+  pr_feat_add(C_AVBL);
+
+  c = find_config(main_server->conf, CONF_PARAM, "FSQuotaCacheTTL", FALSE);
+  if (c != NULL) {
+    fsquota_cache_ttl = *((unsigned int *) c->argv[0]);
+  }
+
+  /* Done now, while the entire filesystem is still visible. */
+  (void) fsquota_backend_init();
+
+  if (fsquota_mounts_open(fsquota_pool) < 0 &&
+      errno != ENOSYS) {
+    pr_log_debug(DEBUG3, MOD_FSQUOTA_VERSION
+      ": unable to read mount table: %s", strerror(errno));
+  }
+
+  if (fsquota_cache_init(fsquota_pool, fsquota_cache_ttl) < 0) {
+    pr_log_debug(DEBUG1, MOD_FSQUOTA_VERSION
+      ": error initializing cache: %s", strerror(errno));
+  }
+
+  /* Shared with the other nodes; the mount table is read now, before any
+   * chroot.
+   */
+  c = find_config(main_server->conf, CONF_PARAM, "FSQuotaMemcache", FALSE);
+  if (c != NULL &&
+      *((int *) c->argv[0]) == TRUE) {
+    unsigned int ttl;
+
+    ttl = *((unsigned int *) c->argv[1]);
+    if (ttl == 0) {
+      ttl = (fsquota_cache_ttl > 0 ? fsquota_cache_ttl :
+        FSQUOTA_CACHE_DEFAULT_TTL);
+    }
+
+    if (fsquota_cache_set_shared(fsquota_pool, ttl) < 0) {
+      pr_log_debug(DEBUG1, MOD_FSQUOTA_VERSION
+        ": unable to use memcache for FSQuotaMemcache: %s", strerror(errno));
+    }
+  }
+
+  /* The daemon reads the kernel's quota events, and passes them on as flush
+   * requests; the session has no use for the daemon's subscription.
+   */
+  fsquota_netlink_stop();
+
+  c = find_config(main_server->conf, CONF_PARAM, "FSQuotaQueryRate", FALSE);
+  if (c != NULL) {
+    double rate;
+    unsigned int burst;
+
+    rate = *((double *) c->argv[0]);
+    burst = *((unsigned int *) c->argv[1]);
+
+    if (fsquota_cache_set_rate(rate, burst) < 0) {
+      pr_log_debug(DEBUG1, MOD_FSQUOTA_VERSION
+        ": error setting FSQuotaQueryRate: %s", strerror(errno));
+
+    } else {
+      pr_trace_msg(trace_channel, 9,
+        "limiting quota queries to %.2f/sec (burst %u)", rate, burst);
+    }
+  }
+
+  c = find_config(main_server->conf, CONF_PARAM, "FSQuotaUsageLimit", FALSE);
+  while (c != NULL) {
+    pr_signals_handle();
+
+    (void) fsquota_index_set_limits(*((int *) c->argv[0]),
+      *((uint64_t *) c->argv[1]), *((uint64_t *) c->argv[2]));
+
+    c = find_config_next(c, c->next, CONF_PARAM, "FSQuotaUsageLimit", FALSE);
+  }
+
+  c = find_config(main_server->conf, CONF_PARAM, "FSQuotaWarn", FALSE);
+  if (c != NULL) {
+    fsquota_warn_pcts = c->argv[0];
+    fsquota_warn_npcts = *((unsigned int *) c->argv[1]);
+  }
+
+  /* The map must be read before any chroot. */
+  c = find_config(main_server->conf, CONF_PARAM, "FSQuotaProjects", FALSE);
+  if (c != NULL &&
+      strcasecmp(c->argv[0], "xattr") != 0) {
+    if (fsquota_read_project_map(c->argv[0]) < 0) {
+      pr_log_debug(DEBUG1, MOD_FSQUOTA_VERSION
+        ": error reading FSQuotaProjects map '%s': %s", (char *) c->argv[0],
+        strerror(errno));
+    }
+  }
+
+  pr_event_register(&fsquota_module, "core.chroot", fsquota_chroot_ev, NULL);
+  pr_event_register(&fsquota_module, "core.exit", fsquota_exit_ev, NULL);
+
   return 0;
 }
 
 /* Module API tables
  */
 
+#ifdef PR_USE_CTRLS
+static ctrls_acttab_t fsquota_acttab[] = {
+  { "fsquota", "query and manage mod_fsquota caches", NULL,
+    fsquota_handle_fsquota },
+  { NULL, NULL, NULL, NULL }
+};
+#endif /* PR_USE_CTRLS */
+
 static conftable fsquota_conftab[] = {
+  { "FSQuotaCacheTTL",	set_fsquotacachettl,	NULL },
+  { "FSQuotaControlsACLs",	set_fsquotactrlsacls,	NULL },
   { "FSQuotaEngine",	set_fsquotaengine,	NULL },
+  { "FSQuotaMemcache",	set_fsquotamemcache,	NULL },
   { "FSQuotaOptions",	set_fsquotaoptions,	NULL },
+  { "FSQuotaProjects",	set_fsquotaprojects,	NULL },
+  { "FSQuotaQueryRate",	set_fsquotaqueryrate,	NULL },
+  { "FSQuotaUploadVolumes",	set_fsquotauploadvolumes,	NULL },
+  { "FSQuotaUsageIndex",	set_fsquotausageindex,	NULL },
+  { "FSQuotaUsageLimit",	set_fsquotausagelimit,	NULL },
+  { "FSQuotaWarmup",		set_fsquotawarmup,	NULL },
+  { "FSQuotaWarn",		set_fsquotawarn,	NULL },
   { NULL }
 };
 
 static cmdtable fsquota_cmdtab[] = {
   { POST_CMD,	C_PASS, G_NONE,	fsquota_post_pass,	FALSE,	FALSE },
+  { CMD,	C_AVBL,	G_DIRS,	fsquota_avbl,		TRUE,	FALSE,	CL_INFO },
   { CMD,	C_SITE,	G_NONE,	fsquota_site,		FALSE,	FALSE,	CL_MISC },
 
+  { PRE_CMD,	C_ALLO,	G_NONE,	fsquota_pre_allo,	TRUE,	FALSE },
+  { PRE_CMD,	C_SITE,	G_NONE,	fsquota_pre_site_copy,	FALSE,	FALSE },
+  { PRE_CMD,	C_STOR,	G_NONE,	fsquota_pre_stor_volume,	TRUE,	FALSE },
+  { PRE_CMD,	C_STOR,	G_NONE,	fsquota_pre_stor_reserve,	TRUE,	FALSE },
+  { PRE_CMD,	C_STOU,	G_NONE,	fsquota_pre_stor_reserve,	TRUE,	FALSE },
+  { PRE_CMD,	C_APPE,	G_NONE,	fsquota_pre_update,	TRUE,	FALSE },
+  { PRE_CMD,	C_DELE,	G_NONE,	fsquota_pre_update,	TRUE,	FALSE },
+  { PRE_CMD,	C_MKD,	G_NONE,	fsquota_pre_update,	TRUE,	FALSE },
+  { PRE_CMD,	C_RMD,	G_NONE,	fsquota_pre_update,	TRUE,	FALSE },
+  { PRE_CMD,	C_RNTO,	G_NONE,	fsquota_pre_update,	TRUE,	FALSE },
+  { PRE_CMD,	C_STOR,	G_NONE,	fsquota_pre_update,	TRUE,	FALSE },
+  { PRE_CMD,	C_STOU,	G_NONE,	fsquota_pre_update,	TRUE,	FALSE },
+  { PRE_CMD,	C_XMKD,	G_NONE,	fsquota_pre_update,	TRUE,	FALSE },
+  { PRE_CMD,	C_XRMD,	G_NONE,	fsquota_pre_update,	TRUE,	FALSE },
+
+  { POST_CMD,	C_APPE,	G_NONE,	fsquota_post_update,	TRUE,	FALSE },
+  { POST_CMD,	C_DELE,	G_NONE,	fsquota_post_update,	TRUE,	FALSE },
+  { POST_CMD,	C_MKD,	G_NONE,	fsquota_post_update,	TRUE,	FALSE },
+  { POST_CMD,	C_RMD,	G_NONE,	fsquota_post_update,	TRUE,	FALSE },
+  { POST_CMD,	C_RNTO,	G_NONE,	fsquota_post_update,	TRUE,	FALSE },
+  { POST_CMD,	C_STOR,	G_NONE,	fsquota_post_update,	TRUE,	FALSE },
+  { POST_CMD,	C_STOU,	G_NONE,	fsquota_post_update,	TRUE,	FALSE },
+  { POST_CMD,	C_XMKD,	G_NONE,	fsquota_post_update,	TRUE,	FALSE },
+  { POST_CMD,	C_XRMD,	G_NONE,	fsquota_post_update,	TRUE,	FALSE },
+
+  { POST_CMD_ERR,	C_APPE,	G_NONE,	fsquota_post_update_err,	TRUE,	FALSE },
+  { POST_CMD_ERR,	C_DELE,	G_NONE,	fsquota_post_update_err,	TRUE,	FALSE },
+  { POST_CMD_ERR,	C_MKD,	G_NONE,	fsquota_post_update_err,	TRUE,	FALSE },
+  { POST_CMD_ERR,	C_RMD,	G_NONE,	fsquota_post_update_err,	TRUE,	FALSE },
+  { POST_CMD_ERR,	C_RNTO,	G_NONE,	fsquota_post_update_err,	TRUE,	FALSE },
+  { POST_CMD_ERR,	C_STOR,	G_NONE,	fsquota_post_update_err,	TRUE,	FALSE },
+  { POST_CMD_ERR,	C_STOU,	G_NONE,	fsquota_post_update_err,	TRUE,	FALSE },
+  { POST_CMD_ERR,	C_XMKD,	G_NONE,	fsquota_post_update_err,	TRUE,	FALSE },
+  { POST_CMD_ERR,	C_XRMD,	G_NONE,	fsquota_post_update_err,	TRUE,	FALSE },
+
+  { LOG_CMD,	C_CDUP,	G_NONE,	fsquota_log_warn,	TRUE,	FALSE },
+  { LOG_CMD,	C_CWD,	G_NONE,	fsquota_log_warn,	TRUE,	FALSE },
+  { LOG_CMD,	C_PASS,	G_NONE,	fsquota_log_warn,	FALSE,	FALSE },
+  { LOG_CMD,	C_XCUP,	G_NONE,	fsquota_log_warn,	TRUE,	FALSE },
+  { LOG_CMD,	C_XCWD,	G_NONE,	fsquota_log_warn,	TRUE,	FALSE },
+
+#ifdef HAVE_SYS_STATVFS_H
+  { HOOK,	"fsquota_statvfs", G_NONE, fsquota_statvfs,	FALSE,	FALSE },
+#endif /* HAVE_SYS_STATVFS_H */
+
   { 0, NULL }
 };
 
@@ -649,7 +4178,7 @@ module fsquota_module = {
   NULL,
 
   /* Module initialization */
-  NULL,
+  fsquota_init,
 
   /* Session initialization */
   fsquota_sess_init,
@@ -0,0 +1,567 @@
+/*
+ * ProFTPD - mod_fsquota mount table
+ * Copyright (c) 2013-2021 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_fsquota.h"
+#include "mounts.h"
+
+#ifdef LINUX
+# include <poll.h>
+# include <sys/sysmacros.h>
+
+/* The mount points, as a trie of path components; each node which is a mount
+ * point refers to the mount, the last one mounted there winning.
+ */
+struct mounts_node {
+  const char *name;
+  size_t namelen;
+
+  struct mounts_node *children, *next;
+  struct fsquota_mount *mount;
+};
+
+static pool *mounts_pool = NULL;
+
+/* Holds the trie and mounts of the current table; replaced on change. */
+static pool *mounts_table_pool = NULL;
+static struct mounts_node *mounts_root = NULL;
+static array_header *mounts_list = NULL;
+static unsigned long mounts_gen = 0;
+
+/* The kernel flags the open table with POLLPRI when it changes.  It is
+ * polled at most once a second.
+ */
+static int mounts_fd = -1;
+static time_t mounts_checked_ts = 0;
+
+static const char *trace_channel = "fsquota.mounts";
+
+/* Undoes the octal escaping of spaces, tabs, newlines and backslashes in
+ * mount table fields, in place.
+ */
+static char *mounts_unescape(char *field) {
+  char *src, *dst;
+
+  for (src = dst = field; *src != '\0'; src++, dst++) {
+    if (src[0] == '\\' &&
+        src[1] >= '0' && src[1] <= '3' &&
+        src[2] >= '0' && src[2] <= '7' &&
+        src[3] >= '0' && src[3] <= '7') {
+      *dst = (char) (((src[1] - '0') << 6) | ((src[2] - '0') << 3) |
+        (src[3] - '0'));
+      src += 3;
+
+    } else {
+      *dst = *src;
+    }
+  }
+
+  *dst = '\0';
+  return field;
+}
+
+/* Returns the next path component, and its length, or NULL at the end. */
+static const char *mounts_next_component(const char **path, size_t *len) {
+  const char *ptr;
+
+  ptr = *path;
+  while (*ptr == '/') {
+    ptr++;
+  }
+
+  if (*ptr == '\0') {
+    *path = ptr;
+    return NULL;
+  }
+
+  *len = strcspn(ptr, "/");
+  *path = ptr + *len;
+  return ptr;
+}
+
+static void mounts_add(pool *p, struct mounts_node *root,
+    struct fsquota_mount *mount) {
+  struct mounts_node *node;
+  const char *path, *name;
+  size_t namelen = 0;
+
+  node = root;
+  path = mount->path;
+
+  while ((name = mounts_next_component(&path, &namelen)) != NULL) {
+    struct mounts_node *child;
+
+    for (child = node->children; child != NULL; child = child->next) {
+      if (child->namelen == namelen &&
+          strncmp(child->name, name, namelen) == 0) {
+        break;
+      }
+    }
+
+    if (child == NULL) {
+      child = pcalloc(p, sizeof(struct mounts_node));
+      child->name = pstrndup(p, name, namelen);
+      child->namelen = namelen;
+      child->next = node->children;
+      node->children = child;
+    }
+
+    node = child;
+  }
+
+  node->mount = mount;
+}
+
+/* Reads the entire table; the kernel generates it anew on each read from the
+ * start.
+ */
+static char *mounts_read(pool *p) {
+  size_t bufsz = 16384, buflen = 0;
+  char *buf;
+
+  if (lseek(mounts_fd, 0, SEEK_SET) < 0) {
+    return NULL;
+  }
+
+  buf = palloc(p, bufsz);
+
+  while (TRUE) {
+    ssize_t len;
+
+    if (buflen + 1 >= bufsz) {
+      char *larger;
+
+      larger = palloc(p, bufsz * 2);
+      memcpy(larger, buf, buflen);
+      buf = larger;
+      bufsz *= 2;
+    }
+
+    len = read(mounts_fd, buf + buflen, bufsz - buflen - 1);
+    if (len < 0) {
+      if (errno == EINTR) {
+        pr_signals_handle();
+        continue;
+      }
+
+      return NULL;
+    }
+
+    if (len == 0) {
+      break;
+    }
+
+    buflen += len;
+  }
+
+  buf[buflen] = '\0';
+  return buf;
+}
+
+/* Builds the trie from /proc/self/mountinfo, whose lines look like:
+ *
+ *  36 35 0:53 / /home rw,relatime shared:1 - nfs4 server:/export rw,...
+ */
+static int mounts_build(void) {
+  pool *table_pool;
+  struct mounts_node *root;
+  array_header *list;
+  char *buf, *line, *next;
+
+  table_pool = make_sub_pool(mounts_pool);
+  pr_pool_tag(table_pool, MOD_FSQUOTA_VERSION ": Mount Table Pool");
+
+  buf = mounts_read(table_pool);
+  if (buf == NULL) {
+    int xerrno = errno;
+
+    pr_trace_msg(trace_channel, 3,
+      "unable to read /proc/self/mountinfo: %s", strerror(xerrno));
+    destroy_pool(table_pool);
+
+    errno = xerrno;
+    return -1;
+  }
+
+  root = pcalloc(table_pool, sizeof(struct mounts_node));
+  list = make_array(table_pool, 16, sizeof(struct fsquota_mount *));
+
+  for (line = buf; line != NULL && *line != '\0'; line = next) {
+    struct fsquota_mount *mount;
+    unsigned int major = 0, minor = 0;
+    char *ptr, *mount_path, *mount_opts, *fstype, *source, *super_opts;
+
+    next = strchr(line, '\n');
+    if (next != NULL) {
+      *next++ = '\0';
+    }
+
+    if (sscanf(line, "%*u %*u %u:%u", &major, &minor) != 2) {
+      continue;
+    }
+
+    /* Skip the IDs, device and root, to get to the mount point. */
+    ptr = strchr(line, ' ');
+    ptr = (ptr != NULL ? strchr(ptr + 1, ' ') : NULL);
+    ptr = (ptr != NULL ? strchr(ptr + 1, ' ') : NULL);
+    ptr = (ptr != NULL ? strchr(ptr + 1, ' ') : NULL);
+    if (ptr == NULL) {
+      continue;
+    }
+
+    mount_path = ptr + 1;
+    ptr = strchr(mount_path, ' ');
+    if (ptr == NULL) {
+      continue;
+    }
+    *ptr++ = '\0';
+
+    /* The filesystem type and source follow the separator, which directly
+     * follows the mount options if there are no optional fields.
+     */
+    mount_opts = ptr;
+    ptr = strstr(mount_opts, " - ");
+    if (ptr == NULL) {
+      continue;
+    }
+
+    fstype = ptr + 3;
+    *(strchr(mount_opts, ' ')) = '\0';
+
+    ptr = strchr(fstype, ' ');
+    if (ptr == NULL) {
+      continue;
+    }
+    *ptr++ = '\0';
+
+    source = ptr;
+    super_opts = "";
+    ptr = strchr(source, ' ');
+    if (ptr != NULL) {
+      *ptr++ = '\0';
+      super_opts = ptr;
+    }
+
+    mount = pcalloc(table_pool, sizeof(struct fsquota_mount));
+    mount->dev = makedev(major, minor);
+    mount->path = mounts_unescape(mount_path);
+    mount->fstype = fstype;
+    mount->source = mounts_unescape(source);
+    mount->options = pstrcat(table_pool, mount_opts, ",", super_opts, NULL);
+
+    mounts_add(table_pool, root, mount);
+    *((struct fsquota_mount **) push_array(list)) = mount;
+  }
+
+  if (mounts_table_pool != NULL) {
+    destroy_pool(mounts_table_pool);
+  }
+
+  mounts_table_pool = table_pool;
+  mounts_root = root;
+  mounts_list = list;
+  mounts_gen++;
+
+  pr_trace_msg(trace_channel, 9, "read %d mounts from /proc/self/mountinfo",
+    list->nelts);
+  return 0;
+}
+
+/* Rebuilds the trie if the mount table has changed since it was built. */
+static void mounts_check(void) {
+  struct pollfd pfd;
+  time_t now;
+
+  time(&now);
+  if (now == mounts_checked_ts) {
+    return;
+  }
+
+  mounts_checked_ts = now;
+
+  pfd.fd = mounts_fd;
+  pfd.events = POLLPRI;
+  pfd.revents = 0;
+
+  if (poll(&pfd, 1, 0) > 0 &&
+      (pfd.revents & (POLLPRI|POLLERR))) {
+    pr_trace_msg(trace_channel, 8, "%s",
+      "mount table changed, reading it again");
+    (void) mounts_build();
+  }
+}
+
+int fsquota_mounts_open(pool *p) {
+  int fd;
+
+  if (p == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (mounts_fd >= 0) {
+    return 0;
+  }
+
+  fd = open("/proc/self/mountinfo", O_RDONLY);
+  if (fd < 0) {
+    int xerrno = errno;
+
+    pr_trace_msg(trace_channel, 3,
+      "unable to open /proc/self/mountinfo: %s", strerror(xerrno));
+
+    errno = xerrno;
+    return -1;
+  }
+
+  (void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  mounts_pool = make_sub_pool(p);
+  pr_pool_tag(mounts_pool, MOD_FSQUOTA_VERSION ": Mounts Pool");
+
+  mounts_fd = fd;
+  time(&mounts_checked_ts);
+
+  if (mounts_build() < 0) {
+    int xerrno = errno;
+
+    (void) fsquota_mounts_close();
+
+    errno = xerrno;
+    return -1;
+  }
+
+  return 0;
+}
+
+int fsquota_mounts_close(void) {
+  if (mounts_fd >= 0) {
+    (void) close(mounts_fd);
+    mounts_fd = -1;
+  }
+
+  if (mounts_pool != NULL) {
+    destroy_pool(mounts_pool);
+    mounts_pool = NULL;
+  }
+
+  mounts_table_pool = NULL;
+  mounts_root = NULL;
+  mounts_list = NULL;
+  mounts_checked_ts = 0;
+
+  return 0;
+}
+
+const struct fsquota_mount *fsquota_mounts_lookup(const char *path) {
+  struct mounts_node *node;
+  const struct fsquota_mount *mount;
+  const char *name;
+  size_t namelen = 0;
+
+  if (path == NULL ||
+      *path != '/') {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if (mounts_fd < 0) {
+    errno = EPERM;
+    return NULL;
+  }
+
+  mounts_check();
+
+  node = mounts_root;
+  mount = node->mount;
+
+  while ((name = mounts_next_component(&path, &namelen)) != NULL) {
+    struct mounts_node *child;
+
+    /* Only canonical paths can be matched by prefix. */
+    if (name[0] == '.' &&
+        (namelen == 1 ||
+         (namelen == 2 && name[1] == '.'))) {
+      errno = ENOENT;
+      return NULL;
+    }
+
+    /* Past the deepest mount point, the rest is only checked. */
+    if (node == NULL) {
+      continue;
+    }
+
+    for (child = node->children; child != NULL; child = child->next) {
+      if (child->namelen == namelen &&
+          strncmp(child->name, name, namelen) == 0) {
+        break;
+      }
+    }
+
+    node = child;
+    if (node != NULL &&
+        node->mount != NULL) {
+      mount = node->mount;
+    }
+  }
+
+  if (mount == NULL) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  /* Btrfs gives each subvolume its own device number, and overlayfs reports
+   * that of the underlying filesystem, for files; neither matches the
+   * mount's.
+   */
+  if (strcmp(mount->fstype, "btrfs") == 0 ||
+      strcmp(mount->fstype, "overlay") == 0) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  return mount;
+}
+
+unsigned long fsquota_mounts_get_generation(void) {
+  if (mounts_fd < 0) {
+    return 0;
+  }
+
+  mounts_check();
+  return mounts_gen;
+}
+
+const struct fsquota_mount *fsquota_mounts_get_dev(dev_t dev) {
+  register int i;
+  struct fsquota_mount **mounts;
+
+  if (mounts_fd < 0) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  mounts_check();
+
+  mounts = mounts_list->elts;
+  for (i = 0; i < mounts_list->nelts; i++) {
+    if (mounts[i]->dev == dev) {
+      return mounts[i];
+    }
+  }
+
+  errno = ENOENT;
+  return NULL;
+}
+
+const array_header *fsquota_mounts_get_list(void) {
+  if (mounts_fd < 0) {
+    errno = ENOENT;
+    return NULL;
+  }
+
+  mounts_check();
+  return mounts_list;
+}
+
+int fsquota_mounts_have_quotas(const struct fsquota_mount *mount) {
+  const char *ptr;
+
+  if (mount == NULL ||
+      mount->options == NULL) {
+    return FALSE;
+  }
+
+  for (ptr = mount->options; *ptr != '\0'; ptr += strcspn(ptr, ",")) {
+    size_t len;
+
+    if (*ptr == ',') {
+      ptr++;
+    }
+
+    len = strcspn(ptr, ",=");
+    if (ptr[len] == '=') {
+      /* The journaled quota files of ext3/ext4, e.g. "usrjquota=aquota.user";
+       * an empty name turns them off.
+       */
+      if (len == 9 &&
+          strncmp(ptr + 3, "jquota", 6) == 0 &&
+          ptr[len+1] != ',' &&
+          ptr[len+1] != '\0') {
+        return TRUE;
+      }
+
+      continue;
+    }
+
+    if (len == 7 &&
+        strncmp(ptr, "noquota", 7) == 0) {
+      continue;
+    }
+
+    /* E.g. "usrquota", "quota", and XFS' "uquota" and "uqnoenforce". */
+    if ((len >= 5 &&
+         strncmp(ptr + len - 5, "quota", 5) == 0) ||
+        (len >= 10 &&
+         strncmp(ptr + len - 10, "qnoenforce", 10) == 0)) {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+#else
+
+int fsquota_mounts_open(pool *p) {
+  errno = ENOSYS;
+  return -1;
+}
+
+int fsquota_mounts_close(void) {
+  return 0;
+}
+
+const struct fsquota_mount *fsquota_mounts_lookup(const char *path) {
+  errno = ENOSYS;
+  return NULL;
+}
+
+unsigned long fsquota_mounts_get_generation(void) {
+  return 0;
+}
+
+const struct fsquota_mount *fsquota_mounts_get_dev(dev_t dev) {
+  errno = ENOSYS;
+  return NULL;
+}
+
+const array_header *fsquota_mounts_get_list(void) {
+  errno = ENOSYS;
+  return NULL;
+}
+
+int fsquota_mounts_have_quotas(const struct fsquota_mount *mount) {
+  return FALSE;
+}
+#endif /* LINUX */
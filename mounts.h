@@ -0,0 +1,81 @@
+/*
+ * ProFTPD - mod_fsquota mount table API
+ * Copyright (c) 2013-2021 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_fsquota.h"
+
+#ifndef MOD_FSQUOTA_MOUNTS_H
+#define MOD_FSQUOTA_MOUNTS_H
+
+struct fsquota_mount {
+  dev_t dev;
+
+  /* Where the filesystem is mounted, as seen before any chroot. */
+  const char *path;
+
+  const char *fstype;
+
+  /* E.g. the device, or "server:/export" for NFS. */
+  const char *source;
+
+  /* The per-mount options, then the filesystem's own, comma-separated. */
+  const char *options;
+};
+
+/* Reads the mount table, keeping it open so that it can be re-read, even
+ * after chroot, whenever the kernel reports a change to it.  Must be called
+ * before chroot; does nothing if the table is already open.
+ */
+int fsquota_mounts_open(pool *p);
+int fsquota_mounts_close(void);
+
+/* Returns the mount holding the given absolute path, as seen before any
+ * chroot, by the longest mount point prefix of the path; no syscalls are
+ * made, other than to notice changes to the mount table.  Symlinks in the
+ * path are not resolved.  Returns NULL with ENOENT if the device of the
+ * mount does not identify the files on it (btrfs subvolumes, overlayfs),
+ * and the caller needs to stat(2) the path instead.
+ *
+ * The returned mount is valid until the next call.
+ */
+const struct fsquota_mount *fsquota_mounts_lookup(const char *path);
+
+/* Returns a number which changes whenever the mount table is read anew,
+ * or zero if the table is not open.
+ */
+unsigned long fsquota_mounts_get_generation(void);
+
+/* Returns the mount of the given device, or NULL with ENOENT. */
+const struct fsquota_mount *fsquota_mounts_get_dev(dev_t dev);
+
+/* Returns all of the mounts, as pointers, in mount table order; valid until
+ * the next call.
+ */
+const array_header *fsquota_mounts_get_list(void);
+
+/* Returns TRUE if the mount's options show that quotas of any type are on,
+ * e.g. "usrquota" or "usrjquota=", FALSE otherwise.
+ */
+int fsquota_mounts_have_quotas(const struct fsquota_mount *mount);
+
+#endif /* MOD_FSQUOTA_MOUNTS_H */
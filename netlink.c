@@ -0,0 +1,374 @@
+/*
+ * ProFTPD - mod_fsquota kernel quota events
+ * Copyright (c) 2013-2021 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_fsquota.h"
+#include "netlink.h"
+#include "shm.h"
+
+#if defined(LINUX) && defined(HAVE_LINUX_GENETLINK_H)
+# include <sys/socket.h>
+# include <sys/sysmacros.h>
+# include <linux/netlink.h>
+# include <linux/genetlink.h>
+
+# ifndef SOL_NETLINK
+#  define SOL_NETLINK			270
+# endif
+
+/* From <linux/quota.h>, which clashes with <sys/quota.h>. */
+# define FSQUOTA_NL_FAMILY_NAME		"VFS_DQUOT"
+# define FSQUOTA_NL_GROUP_NAME		"events"
+# define FSQUOTA_NL_C_WARNING		1
+# define FSQUOTA_NL_A_QTYPE		1
+# define FSQUOTA_NL_A_EXCESS_ID		2
+# define FSQUOTA_NL_A_WARNING		3
+# define FSQUOTA_NL_A_DEV_MAJOR		4
+# define FSQUOTA_NL_A_DEV_MINOR		5
+
+# define FSQUOTA_NL_QTYPE_USER		0
+# define FSQUOTA_NL_QTYPE_GROUP		1
+# define FSQUOTA_NL_QTYPE_PROJECT	2
+
+static int netlink_fd = -1;
+static uint16_t netlink_family_id = 0;
+
+static const char *trace_channel = "fsquota.netlink";
+
+static struct nlattr *netlink_attr_next(struct nlattr *na, int *len) {
+  int attrlen;
+
+  attrlen = NLA_ALIGN(na->nla_len);
+  *len -= attrlen;
+  return (struct nlattr *) (((char *) na) + attrlen);
+}
+
+static int netlink_attr_ok(struct nlattr *na, int len) {
+  return (len >= (int) NLA_HDRLEN &&
+    na->nla_len >= NLA_HDRLEN &&
+    (int) na->nla_len <= len);
+}
+
+/* Asks the generic netlink controller for the ID of the quota family, and
+ * of its multicast group.
+ */
+static int netlink_resolve(int fd, uint16_t *family_id, uint32_t *group_id) {
+  struct {
+    struct nlmsghdr n;
+    struct genlmsghdr g;
+    char buf[256];
+  } req;
+  struct nlattr *na;
+  struct sockaddr_nl addr;
+  char buf[8192];
+  struct nlmsghdr *nlh;
+  ssize_t len;
+  int found_family = FALSE, found_group = FALSE;
+
+  memset(&req, 0, sizeof(req));
+  req.n.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+  req.n.nlmsg_type = GENL_ID_CTRL;
+  req.n.nlmsg_flags = NLM_F_REQUEST;
+  req.n.nlmsg_seq = 1;
+  req.n.nlmsg_pid = 0;
+  req.g.cmd = CTRL_CMD_GETFAMILY;
+  req.g.version = 1;
+
+  na = (struct nlattr *) (((char *) &req) + NLMSG_ALIGN(req.n.nlmsg_len));
+  na->nla_type = CTRL_ATTR_FAMILY_NAME;
+  na->nla_len = NLA_HDRLEN + strlen(FSQUOTA_NL_FAMILY_NAME) + 1;
+  memcpy(((char *) na) + NLA_HDRLEN, FSQUOTA_NL_FAMILY_NAME,
+    strlen(FSQUOTA_NL_FAMILY_NAME) + 1);
+  req.n.nlmsg_len += NLA_ALIGN(na->nla_len);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+
+  if (sendto(fd, &req, req.n.nlmsg_len, 0, (struct sockaddr *) &addr,
+      sizeof(addr)) < 0) {
+    return -1;
+  }
+
+  len = recv(fd, buf, sizeof(buf), 0);
+  if (len < 0) {
+    return -1;
+  }
+
+  for (nlh = (struct nlmsghdr *) buf; NLMSG_OK(nlh, len);
+       nlh = NLMSG_NEXT(nlh, len)) {
+    int attrlen;
+
+    if (nlh->nlmsg_type == NLMSG_ERROR) {
+      struct nlmsgerr *err;
+
+      /* Most likely, the kernel was built without CONFIG_QUOTA_NETLINK. */
+      err = NLMSG_DATA(nlh);
+      errno = (err->error < 0 ? -err->error : ENOENT);
+      return -1;
+    }
+
+    attrlen = nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+    na = (struct nlattr *) (((char *) NLMSG_DATA(nlh)) + GENL_HDRLEN);
+
+    for (; netlink_attr_ok(na, attrlen); na = netlink_attr_next(na, &attrlen)) {
+      if (na->nla_type == CTRL_ATTR_FAMILY_ID) {
+        memcpy(family_id, ((char *) na) + NLA_HDRLEN, sizeof(uint16_t));
+        found_family = TRUE;
+
+      } else if ((na->nla_type & NLA_TYPE_MASK) == CTRL_ATTR_MCAST_GROUPS) {
+        struct nlattr *grp;
+        int grplen;
+
+        grplen = na->nla_len - NLA_HDRLEN;
+        grp = (struct nlattr *) (((char *) na) + NLA_HDRLEN);
+
+        for (; netlink_attr_ok(grp, grplen);
+             grp = netlink_attr_next(grp, &grplen)) {
+          struct nlattr *ga;
+          int galen;
+          const char *name = NULL;
+          uint32_t id = 0;
+
+          galen = grp->nla_len - NLA_HDRLEN;
+          ga = (struct nlattr *) (((char *) grp) + NLA_HDRLEN);
+
+          for (; netlink_attr_ok(ga, galen);
+               ga = netlink_attr_next(ga, &galen)) {
+            if (ga->nla_type == CTRL_ATTR_MCAST_GRP_NAME) {
+              name = ((char *) ga) + NLA_HDRLEN;
+
+            } else if (ga->nla_type == CTRL_ATTR_MCAST_GRP_ID) {
+              memcpy(&id, ((char *) ga) + NLA_HDRLEN, sizeof(uint32_t));
+            }
+          }
+
+          if (name != NULL &&
+              strcmp(name, FSQUOTA_NL_GROUP_NAME) == 0) {
+            *group_id = id;
+            found_group = TRUE;
+          }
+        }
+      }
+    }
+  }
+
+  if (found_family == FALSE ||
+      found_group == FALSE) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  return 0;
+}
+
+int fsquota_netlink_open(void) {
+  int fd, flags, xerrno;
+  uint16_t family_id = 0;
+  uint32_t group_id = 0;
+  struct sockaddr_nl addr;
+
+  if (netlink_fd >= 0) {
+    return 0;
+  }
+
+  fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_GENERIC);
+  if (fd < 0) {
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+      netlink_resolve(fd, &family_id, &group_id) < 0 ||
+      setsockopt(fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &group_id,
+        sizeof(group_id)) < 0) {
+    xerrno = errno;
+
+    pr_trace_msg(trace_channel, 3,
+      "unable to subscribe to kernel quota events: %s", strerror(xerrno));
+    (void) close(fd);
+
+    errno = xerrno;
+    return -1;
+  }
+
+  /* Events are only ever read opportunistically. */
+  flags = fcntl(fd, F_GETFL);
+  (void) fcntl(fd, F_SETFL, flags|O_NONBLOCK);
+  (void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  netlink_fd = fd;
+  netlink_family_id = family_id;
+
+  pr_trace_msg(trace_channel, 9,
+    "subscribed to kernel quota events (family %u, group %lu)",
+    (unsigned int) family_id, (unsigned long) group_id);
+  return 0;
+}
+
+int fsquota_netlink_close(void) {
+  if (netlink_fd >= 0) {
+    (void) close(netlink_fd);
+    netlink_fd = -1;
+  }
+
+  return 0;
+}
+
+static void netlink_handle_event(struct nlmsghdr *nlh) {
+  struct genlmsghdr *genl;
+  struct nlattr *na;
+  int attrlen, qtype = -1, type;
+  uint32_t warning = 0, major = 0, minor = 0;
+  uint64_t id = 0;
+
+  genl = NLMSG_DATA(nlh);
+  if (genl->cmd != FSQUOTA_NL_C_WARNING) {
+    return;
+  }
+
+  attrlen = nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+  na = (struct nlattr *) (((char *) genl) + GENL_HDRLEN);
+
+  for (; netlink_attr_ok(na, attrlen); na = netlink_attr_next(na, &attrlen)) {
+    char *data;
+
+    data = ((char *) na) + NLA_HDRLEN;
+
+    switch (na->nla_type) {
+      case FSQUOTA_NL_A_QTYPE: {
+        uint32_t val;
+
+        memcpy(&val, data, sizeof(val));
+        qtype = (int) val;
+        break;
+      }
+
+      case FSQUOTA_NL_A_EXCESS_ID:
+        memcpy(&id, data, sizeof(id));
+        break;
+
+      case FSQUOTA_NL_A_WARNING:
+        memcpy(&warning, data, sizeof(warning));
+        break;
+
+      case FSQUOTA_NL_A_DEV_MAJOR:
+        memcpy(&major, data, sizeof(major));
+        break;
+
+      case FSQUOTA_NL_A_DEV_MINOR:
+        memcpy(&minor, data, sizeof(minor));
+        break;
+    }
+  }
+
+  switch (qtype) {
+    case FSQUOTA_NL_QTYPE_USER:
+      type = FSQUOTA_TYPE_USER;
+      break;
+
+    case FSQUOTA_NL_QTYPE_GROUP:
+      type = FSQUOTA_TYPE_GROUP;
+      break;
+
+    case FSQUOTA_NL_QTYPE_PROJECT:
+      type = FSQUOTA_TYPE_PROJECT;
+      break;
+
+    default:
+      return;
+  }
+
+  pr_trace_msg(trace_channel, 9,
+    "received quota event %lu for %s ID %lu on device %lu:%lu",
+    (unsigned long) warning, type == FSQUOTA_TYPE_USER ? "user" :
+      type == FSQUOTA_TYPE_GROUP ? "group" : "project",
+    (unsigned long) id, (unsigned long) major, (unsigned long) minor);
+
+  /* Flush requests name no filesystem, so the sessions discard the ID's
+   * values on every filesystem; events are rare enough for that not to
+   * matter.
+   */
+  if (fsquota_shm_request_flush(type, (unsigned long) id) < 0) {
+    pr_trace_msg(trace_channel, 3,
+      "unable to request flush for %s ID %lu: %s",
+      type == FSQUOTA_TYPE_USER ? "user" :
+        type == FSQUOTA_TYPE_GROUP ? "group" : "project",
+      (unsigned long) id, strerror(errno));
+  }
+}
+
+int fsquota_netlink_handle(void) {
+  char buf[8192];
+  ssize_t len;
+  int count = 0;
+
+  if (netlink_fd < 0) {
+    return 0;
+  }
+
+  while ((len = recv(netlink_fd, buf, sizeof(buf), 0)) > 0) {
+    struct nlmsghdr *nlh;
+    int msglen;
+
+    msglen = (int) len;
+    for (nlh = (struct nlmsghdr *) buf; NLMSG_OK(nlh, msglen);
+         nlh = NLMSG_NEXT(nlh, msglen)) {
+      if (nlh->nlmsg_type != netlink_family_id) {
+        continue;
+      }
+
+      netlink_handle_event(nlh);
+      count++;
+    }
+  }
+
+  if (len < 0 &&
+      errno == ENOBUFS) {
+    /* Events were dropped; there is no telling which entries they were
+     * for.
+     */
+    pr_trace_msg(trace_channel, 5, "%s",
+      "kernel quota events lost, requesting flush of all cached values");
+    (void) fsquota_shm_request_flush(0, 0);
+  }
+
+  return count;
+}
+
+#else
+
+int fsquota_netlink_open(void) {
+  errno = ENOSYS;
+  return -1;
+}
+
+int fsquota_netlink_close(void) {
+  return 0;
+}
+
+int fsquota_netlink_handle(void) {
+  return 0;
+}
+#endif /* LINUX and HAVE_LINUX_GENETLINK_H */
@@ -0,0 +1,44 @@
+/*
+ * ProFTPD - mod_fsquota kernel quota event API
+ * Copyright (c) 2013-2021 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_fsquota.h"
+
+#ifndef MOD_FSQUOTA_NETLINK_H
+#define MOD_FSQUOTA_NETLINK_H
+
+/* Subscribes to the kernel's quota events (the "VFS_DQUOT" generic netlink
+ * family), which are sent when a user/group crosses a quota limit, in
+ * either direction.  Only the daemon subscribes, since the kernel sends
+ * every event to every subscriber.
+ */
+int fsquota_netlink_open(void);
+int fsquota_netlink_close(void);
+
+/* Reads any pending quota events, without blocking, and asks the sessions,
+ * via the shared flush requests, to discard their cached values of the
+ * affected IDs.  Returns the number of events read.
+ */
+int fsquota_netlink_handle(void);
+
+#endif /* MOD_FSQUOTA_NETLINK_H */
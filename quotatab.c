@@ -0,0 +1,304 @@
+/*
+ * ProFTPD - mod_fsquota mod_quotatab backend
+ * Copyright (c) 2013-2021 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_fsquota.h"
+#include "cache.h"
+#include "quotatab.h"
+
+#ifdef FSQUOTA_USE_QUOTATAB
+# include "../mod_quotatab.h"
+
+/* The "fsquota" backend serves both limits and tallies from the kernel's
+ * own quota accounting, via the cache:
+ *
+ *  QuotaLimitTable fsquota:[/path]
+ *  QuotaTallyTable fsquota:[/path]
+ *
+ * If no path is given, the filesystem of the current directory is used.
+ * Since the kernel already tracks usage, there is no table to lock or
+ * rewrite; a tally write only marks the cached values stale.
+ */
+
+static const char *trace_channel = "fsquota.quotatab";
+
+static const char *fsquotatab_get_path(quota_table_t *tab) {
+  if (tab->tab_data != NULL) {
+    return tab->tab_data;
+  }
+
+  return pr_fs_getcwd();
+}
+
+static int fsquotatab_get_id(quota_table_t *tab, const char *name,
+    quota_type_t quota_type, int *type, unsigned long *id) {
+
+  switch (quota_type) {
+    case USER_QUOTA: {
+      uid_t uid;
+
+      if (session.user != NULL &&
+          strcmp(name, session.user) == 0) {
+        uid = session.uid;
+
+      } else {
+        uid = pr_auth_name2uid(tab->tab_pool, name);
+        if (uid == (uid_t) -1) {
+          errno = ENOENT;
+          return -1;
+        }
+      }
+
+      *type = FSQUOTA_TYPE_USER;
+      *id = (unsigned long) uid;
+      break;
+    }
+
+    case GROUP_QUOTA: {
+      gid_t gid;
+
+      if (session.group != NULL &&
+          strcmp(name, session.group) == 0) {
+        gid = session.gid;
+
+      } else {
+        gid = pr_auth_name2gid(tab->tab_pool, name);
+        if (gid == (gid_t) -1) {
+          errno = ENOENT;
+          return -1;
+        }
+      }
+
+      *type = FSQUOTA_TYPE_GROUP;
+      *id = (unsigned long) gid;
+      break;
+    }
+
+    default:
+      /* The kernel knows nothing of class or "all" quotas. */
+      errno = ENOENT;
+      return -1;
+  }
+
+  return 0;
+}
+
+static int fsquotatab_close(quota_table_t *tab) {
+  destroy_pool(tab->tab_pool);
+  return 0;
+}
+
+static int fsquotatab_create(quota_table_t *tab, void *ptr) {
+  /* Nothing to create; the kernel has a record for every ID. */
+  return 0;
+}
+
+static unsigned char fsquotatab_lookup(quota_table_t *tab, void *ptr,
+    const char *name, quota_type_t quota_type) {
+  int res, type;
+  unsigned long id;
+  uint64_t kb_total = 0, kb_used = 0, file_total = 0, file_used = 0;
+
+  if (name == NULL) {
+    return FALSE;
+  }
+
+  if (fsquotatab_get_id(tab, name, quota_type, &type, &id) < 0) {
+    return FALSE;
+  }
+
+  res = fsquota_cache_get(fsquotatab_get_path(tab), type, id, &kb_total,
+    &kb_used, &file_total, &file_used);
+  if (res < 0) {
+    int xerrno = errno;
+
+    pr_trace_msg(trace_channel, 5,
+      "error looking up quota for '%s': %s", name, strerror(xerrno));
+    quotatab_log("error looking up filesystem quota for '%s': %s", name,
+      strerror(xerrno));
+    return FALSE;
+  }
+
+  if (tab->tab_type == TYPE_LIMIT) {
+    quota_limit_t *limit = ptr;
+
+    if (kb_total == 0 &&
+        file_total == 0) {
+      pr_trace_msg(trace_channel, 9,
+        "no filesystem quota limits configured for '%s'", name);
+      return FALSE;
+    }
+
+    memset(limit, 0, sizeof(quota_limit_t));
+    sstrncpy(limit->name, name, sizeof(limit->name));
+    limit->quota_type = quota_type;
+    limit->quota_per_session = FALSE;
+
+    /* The kernel enforces the hard limit itself; let mod_quotatab handle
+     * the soft limit, so that uploads in progress are allowed to complete.
+     */
+    limit->quota_limit_type = SOFT_LIMIT;
+    limit->bytes_in_avail = (double) kb_total * 1024.0;
+    limit->files_in_avail = (unsigned int) file_total;
+
+  } else {
+    quota_tally_t *tally = ptr;
+
+    memset(tally, 0, sizeof(quota_tally_t));
+    sstrncpy(tally->name, name, sizeof(tally->name));
+    tally->quota_type = quota_type;
+    tally->bytes_in_used = (double) kb_used * 1024.0;
+    tally->files_in_used = (unsigned int) file_used;
+  }
+
+  return TRUE;
+}
+
+static int fsquotatab_read(quota_table_t *tab, void *ptr) {
+  quota_tally_t *tally = ptr;
+  int res, type;
+  unsigned long id;
+  uint64_t kb_used = 0, file_used = 0;
+
+  if (fsquotatab_get_id(tab, tally->name, tally->quota_type, &type, &id) < 0) {
+    return -1;
+  }
+
+  res = fsquota_cache_get(fsquotatab_get_path(tab), type, id, NULL, &kb_used,
+    NULL, &file_used);
+  if (res < 0) {
+    return -1;
+  }
+
+  tally->bytes_in_used = (double) kb_used * 1024.0;
+  tally->files_in_used = (unsigned int) file_used;
+  return 0;
+}
+
+static unsigned char fsquotatab_verify(quota_table_t *tab) {
+  return TRUE;
+}
+
+static int fsquotatab_write(quota_table_t *tab, void *ptr) {
+  quota_tally_t *tally = ptr;
+  int type;
+  unsigned long id;
+
+  if (fsquotatab_get_id(tab, tally->name, tally->quota_type, &type, &id) < 0) {
+    return 0;
+  }
+
+  /* The kernel has already accounted for the transfer.  mod_quotatab's
+   * tally is the usage it last read plus the transfer, which may already
+   * include it, so the tally itself is not kept; the next read queries the
+   * kernel instead.
+   */
+  if (fsquota_cache_expire(fsquotatab_get_path(tab), type, id) < 0 &&
+      errno != ENOENT) {
+    pr_trace_msg(trace_channel, 9,
+      "unable to expire cached usage for '%s': %s", tally->name,
+      strerror(errno));
+  }
+
+  return 0;
+}
+
+static int fsquotatab_rlock(quota_table_t *tab) {
+  return 0;
+}
+
+static int fsquotatab_unlock(quota_table_t *tab) {
+  return 0;
+}
+
+static int fsquotatab_wlock(quota_table_t *tab) {
+  return 0;
+}
+
+static quota_table_t *fsquotatab_open(pool *parent_pool,
+    quota_tabtype_t tab_type, const char *srcinfo) {
+  quota_table_t *tab;
+  pool *tab_pool;
+
+  tab_pool = make_sub_pool(parent_pool);
+  pr_pool_tag(tab_pool, MOD_FSQUOTA_VERSION ": quotatab table pool");
+
+  tab = pcalloc(tab_pool, sizeof(quota_table_t));
+  tab->tab_pool = tab_pool;
+  tab->tab_type = tab_type;
+
+  if (srcinfo != NULL &&
+      *srcinfo == '/') {
+    tab->tab_data = pstrdup(tab_pool, srcinfo);
+  }
+
+  tab->tab_close = fsquotatab_close;
+  tab->tab_create = fsquotatab_create;
+  tab->tab_lookup = fsquotatab_lookup;
+  tab->tab_read = fsquotatab_read;
+  tab->tab_verify = fsquotatab_verify;
+  tab->tab_write = fsquotatab_write;
+
+  tab->tab_rlock = fsquotatab_rlock;
+  tab->tab_unlock = fsquotatab_unlock;
+  tab->tab_wlock = fsquotatab_wlock;
+
+  /* There is no file to lock. */
+  tab->tab_lockfd = -1;
+
+  return tab;
+}
+
+int fsquota_quotatab_init(void) {
+  if (quotatab_register_backend("fsquota", fsquotatab_open,
+      QUOTATAB_LIMIT_SRC|QUOTATAB_TALLY_SRC) < 0) {
+    int xerrno = errno;
+
+    pr_log_pri(PR_LOG_NOTICE, MOD_FSQUOTA_VERSION
+      ": notice: error registering backend for mod_quotatab: %s",
+      strerror(xerrno));
+
+    errno = xerrno;
+    return -1;
+  }
+
+  return 0;
+}
+
+int fsquota_quotatab_free(void) {
+  return quotatab_unregister_backend("fsquota",
+    QUOTATAB_LIMIT_SRC|QUOTATAB_TALLY_SRC);
+}
+
+#else
+
+int fsquota_quotatab_init(void) {
+  errno = ENOSYS;
+  return -1;
+}
+
+int fsquota_quotatab_free(void) {
+  errno = ENOSYS;
+  return -1;
+}
+#endif /* FSQUOTA_USE_QUOTATAB */
@@ -0,0 +1,595 @@
+/*
+ * ProFTPD - mod_fsquota shared memory
+ * Copyright (c) 2013-2021 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_fsquota.h"
+#include "shm.h"
+
+#include <sys/mman.h>
+
+/* State shared by the daemon and its sessions, in an anonymous shared
+ * mapping created by the daemon and inherited across fork(2).  Counters
+ * are updated atomically where the compiler allows; flush requests have a
+ * single writer, the daemon (via ftpdctl), so the request is written before
+ * its generation is published.  Each session slot is written only by the
+ * session which claimed it; readers may see a slot mid-update, which is good
+ * enough for monitoring.  Trends are written by whichever session looked up
+ * the values, so writers take a per-trend lock, skipping the sample if it is
+ * held; readers do not.
+ */
+
+struct fsquota_shm_flush {
+  unsigned long gen;
+  int type;
+  unsigned long id;
+};
+
+struct fsquota_shm {
+  unsigned long hits;
+  unsigned long queries;
+  unsigned long throttled;
+
+  unsigned long flush_gen;
+  struct fsquota_shm_flush flushes[FSQUOTA_SHM_NFLUSHES];
+
+  struct fsquota_shm_session sessions[FSQUOTA_SHM_NSESSIONS];
+
+  struct fsquota_shm_trend_slot {
+    int lock;
+    struct fsquota_shm_trend trend;
+  } trends[FSQUOTA_SHM_NTRENDS];
+};
+
+/* Number of slots probed for a trend, starting at its hash. */
+#define FSQUOTA_SHM_TREND_PROBES	8
+
+static struct fsquota_shm *shm = NULL;
+
+/* The slot claimed by this session, if any. */
+static struct fsquota_shm_session *shm_session = NULL;
+
+#if defined(__GNUC__)
+# define FSQUOTA_SHM_INCR(v)	((void) __sync_fetch_and_add(&(v), 1))
+# define FSQUOTA_SHM_SYNC()	__sync_synchronize()
+# define FSQUOTA_SHM_CAS(v, o, n)	__sync_bool_compare_and_swap(&(v), (o), (n))
+#else
+# define FSQUOTA_SHM_INCR(v)	((v)++)
+# define FSQUOTA_SHM_SYNC()
+# define FSQUOTA_SHM_CAS(v, o, n)	((v) == (o) ? ((v) = (n), TRUE) : FALSE)
+#endif
+
+int fsquota_shm_init(void) {
+  void *ptr;
+
+  /* Created once; the counters survive restarts. */
+  if (shm != NULL) {
+    return 0;
+  }
+
+  ptr = mmap(NULL, sizeof(struct fsquota_shm), PROT_READ|PROT_WRITE,
+    MAP_SHARED|MAP_ANON, -1, 0);
+  if (ptr == MAP_FAILED) {
+    int xerrno = errno;
+
+    pr_log_pri(PR_LOG_NOTICE, MOD_FSQUOTA_VERSION
+      ": unable to allocate shared memory: %s", strerror(xerrno));
+
+    errno = xerrno;
+    return -1;
+  }
+
+  memset(ptr, 0, sizeof(struct fsquota_shm));
+  shm = ptr;
+  return 0;
+}
+
+int fsquota_shm_free(void) {
+  if (shm != NULL) {
+    (void) munmap(shm, sizeof(struct fsquota_shm));
+    shm = NULL;
+  }
+
+  return 0;
+}
+
+int fsquota_shm_incr_stat(int stat) {
+  if (shm == NULL) {
+    errno = EPERM;
+    return -1;
+  }
+
+  switch (stat) {
+    case FSQUOTA_SHM_STAT_HITS:
+      FSQUOTA_SHM_INCR(shm->hits);
+      break;
+
+    case FSQUOTA_SHM_STAT_QUERIES:
+      FSQUOTA_SHM_INCR(shm->queries);
+      break;
+
+    case FSQUOTA_SHM_STAT_THROTTLED:
+      FSQUOTA_SHM_INCR(shm->throttled);
+      break;
+
+    default:
+      errno = EINVAL;
+      return -1;
+  }
+
+  return 0;
+}
+
+int fsquota_shm_get_stats(unsigned long *hits, unsigned long *queries,
+    unsigned long *throttled) {
+  if (shm == NULL) {
+    errno = EPERM;
+    return -1;
+  }
+
+  if (hits != NULL) {
+    *hits = shm->hits;
+  }
+
+  if (queries != NULL) {
+    *queries = shm->queries;
+  }
+
+  if (throttled != NULL) {
+    *throttled = shm->throttled;
+  }
+
+  return 0;
+}
+
+int fsquota_shm_request_flush(int type, unsigned long id) {
+  struct fsquota_shm_flush *flush;
+  unsigned long gen;
+
+  if (shm == NULL) {
+    errno = EPERM;
+    return -1;
+  }
+
+  gen = shm->flush_gen + 1;
+
+  flush = &(shm->flushes[gen % FSQUOTA_SHM_NFLUSHES]);
+  flush->type = type;
+  flush->id = id;
+  flush->gen = gen;
+
+  FSQUOTA_SHM_SYNC();
+  shm->flush_gen = gen;
+
+  return 0;
+}
+
+unsigned long fsquota_shm_get_flush_gen(void) {
+  if (shm == NULL) {
+    return 0;
+  }
+
+  return shm->flush_gen;
+}
+
+int fsquota_shm_get_flush(unsigned long gen, int *type, unsigned long *id) {
+  struct fsquota_shm_flush *flush;
+
+  if (shm == NULL) {
+    errno = EPERM;
+    return -1;
+  }
+
+  flush = &(shm->flushes[gen % FSQUOTA_SHM_NFLUSHES]);
+  if (flush->gen != gen) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  *type = flush->type;
+  *id = flush->id;
+  return 0;
+}
+
+/* Returns TRUE if the session with the given PID died without releasing its
+ * slot, e.g. when killed, so that the slot can be claimed again.
+ */
+static int shm_session_is_dead(pid_t pid) {
+  return (pid != 0 &&
+    kill(pid, 0) < 0 &&
+    errno == ESRCH);
+}
+
+int fsquota_shm_session_add(uid_t uid) {
+  register unsigned int i;
+  pid_t pid;
+
+  if (shm == NULL) {
+    errno = EPERM;
+    return -1;
+  }
+
+  if (shm_session != NULL) {
+    shm_session->uid = uid;
+    return 0;
+  }
+
+  pid = getpid();
+
+  for (i = 0; i < FSQUOTA_SHM_NSESSIONS; i++) {
+    struct fsquota_shm_session *slot;
+    pid_t slot_pid;
+
+    slot = &(shm->sessions[i]);
+    slot_pid = slot->pid;
+
+    /* Slots left by dead sessions are reclaimed here too, so that they do
+     * not fill up the table between ftpdctl listings.
+     */
+    if (slot_pid != 0 &&
+        shm_session_is_dead(slot_pid) == FALSE) {
+      continue;
+    }
+
+    if (FSQUOTA_SHM_CAS(slot->pid, slot_pid, pid)) {
+      slot->uid = uid;
+      slot->updated = 0;
+      slot->kb_total = slot->kb_used = 0;
+      slot->file_total = slot->file_used = 0;
+
+      shm_session = slot;
+      return 0;
+    }
+  }
+
+  errno = ENOSPC;
+  return -1;
+}
+
+int fsquota_shm_session_remove(void) {
+  if (shm_session != NULL) {
+    shm_session->updated = 0;
+    FSQUOTA_SHM_SYNC();
+    shm_session->pid = 0;
+    shm_session = NULL;
+  }
+
+  return 0;
+}
+
+int fsquota_shm_session_update(uint64_t kb_total, uint64_t kb_used,
+    uint64_t file_total, uint64_t file_used) {
+  if (shm_session == NULL) {
+    return 0;
+  }
+
+  shm_session->kb_total = kb_total;
+  shm_session->kb_used = kb_used;
+  shm_session->file_total = file_total;
+  shm_session->file_used = file_used;
+  time(&(shm_session->updated));
+
+  return 0;
+}
+
+array_header *fsquota_shm_get_sessions(pool *p) {
+  register unsigned int i;
+  array_header *sessions;
+
+  if (shm == NULL) {
+    errno = EPERM;
+    return NULL;
+  }
+
+  sessions = make_array(p, 0, sizeof(struct fsquota_shm_session));
+
+  for (i = 0; i < FSQUOTA_SHM_NSESSIONS; i++) {
+    struct fsquota_shm_session *slot;
+    pid_t pid;
+
+    slot = &(shm->sessions[i]);
+    pid = slot->pid;
+    if (pid == 0) {
+      continue;
+    }
+
+    /* Sessions which died without releasing their slots. */
+    if (shm_session_is_dead(pid)) {
+      (void) FSQUOTA_SHM_CAS(slot->pid, pid, 0);
+      continue;
+    }
+
+    if (slot->updated == 0) {
+      continue;
+    }
+
+    *((struct fsquota_shm_session *) push_array(sessions)) = *slot;
+  }
+
+  return sessions;
+}
+
+static unsigned int shm_trend_hash(dev_t dev, int type, unsigned long id) {
+  unsigned long h;
+
+  h = ((unsigned long) dev * 31) + (unsigned long) type;
+  h = (h * 31) + id;
+  h *= 2654435761UL;
+
+  return (unsigned int) (h % FSQUOTA_SHM_NTRENDS);
+}
+
+static int shm_trend_matches(const struct fsquota_shm_trend *trend,
+    dev_t dev, int type, unsigned long id) {
+  return (trend->nsamples > 0 &&
+    trend->dev == dev &&
+    trend->type == type &&
+    trend->id == id);
+}
+
+static void shm_trend_sample(struct fsquota_shm_trend *trend, time_t now,
+    uint64_t kb_used, uint64_t file_used) {
+  struct fsquota_shm_sample *sample;
+
+  /* The first sample starts the window, and stays.  After it, the latest
+   * sample only stands for the current usage: it is replaced by newer ones
+   * until it is FSQUOTA_SHM_SAMPLE_INTERVAL after the sample before it, and
+   * only then is another sample added.  Replacing the latest sample against
+   * its own timestamp instead would let frequent lookups keep it from ever
+   * aging.
+   */
+  if (trend->nsamples >= 2 &&
+      (now - trend->samples[trend->nsamples-2].ts) <
+        FSQUOTA_SHM_SAMPLE_INTERVAL) {
+    sample = &(trend->samples[trend->nsamples-1]);
+
+  } else {
+    if (trend->nsamples == FSQUOTA_SHM_NSAMPLES) {
+      memmove(trend->samples, trend->samples + 1,
+        sizeof(struct fsquota_shm_sample) * (FSQUOTA_SHM_NSAMPLES - 1));
+      trend->nsamples--;
+    }
+
+    sample = &(trend->samples[trend->nsamples++]);
+  }
+
+  sample->ts = now;
+  sample->kb_used = kb_used;
+  sample->file_used = file_used;
+}
+
+int fsquota_shm_trend_add(dev_t dev, int type, unsigned long id,
+    uint64_t kb_total, uint64_t kb_used, uint64_t file_total,
+    uint64_t file_used) {
+  register unsigned int i;
+  struct fsquota_shm_trend_slot *slot = NULL, *oldest = NULL;
+  unsigned int h;
+  time_t now;
+
+  if (shm == NULL) {
+    errno = EPERM;
+    return -1;
+  }
+
+  h = shm_trend_hash(dev, type, id);
+  for (i = 0; i < FSQUOTA_SHM_TREND_PROBES; i++) {
+    struct fsquota_shm_trend_slot *probe;
+    struct fsquota_shm_trend *trend;
+
+    probe = &(shm->trends[(h + i) % FSQUOTA_SHM_NTRENDS]);
+    trend = &(probe->trend);
+
+    if (shm_trend_matches(trend, dev, type, id)) {
+      slot = probe;
+      break;
+    }
+
+    if (trend->nsamples == 0) {
+      if (oldest == NULL ||
+          oldest->trend.nsamples > 0) {
+        oldest = probe;
+      }
+
+      continue;
+    }
+
+    if (oldest == NULL ||
+        (oldest->trend.nsamples > 0 &&
+         trend->samples[trend->nsamples-1].ts <
+           oldest->trend.samples[oldest->trend.nsamples-1].ts)) {
+      oldest = probe;
+    }
+  }
+
+  if (slot == NULL) {
+    slot = oldest;
+  }
+
+  if (!FSQUOTA_SHM_CAS(slot->lock, 0, 1)) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  time(&now);
+
+  if (!shm_trend_matches(&(slot->trend), dev, type, id)) {
+    /* A new trend, or one replacing the least recently sampled trend. */
+    slot->trend.nsamples = 0;
+    slot->trend.dev = dev;
+    slot->trend.type = type;
+    slot->trend.id = id;
+  }
+
+  slot->trend.kb_total = kb_total;
+  slot->trend.file_total = file_total;
+  shm_trend_sample(&(slot->trend), now, kb_used, file_used);
+
+  FSQUOTA_SHM_SYNC();
+  slot->lock = 0;
+
+  return 0;
+}
+
+int fsquota_shm_trend_get(dev_t dev, int type, unsigned long id,
+    struct fsquota_shm_trend *trend) {
+  register unsigned int i;
+  unsigned int h;
+
+  if (shm == NULL) {
+    errno = EPERM;
+    return -1;
+  }
+
+  h = shm_trend_hash(dev, type, id);
+  for (i = 0; i < FSQUOTA_SHM_TREND_PROBES; i++) {
+    struct fsquota_shm_trend_slot *probe;
+
+    probe = &(shm->trends[(h + i) % FSQUOTA_SHM_NTRENDS]);
+    if (shm_trend_matches(&(probe->trend), dev, type, id)) {
+      *trend = probe->trend;
+      return 0;
+    }
+  }
+
+  errno = ENOENT;
+  return -1;
+}
+
+array_header *fsquota_shm_get_trends(pool *p) {
+  register unsigned int i;
+  array_header *trends;
+
+  if (shm == NULL) {
+    errno = EPERM;
+    return NULL;
+  }
+
+  trends = make_array(p, 0, sizeof(struct fsquota_shm_trend));
+
+  for (i = 0; i < FSQUOTA_SHM_NTRENDS; i++) {
+    struct fsquota_shm_trend_slot *slot;
+
+    slot = &(shm->trends[i]);
+    if (slot->trend.nsamples == 0) {
+      continue;
+    }
+
+    *((struct fsquota_shm_trend *) push_array(trends)) = slot->trend;
+  }
+
+  return trends;
+}
+
+int fsquota_shm_trend_rate(const struct fsquota_shm_trend *trend,
+    double *kb_rate, double *file_rate) {
+  const struct fsquota_shm_sample *first, *last;
+  double hours;
+
+  if (trend == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (trend->nsamples < 2) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  /* Over a shorter span, e.g. a login followed by an upload, the rate would
+   * be off by orders of magnitude.
+   */
+  first = &(trend->samples[0]);
+  last = &(trend->samples[trend->nsamples-1]);
+  if ((last->ts - first->ts) < FSQUOTA_SHM_SAMPLE_INTERVAL) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  hours = (double) (last->ts - first->ts) / 3600.0;
+
+  if (kb_rate != NULL) {
+    *kb_rate = ((double) last->kb_used - (double) first->kb_used) / hours;
+  }
+
+  if (file_rate != NULL) {
+    *file_rate = ((double) last->file_used - (double) first->file_used) /
+      hours;
+  }
+
+  return 0;
+}
+
+/* Returns the number of seconds until the given usage reaches the given
+ * limit, at the given rate per hour; or -1 if it never will.
+ */
+static long shm_trend_secs_left(uint64_t total, uint64_t used, double rate) {
+  if (total == 0 ||
+      rate <= 0.0) {
+    return -1;
+  }
+
+  if (used >= total) {
+    return 0;
+  }
+
+  return (long) (((double) (total - used) / rate) * 3600.0);
+}
+
+int fsquota_shm_trend_eta(const struct fsquota_shm_trend *trend, time_t now,
+    long *secs) {
+  const struct fsquota_shm_sample *last;
+  double kb_rate = 0.0, file_rate = 0.0;
+  long kb_secs, file_secs, eta;
+
+  if (trend == NULL ||
+      secs == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (fsquota_shm_trend_rate(trend, &kb_rate, &file_rate) < 0) {
+    return -1;
+  }
+
+  last = &(trend->samples[trend->nsamples-1]);
+  kb_secs = shm_trend_secs_left(trend->kb_total, last->kb_used, kb_rate);
+  file_secs = shm_trend_secs_left(trend->file_total, last->file_used,
+    file_rate);
+
+  eta = kb_secs;
+  if (file_secs >= 0 &&
+      (eta < 0 || file_secs < eta)) {
+    eta = file_secs;
+  }
+
+  /* The estimate is as of the latest sample. */
+  if (eta > 0 &&
+      now > last->ts) {
+    eta -= (long) (now - last->ts);
+    if (eta < 0) {
+      eta = 0;
+    }
+  }
+
+  *secs = eta;
+  return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ * ProFTPD - mod_fsquota shared memory API
+ * Copyright (c) 2013-2021 TJ Saunders
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Suite 500, Boston, MA 02110-1335, USA.
+ *
+ * As a special exemption, TJ Saunders and other respective copyright holders
+ * give permission to link this program with OpenSSL, and distribute the
+ * resulting executable, without including the source code for OpenSSL in the
+ * source distribution.
+ */
+
+#include "mod_fsquota.h"
+
+#ifndef MOD_FSQUOTA_SHM_H
+#define MOD_FSQUOTA_SHM_H
+
+/* Daemon-wide counters, summed across all sessions. */
+#define FSQUOTA_SHM_STAT_HITS		1
+#define FSQUOTA_SHM_STAT_QUERIES	2
+#define FSQUOTA_SHM_STAT_THROTTLED	3
+
+/* Number of flush requests remembered; sessions further behind than this
+ * discard their entire cache.
+ */
+#define FSQUOTA_SHM_NFLUSHES		32
+
+/* Number of sessions whose quota pressure can be published at once. */
+#define FSQUOTA_SHM_NSESSIONS		1024
+
+/* The last-known user quota values of a single session. */
+struct fsquota_shm_session {
+  pid_t pid;
+  uid_t uid;
+  time_t updated;
+  uint64_t kb_total, kb_used, file_total, file_used;
+};
+
+/* Number of (filesystem, type, ID) usage trends kept; when full, the trend
+ * least recently sampled is replaced.
+ */
+#define FSQUOTA_SHM_NTRENDS		512
+
+/* Number of usage samples kept per trend, and the minimum number of seconds
+ * between them; together, the window over which the rate of change is
+ * measured.
+ */
+#define FSQUOTA_SHM_NSAMPLES		12
+#define FSQUOTA_SHM_SAMPLE_INTERVAL	300
+
+struct fsquota_shm_sample {
+  time_t ts;
+  uint64_t kb_used, file_used;
+};
+
+/* The recent usage of a single type/ID on a single filesystem, oldest
+ * sample first.
+ */
+struct fsquota_shm_trend {
+  dev_t dev;
+  int type;
+  unsigned long id;
+  uint64_t kb_total, file_total;
+
+  unsigned int nsamples;
+  struct fsquota_shm_sample samples[FSQUOTA_SHM_NSAMPLES];
+};
+
+/* Creates the memory shared between the daemon and all of its sessions;
+ * called by the daemon, before any sessions are forked.
+ */
+int fsquota_shm_init(void);
+int fsquota_shm_free(void);
+
+int fsquota_shm_incr_stat(int stat);
+int fsquota_shm_get_stats(unsigned long *hits, unsigned long *queries,
+  unsigned long *throttled);
+
+/* Asks every session to discard its cached values for the given type/ID;
+ * a type of zero means all cached values.
+ */
+int fsquota_shm_request_flush(int type, unsigned long id);
+
+/* Returns the generation of the most recent flush request. */
+unsigned long fsquota_shm_get_flush_gen(void);
+
+/* Returns the flush request of the given generation.  Fails with ENOENT if
+ * it is no longer remembered.
+ */
+int fsquota_shm_get_flush(unsigned long gen, int *type, unsigned long *id);
+
+/* Claims a slot for publishing the calling session's quota values.  Fails
+ * with ENOSPC if all slots are taken.
+ */
+int fsquota_shm_session_add(uid_t uid);
+int fsquota_shm_session_remove(void);
+
+/* Publishes the calling session's latest user quota values; a no-op if the
+ * session has no slot.
+ */
+int fsquota_shm_session_update(uint64_t kb_total, uint64_t kb_used,
+  uint64_t file_total, uint64_t file_used);
+
+/* Returns a copy of the published values of all sessions, releasing the
+ * slots of sessions which are no longer running.
+ */
+array_header *fsquota_shm_get_sessions(pool *p);
+
+/* Records a usage sample for the given type/ID on the given device.  A
+ * sample taken sooner than FSQUOTA_SHM_SAMPLE_INTERVAL after the last sample
+ * but one replaces the latest sample, rather than being added.  Fails with
+ * EAGAIN if another session is recording a sample for the same slot.
+ */
+int fsquota_shm_trend_add(dev_t dev, int type, unsigned long id,
+  uint64_t kb_total, uint64_t kb_used, uint64_t file_total,
+  uint64_t file_used);
+
+/* Returns a copy of the trend for the given type/ID on the given device.
+ * Fails with ENOENT if there is none.
+ */
+int fsquota_shm_trend_get(dev_t dev, int type, unsigned long id,
+  struct fsquota_shm_trend *trend);
+
+/* Returns a copy of all of the trends. */
+array_header *fsquota_shm_get_trends(pool *p);
+
+/* Returns the rates of change, per hour, of the trend's usage.  Fails with
+ * EAGAIN until the samples span at least FSQUOTA_SHM_SAMPLE_INTERVAL.
+ */
+int fsquota_shm_trend_rate(const struct fsquota_shm_trend *trend,
+  double *kb_rate, double *file_rate);
+
+/* Returns the number of seconds from now until the trend's usage reaches
+ * either of its limits, at the current rates; or -1 if it never will.
+ * Fails with EAGAIN if the trend does not have enough samples yet.
+ */
+int fsquota_shm_trend_eta(const struct fsquota_shm_trend *trend, time_t now,
+  long *secs);
+
+#endif /* MOD_FSQUOTA_SHM_H */
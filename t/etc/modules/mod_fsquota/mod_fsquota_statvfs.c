@@ -0,0 +1,105 @@
+/*
+ * Loaded into proftpd, via mod_dso, by the mod_fsquota statvfs hook test, in
+ * place of a module such as mod_sftp: "SITE STATVFS [path]" looks up the
+ * "fsquota_statvfs" hook, calls it with the statvfs(2) values for the path
+ * (the current directory by default), and answers with the available blocks
+ * and files before and after it, as:
+ *
+ *  200 bavail <before> <after> favail <before> <after> frsize <frsize>
+ *
+ * Built from the top of the proftpd source tree:
+ *
+ *  cc -shared -fPIC -DPR_SHARED_MODULE -I. -Iinclude \
+ *    -o mod_fsquota_statvfs.so mod_fsquota_statvfs.c
+ */
+
+#include "conf.h"
+#include <sys/statvfs.h>
+
+#define MOD_FSQUOTA_STATVFS_VERSION	"mod_fsquota_statvfs/0.1"
+
+module fsquota_statvfs_module;
+
+MODRET fsquota_statvfs_site(cmd_rec *cmd) {
+  const char *path = ".";
+  struct statvfs fs;
+  unsigned long bavail, favail, frsize;
+  cmdtable *tab;
+  cmd_rec *hook_cmd;
+  modret_t *mr;
+
+  if (cmd->argc < 2 ||
+      strcasecmp(cmd->argv[1], "STATVFS") != 0) {
+    return PR_DECLINED(cmd);
+  }
+
+  if (cmd->argc > 2) {
+    path = cmd->argv[2];
+  }
+
+  if (statvfs(path, &fs) < 0) {
+    int xerrno = errno;
+
+    pr_response_add_err(R_550, "%s: %s", path, strerror(xerrno));
+    return PR_ERROR(cmd);
+  }
+
+  bavail = (unsigned long) fs.f_bavail;
+  favail = (unsigned long) fs.f_favail;
+  frsize = (unsigned long) (fs.f_frsize ? fs.f_frsize : fs.f_bsize);
+
+  tab = pr_stash_get_symbol2(PR_SYM_HOOK, "fsquota_statvfs", NULL, NULL,
+    NULL);
+  if (tab == NULL) {
+    pr_response_add_err(R_500, "fsquota_statvfs hook not found");
+    return PR_ERROR(cmd);
+  }
+
+  hook_cmd = pr_cmd_alloc(cmd->tmp_pool, 2, path, &fs);
+  mr = pr_module_call(tab->m, tab->handler, hook_cmd);
+  if (MODRET_ISDECLINED(mr)) {
+    pr_response_add_err(R_550, "fsquota_statvfs hook declined");
+    return PR_ERROR(cmd);
+  }
+
+  pr_response_add(R_200, "bavail %lu %lu favail %lu %lu frsize %lu", bavail,
+    (unsigned long) fs.f_bavail, favail, (unsigned long) fs.f_favail, frsize);
+  return PR_HANDLED(cmd);
+}
+
+/* Module API tables
+ */
+
+static cmdtable fsquota_statvfs_cmdtab[] = {
+  { CMD,	C_SITE,	G_NONE,	fsquota_statvfs_site,	FALSE,	FALSE,	CL_MISC },
+  { 0, NULL }
+};
+
+module fsquota_statvfs_module = {
+  /* Always NULL */
+  NULL, NULL,
+
+  /* Module API version */
+  0x20,
+
+  /* Module name */
+  "fsquota_statvfs",
+
+  /* Module configuration handler table */
+  NULL,
+
+  /* Module command handler table */
+  fsquota_statvfs_cmdtab,
+
+  /* Module authentication handler table */
+  NULL,
+
+  /* Module initialization */
+  NULL,
+
+  /* Session initialization */
+  NULL,
+
+  /* Module version */
+  MOD_FSQUOTA_STATVFS_VERSION
+};
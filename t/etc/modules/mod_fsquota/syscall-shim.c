@@ -0,0 +1,306 @@
+/*
+ * Preloaded into proftpd by the mod_fsquota syscall-budget tests: logs each
+ * stat(2), statfs(2), statvfs(2) and quotactl(2) call, as a "pid ppid call"
+ * line, to the file named by $FSQUOTA_SHIM_LOG, and answers quotactl(2) with
+ * canned values so that the tests do not need a filesystem with quotas.
+ * Quota queries are logged as "pid ppid quotactl getquota type id".  If
+ * $FSQUOTA_SHIM_LATENCY is set, each quotactl(2) call first sleeps for that
+ * many microseconds, to mimic a slow quota subsystem.  If
+ * $FSQUOTA_SHIM_BTRFS_SYSFS is set, every filesystem looks like btrfs, and
+ * that directory stands in for /sys/fs/btrfs.
+ *
+ *  cc -shared -fPIC -o syscall-shim.so syscall-shim.c -ldl
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/statvfs.h>
+#include <sys/quota.h>
+#include <sys/ioctl.h>
+#include <linux/btrfs.h>
+
+/* Canned quota: 1 MB of 10 MB, 10 of 100 files; the hard limits are 12 MB
+ * and 120 files.
+ */
+#define SHIM_KB_LIMIT		10240
+#define SHIM_KB_HARD_LIMIT	12288
+#define SHIM_BYTES_USED		(1024 * 1024)
+#define SHIM_FILES_LIMIT	100
+#define SHIM_FILES_HARD_LIMIT	120
+#define SHIM_FILES_USED		10
+
+#define SHIM_GRPQUOTA		1
+#define SHIM_PRJQUOTA		2
+
+/* Groups 600 to 699 use as many MB as their ID is past 600, so that tests
+ * can give a session groups with different usage.
+ */
+#define SHIM_GROUP_BASE		600
+
+#ifndef QFMT_VFS_V1
+# define QFMT_VFS_V1		4
+#endif
+
+/* As btrfs, every path is in subvolume 257 of the filesystem whose fsid
+ * bytes are 0 to 15, i.e. the qgroup values are read from
+ * "$FSQUOTA_SHIM_BTRFS_SYSFS/00010203-0405-0607-0809-0a0b0c0d0e0f/qgroups/0_257".
+ */
+#define SHIM_BTRFS_MAGIC	0x9123683E
+#define SHIM_BTRFS_SUBVOL	257
+
+static int shim_fd = -1;
+static useconds_t shim_latency = 0;
+static const char *shim_btrfs_sysfs = NULL;
+
+/* Opened before any chroot, and inherited by every session. */
+__attribute__((constructor))
+static void shim_init(void) {
+  const char *path, *latency;
+
+  shim_btrfs_sysfs = getenv("FSQUOTA_SHIM_BTRFS_SYSFS");
+
+  path = getenv("FSQUOTA_SHIM_LOG");
+  if (path != NULL) {
+    shim_fd = open(path, O_WRONLY|O_APPEND|O_CREAT, 0644);
+  }
+
+  latency = getenv("FSQUOTA_SHIM_LATENCY");
+  if (latency != NULL) {
+    shim_latency = (useconds_t) strtoul(latency, NULL, 10);
+  }
+}
+
+static void shim_log(const char *call) {
+  char buf[128];
+  int len, xerrno = errno;
+
+  if (shim_fd < 0) {
+    return;
+  }
+
+  len = snprintf(buf, sizeof(buf), "%lu %lu %s\n", (unsigned long) getpid(),
+    (unsigned long) getppid(), call);
+  if (write(shim_fd, buf, len) < 0) {
+    /* Nothing to be done. */
+  }
+
+  errno = xerrno;
+}
+
+#define SHIM_NEXT(name) \
+  static __typeof__(name) *next_##name = NULL; \
+  if (next_##name == NULL) \
+    next_##name = (__typeof__(name) *) dlsym(RTLD_NEXT, #name)
+
+int stat(const char *path, struct stat *st) {
+  SHIM_NEXT(stat);
+  shim_log("stat");
+  return next_stat(path, st);
+}
+
+int stat64(const char *path, struct stat64 *st) {
+  SHIM_NEXT(stat64);
+  shim_log("stat");
+  return next_stat64(path, st);
+}
+
+/* Older glibc versions route stat(2) through these. */
+int __xstat(int ver, const char *path, struct stat *st) {
+  static int (*next_xstat)(int, const char *, struct stat *) = NULL;
+
+  if (next_xstat == NULL) {
+    next_xstat = dlsym(RTLD_NEXT, "__xstat");
+  }
+
+  shim_log("stat");
+  return next_xstat(ver, path, st);
+}
+
+int __xstat64(int ver, const char *path, struct stat64 *st) {
+  static int (*next_xstat64)(int, const char *, struct stat64 *) = NULL;
+
+  if (next_xstat64 == NULL) {
+    next_xstat64 = dlsym(RTLD_NEXT, "__xstat64");
+  }
+
+  shim_log("stat");
+  return next_xstat64(ver, path, st);
+}
+
+int statfs(const char *path, struct statfs *st) {
+  int res;
+
+  SHIM_NEXT(statfs);
+  shim_log("statfs");
+
+  res = next_statfs(path, st);
+  if (res == 0 &&
+      shim_btrfs_sysfs != NULL) {
+    st->f_type = SHIM_BTRFS_MAGIC;
+  }
+
+  return res;
+}
+
+int statfs64(const char *path, struct statfs64 *st) {
+  int res;
+
+  SHIM_NEXT(statfs64);
+  shim_log("statfs");
+
+  res = next_statfs64(path, st);
+  if (res == 0 &&
+      shim_btrfs_sysfs != NULL) {
+    st->f_type = SHIM_BTRFS_MAGIC;
+  }
+
+  return res;
+}
+
+static const char *shim_btrfs_path(const char *path) {
+  if (shim_btrfs_sysfs != NULL &&
+      strcmp(path, "/sys/fs/btrfs") == 0) {
+    return shim_btrfs_sysfs;
+  }
+
+  return path;
+}
+
+int open(const char *path, int flags, ...) {
+  va_list ap;
+  mode_t mode;
+
+  SHIM_NEXT(open);
+
+  va_start(ap, flags);
+  mode = (mode_t) va_arg(ap, int);
+  va_end(ap);
+
+  return next_open(shim_btrfs_path(path), flags, mode);
+}
+
+int open64(const char *path, int flags, ...) {
+  va_list ap;
+  mode_t mode;
+
+  SHIM_NEXT(open64);
+
+  va_start(ap, flags);
+  mode = (mode_t) va_arg(ap, int);
+  va_end(ap);
+
+  return next_open64(shim_btrfs_path(path), flags, mode);
+}
+
+/* Answers the subvolume and filesystem lookups which find a path's qgroup. */
+int ioctl(int fd, unsigned long req, ...) {
+  va_list ap;
+  void *arg;
+
+  SHIM_NEXT(ioctl);
+
+  va_start(ap, req);
+  arg = va_arg(ap, void *);
+  va_end(ap);
+
+  if (shim_btrfs_sysfs != NULL) {
+    if (req == BTRFS_IOC_INO_LOOKUP) {
+      struct btrfs_ioctl_ino_lookup_args *lookup = arg;
+
+      lookup->treeid = SHIM_BTRFS_SUBVOL;
+      lookup->name[0] = '\0';
+      return 0;
+    }
+
+    if (req == BTRFS_IOC_FS_INFO) {
+      struct btrfs_ioctl_fs_info_args *info = arg;
+      unsigned int i;
+
+      memset(info, 0, sizeof(struct btrfs_ioctl_fs_info_args));
+      for (i = 0; i < sizeof(info->fsid); i++) {
+        info->fsid[i] = (unsigned char) i;
+      }
+
+      return 0;
+    }
+  }
+
+  return next_ioctl(fd, req, arg);
+}
+
+int statvfs(const char *path, struct statvfs *st) {
+  SHIM_NEXT(statvfs);
+  shim_log("statvfs");
+  return next_statvfs(path, st);
+}
+
+int statvfs64(const char *path, struct statvfs64 *st) {
+  SHIM_NEXT(statvfs64);
+  shim_log("statvfs");
+  return next_statvfs64(path, st);
+}
+
+int quotactl(int cmd, const char *special, int id, caddr_t addr) {
+  struct dqblk *dq;
+
+  if ((cmd >> SUBCMDSHIFT) == Q_GETQUOTA) {
+    char call[64];
+
+    snprintf(call, sizeof(call), "quotactl getquota %d %d", cmd & SUBCMDMASK,
+      id);
+    shim_log(call);
+
+  } else {
+    shim_log("quotactl");
+  }
+
+  if (shim_latency > 0) {
+    usleep(shim_latency);
+  }
+
+  /* Quotas of every type are on. */
+  if ((cmd >> SUBCMDSHIFT) == Q_GETFMT) {
+    *((unsigned int *) addr) = QFMT_VFS_V1;
+    return 0;
+  }
+
+  if ((cmd >> SUBCMDSHIFT) != Q_GETQUOTA) {
+    errno = ENOSYS;
+    return -1;
+  }
+
+  dq = (struct dqblk *) addr;
+  memset(dq, 0, sizeof(struct dqblk));
+  dq->dqb_bsoftlimit = SHIM_KB_LIMIT;
+  dq->dqb_bhardlimit = SHIM_KB_HARD_LIMIT;
+  dq->dqb_curspace = SHIM_BYTES_USED;
+  dq->dqb_isoftlimit = SHIM_FILES_LIMIT;
+  dq->dqb_ihardlimit = SHIM_FILES_HARD_LIMIT;
+  dq->dqb_curinodes = SHIM_FILES_USED;
+  dq->dqb_valid = QIF_ALL;
+
+  /* Project quotas report the project ID as the file count, so that tests
+   * can tell which project was queried.
+   */
+  if ((cmd & SUBCMDMASK) == SHIM_PRJQUOTA) {
+    dq->dqb_curinodes = id;
+  }
+
+  if ((cmd & SUBCMDMASK) == SHIM_GRPQUOTA &&
+      id >= SHIM_GROUP_BASE &&
+      id < SHIM_GROUP_BASE + 100) {
+    dq->dqb_curspace = (id - SHIM_GROUP_BASE) * 1024ULL * 1024ULL;
+  }
+
+  return 0;
+}
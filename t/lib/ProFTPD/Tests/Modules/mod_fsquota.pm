@@ -8,9 +8,11 @@ use File::Copy;
 use File::Path qw(mkpath);
 use File::Spec;
 use IO::Handle;
+use IO::Select;
+use IO::Socket::INET;
 
 use ProFTPD::TestSuite::FTP;
-use ProFTPD::TestSuite::Utils qw(:auth :config :running :test :testsuite);
+use ProFTPD::TestSuite::Utils qw(:auth :config :features :running :test :testsuite);
 
 $| = 1;
 
@@ -27,6 +29,121 @@ my $TESTS = {
     test_class => [qw(forking)],
   },
 
+  fsquota_avbl => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  fsquota_site_machine => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  fsquota_usage_index_enforce => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  fsquota_syscall_budget => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  fsquota_xfer_notes => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  fsquota_project_map => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  fsquota_upload_volumes => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  fsquota_allo_reserve => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  fsquota_warn => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  fsquota_warmup => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  fsquota_usage_trend => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  fsquota_site_facts => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  fsquota_memcache => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  fsquota_site_copy => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  fsquota_mount_table => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  fsquota_quotatab_tally => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  fsquota_limit_events => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  fsquota_ctrls_sessions => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  fsquota_query_rate => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  fsquota_netlink_events => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  fsquota_groups => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  fsquota_statvfs_hook => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
+  fsquota_btrfs_qgroups => {
+    order => ++$order,
+    test_class => [qw(forking)],
+  },
+
 };
 
 sub new {
@@ -37,6 +154,29 @@ sub list_tests {
 #  return testsuite_get_runnable_tests($TESTS);
   return qw(
     fsquota_off_displayconnect
+    fsquota_avbl
+    fsquota_site_machine
+    fsquota_usage_index_enforce
+    fsquota_syscall_budget
+    fsquota_xfer_notes
+    fsquota_project_map
+    fsquota_upload_volumes
+    fsquota_allo_reserve
+    fsquota_warn
+    fsquota_warmup
+    fsquota_usage_trend
+    fsquota_site_facts
+    fsquota_memcache
+    fsquota_site_copy
+    fsquota_mount_table
+    fsquota_quotatab_tally
+    fsquota_limit_events
+    fsquota_ctrls_sessions
+    fsquota_query_rate
+    fsquota_netlink_events
+    fsquota_groups
+    fsquota_statvfs_hook
+    fsquota_btrfs_qgroups
   );
 }
 
@@ -190,4 +330,3928 @@ print STDERR "msgs:\n", Dumper($resp_msgs), "\n";
   unlink($log_file);
 }
 
+sub fsquota_avbl {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+
+  my $config_file = "$tmpdir/fsquota.conf";
+  my $pid_file = File::Spec->rel2abs("$tmpdir/fsquota.pid");
+  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/fsquota.scoreboard");
+
+  my $log_file = test_get_logfile();
+
+  my $auth_user_file = File::Spec->rel2abs("$tmpdir/fsquota.passwd");
+  my $auth_group_file = File::Spec->rel2abs("$tmpdir/fsquota.group");
+
+  my $user = 'proftpd';
+  my $passwd = 'test';
+  my $group = 'ftpd';
+  my $home_dir = File::Spec->rel2abs($tmpdir);
+  my $uid = 500;
+  my $gid = 500;
+
+  # Make sure that, if we're running as root, that the home directory has
+  # permissions/privs set for the account we create
+  if ($< == 0) {
+    unless (chmod(0755, $home_dir)) {
+      die("Can't set perms on $home_dir to 0755: $!");
+    }
+
+    unless (chown($uid, $gid, $home_dir)) {
+      die("Can't set owner of $home_dir to $uid/$gid: $!");
+    }
+  }
+
+  auth_user_write($auth_user_file, $user, $passwd, $uid, $gid, $home_dir,
+    '/bin/bash');
+  auth_group_write($auth_group_file, $group, $gid, $user);
+
+  my $config = {
+    PidFile => $pid_file,
+    ScoreboardFile => $scoreboard_file,
+    SystemLog => $log_file,
+    TraceLog => $log_file,
+    Trace => 'DEFAULT:10 event:0 lock:0 scoreboard:0 signal:0 fsquota:20',
+
+    AuthUserFile => $auth_user_file,
+    AuthGroupFile => $auth_group_file,
+    SocketBindTight => 'on',
+
+    IfModules => {
+      'mod_fsquota.c' => {
+        FSQuotaEngine => 'on',
+      },
+
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($config_file, $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($user, $passwd);
+
+      my ($resp_code, $resp_msg) = $client->quote('AVBL');
+
+      my $expected;
+
+      $expected = 213;
+      $self->assert($expected == $resp_code,
+        test_msg("Expected response code $expected, got $resp_code"));
+
+      $expected = '^\d+$';
+      $self->assert(qr/$expected/, $resp_msg,
+        test_msg("Expected response message '$expected', got '$resp_msg'"));
+
+      # AVBL on a file is an error
+      my $test_file = File::Spec->rel2abs("$tmpdir/test.txt");
+      if (open(my $fh, "> $test_file")) {
+        close($fh);
+
+      } else {
+        die("Can't open $test_file: $!");
+      }
+
+      eval { $client->quote('AVBL', 'test.txt') };
+      unless ($@) {
+        die("AVBL on file succeeded unexpectedly");
+      }
+
+      $resp_code = $client->response_code();
+      $expected = 550;
+      $self->assert($expected == $resp_code,
+        test_msg("Expected response code $expected, got $resp_code"));
+
+      $client->quit();
+    };
+
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    eval { server_wait($config_file, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($pid_file);
+
+  $self->assert_child_ok($pid);
+
+  if ($ex) {
+    test_append_logfile($log_file, $ex);
+    unlink($log_file);
+
+    die($ex);
+  }
+
+  unlink($log_file);
+}
+
+sub fsquota_site_machine {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+
+  my $config_file = "$tmpdir/fsquota.conf";
+  my $pid_file = File::Spec->rel2abs("$tmpdir/fsquota.pid");
+  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/fsquota.scoreboard");
+
+  my $log_file = test_get_logfile();
+
+  my $auth_user_file = File::Spec->rel2abs("$tmpdir/fsquota.passwd");
+  my $auth_group_file = File::Spec->rel2abs("$tmpdir/fsquota.group");
+
+  my $user = 'proftpd';
+  my $passwd = 'test';
+  my $group = 'ftpd';
+  my $home_dir = File::Spec->rel2abs($tmpdir);
+  my $uid = 500;
+  my $gid = 500;
+
+  # Make sure that, if we're running as root, that the home directory has
+  # permissions/privs set for the account we create
+  if ($< == 0) {
+    unless (chmod(0755, $home_dir)) {
+      die("Can't set perms on $home_dir to 0755: $!");
+    }
+
+    unless (chown($uid, $gid, $home_dir)) {
+      die("Can't set owner of $home_dir to $uid/$gid: $!");
+    }
+  }
+
+  auth_user_write($auth_user_file, $user, $passwd, $uid, $gid, $home_dir,
+    '/bin/bash');
+  auth_group_write($auth_group_file, $group, $gid, $user);
+
+  my $config = {
+    PidFile => $pid_file,
+    ScoreboardFile => $scoreboard_file,
+    SystemLog => $log_file,
+    TraceLog => $log_file,
+    Trace => 'DEFAULT:10 event:0 lock:0 scoreboard:0 signal:0 fsquota:20',
+
+    AuthUserFile => $auth_user_file,
+    AuthGroupFile => $auth_group_file,
+    SocketBindTight => 'on',
+
+    IfModules => {
+      'mod_fsquota.c' => {
+        FSQuotaEngine => 'on',
+        FSQuotaOptions => 'ShowQuota',
+        FSQuotaCacheTTL => 60,
+      },
+
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($config_file, $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($user, $passwd);
+
+      my ($resp_code, $resp_msg) = $client->site('FSQUOTA', 'MACHINE');
+
+      my $expected;
+
+      $expected = 200;
+      $self->assert($expected == $resp_code,
+        test_msg("Expected response code $expected, got $resp_code"));
+
+      $expected = '^token=([0-9a-f]{16})';
+      $self->assert(qr/$expected/, $resp_msg,
+        test_msg("Expected response message '$expected', got '$resp_msg'"));
+
+      $resp_msg =~ /^token=([0-9a-f]{16})/;
+      my $token = $1;
+
+      # Nothing has changed, so the conditional form says so
+      ($resp_code, $resp_msg) = $client->site('FSQUOTA', 'MACHINE', $token);
+
+      $expected = 200;
+      $self->assert($expected == $resp_code,
+        test_msg("Expected response code $expected, got $resp_code"));
+
+      $expected = "unchanged token=$token";
+      $self->assert($expected eq $resp_msg,
+        test_msg("Expected response message '$expected', got '$resp_msg'"));
+
+      # A stale token gets the full snapshot
+      ($resp_code, $resp_msg) = $client->site('FSQUOTA', 'MACHINE',
+        '0000000000000000');
+
+      $expected = "^token=$token";
+      $self->assert(qr/$expected/, $resp_msg,
+        test_msg("Expected response message '$expected', got '$resp_msg'"));
+
+      $client->quit();
+    };
+
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    eval { server_wait($config_file, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($pid_file);
+
+  $self->assert_child_ok($pid);
+
+  if ($ex) {
+    test_append_logfile($log_file, $ex);
+    unlink($log_file);
+
+    die($ex);
+  }
+
+  unlink($log_file);
+}
+
+sub fsquota_usage_index_enforce {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+
+  my $config_file = "$tmpdir/fsquota.conf";
+  my $pid_file = File::Spec->rel2abs("$tmpdir/fsquota.pid");
+  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/fsquota.scoreboard");
+
+  my $log_file = test_get_logfile();
+
+  my $auth_user_file = File::Spec->rel2abs("$tmpdir/fsquota.passwd");
+  my $auth_group_file = File::Spec->rel2abs("$tmpdir/fsquota.group");
+
+  my $user = 'proftpd';
+  my $passwd = 'test';
+  my $group = 'ftpd';
+  my $home_dir = File::Spec->rel2abs($tmpdir);
+  my $uid = 500;
+  my $gid = 500;
+
+  # Make sure that, if we're running as root, that the home directory has
+  # permissions/privs set for the account we create
+  if ($< == 0) {
+    unless (chmod(0755, $home_dir)) {
+      die("Can't set perms on $home_dir to 0755: $!");
+    }
+
+    unless (chown($uid, $gid, $home_dir)) {
+      die("Can't set owner of $home_dir to $uid/$gid: $!");
+    }
+  }
+
+  my $sub_dir = File::Spec->rel2abs("$tmpdir/sub");
+  mkpath($sub_dir);
+
+  # A directory, with a file over the limit, to be moved into and out of
+  # the indexed tree.
+  my $big_dir = File::Spec->rel2abs("$tmpdir/big");
+  mkpath($big_dir);
+
+  my $big_file = File::Spec->rel2abs("$big_dir/big.bin");
+  if (open(my $fh, "> $big_file")) {
+    print $fh "A" x 65536;
+    unless (close($fh)) {
+      die("Can't write $big_file: $!");
+    }
+
+  } else {
+    die("Can't open $big_file: $!");
+  }
+
+  if ($< == 0) {
+    unless (chown($uid, $gid, $sub_dir, $big_dir, $big_file)) {
+      die("Can't set owner of $sub_dir to $uid/$gid: $!");
+    }
+  }
+
+  my $index_file = File::Spec->rel2abs("$tmpdir/fsquota.idx");
+
+  auth_user_write($auth_user_file, $user, $passwd, $uid, $gid, $home_dir,
+    '/bin/bash');
+  auth_group_write($auth_group_file, $group, $gid, $user);
+
+  my $config = {
+    PidFile => $pid_file,
+    ScoreboardFile => $scoreboard_file,
+    SystemLog => $log_file,
+    TraceLog => $log_file,
+    Trace => 'DEFAULT:10 event:0 lock:0 scoreboard:0 signal:0 fsquota:20',
+
+    AuthUserFile => $auth_user_file,
+    AuthGroupFile => $auth_group_file,
+    SocketBindTight => 'on',
+
+    IfModules => {
+      'mod_fsquota.c' => {
+        FSQuotaEngine => 'on',
+        FSQuotaOptions => 'EnforceUsageLimits',
+        FSQuotaUsageIndex => "$sub_dir $index_file",
+        FSQuotaUsageLimit => 'user 16',
+      },
+
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($config_file, $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($user, $passwd);
+
+      fsquota_index_wait($index_file);
+
+      # Moving the directory in brings its contents into the index.
+      $client->rnfr('big');
+      $client->rnto('sub/big');
+
+      my $conn = $client->stor_raw('sub/test2.bin');
+      if ($conn) {
+        die("STOR sub/test2.bin succeeded unexpectedly");
+      }
+
+      my $resp_code = $client->response_code();
+      my $expected = 552;
+      $self->assert($expected == $resp_code,
+        test_msg("Expected response code $expected, got $resp_code"));
+
+      # Moving it back out takes them along again.
+      $client->rnfr('sub/big');
+      $client->rnto('big');
+
+      $conn = $client->stor_raw('sub/test.bin');
+      unless ($conn) {
+        die("STOR sub/test.bin failed: " . $client->response_code() . " " .
+          $client->response_msg());
+      }
+
+      my $buf = "A" x 65536;
+      $conn->write($buf, length($buf), 25);
+      eval { $conn->close() };
+
+      $resp_code = $client->response_code();
+      $expected = 226;
+      $self->assert($expected == $resp_code,
+        test_msg("Expected response code $expected, got $resp_code"));
+
+      # The index now has the user over the 16 KB limit.
+      $conn = $client->stor_raw('sub/test2.bin');
+      if ($conn) {
+        die("STOR sub/test2.bin succeeded unexpectedly");
+      }
+
+      $resp_code = $client->response_code();
+      $expected = 552;
+      $self->assert($expected == $resp_code,
+        test_msg("Expected response code $expected, got $resp_code"));
+
+      # Uploads outside of the indexed tree are not limited.
+      $conn = $client->stor_raw('test.bin');
+      unless ($conn) {
+        die("STOR test.bin failed: " . $client->response_code() . " " .
+          $client->response_msg());
+      }
+
+      $conn->write($buf, length($buf), 25);
+      eval { $conn->close() };
+
+      $client->quit();
+    };
+
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    eval { server_wait($config_file, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($pid_file);
+
+  $self->assert_child_ok($pid);
+
+  if ($ex) {
+    test_append_logfile($log_file, $ex);
+    unlink($log_file);
+
+    die($ex);
+  }
+
+  unlink($log_file);
+}
+
+# Compiles the syscall shim, which answers quotactl(2) with canned values
+# (10 MB and 100 files limits, 1 MB and 10 files used), and returns its path.
+# Waits for the scan seeding the given usage index to finish, by polling the
+# state in the index file's header.
+sub fsquota_index_wait {
+  my $index_file = shift;
+  my $timeout = shift;
+  $timeout = 10 unless defined($timeout);
+
+  for (my $i = 0; $i < $timeout * 10; $i++) {
+    if (open(my $fh, "< $index_file")) {
+      my $hdr;
+      my $len = read($fh, $hdr, 16);
+      close($fh);
+
+      if (defined($len) &&
+          $len == 16) {
+        my ($magic, $version, $nslots, $state) = unpack('L4', $hdr);
+
+        # FSQUOTA_INDEX_STATE_SEEDED
+        return if $state == 2;
+      }
+    }
+
+    select(undef, undef, undef, 0.1);
+  }
+
+  die("Usage index $index_file not seeded after $timeout seconds");
+}
+
+sub fsquota_shim_lib {
+  my $tmpdir = shift;
+
+  my $shim_src = File::Spec->rel2abs(
+    't/etc/modules/mod_fsquota/syscall-shim.c');
+  my $shim_lib = File::Spec->rel2abs("$tmpdir/syscall-shim.so");
+  unless (-f $shim_lib) {
+    my $res = system("cc -shared -fPIC -o $shim_lib $shim_src -ldl");
+    if ($res != 0) {
+      die("Can't compile $shim_src");
+    }
+  }
+
+  return $shim_lib;
+}
+
+# Runs a login, and a number of CWDs, against a server with the syscall shim
+# preloaded; returns the number of each logged call made by the sessions,
+# the login response lines, and the trace log.  The optional options are
+# extra mod_fsquota directives ('config'), a delay in seconds before each
+# CWD ('cwd_delay'), and a function to call once logged in, before the CWDs
+# ('before_cwds').
+sub fsquota_syscall_run {
+  my $self = shift;
+  my $engine = shift;
+  my $ncwds = shift;
+  my $warmup = shift;
+  my $opts = shift;
+  $opts = {} unless defined($opts);
+  my $tmpdir = $self->{tmpdir};
+
+  my $config_file = "$tmpdir/fsquota.conf";
+  my $pid_file = File::Spec->rel2abs("$tmpdir/fsquota.pid");
+  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/fsquota.scoreboard");
+
+  my $log_file = test_get_logfile();
+
+  my $auth_user_file = File::Spec->rel2abs("$tmpdir/fsquota.passwd");
+  my $auth_group_file = File::Spec->rel2abs("$tmpdir/fsquota.group");
+
+  my $user = 'proftpd';
+  my $passwd = 'test';
+  my $group = 'ftpd';
+  my $home_dir = File::Spec->rel2abs($tmpdir);
+  my $uid = 500;
+  my $gid = 500;
+
+  my $sub_dir = File::Spec->rel2abs("$tmpdir/sub");
+  mkpath($sub_dir);
+
+  # Make sure that, if we're running as root, that the home directory has
+  # permissions/privs set for the account we create
+  if ($< == 0) {
+    unless (chmod(0755, $home_dir, $sub_dir)) {
+      die("Can't set perms on $home_dir to 0755: $!");
+    }
+
+    unless (chown($uid, $gid, $home_dir, $sub_dir)) {
+      die("Can't set owner of $home_dir to $uid/$gid: $!");
+    }
+  }
+
+  auth_user_write($auth_user_file, $user, $passwd, $uid, $gid, $home_dir,
+    '/bin/bash');
+  auth_group_write($auth_group_file, $group, $gid, $user);
+
+  my $shim_lib = fsquota_shim_lib($tmpdir);
+
+  my $shim_log = File::Spec->rel2abs("$tmpdir/syscalls-$engine" .
+    ($warmup ? "-warmup" : "") . ".log");
+  unlink($shim_log);
+
+  my $display = <<EOD;
+User quota: %{fsquota.user.enabled}
+  Bytes: %{fsquota.user.kb.used} of %{fsquota.user.kb.total}
+  Files: %{fsquota.user.files.used} of %{fsquota.user.files.total}
+Group quota: %{fsquota.group.enabled} (%{fsquota.group.name})
+  Bytes: %{fsquota.group.kb.used} of %{fsquota.group.kb.total}
+  Files: %{fsquota.group.files.used} of %{fsquota.group.files.total}
+EOD
+
+  my $login_file = File::Spec->rel2abs("$tmpdir/login.txt");
+  my $chdir_file = File::Spec->rel2abs("$sub_dir/.message");
+  foreach my $file ($login_file, $chdir_file) {
+    if (open(my $fh, "> $file")) {
+      print $fh $display;
+      unless (close($fh)) {
+        die("Can't write $file: $!");
+      }
+
+    } else {
+      die("Can't open $file: $!");
+    }
+  }
+
+  my $config = {
+    PidFile => $pid_file,
+    ScoreboardFile => $scoreboard_file,
+    SystemLog => $log_file,
+    TraceLog => $log_file,
+    Trace => 'DEFAULT:10 event:0 lock:0 scoreboard:0 signal:0 fsquota:20 fsquota.cache:20 fsquota.netlink:20',
+
+    AuthUserFile => $auth_user_file,
+    AuthGroupFile => $auth_group_file,
+    SocketBindTight => 'on',
+    DefaultRoot => '~',
+
+    DisplayLogin => $login_file,
+    DisplayChdir => '.message',
+
+    IfModules => {
+      'mod_fsquota.c' => {
+        FSQuotaEngine => $engine,
+        FSQuotaCacheTTL => 60,
+      },
+
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+    },
+  };
+
+  if ($warmup) {
+    $config->{IfModules}->{'mod_fsquota.c'}->{FSQuotaWarmup} = $home_dir;
+  }
+
+  if (defined($opts->{config})) {
+    foreach my $key (keys(%{ $opts->{config} })) {
+      $config->{IfModules}->{'mod_fsquota.c'}->{$key} =
+        $opts->{config}->{$key};
+    }
+  }
+
+  my ($port, $config_user, $config_group) = config_write($config_file, $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+  my $daemon_pid;
+  my $resp_msgs = [];
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($user, $passwd);
+      $resp_msgs = $client->response_msgs();
+
+      if ($opts->{before_cwds}) {
+        $opts->{before_cwds}->();
+      }
+
+      for (my $i = 0; $i < $ncwds; $i++) {
+        if ($opts->{cwd_delay}) {
+          select(undef, undef, undef, $opts->{cwd_delay});
+        }
+
+        $client->cwd('sub');
+        $client->cdup();
+      }
+
+      $client->quit();
+
+      if (open(my $fh, "< $pid_file")) {
+        $daemon_pid = <$fh>;
+        chomp($daemon_pid);
+        close($fh);
+      }
+    };
+
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    $ENV{LD_PRELOAD} = $shim_lib;
+    $ENV{FSQUOTA_SHIM_LOG} = $shim_log;
+
+    eval { server_wait($config_file, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($pid_file);
+
+  $self->assert_child_ok($pid);
+
+  if ($ex) {
+    test_append_logfile($log_file, $ex);
+    unlink($log_file);
+
+    die($ex);
+  }
+
+  my $log = '';
+  if (open(my $fh, "< $log_file")) {
+    local $/;
+    $log = <$fh>;
+    close($fh);
+  }
+
+  unlink($log_file);
+
+  # Only count the calls made by the sessions, i.e. the daemon's children.
+  my $counts = { stat => 0, statfs => 0, statvfs => 0, quotactl => 0 };
+  if (open(my $fh, "< $shim_log")) {
+    while (my $line = <$fh>) {
+      chomp($line);
+      my ($call_pid, $call_ppid, $call) = split(' ', $line);
+
+      if (defined($daemon_pid) &&
+          $call_ppid == $daemon_pid) {
+        $counts->{$call}++;
+      }
+    }
+
+    close($fh);
+
+  } else {
+    die("Can't read $shim_log: $!");
+  }
+
+  return ($counts, $resp_msgs, $log);
+}
+
+# Starts a minimal memcached, speaking just enough of the text protocol
+# for proftpd, on loopback; returns its PID and port.
+sub fsquota_memcached_stub {
+  my $listen = IO::Socket::INET->new(
+    LocalAddr => '127.0.0.1',
+    LocalPort => 0,
+    Listen => 5,
+    ReuseAddr => 1,
+  );
+  unless ($listen) {
+    die("Can't listen for memcached stub: $!");
+  }
+
+  my $port = $listen->sockport();
+
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    close($listen);
+    return ($pid, $port);
+  }
+
+  my $store = {};
+  my $bufs = {};
+  my $sel = IO::Select->new($listen);
+
+  while (1) {
+    foreach my $fh ($sel->can_read()) {
+      if ($fh == $listen) {
+        my $conn = $listen->accept();
+        $conn->autoflush(1);
+        $bufs->{$conn} = '';
+        $sel->add($conn);
+        next;
+      }
+
+      my $data = '';
+      unless (sysread($fh, $data, 8192)) {
+        $sel->remove($fh);
+        delete($bufs->{$fh});
+        close($fh);
+        next;
+      }
+
+      $bufs->{$fh} .= $data;
+
+      # Handle every complete request received so far.
+      while ($bufs->{$fh} =~ /^([^\r\n]*)\r?\n/) {
+        my $line = $1;
+        my ($cmd, @args) = split(' ', $line);
+        $cmd = lc($cmd || '');
+
+        my $consumed = length($&);
+
+        if ($cmd eq 'set' ||
+            $cmd eq 'add' ||
+            $cmd eq 'replace') {
+          my ($key, $flags, $expires, $len, $noreply) = @args;
+
+          # Wait for the rest of the value.
+          last if length($bufs->{$fh}) < $consumed + $len + 2;
+
+          $store->{$key} = [$flags, substr($bufs->{$fh}, $consumed, $len)];
+          $consumed += $len + 2;
+          syswrite($fh, "STORED\r\n") unless $noreply;
+
+        } elsif ($cmd eq 'get' ||
+                 $cmd eq 'gets') {
+          my $resp = '';
+          foreach my $key (@args) {
+            if (defined($store->{$key})) {
+              my ($flags, $value) = @{ $store->{$key} };
+              $resp .= "VALUE $key $flags " . length($value) . "\r\n" .
+                "$value\r\n";
+            }
+          }
+
+          syswrite($fh, "${resp}END\r\n");
+
+        } elsif ($cmd eq 'delete') {
+          my $found = delete($store->{$args[0]});
+          syswrite($fh, ($found ? "DELETED" : "NOT_FOUND") . "\r\n");
+
+        } elsif ($cmd eq 'version') {
+          syswrite($fh, "VERSION 1.4.0\r\n");
+
+        } elsif ($cmd eq 'quit') {
+          last;
+
+        } else {
+          syswrite($fh, "ERROR\r\n");
+        }
+
+        substr($bufs->{$fh}, 0, $consumed) = '';
+      }
+    }
+  }
+}
+
+sub fsquota_syscall_budget {
+  my $self = shift;
+
+  # Fixed budgets, beyond what the sessions do without mod_fsquota: one
+  # quota status check and one quota query each for the user and group, and
+  # one stat(2) per distinct directory, no matter how many variables are
+  # displayed.
+  my $login_quotactl_budget = 4;
+  my $login_stat_budget = 2;
+  my $cwd_stat_budget = 2;
+  my $ncwds = 5;
+
+  my ($off_counts) = $self->fsquota_syscall_run('off', $ncwds);
+  my ($on_counts, $resp_msgs) = $self->fsquota_syscall_run('on', $ncwds);
+
+  my $resp_msg = join("\n", @$resp_msgs);
+  my $expected = 'Files: 10 of 100';
+  $self->assert(qr/$expected/, $resp_msg,
+    test_msg("Expected response message '$expected', got '$resp_msg'"));
+
+  my $quotactls = $on_counts->{quotactl} - $off_counts->{quotactl};
+  $self->assert($quotactls <= $login_quotactl_budget,
+    test_msg("Expected at most $login_quotactl_budget quotactl(2) calls, got $quotactls"));
+
+  my $stats = $on_counts->{stat} - $off_counts->{stat};
+  my $stat_budget = $login_stat_budget + ($ncwds * $cwd_stat_budget);
+  $self->assert($stats <= $stat_budget,
+    test_msg("Expected at most $stat_budget stat(2) calls, got $stats"));
+
+  my $statvfs = $on_counts->{statvfs} - $off_counts->{statvfs};
+  $self->assert($statvfs == 0,
+    test_msg("Expected no statvfs(2) calls, got $statvfs"));
+}
+
+sub fsquota_warmup {
+  my $self = shift;
+
+  my ($cold_counts) = $self->fsquota_syscall_run('on', 1);
+  my ($warm_counts, $resp_msgs, $log) = $self->fsquota_syscall_run('on', 1,
+    1);
+
+  my $resp_msg = join("\n", @$resp_msgs);
+  foreach my $expected ('User quota: on', 'Group quota: on',
+      'Files: 10 of 100') {
+    $self->assert(qr/$expected/, $resp_msg,
+      test_msg("Expected response message '$expected', got '$resp_msg'"));
+  }
+
+  my $expected = 'warmed up .*\): user quotas on, group quotas on';
+  $self->assert(qr/$expected/, $log,
+    test_msg("Expected trace message '$expected'"));
+
+  $expected = 'using daemon-resolved user quota status';
+  $self->assert(qr/$expected/, $log,
+    test_msg("Expected trace message '$expected'"));
+
+  # The daemon has already checked (using Q_GETFMT) whether user/group quotas
+  # are on, so the session only queries the values.
+  my $quotactls = $cold_counts->{quotactl} - $warm_counts->{quotactl};
+  $self->assert($quotactls == 2,
+    test_msg("Expected 2 fewer quotactl(2) calls, got $quotactls"));
+
+  # Nor does it check which backend serves the filesystem, which, with the
+  # btrfs backend built in, is a statfs(2) per query.
+  $self->assert($warm_counts->{statfs} == 0 ||
+    $warm_counts->{statfs} < $cold_counts->{statfs},
+    test_msg("Expected fewer statfs(2) calls than $cold_counts->{statfs}, got $warm_counts->{statfs}"));
+}
+
+# Returns the filesystem type of the mount holding the given path, by its
+# longest mount point prefix, or undef if the mount table cannot be read.
+sub fsquota_mount_fstype {
+  my $path = shift;
+
+  my $fstype;
+  if (open(my $fh, "< /proc/self/mountinfo")) {
+    my $best = -1;
+
+    while (my $line = <$fh>) {
+      my @fields = split(' ', $line);
+      my $mount_path = $fields[4];
+      $mount_path =~ s/\\([0-7]{3})/chr(oct($1))/eg;
+
+      my ($sep) = grep { $fields[$_] eq '-' } (6..$#fields);
+      next unless defined($sep);
+
+      my $prefix = ($mount_path eq '/' ? '/' : "$mount_path/");
+      if (($path eq $mount_path || index($path, $prefix) == 0) &&
+          length($mount_path) >= $best) {
+        $best = length($mount_path);
+        $fstype = $fields[$sep + 1];
+      }
+    }
+
+    close($fh);
+  }
+
+  return $fstype;
+}
+
+sub fsquota_mount_table {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+
+  # Paths on these are stat(2)'d anyway; their device numbers are per
+  # subvolume/underlying filesystem.
+  my $fstype = fsquota_mount_fstype(File::Spec->rel2abs($tmpdir));
+  if (!defined($fstype) ||
+      $fstype eq 'btrfs' ||
+      $fstype eq 'overlay') {
+    print STDERR " + no usable mount table for $tmpdir, skipping\n";
+    return;
+  }
+
+  # The cached values expire between the CWDs; the directories' devices,
+  # confirmed by the mount table, do not.
+  my $ncwds = 3;
+  my $opts = {
+    config => {
+      FSQuotaCacheTTL => 1,
+    },
+    cwd_delay => 1.1,
+  };
+
+  my ($off_counts) = $self->fsquota_syscall_run('off', $ncwds, 0, $opts);
+  my ($on_counts, $resp_msgs) = $self->fsquota_syscall_run('on', $ncwds, 0,
+    $opts);
+
+  my $resp_msg = join("\n", @$resp_msgs);
+  my $expected = 'Files: 10 of 100';
+  $self->assert(qr/$expected/, $resp_msg,
+    test_msg("Expected response message '$expected', got '$resp_msg'"));
+
+  # Each distinct directory, inside the chroot, is stat(2)'d once, to
+  # confirm the mount table's answer; not again once its TTL has passed.
+  my $stats = $on_counts->{stat} - $off_counts->{stat};
+  $self->assert($stats <= 2,
+    test_msg("Expected at most 2 stat(2) calls, got $stats"));
+}
+
+sub fsquota_xfer_notes {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+
+  my $config_file = "$tmpdir/fsquota.conf";
+  my $pid_file = File::Spec->rel2abs("$tmpdir/fsquota.pid");
+  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/fsquota.scoreboard");
+
+  my $log_file = test_get_logfile();
+
+  my $auth_user_file = File::Spec->rel2abs("$tmpdir/fsquota.passwd");
+  my $auth_group_file = File::Spec->rel2abs("$tmpdir/fsquota.group");
+
+  my $user = 'proftpd';
+  my $passwd = 'test';
+  my $group = 'ftpd';
+  my $home_dir = File::Spec->rel2abs($tmpdir);
+  my $uid = 500;
+  my $gid = 500;
+
+  # Make sure that, if we're running as root, that the home directory has
+  # permissions/privs set for the account we create
+  if ($< == 0) {
+    unless (chmod(0755, $home_dir)) {
+      die("Can't set perms on $home_dir to 0755: $!");
+    }
+
+    unless (chown($uid, $gid, $home_dir)) {
+      die("Can't set owner of $home_dir to $uid/$gid: $!");
+    }
+  }
+
+  auth_user_write($auth_user_file, $user, $passwd, $uid, $gid, $home_dir,
+    '/bin/bash');
+  auth_group_write($auth_group_file, $group, $gid, $user);
+
+  my $shim_lib = fsquota_shim_lib($tmpdir);
+  my $shim_log = File::Spec->rel2abs("$tmpdir/syscalls.log");
+
+  # Displaying the usage at login caches it; the upload then adjusts the
+  # cached values.
+  my $login_file = File::Spec->rel2abs("$tmpdir/login.txt");
+  if (open(my $fh, "> $login_file")) {
+    print $fh "Used: %{fsquota.user.kb.used}\n";
+    unless (close($fh)) {
+      die("Can't write $login_file: $!");
+    }
+
+  } else {
+    die("Can't open $login_file: $!");
+  }
+
+  my $ext_log = File::Spec->rel2abs("$tmpdir/ext.log");
+
+  my $config = {
+    PidFile => $pid_file,
+    ScoreboardFile => $scoreboard_file,
+    SystemLog => $log_file,
+    TraceLog => $log_file,
+    Trace => 'DEFAULT:10 event:0 lock:0 scoreboard:0 signal:0 fsquota:20',
+
+    AuthUserFile => $auth_user_file,
+    AuthGroupFile => $auth_group_file,
+    SocketBindTight => 'on',
+
+    DisplayLogin => $login_file,
+    LogFormat => 'quota "%m %{note:fsquota.user.kb.used} %{note:fsquota.user.files.used} %{note:fsquota.user.files.avail}"',
+    ExtendedLog => "$ext_log WRITE quota",
+
+    IfModules => {
+      'mod_fsquota.c' => {
+        FSQuotaEngine => 'on',
+        FSQuotaCacheTTL => 60,
+      },
+
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($config_file, $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($user, $passwd);
+
+      # The second upload overwrites the first, with the same size.
+      for (my $i = 0; $i < 2; $i++) {
+        my $conn = $client->stor_raw('test.bin');
+        unless ($conn) {
+          die("STOR test.bin failed: " . $client->response_code() . " " .
+            $client->response_msg());
+        }
+
+        my $buf = "A" x 2048;
+        $conn->write($buf, length($buf), 25);
+        eval { $conn->close() };
+
+        my $resp_code = $client->response_code();
+        my $expected = 226;
+        $self->assert($expected == $resp_code,
+          test_msg("Expected response code $expected, got $resp_code"));
+      }
+
+      $client->quit();
+    };
+
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    $ENV{LD_PRELOAD} = $shim_lib;
+    $ENV{FSQUOTA_SHIM_LOG} = $shim_log;
+
+    eval { server_wait($config_file, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($pid_file);
+
+  $self->assert_child_ok($pid);
+
+  if ($ex) {
+    test_append_logfile($log_file, $ex);
+    unlink($log_file);
+
+    die($ex);
+  }
+
+  eval {
+    if (open(my $fh, "< $ext_log")) {
+      my @lines = <$fh>;
+      chomp(@lines);
+      close($fh);
+
+      $self->assert(scalar(@lines) == 2,
+        test_msg("Expected 2 log lines, got " . scalar(@lines)));
+
+      # 1024 KB and 10 files cached at login, plus the 2 KB and file of the
+      # upload.
+      my $expected = "STOR 1026 11 89";
+      $self->assert($expected eq $lines[0],
+        test_msg("Expected '$expected', got '$lines[0]'"));
+
+      # Overwriting it changes the usage by an unknown amount, so the
+      # values are queried afresh, from the shim, which does not count the
+      # upload.
+      $expected = "STOR 1024 10 90";
+      $self->assert($expected eq $lines[1],
+        test_msg("Expected '$expected', got '$lines[1]'"));
+
+    } else {
+      die("Can't read $ext_log: $!");
+    }
+  };
+  if ($@) {
+    $ex = $@;
+  }
+
+  if ($ex) {
+    test_append_logfile($log_file, $ex);
+    unlink($log_file);
+
+    die($ex);
+  }
+
+  unlink($log_file);
+}
+
+sub fsquota_project_map {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+
+  my $config_file = "$tmpdir/fsquota.conf";
+  my $pid_file = File::Spec->rel2abs("$tmpdir/fsquota.pid");
+  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/fsquota.scoreboard");
+
+  my $log_file = test_get_logfile();
+
+  my $auth_user_file = File::Spec->rel2abs("$tmpdir/fsquota.passwd");
+  my $auth_group_file = File::Spec->rel2abs("$tmpdir/fsquota.group");
+
+  my $user = 'proftpd';
+  my $passwd = 'test';
+  my $group = 'ftpd';
+  my $home_dir = File::Spec->rel2abs($tmpdir);
+  my $uid = 500;
+  my $gid = 500;
+
+  # Make sure that, if we're running as root, that the home directory has
+  # permissions/privs set for the account we create
+  if ($< == 0) {
+    unless (chmod(0755, $home_dir)) {
+      die("Can't set perms on $home_dir to 0755: $!");
+    }
+
+    unless (chown($uid, $gid, $home_dir)) {
+      die("Can't set owner of $home_dir to $uid/$gid: $!");
+    }
+  }
+
+  auth_user_write($auth_user_file, $user, $passwd, $uid, $gid, $home_dir,
+    '/bin/bash');
+  auth_group_write($auth_group_file, $group, $gid, $user);
+
+  my $shim_lib = fsquota_shim_lib($tmpdir);
+  my $shim_log = File::Spec->rel2abs("$tmpdir/syscalls.log");
+
+  my $map_file = File::Spec->rel2abs("$tmpdir/projects");
+  if (open(my $fh, "> $map_file")) {
+    print $fh "# Project ID:home\n41:/nonexistent\n42:$home_dir/\n";
+    unless (close($fh)) {
+      die("Can't write $map_file: $!");
+    }
+
+  } else {
+    die("Can't open $map_file: $!");
+  }
+
+  my $login_file = File::Spec->rel2abs("$tmpdir/login.txt");
+  if (open(my $fh, "> $login_file")) {
+    print $fh "Project %{fsquota.project.id}: %{fsquota.project.files.used} of %{fsquota.project.files.total} files\n";
+    unless (close($fh)) {
+      die("Can't write $login_file: $!");
+    }
+
+  } else {
+    die("Can't open $login_file: $!");
+  }
+
+  my $config = {
+    PidFile => $pid_file,
+    ScoreboardFile => $scoreboard_file,
+    SystemLog => $log_file,
+    TraceLog => $log_file,
+    Trace => 'DEFAULT:10 event:0 lock:0 scoreboard:0 signal:0 fsquota:20',
+
+    AuthUserFile => $auth_user_file,
+    AuthGroupFile => $auth_group_file,
+    SocketBindTight => 'on',
+    DefaultRoot => '~',
+
+    DisplayLogin => $login_file,
+
+    IfModules => {
+      'mod_fsquota.c' => {
+        FSQuotaEngine => 'on',
+        FSQuotaProjects => $map_file,
+      },
+
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($config_file, $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($user, $passwd);
+
+      my $resp_msg = join("\n", @{ $client->response_msgs() });
+      $client->quit();
+
+      # The shim reports a project's ID as its file count.
+      my $expected = 'Project 42: 42 of 100 files';
+      $self->assert(qr/$expected/, $resp_msg,
+        test_msg("Expected response message '$expected', got '$resp_msg'"));
+    };
+
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    $ENV{LD_PRELOAD} = $shim_lib;
+    $ENV{FSQUOTA_SHIM_LOG} = $shim_log;
+
+    eval { server_wait($config_file, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($pid_file);
+
+  $self->assert_child_ok($pid);
+
+  if ($ex) {
+    test_append_logfile($log_file, $ex);
+    unlink($log_file);
+
+    die($ex);
+  }
+
+  unlink($log_file);
+}
+
+sub fsquota_upload_volumes {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+
+  my $config_file = "$tmpdir/fsquota.conf";
+  my $pid_file = File::Spec->rel2abs("$tmpdir/fsquota.pid");
+  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/fsquota.scoreboard");
+
+  my $log_file = test_get_logfile();
+
+  my $auth_user_file = File::Spec->rel2abs("$tmpdir/fsquota.passwd");
+  my $auth_group_file = File::Spec->rel2abs("$tmpdir/fsquota.group");
+
+  my $user = 'proftpd';
+  my $passwd = 'test';
+  my $group = 'ftpd';
+  my $home_dir = File::Spec->rel2abs($tmpdir);
+  my $uid = 500;
+  my $gid = 500;
+
+  my $spool_dir = File::Spec->rel2abs("$tmpdir/spool");
+  my $vol1_dir = File::Spec->rel2abs("$tmpdir/vol1");
+  my $vol2_dir = File::Spec->rel2abs("$tmpdir/vol2");
+  mkpath([$spool_dir, $vol1_dir, $vol2_dir]);
+
+  # Make sure that, if we're running as root, that the home directory has
+  # permissions/privs set for the account we create
+  if ($< == 0) {
+    unless (chmod(0755, $home_dir, $spool_dir, $vol1_dir, $vol2_dir)) {
+      die("Can't set perms on $home_dir to 0755: $!");
+    }
+
+    unless (chown($uid, $gid, $home_dir, $spool_dir, $vol1_dir, $vol2_dir)) {
+      die("Can't set owner of $home_dir to $uid/$gid: $!");
+    }
+  }
+
+  auth_user_write($auth_user_file, $user, $passwd, $uid, $gid, $home_dir,
+    '/bin/bash');
+  auth_group_write($auth_group_file, $group, $gid, $user);
+
+  my $config = {
+    PidFile => $pid_file,
+    ScoreboardFile => $scoreboard_file,
+    SystemLog => $log_file,
+    TraceLog => $log_file,
+    Trace => 'DEFAULT:10 event:0 lock:0 scoreboard:0 signal:0 fsquota:20',
+
+    AuthUserFile => $auth_user_file,
+    AuthGroupFile => $auth_group_file,
+    SocketBindTight => 'on',
+    DefaultRoot => '~',
+
+    IfModules => {
+      'mod_fsquota.c' => {
+        FSQuotaEngine => 'on',
+        FSQuotaUploadVolumes => "$spool_dir $vol1_dir $vol2_dir",
+      },
+
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($config_file, $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($user, $passwd);
+
+      foreach my $file (qw(spool/test.txt test.txt)) {
+        my $conn = $client->stor_raw($file);
+        unless ($conn) {
+          die("STOR $file failed: " . $client->response_code() . " " .
+            $client->response_msg());
+        }
+
+        my $buf = "Hello, World!\n";
+        $conn->write($buf, length($buf), 25);
+        eval { $conn->close() };
+      }
+
+      $client->quit();
+    };
+
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    eval { server_wait($config_file, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($pid_file);
+
+  $self->assert_child_ok($pid);
+
+  eval {
+    # The upload into the spool lands on one of the volumes; others are
+    # left alone.
+    $self->assert(!-f "$spool_dir/test.txt",
+      test_msg("File $spool_dir/test.txt exists unexpectedly"));
+    $self->assert(-f "$vol1_dir/test.txt" || -f "$vol2_dir/test.txt",
+      test_msg("File test.txt not found on any upload volume"));
+    $self->assert(-f "$home_dir/test.txt",
+      test_msg("File $home_dir/test.txt does not exist"));
+  };
+  if ($@) {
+    $ex = $@;
+  }
+
+  if ($ex) {
+    test_append_logfile($log_file, $ex);
+    unlink($log_file);
+
+    die($ex);
+  }
+
+  unlink($log_file);
+}
+
+sub fsquota_allo_reserve {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+
+  my $config_file = "$tmpdir/fsquota.conf";
+  my $pid_file = File::Spec->rel2abs("$tmpdir/fsquota.pid");
+  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/fsquota.scoreboard");
+
+  my $log_file = test_get_logfile();
+
+  my $auth_user_file = File::Spec->rel2abs("$tmpdir/fsquota.passwd");
+  my $auth_group_file = File::Spec->rel2abs("$tmpdir/fsquota.group");
+
+  my $user = 'proftpd';
+  my $passwd = 'test';
+  my $group = 'ftpd';
+  my $home_dir = File::Spec->rel2abs($tmpdir);
+  my $uid = 500;
+  my $gid = 500;
+
+  # Make sure that, if we're running as root, that the home directory has
+  # permissions/privs set for the account we create
+  if ($< == 0) {
+    unless (chmod(0755, $home_dir)) {
+      die("Can't set perms on $home_dir to 0755: $!");
+    }
+
+    unless (chown($uid, $gid, $home_dir)) {
+      die("Can't set owner of $home_dir to $uid/$gid: $!");
+    }
+  }
+
+  auth_user_write($auth_user_file, $user, $passwd, $uid, $gid, $home_dir,
+    '/bin/bash');
+  auth_group_write($auth_group_file, $group, $gid, $user);
+
+  my $shim_lib = fsquota_shim_lib($tmpdir);
+  my $shim_log = File::Spec->rel2abs("$tmpdir/syscalls.log");
+
+  my $test_file = File::Spec->rel2abs("$tmpdir/test.txt");
+
+  my $config = {
+    PidFile => $pid_file,
+    ScoreboardFile => $scoreboard_file,
+    SystemLog => $log_file,
+    TraceLog => $log_file,
+    Trace => 'DEFAULT:10 event:0 lock:0 scoreboard:0 signal:0 fsquota:20',
+
+    AuthUserFile => $auth_user_file,
+    AuthGroupFile => $auth_group_file,
+    SocketBindTight => 'on',
+
+    IfModules => {
+      'mod_fsquota.c' => {
+        FSQuotaEngine => 'on',
+      },
+
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($config_file, $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($user, $passwd);
+
+      # The shim's quota leaves 9 MB; 100 MB does not fit.
+      eval { $client->allo(100 * 1024 * 1024) };
+      unless ($@) {
+        die("ALLO of 100 MB succeeded unexpectedly");
+      }
+
+      my $resp_code = $client->response_code();
+      my $expected = 552;
+      $self->assert($expected == $resp_code,
+        test_msg("Expected response code $expected, got $resp_code"));
+
+      $client->allo(65536);
+
+      my $conn = $client->stor_raw('test.txt');
+      unless ($conn) {
+        die("STOR test.txt failed: " . $client->response_code() . " " .
+          $client->response_msg());
+      }
+
+      my $buf = "Hello, World!\n";
+      $conn->write($buf, length($buf), 25);
+      eval { $conn->close() };
+
+      $resp_code = $client->response_code();
+      $expected = 226;
+      $self->assert($expected == $resp_code,
+        test_msg("Expected response code $expected, got $resp_code"));
+
+      $client->quit();
+    };
+
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    $ENV{LD_PRELOAD} = $shim_lib;
+    $ENV{FSQUOTA_SHIM_LOG} = $shim_log;
+
+    eval { server_wait($config_file, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($pid_file);
+
+  $self->assert_child_ok($pid);
+
+  eval {
+    # Only what was sent is kept; the rest of the reservation is released.
+    my $size = -s $test_file;
+    my $expected = 14;
+    $self->assert($expected == $size,
+      test_msg("Expected size $expected, got $size"));
+
+    my $blocks = (stat($test_file))[12];
+    $self->assert($blocks < 128,
+      test_msg("Expected unused reservation to be released, got $blocks blocks"));
+  };
+  if ($@) {
+    $ex = $@;
+  }
+
+  if ($ex) {
+    test_append_logfile($log_file, $ex);
+    unlink($log_file);
+
+    die($ex);
+  }
+
+  unlink($log_file);
+}
+
+sub fsquota_warn {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+
+  my $config_file = "$tmpdir/fsquota.conf";
+  my $pid_file = File::Spec->rel2abs("$tmpdir/fsquota.pid");
+  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/fsquota.scoreboard");
+
+  my $log_file = test_get_logfile();
+
+  my $auth_user_file = File::Spec->rel2abs("$tmpdir/fsquota.passwd");
+  my $auth_group_file = File::Spec->rel2abs("$tmpdir/fsquota.group");
+
+  my $user = 'proftpd';
+  my $passwd = 'test';
+  my $group = 'ftpd';
+  my $home_dir = File::Spec->rel2abs($tmpdir);
+  my $uid = 500;
+  my $gid = 500;
+
+  my $sub_dir = File::Spec->rel2abs("$tmpdir/sub");
+  mkpath($sub_dir);
+
+  # Make sure that, if we're running as root, that the home directory has
+  # permissions/privs set for the account we create
+  if ($< == 0) {
+    unless (chmod(0755, $home_dir, $sub_dir)) {
+      die("Can't set perms on $home_dir to 0755: $!");
+    }
+
+    unless (chown($uid, $gid, $home_dir, $sub_dir)) {
+      die("Can't set owner of $home_dir to $uid/$gid: $!");
+    }
+  }
+
+  auth_user_write($auth_user_file, $user, $passwd, $uid, $gid, $home_dir,
+    '/bin/bash');
+  auth_group_write($auth_group_file, $group, $gid, $user);
+
+  my $shim_lib = fsquota_shim_lib($tmpdir);
+  my $shim_log = File::Spec->rel2abs("$tmpdir/syscalls.log");
+
+  # Displaying the usage at login caches it, for the warning to use.
+  my $login_file = File::Spec->rel2abs("$tmpdir/login.txt");
+  if (open(my $fh, "> $login_file")) {
+    print $fh "Used: %{fsquota.user.kb.used}\n";
+    unless (close($fh)) {
+      die("Can't write $login_file: $!");
+    }
+
+  } else {
+    die("Can't open $login_file: $!");
+  }
+
+  my $config = {
+    PidFile => $pid_file,
+    ScoreboardFile => $scoreboard_file,
+    SystemLog => $log_file,
+    TraceLog => $log_file,
+    Trace => 'DEFAULT:10 event:0 lock:0 scoreboard:0 signal:0 fsquota:20',
+
+    AuthUserFile => $auth_user_file,
+    AuthGroupFile => $auth_group_file,
+    SocketBindTight => 'on',
+
+    DisplayLogin => $login_file,
+
+    IfModules => {
+      'mod_fsquota.c' => {
+        FSQuotaEngine => 'on',
+        FSQuotaCacheTTL => 60,
+        FSQuotaWarn => '5% 50%',
+      },
+
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($config_file, $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($user, $passwd);
+
+      # The shim's quota is 10% used, past the 5% threshold.
+      my $resp_msg = join("\n", @{ $client->response_msgs() });
+      my $expected = 'Warning: user quota 10% used';
+      $self->assert(qr/$expected/, $resp_msg,
+        test_msg("Expected response message '$expected', got '$resp_msg'"));
+
+      # The crossing has been announced; it is not repeated.
+      $client->cwd('sub');
+      $resp_msg = join("\n", @{ $client->response_msgs() });
+      $self->assert($resp_msg !~ /Warning: user quota/,
+        test_msg("Unexpected repeated warning: '$resp_msg'"));
+
+      $client->quit();
+    };
+
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    $ENV{LD_PRELOAD} = $shim_lib;
+    $ENV{FSQUOTA_SHIM_LOG} = $shim_log;
+
+    eval { server_wait($config_file, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($pid_file);
+
+  $self->assert_child_ok($pid);
+
+  if ($ex) {
+    test_append_logfile($log_file, $ex);
+    unlink($log_file);
+
+    die($ex);
+  }
+
+  unlink($log_file);
+}
+
+sub fsquota_memcache {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+
+  unless (feature_have_module_compiled('mod_memcache.c')) {
+    print STDERR " + mod_memcache not compiled, skipping\n";
+    return;
+  }
+
+  my $config_file = "$tmpdir/fsquota.conf";
+  my $pid_file = File::Spec->rel2abs("$tmpdir/fsquota.pid");
+  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/fsquota.scoreboard");
+
+  my $log_file = test_get_logfile();
+
+  my $auth_user_file = File::Spec->rel2abs("$tmpdir/fsquota.passwd");
+  my $auth_group_file = File::Spec->rel2abs("$tmpdir/fsquota.group");
+
+  my $user = 'proftpd';
+  my $passwd = 'test';
+  my $group = 'ftpd';
+  my $home_dir = File::Spec->rel2abs($tmpdir);
+  my $uid = 500;
+  my $gid = 500;
+
+  my $sub_dir = File::Spec->rel2abs("$tmpdir/sub");
+  mkpath($sub_dir);
+
+  # Make sure that, if we're running as root, that the home directory has
+  # permissions/privs set for the account we create
+  if ($< == 0) {
+    unless (chmod(0755, $home_dir, $sub_dir)) {
+      die("Can't set perms on $home_dir to 0755: $!");
+    }
+
+    unless (chown($uid, $gid, $home_dir, $sub_dir)) {
+      die("Can't set owner of $home_dir to $uid/$gid: $!");
+    }
+  }
+
+  auth_user_write($auth_user_file, $user, $passwd, $uid, $gid, $home_dir,
+    '/bin/bash');
+  auth_group_write($auth_group_file, $group, $gid, $user);
+
+  my $shim_lib = fsquota_shim_lib($tmpdir);
+  my $shim_log = File::Spec->rel2abs("$tmpdir/syscalls.log");
+
+  # Displaying the usage at login looks up the user and group quotas.
+  my $login_file = File::Spec->rel2abs("$tmpdir/login.txt");
+  if (open(my $fh, "> $login_file")) {
+    print $fh "Used: %{fsquota.user.kb.used} %{fsquota.group.kb.used}\n";
+    unless (close($fh)) {
+      die("Can't write $login_file: $!");
+    }
+
+  } else {
+    die("Can't open $login_file: $!");
+  }
+
+  my ($memcached_pid, $memcached_port) = fsquota_memcached_stub();
+
+  my $config = {
+    PidFile => $pid_file,
+    ScoreboardFile => $scoreboard_file,
+    SystemLog => $log_file,
+    TraceLog => $log_file,
+    Trace => 'DEFAULT:10 event:0 lock:0 scoreboard:0 signal:0 fsquota:20',
+
+    AuthUserFile => $auth_user_file,
+    AuthGroupFile => $auth_group_file,
+    SocketBindTight => 'on',
+
+    DisplayLogin => $login_file,
+
+    IfModules => {
+      'mod_fsquota.c' => {
+        FSQuotaEngine => 'on',
+        FSQuotaCacheTTL => 60,
+        FSQuotaMemcache => 'on 60',
+      },
+
+      'mod_memcache.c' => {
+        MemcacheEngine => 'on',
+        MemcacheServers => "127.0.0.1:$memcached_port",
+        MemcacheOptions => 'NoBinaryProtocol',
+      },
+
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($config_file, $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+  my $daemon_pid;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      # The first session queries the kernel, and shares the values; the
+      # second session, e.g. on another node, uses them.
+      for (my $i = 0; $i < 2; $i++) {
+        my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+        $client->login($user, $passwd);
+        $client->quit();
+      }
+
+      if (open(my $fh, "< $pid_file")) {
+        $daemon_pid = <$fh>;
+        chomp($daemon_pid);
+        close($fh);
+      }
+    };
+
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    $ENV{LD_PRELOAD} = $shim_lib;
+    $ENV{FSQUOTA_SHIM_LOG} = $shim_log;
+
+    eval { server_wait($config_file, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($pid_file);
+
+  kill('TERM', $memcached_pid);
+  waitpid($memcached_pid, 0);
+
+  $self->assert_child_ok($pid);
+
+  if ($ex) {
+    test_append_logfile($log_file, $ex);
+    unlink($log_file);
+
+    die($ex);
+  }
+
+  unlink($log_file);
+
+  # Count the quotactl(2) calls of each session, in order.
+  my $sessions = [];
+  my $counts = {};
+  if (open(my $fh, "< $shim_log")) {
+    while (my $line = <$fh>) {
+      chomp($line);
+      my ($call_pid, $call_ppid, $call) = split(' ', $line);
+
+      if ($call eq 'quotactl' &&
+          defined($daemon_pid) &&
+          $call_ppid == $daemon_pid) {
+        push(@$sessions, $call_pid) unless defined($counts->{$call_pid});
+        $counts->{$call_pid}++;
+      }
+    }
+
+    close($fh);
+
+  } else {
+    die("Can't read $shim_log: $!");
+  }
+
+  $self->assert(scalar(@$sessions) >= 1,
+    test_msg("Expected quotactl(2) calls from the first session"));
+
+  my $first = $counts->{$sessions->[0]};
+  my $second = (scalar(@$sessions) > 1 ? $counts->{$sessions->[1]} : 0);
+
+  # The second session skips the user and group quota queries.
+  my $saved = $first - $second;
+  $self->assert($saved == 2,
+    test_msg("Expected 2 fewer quotactl(2) calls, got $saved"));
+}
+
+sub fsquota_site_facts {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+
+  my $config_file = "$tmpdir/fsquota.conf";
+  my $pid_file = File::Spec->rel2abs("$tmpdir/fsquota.pid");
+  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/fsquota.scoreboard");
+
+  my $log_file = test_get_logfile();
+
+  my $auth_user_file = File::Spec->rel2abs("$tmpdir/fsquota.passwd");
+  my $auth_group_file = File::Spec->rel2abs("$tmpdir/fsquota.group");
+
+  my $user = 'proftpd';
+  my $passwd = 'test';
+  my $group = 'ftpd';
+  my $home_dir = File::Spec->rel2abs($tmpdir);
+  my $uid = 500;
+  my $gid = 500;
+
+  my $sub_dir = File::Spec->rel2abs("$tmpdir/sub");
+  mkpath($sub_dir);
+
+  # Make sure that, if we're running as root, that the home directory has
+  # permissions/privs set for the account we create
+  if ($< == 0) {
+    unless (chmod(0755, $home_dir, $sub_dir)) {
+      die("Can't set perms on $home_dir to 0755: $!");
+    }
+
+    unless (chown($uid, $gid, $home_dir, $sub_dir)) {
+      die("Can't set owner of $home_dir to $uid/$gid: $!");
+    }
+  }
+
+  auth_user_write($auth_user_file, $user, $passwd, $uid, $gid, $home_dir,
+    '/bin/bash');
+  auth_group_write($auth_group_file, $group, $gid, $user);
+
+  my $shim_lib = fsquota_shim_lib($tmpdir);
+  my $shim_log = File::Spec->rel2abs("$tmpdir/syscalls.log");
+
+  my $config = {
+    PidFile => $pid_file,
+    ScoreboardFile => $scoreboard_file,
+    SystemLog => $log_file,
+    TraceLog => $log_file,
+    Trace => 'DEFAULT:10 event:0 lock:0 scoreboard:0 signal:0 fsquota:20',
+
+    AuthUserFile => $auth_user_file,
+    AuthGroupFile => $auth_group_file,
+    SocketBindTight => 'on',
+
+    IfModules => {
+      'mod_fsquota.c' => {
+        FSQuotaEngine => 'on',
+        FSQuotaOptions => 'ShowQuota',
+        FSQuotaCacheTTL => 60,
+      },
+
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($config_file, $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($user, $passwd);
+
+      my ($resp_code, $resp_msg) = $client->site('FSQUOTA', 'FACTS', '.',
+        'sub', 'nonexistent');
+
+      my $expected = 200;
+      $self->assert($expected == $resp_code,
+        test_msg("Expected response code $expected, got $resp_code"));
+
+      # Both directories are on the same filesystem, with the shim's quota
+      # of 1 MB of 10 MB; the missing directory has no facts.
+      $resp_msg = join("\n", @{ $client->response_msgs() });
+      foreach my $dir ('.', 'sub') {
+        $expected = '^\s*x\.quota\.avail=\d+;x\.quota\.used=1048576;' .
+          'x\.quota\.limit=10485760; ' . quotemeta($dir) . '$';
+        $self->assert(qr/$expected/m, $resp_msg,
+          test_msg("Expected response message '$expected', got '$resp_msg'"));
+      }
+
+      $expected = '^\s*nonexistent$';
+      $self->assert(qr/$expected/m, $resp_msg,
+        test_msg("Expected response message '$expected', got '$resp_msg'"));
+
+      $client->quit();
+    };
+
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    $ENV{LD_PRELOAD} = $shim_lib;
+    $ENV{FSQUOTA_SHIM_LOG} = $shim_log;
+
+    eval { server_wait($config_file, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($pid_file);
+
+  $self->assert_child_ok($pid);
+
+  if ($ex) {
+    test_append_logfile($log_file, $ex);
+    unlink($log_file);
+
+    die($ex);
+  }
+
+  unlink($log_file);
+}
+
+sub fsquota_usage_trend {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+
+  my $config_file = "$tmpdir/fsquota.conf";
+  my $pid_file = File::Spec->rel2abs("$tmpdir/fsquota.pid");
+  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/fsquota.scoreboard");
+
+  my $log_file = test_get_logfile();
+
+  my $auth_user_file = File::Spec->rel2abs("$tmpdir/fsquota.passwd");
+  my $auth_group_file = File::Spec->rel2abs("$tmpdir/fsquota.group");
+
+  my $user = 'proftpd';
+  my $passwd = 'test';
+  my $group = 'ftpd';
+  my $home_dir = File::Spec->rel2abs($tmpdir);
+  my $uid = 500;
+  my $gid = 500;
+
+  my $sub_dir = File::Spec->rel2abs("$tmpdir/sub");
+  mkpath($sub_dir);
+
+  # Make sure that, if we're running as root, that the home directory has
+  # permissions/privs set for the account we create
+  if ($< == 0) {
+    unless (chmod(0755, $home_dir, $sub_dir)) {
+      die("Can't set perms on $home_dir to 0755: $!");
+    }
+
+    unless (chown($uid, $gid, $home_dir, $sub_dir)) {
+      die("Can't set owner of $home_dir to $uid/$gid: $!");
+    }
+  }
+
+  auth_user_write($auth_user_file, $user, $passwd, $uid, $gid, $home_dir,
+    '/bin/bash');
+  auth_group_write($auth_group_file, $group, $gid, $user);
+
+  my $shim_lib = fsquota_shim_lib($tmpdir);
+  my $shim_log = File::Spec->rel2abs("$tmpdir/syscalls.log");
+
+  # The first sample is taken at login, and the second on changing into the
+  # subdirectory, once the cached values have expired.
+  my $login_file = File::Spec->rel2abs("$tmpdir/login.txt");
+  my $chdir_file = File::Spec->rel2abs("$sub_dir/.message");
+  my $display = {
+    $login_file => "Used: %{fsquota.user.kb.used}\n",
+    $chdir_file => "Rate: %{fsquota.user.files.rate} ETA: %{fsquota.user.eta}\n",
+  };
+
+  foreach my $file (keys(%$display)) {
+    if (open(my $fh, "> $file")) {
+      print $fh $display->{$file};
+      unless (close($fh)) {
+        die("Can't write $file: $!");
+      }
+
+    } else {
+      die("Can't open $file: $!");
+    }
+  }
+
+  my $config = {
+    PidFile => $pid_file,
+    ScoreboardFile => $scoreboard_file,
+    SystemLog => $log_file,
+    TraceLog => $log_file,
+    Trace => 'DEFAULT:10 event:0 lock:0 scoreboard:0 signal:0 fsquota:20',
+
+    AuthUserFile => $auth_user_file,
+    AuthGroupFile => $auth_group_file,
+    SocketBindTight => 'on',
+
+    DisplayLogin => $login_file,
+    DisplayChdir => '.message',
+
+    IfModules => {
+      'mod_fsquota.c' => {
+        FSQuotaEngine => 'on',
+        FSQuotaCacheTTL => 1,
+      },
+
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($config_file, $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($user, $passwd);
+
+      # Let the cached values expire.
+      sleep(2);
+
+      # Two samples, seconds apart, are too close together for a rate.
+      $client->cwd('sub');
+      my $resp_msg = join("\n", @{ $client->response_msgs() });
+      my $expected = 'Rate: unavailable ETA: unavailable';
+      $self->assert(qr/$expected/, $resp_msg,
+        test_msg("Expected response message '$expected', got '$resp_msg'"));
+
+      $client->quit();
+    };
+
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    $ENV{LD_PRELOAD} = $shim_lib;
+    $ENV{FSQUOTA_SHIM_LOG} = $shim_log;
+
+    eval { server_wait($config_file, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($pid_file);
+
+  $self->assert_child_ok($pid);
+
+  if ($ex) {
+    test_append_logfile($log_file, $ex);
+    unlink($log_file);
+
+    die($ex);
+  }
+
+  unlink($log_file);
+}
+
+sub fsquota_site_copy {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+
+  unless (feature_have_module_compiled('mod_copy.c')) {
+    print STDERR " + mod_copy not compiled, skipping\n";
+    return;
+  }
+
+  my $config_file = "$tmpdir/fsquota.conf";
+  my $pid_file = File::Spec->rel2abs("$tmpdir/fsquota.pid");
+  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/fsquota.scoreboard");
+
+  my $log_file = test_get_logfile();
+
+  my $auth_user_file = File::Spec->rel2abs("$tmpdir/fsquota.passwd");
+  my $auth_group_file = File::Spec->rel2abs("$tmpdir/fsquota.group");
+
+  my $user = 'proftpd';
+  my $passwd = 'test';
+  my $group = 'ftpd';
+  my $home_dir = File::Spec->rel2abs($tmpdir);
+  my $uid = 500;
+  my $gid = 500;
+
+  # Make sure that, if we're running as root, that the home directory has
+  # permissions/privs set for the account we create
+  if ($< == 0) {
+    unless (chmod(0755, $home_dir)) {
+      die("Can't set perms on $home_dir to 0755: $!");
+    }
+
+    unless (chown($uid, $gid, $home_dir)) {
+      die("Can't set owner of $home_dir to $uid/$gid: $!");
+    }
+  }
+
+  auth_user_write($auth_user_file, $user, $passwd, $uid, $gid, $home_dir,
+    '/bin/bash');
+  auth_group_write($auth_group_file, $group, $gid, $user);
+
+  my $shim_lib = fsquota_shim_lib($tmpdir);
+  my $shim_log = File::Spec->rel2abs("$tmpdir/syscalls.log");
+
+  # The shim's quota leaves 9 MB; a copy of a 12 MB file does not fit, but a
+  # copy of a small one does.
+  my $big_file = File::Spec->rel2abs("$tmpdir/big.dat");
+  my $small_file = File::Spec->rel2abs("$tmpdir/small.dat");
+
+  foreach my $spec ([$big_file, 12 * 1024], [$small_file, 4]) {
+    my ($path, $kb) = @$spec;
+
+    if (open(my $fh, "> $path")) {
+      print $fh ("A" x 1024) x $kb;
+      unless (close($fh)) {
+        die("Can't write $path: $!");
+      }
+
+    } else {
+      die("Can't open $path: $!");
+    }
+  }
+
+  my $config = {
+    PidFile => $pid_file,
+    ScoreboardFile => $scoreboard_file,
+    SystemLog => $log_file,
+    TraceLog => $log_file,
+    Trace => 'DEFAULT:10 event:0 lock:0 scoreboard:0 signal:0 fsquota:20',
+
+    AuthUserFile => $auth_user_file,
+    AuthGroupFile => $auth_group_file,
+    SocketBindTight => 'on',
+
+    IfModules => {
+      'mod_fsquota.c' => {
+        FSQuotaEngine => 'on',
+      },
+
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($config_file, $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($user, $passwd);
+
+      $client->site('CPFR', 'big.dat');
+
+      eval { $client->site('CPTO', 'big copy.dat') };
+      unless ($@) {
+        die("SITE CPTO of 12 MB succeeded unexpectedly");
+      }
+
+      my $resp_code = $client->response_code();
+      my $expected = 552;
+      $self->assert($expected == $resp_code,
+        test_msg("Expected response code $expected, got $resp_code"));
+
+      if (-e "$tmpdir/big copy.dat") {
+        die("Refused copy 'big copy.dat' exists unexpectedly");
+      }
+
+      eval { $client->site('COPY', 'big.dat', 'big2.dat') };
+      unless ($@) {
+        die("SITE COPY of 12 MB succeeded unexpectedly");
+      }
+
+      $resp_code = $client->response_code();
+      $self->assert($expected == $resp_code,
+        test_msg("Expected response code $expected, got $resp_code"));
+
+      $client->site('CPFR', 'small.dat');
+      $client->site('CPTO', 'small copy.dat');
+
+      unless (-f "$tmpdir/small copy.dat") {
+        die("Copy 'small copy.dat' does not exist");
+      }
+
+      $client->quit();
+    };
+
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    $ENV{LD_PRELOAD} = $shim_lib;
+    $ENV{FSQUOTA_SHIM_LOG} = $shim_log;
+
+    eval { server_wait($config_file, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($pid_file);
+
+  $self->assert_child_ok($pid);
+
+  if ($ex) {
+    test_append_logfile($log_file, $ex);
+    unlink($log_file);
+
+    die($ex);
+  }
+
+  unlink($log_file);
+}
+
+
+sub fsquota_quotatab_tally {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+
+  unless (feature_have_module_compiled('mod_quotatab.c')) {
+    print STDERR " + mod_quotatab not compiled, skipping\n";
+    return;
+  }
+
+  my $config_file = "$tmpdir/fsquota.conf";
+  my $pid_file = File::Spec->rel2abs("$tmpdir/fsquota.pid");
+  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/fsquota.scoreboard");
+
+  my $log_file = test_get_logfile();
+
+  my $auth_user_file = File::Spec->rel2abs("$tmpdir/fsquota.passwd");
+  my $auth_group_file = File::Spec->rel2abs("$tmpdir/fsquota.group");
+
+  my $user = 'proftpd';
+  my $passwd = 'test';
+  my $group = 'ftpd';
+  my $home_dir = File::Spec->rel2abs($tmpdir);
+  my $uid = 500;
+  my $gid = 500;
+
+  my $sub_dir = File::Spec->rel2abs("$tmpdir/sub");
+  mkpath($sub_dir);
+
+  # Make sure that, if we're running as root, that the home directory has
+  # permissions/privs set for the account we create
+  if ($< == 0) {
+    unless (chmod(0755, $home_dir, $sub_dir)) {
+      die("Can't set perms on $home_dir to 0755: $!");
+    }
+
+    unless (chown($uid, $gid, $home_dir, $sub_dir)) {
+      die("Can't set owner of $home_dir to $uid/$gid: $!");
+    }
+  }
+
+  auth_user_write($auth_user_file, $user, $passwd, $uid, $gid, $home_dir,
+    '/bin/bash');
+  auth_group_write($auth_group_file, $group, $gid, $user);
+
+  my $shim_lib = fsquota_shim_lib($tmpdir);
+  my $shim_log = File::Spec->rel2abs("$tmpdir/syscalls.log");
+
+  my $chdir_file = File::Spec->rel2abs("$sub_dir/.message");
+  if (open(my $fh, "> $chdir_file")) {
+    print $fh "Files: %{fsquota.user.files.used}\n";
+    unless (close($fh)) {
+      die("Can't write $chdir_file: $!");
+    }
+
+  } else {
+    die("Can't open $chdir_file: $!");
+  }
+
+  my $config = {
+    PidFile => $pid_file,
+    ScoreboardFile => $scoreboard_file,
+    SystemLog => $log_file,
+    TraceLog => $log_file,
+    Trace => 'DEFAULT:10 event:0 lock:0 scoreboard:0 signal:0 fsquota:20 fsquota.quotatab:20',
+
+    AuthUserFile => $auth_user_file,
+    AuthGroupFile => $auth_group_file,
+    SocketBindTight => 'on',
+
+    DisplayChdir => '.message',
+
+    IfModules => {
+      'mod_fsquota.c' => {
+        FSQuotaEngine => 'on',
+        FSQuotaCacheTTL => 60,
+      },
+
+      'mod_quotatab.c' => {
+        QuotaEngine => 'on',
+        QuotaLimitTable => 'fsquota:',
+        QuotaTallyTable => 'fsquota:',
+      },
+
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($config_file, $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($user, $passwd);
+
+      my $conn = $client->stor_raw('test.bin');
+      unless ($conn) {
+        die("STOR test.bin failed: " . $client->response_code() . " " .
+          $client->response_msg());
+      }
+
+      my $buf = "A" x 2048;
+      $conn->write($buf, length($buf), 25);
+      eval { $conn->close() };
+
+      my $resp_code = $client->response_code();
+      my $expected = 226;
+      $self->assert($expected == $resp_code,
+        test_msg("Expected response code $expected, got $resp_code"));
+
+      # The shim's usage does not change with the upload; mod_quotatab's
+      # tally, which counts it on top of the usage read before, must not
+      # have been carried into the cache.
+      $client->cwd('sub');
+      my $resp_msg = join("\n", @{ $client->response_msgs() });
+      $expected = 'Files: 10$';
+      $self->assert(qr/$expected/m, $resp_msg,
+        test_msg("Expected response message '$expected', got '$resp_msg'"));
+
+      $client->quit();
+    };
+
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    $ENV{LD_PRELOAD} = $shim_lib;
+    $ENV{FSQUOTA_SHIM_LOG} = $shim_log;
+
+    eval { server_wait($config_file, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($pid_file);
+
+  $self->assert_child_ok($pid);
+
+  if ($ex) {
+    test_append_logfile($log_file, $ex);
+    unlink($log_file);
+
+    die($ex);
+  }
+
+  unlink($log_file);
+}
+
+sub fsquota_limit_events {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+
+  my $config_file = "$tmpdir/fsquota.conf";
+  my $pid_file = File::Spec->rel2abs("$tmpdir/fsquota.pid");
+  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/fsquota.scoreboard");
+
+  my $log_file = test_get_logfile();
+
+  my $auth_user_file = File::Spec->rel2abs("$tmpdir/fsquota.passwd");
+  my $auth_group_file = File::Spec->rel2abs("$tmpdir/fsquota.group");
+
+  my $user = 'proftpd';
+  my $passwd = 'test';
+  my $group = 'ftpd';
+  my $home_dir = File::Spec->rel2abs($tmpdir);
+  my $uid = 500;
+  my $gid = 500;
+
+  # Make sure that, if we're running as root, that the home directory has
+  # permissions/privs set for the account we create
+  if ($< == 0) {
+    unless (chmod(0755, $home_dir)) {
+      die("Can't set perms on $home_dir to 0755: $!");
+    }
+
+    unless (chown($uid, $gid, $home_dir)) {
+      die("Can't set owner of $home_dir to $uid/$gid: $!");
+    }
+  }
+
+  auth_user_write($auth_user_file, $user, $passwd, $uid, $gid, $home_dir,
+    '/bin/bash');
+  auth_group_write($auth_group_file, $group, $gid, $user);
+
+  my $shim_lib = fsquota_shim_lib($tmpdir);
+  my $shim_log = File::Spec->rel2abs("$tmpdir/syscalls.log");
+
+  # Displaying the usage at login caches it; the uploads then adjust the
+  # cached values, past the shim's soft and then hard limits.
+  my $login_file = File::Spec->rel2abs("$tmpdir/login.txt");
+  if (open(my $fh, "> $login_file")) {
+    print $fh "Used: %{fsquota.user.kb.used}\n";
+    unless (close($fh)) {
+      die("Can't write $login_file: $!");
+    }
+
+  } else {
+    die("Can't open $login_file: $!");
+  }
+
+  my $config = {
+    PidFile => $pid_file,
+    ScoreboardFile => $scoreboard_file,
+    SystemLog => $log_file,
+    TraceLog => $log_file,
+    Trace => 'DEFAULT:10 event:0 lock:0 scoreboard:0 signal:0 fsquota:20 fsquota.cache:20',
+
+    AuthUserFile => $auth_user_file,
+    AuthGroupFile => $auth_group_file,
+    SocketBindTight => 'on',
+
+    DisplayLogin => $login_file,
+
+    IfModules => {
+      'mod_fsquota.c' => {
+        FSQuotaEngine => 'on',
+        FSQuotaCacheTTL => 60,
+      },
+
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($config_file, $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($user, $passwd);
+
+      # From 1 MB used: 9.5 MB goes over the 10 MB soft limit, and another
+      # 2 MB reaches the 12 MB hard limit.
+      my $uploads = [
+        ['soft.bin', 152],
+        ['hard.bin', 32],
+      ];
+
+      foreach my $upload (@$uploads) {
+        my ($file, $nchunks) = @$upload;
+
+        my $conn = $client->stor_raw($file);
+        unless ($conn) {
+          die("STOR $file failed: " . $client->response_code() . " " .
+            $client->response_msg());
+        }
+
+        my $buf = "A" x 65536;
+        for (my $i = 0; $i < $nchunks; $i++) {
+          $conn->write($buf, length($buf), 25);
+        }
+        eval { $conn->close() };
+
+        my $resp_code = $client->response_code();
+        my $expected = 226;
+        $self->assert($expected == $resp_code,
+          test_msg("Expected response code $expected, got $resp_code"));
+      }
+
+      $client->quit();
+    };
+
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    $ENV{LD_PRELOAD} = $shim_lib;
+    $ENV{FSQUOTA_SHIM_LOG} = $shim_log;
+
+    eval { server_wait($config_file, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($pid_file);
+
+  $self->assert_child_ok($pid);
+
+  if ($ex) {
+    test_append_logfile($log_file, $ex);
+    unlink($log_file);
+
+    die($ex);
+  }
+
+  eval {
+    my $log = '';
+    if (open(my $fh, "< $log_file")) {
+      local $/;
+      $log = <$fh>;
+      close($fh);
+
+    } else {
+      die("Can't read $log_file: $!");
+    }
+
+    my $soft = "user ID $uid: .*generating 'mod_fsquota.soft-limit-exceeded' event";
+    my $hard = "user ID $uid: .*generating 'mod_fsquota.hard-limit-exceeded' event";
+
+    $self->assert($log =~ /$soft/g,
+      test_msg("Expected trace message '$soft'"));
+
+    # The hard limit event follows the soft limit one.
+    $self->assert($log =~ /$hard/g,
+      test_msg("Expected trace message '$hard' after '$soft'"));
+  };
+  if ($@) {
+    $ex = $@;
+  }
+
+  if ($ex) {
+    test_append_logfile($log_file, $ex);
+    unlink($log_file);
+
+    die($ex);
+  }
+
+  unlink($log_file);
+}
+
+# Runs the given ftpdctl command against the given Controls socket, returning
+# the response lines.
+sub fsquota_ftpdctl {
+  my $sock_file = shift;
+  my $ctrl_cmd = shift;
+
+  my $ftpdctl_bin;
+  if ($ENV{PROFTPD_TEST_PATH}) {
+    $ftpdctl_bin = "$ENV{PROFTPD_TEST_PATH}/ftpdctl";
+
+  } else {
+    $ftpdctl_bin = '../ftpdctl';
+  }
+
+  my $cmd = "$ftpdctl_bin -s $sock_file $ctrl_cmd";
+
+  if ($ENV{TEST_VERBOSE}) {
+    print STDERR "Executing ftpdctl: $cmd\n";
+  }
+
+  my @lines = `$cmd`;
+  if ($? != 0) {
+    die("'$cmd' failed");
+  }
+
+  if ($ENV{TEST_VERBOSE}) {
+    print STDERR "ftpdctl output:\n", @lines;
+  }
+
+  return \@lines;
+}
+
+sub fsquota_ctrls_sessions {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+
+  unless (feature_have_feature_enabled('ctrls')) {
+    print STDERR " + Controls support not enabled, skipping\n";
+    return;
+  }
+
+  my $config_file = "$tmpdir/fsquota.conf";
+  my $pid_file = File::Spec->rel2abs("$tmpdir/fsquota.pid");
+  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/fsquota.scoreboard");
+
+  my $log_file = test_get_logfile();
+
+  my $auth_user_file = File::Spec->rel2abs("$tmpdir/fsquota.passwd");
+  my $auth_group_file = File::Spec->rel2abs("$tmpdir/fsquota.group");
+
+  my $ctrls_sock = File::Spec->rel2abs("$tmpdir/fsquota.sock");
+
+  my $user = 'proftpd';
+  my $passwd = 'test';
+  my $group = 'ftpd';
+  my $home_dir = File::Spec->rel2abs($tmpdir);
+  my $uid = 500;
+  my $gid = 500;
+
+  # Make sure that, if we're running as root, that the home directory has
+  # permissions/privs set for the account we create
+  if ($< == 0) {
+    unless (chmod(0755, $home_dir)) {
+      die("Can't set perms on $home_dir to 0755: $!");
+    }
+
+    unless (chown($uid, $gid, $home_dir)) {
+      die("Can't set owner of $home_dir to $uid/$gid: $!");
+    }
+  }
+
+  auth_user_write($auth_user_file, $user, $passwd, $uid, $gid, $home_dir,
+    '/bin/bash');
+  auth_group_write($auth_group_file, $group, $gid, $user);
+
+  my $shim_lib = fsquota_shim_lib($tmpdir);
+  my $shim_log = File::Spec->rel2abs("$tmpdir/syscalls.log");
+
+  # Displaying the usage at login publishes the session's quota values.
+  my $login_file = File::Spec->rel2abs("$tmpdir/login.txt");
+  if (open(my $fh, "> $login_file")) {
+    print $fh "Used: %{fsquota.user.kb.used}\n";
+    unless (close($fh)) {
+      die("Can't write $login_file: $!");
+    }
+
+  } else {
+    die("Can't open $login_file: $!");
+  }
+
+  # The ftpdctl client runs as the invoking user.
+  my $ctrls_user = (getpwuid($<))[0];
+
+  my $config = {
+    PidFile => $pid_file,
+    ScoreboardFile => $scoreboard_file,
+    SystemLog => $log_file,
+    TraceLog => $log_file,
+    Trace => 'DEFAULT:10 event:0 lock:0 scoreboard:0 signal:0 fsquota:20',
+
+    AuthUserFile => $auth_user_file,
+    AuthGroupFile => $auth_group_file,
+    SocketBindTight => 'on',
+
+    DisplayLogin => $login_file,
+
+    IfModules => {
+      'mod_ctrls.c' => {
+        ControlsEngine => 'on',
+        ControlsLog => $log_file,
+        ControlsSocket => $ctrls_sock,
+        ControlsACLs => "all allow user $ctrls_user",
+        ControlsSocketACL => "allow user $ctrls_user",
+      },
+
+      'mod_fsquota.c' => {
+        FSQuotaEngine => 'on',
+        FSQuotaCacheTTL => 60,
+        FSQuotaControlsACLs => "all allow user $ctrls_user",
+      },
+
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($config_file, $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($user, $passwd);
+
+      my $lines = fsquota_ftpdctl($ctrls_sock, 'fsquota stats');
+      my $output = join('', @$lines);
+
+      $self->assert($output =~ /kernel queries: (\d+)/,
+        test_msg("Expected 'kernel queries' in ftpdctl output"));
+      $self->assert($1 > 0,
+        test_msg("Expected kernel queries from the login, got $1"));
+
+      $lines = fsquota_ftpdctl($ctrls_sock, 'fsquota sessions');
+      $output = join('', @$lines);
+
+      my $expected = 'pid (\d+) user \S+ \(UID ' . $uid . '\): ';
+      $self->assert($output =~ /$expected/,
+        test_msg("Expected '$expected' in ftpdctl output '$output'"));
+      my $sess_pid = $1;
+
+      # A killed session cannot release its slot; the slot is no longer
+      # listed, and is free for the next session to claim.
+      unless (kill('KILL', $sess_pid)) {
+        die("Can't kill session PID $sess_pid: $!");
+      }
+      $client = undef;
+
+      # Give the daemon time to reap the killed session.
+      sleep(1);
+
+      $lines = fsquota_ftpdctl($ctrls_sock, 'fsquota sessions');
+      $output = join('', @$lines);
+
+      $self->assert($output !~ /pid $sess_pid /,
+        test_msg("Expected no session with PID $sess_pid, got '$output'"));
+
+      $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($user, $passwd);
+
+      $lines = fsquota_ftpdctl($ctrls_sock, 'fsquota sessions');
+      $output = join('', @$lines);
+
+      $self->assert($output =~ /$expected/,
+        test_msg("Expected '$expected' in ftpdctl output '$output'"));
+
+      $client->quit();
+    };
+
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    $ENV{LD_PRELOAD} = $shim_lib;
+    $ENV{FSQUOTA_SHIM_LOG} = $shim_log;
+
+    eval { server_wait($config_file, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($pid_file);
+
+  $self->assert_child_ok($pid);
+
+  if ($ex) {
+    test_append_logfile($log_file, $ex);
+    unlink($log_file);
+
+    die($ex);
+  }
+
+  unlink($log_file);
+}
+
+sub fsquota_query_rate {
+  my $self = shift;
+
+  # With no caching, every directory change queries the kernel again, unless
+  # FSQuotaQueryRate throttles the queries.
+  my $ncwds = 10;
+  my $rate = 0.1;
+  my $burst = 2;
+
+  my ($free_counts) = $self->fsquota_syscall_run('on', $ncwds, 0,
+    { config => { FSQuotaCacheTTL => 0 } });
+
+  my $start = time();
+  my ($rate_counts, $resp_msgs, $log) = $self->fsquota_syscall_run('on',
+    $ncwds, 0, { config => {
+      FSQuotaCacheTTL => 0,
+      FSQuotaQueryRate => "$rate $burst",
+    } });
+  my $elapsed = time() - $start + 1;
+
+  # The login's queries use the burst; the cached values are shown after.
+  my $resp_msg = join("\n", @$resp_msgs);
+  my $expected = 'Files: 10 of 100';
+  $self->assert(qr/$expected/, $resp_msg,
+    test_msg("Expected response message '$expected', got '$resp_msg'"));
+
+  my $quotactl_cap = $burst + int($elapsed * $rate) + 1;
+  $self->assert($rate_counts->{quotactl} <= $quotactl_cap,
+    test_msg("Expected at most $quotactl_cap quotactl(2) calls, got $rate_counts->{quotactl}"));
+
+  $self->assert($rate_counts->{quotactl} < $free_counts->{quotactl},
+    test_msg("Expected fewer quotactl(2) calls than $free_counts->{quotactl}, got $rate_counts->{quotactl}"));
+
+  $expected = 'quota query rate exceeded, using cached values';
+  $self->assert(qr/$expected/, $log,
+    test_msg("Expected trace message '$expected'"));
+}
+
+# Generic netlink constants, for sending synthetic kernel quota events.
+my $NETLINK_AF = 16;
+my $NETLINK_GENERIC = 16;
+my $GENL_ID_CTRL = 16;
+my $CTRL_CMD_GETFAMILY = 3;
+my $CTRL_ATTR_FAMILY_ID = 1;
+my $CTRL_ATTR_FAMILY_NAME = 2;
+my $CTRL_ATTR_MCAST_GROUPS = 7;
+my $CTRL_ATTR_MCAST_GRP_NAME = 1;
+my $CTRL_ATTR_MCAST_GRP_ID = 2;
+
+sub fsquota_nl_attr {
+  my $type = shift;
+  my $data = shift;
+
+  my $len = 4 + length($data);
+  my $attr = pack('S S', $len, $type) . $data;
+  $attr .= "\0" x ((4 - ($len % 4)) % 4);
+
+  return $attr;
+}
+
+sub fsquota_nl_attrs {
+  my $buf = shift;
+
+  my $attrs = {};
+  while (length($buf) >= 4) {
+    my ($len, $type) = unpack('S S', $buf);
+    last if $len < 4 || $len > length($buf);
+
+    $attrs->{$type & 0x3fff} = substr($buf, 4, $len - 4);
+    substr($buf, 0, ($len + 3) & ~3) = '';
+  }
+
+  return $attrs;
+}
+
+sub fsquota_nl_send {
+  my $sock = shift;
+  my $type = shift;
+  my $cmd = shift;
+  my $attrs = shift;
+  my $groups = shift;
+  $groups = 0 unless defined($groups);
+
+  my $payload = pack('C C S', $cmd, 1, 0) . $attrs;
+  my $msg = pack('L S S L L', 16 + length($payload), $type, 1, 1, 0) .
+    $payload;
+
+  return send($sock, $msg, 0, pack('S x2 L L', $NETLINK_AF, 0, $groups));
+}
+
+# Sends a quota event for the given user ID to the kernel's "VFS_DQUOT"
+# events group, as the kernel would; returns FALSE if the kernel has no such
+# family, or its group cannot be addressed.
+sub fsquota_netlink_event {
+  my $uid = shift;
+
+  my $sock;
+  unless (socket($sock, $NETLINK_AF, 3, $NETLINK_GENERIC)) {
+    return 0;
+  }
+
+  unless (bind($sock, pack('S x2 L L', $NETLINK_AF, 0, 0))) {
+    return 0;
+  }
+
+  fsquota_nl_send($sock, $GENL_ID_CTRL, $CTRL_CMD_GETFAMILY,
+    fsquota_nl_attr($CTRL_ATTR_FAMILY_NAME, "VFS_DQUOT\0"));
+
+  my $buf = '';
+  unless (defined(recv($sock, $buf, 8192, 0))) {
+    return 0;
+  }
+
+  my ($family_id, $group_id);
+  my ($len, $type) = unpack('L S', $buf);
+  if ($type == $GENL_ID_CTRL) {
+    my $attrs = fsquota_nl_attrs(substr($buf, 20, $len - 20));
+    if (defined($attrs->{$CTRL_ATTR_FAMILY_ID})) {
+      $family_id = unpack('S', $attrs->{$CTRL_ATTR_FAMILY_ID});
+    }
+
+    if (defined($attrs->{$CTRL_ATTR_MCAST_GROUPS})) {
+      my $groups = fsquota_nl_attrs($attrs->{$CTRL_ATTR_MCAST_GROUPS});
+      foreach my $group (values(%$groups)) {
+        my $group_attrs = fsquota_nl_attrs($group);
+        my $name = $group_attrs->{$CTRL_ATTR_MCAST_GRP_NAME};
+        if (defined($name) &&
+            $name eq "events\0") {
+          $group_id = unpack('L', $group_attrs->{$CTRL_ATTR_MCAST_GRP_ID});
+        }
+      }
+    }
+  }
+
+  # Only the first 32 groups can be addressed by a sender.
+  unless (defined($family_id) &&
+          defined($group_id) &&
+          $group_id >= 1 &&
+          $group_id <= 32) {
+    return 0;
+  }
+
+  # QUOTA_NL_C_WARNING, for a user crossing its block soft limit.
+  my $attrs = fsquota_nl_attr(1, pack('L', 0)) .
+    fsquota_nl_attr(2, pack('Q', $uid)) .
+    fsquota_nl_attr(3, pack('L', 4)) .
+    fsquota_nl_attr(4, pack('L', 0)) .
+    fsquota_nl_attr(5, pack('L', 0)) .
+    fsquota_nl_attr(6, pack('Q', $uid));
+
+  unless (fsquota_nl_send($sock, $family_id, 1, $attrs,
+      1 << ($group_id - 1))) {
+    return 0;
+  }
+
+  close($sock);
+  return 1;
+}
+
+sub fsquota_netlink_events {
+  my $self = shift;
+
+  # Sending to the kernel's netlink groups requires CAP_NET_ADMIN.
+  unless ($< == 0) {
+    print STDERR " + Not running as root, skipping\n";
+    return;
+  }
+
+  my $opts = {
+    config => {
+      FSQuotaOptions => 'NetlinkEvents',
+    },
+  };
+
+  my ($quiet_counts) = $self->fsquota_syscall_run('on', 1, 0, $opts);
+
+  my $sent = 0;
+  $opts->{before_cwds} = sub {
+    $sent = fsquota_netlink_event(500);
+
+    # Give the daemon's timer time to pass the event on.
+    sleep(2);
+  };
+
+  my ($event_counts, $resp_msgs, $log) = $self->fsquota_syscall_run('on', 1,
+    0, $opts);
+
+  unless ($sent) {
+    print STDERR " + Kernel quota events not supported, skipping\n";
+    return;
+  }
+
+  my $expected = 'received quota event 4 for user ID 500';
+  $self->assert(qr/$expected/, $log,
+    test_msg("Expected trace message '$expected'"));
+
+  $expected = 'flush requested for cached user quota values for ID 500';
+  $self->assert(qr/$expected/, $log,
+    test_msg("Expected trace message '$expected'"));
+
+  # The session queries the kernel again for the user's values, rather than
+  # waiting for the cached values to expire.
+  $self->assert($event_counts->{quotactl} > $quiet_counts->{quotactl},
+    test_msg("Expected more quotactl(2) calls than $quiet_counts->{quotactl}, got $event_counts->{quotactl}"));
+}
+
+sub fsquota_groups {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+
+  my $config_file = "$tmpdir/fsquota.conf";
+  my $pid_file = File::Spec->rel2abs("$tmpdir/fsquota.pid");
+  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/fsquota.scoreboard");
+
+  my $log_file = test_get_logfile();
+
+  my $auth_user_file = File::Spec->rel2abs("$tmpdir/fsquota.passwd");
+  my $auth_group_file = File::Spec->rel2abs("$tmpdir/fsquota.group");
+
+  my $user = 'proftpd';
+  my $passwd = 'test';
+  my $group = 'ftpd';
+  my $home_dir = File::Spec->rel2abs($tmpdir);
+  my $uid = 500;
+  my $gid = 500;
+
+  my $sub_dir = File::Spec->rel2abs("$tmpdir/sub");
+  mkpath($sub_dir);
+
+  # Make sure that, if we're running as root, that the home directory has
+  # permissions/privs set for the account we create
+  if ($< == 0) {
+    unless (chmod(0755, $home_dir, $sub_dir)) {
+      die("Can't set perms on $home_dir to 0755: $!");
+    }
+
+    unless (chown($uid, $gid, $home_dir, $sub_dir)) {
+      die("Can't set owner of $home_dir to $uid/$gid: $!");
+    }
+  }
+
+  auth_user_write($auth_user_file, $user, $passwd, $uid, $gid, $home_dir,
+    '/bin/bash');
+
+  # The shim gives groups 600 to 699 as many MB used as their ID is past
+  # 600; the primary group has the canned 1 MB.
+  my $supp_groups = {
+    quota602 => 602,
+    quota605 => 605,
+  };
+
+  if (open(my $fh, "> $auth_group_file")) {
+    print $fh "$group:*:$gid:$user\n";
+    foreach my $supp_group (sort(keys(%$supp_groups))) {
+      print $fh "$supp_group:*:$supp_groups->{$supp_group}:$user\n";
+    }
+
+    unless (close($fh)) {
+      die("Can't write $auth_group_file: $!");
+    }
+
+  } else {
+    die("Can't open $auth_group_file: $!");
+  }
+
+  my $shim_lib = fsquota_shim_lib($tmpdir);
+  my $shim_log = File::Spec->rel2abs("$tmpdir/syscalls.log");
+
+  my $display = "Group: %{fsquota.group.name} %{fsquota.group.kb.used} of %{fsquota.group.kb.total}\n";
+
+  my $login_file = File::Spec->rel2abs("$tmpdir/login.txt");
+  my $chdir_file = File::Spec->rel2abs("$sub_dir/.message");
+  foreach my $file ($login_file, $chdir_file) {
+    if (open(my $fh, "> $file")) {
+      print $fh $display;
+      unless (close($fh)) {
+        die("Can't write $file: $!");
+      }
+
+    } else {
+      die("Can't open $file: $!");
+    }
+  }
+
+  my $config = {
+    PidFile => $pid_file,
+    ScoreboardFile => $scoreboard_file,
+    SystemLog => $log_file,
+    TraceLog => $log_file,
+    Trace => 'DEFAULT:10 event:0 lock:0 scoreboard:0 signal:0 fsquota:20',
+
+    AuthUserFile => $auth_user_file,
+    AuthGroupFile => $auth_group_file,
+    SocketBindTight => 'on',
+
+    DisplayLogin => $login_file,
+    DisplayChdir => '.message',
+
+    IfModules => {
+      'mod_fsquota.c' => {
+        FSQuotaEngine => 'on',
+        FSQuotaCacheTTL => 60,
+      },
+
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($config_file, $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+  my $daemon_pid;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($user, $passwd);
+
+      # The group variables follow the group with the least space left.
+      my $resp_msg = join("\n", @{ $client->response_msgs() });
+      my $expected = 'Group: quota605 05MB of 10MB';
+      $self->assert(qr/$expected/, $resp_msg,
+        test_msg("Expected response message '$expected', got '$resp_msg'"));
+
+      $client->site('FSQUOTA');
+      $resp_msg = join("\n", @{ $client->response_msgs() });
+
+      foreach my $expected (
+          'Most constrained group quota605: 05MB of 10MB, 10 of 100 files',
+          'Groups:',
+          '  ftpd: 1024KB of 10MB, 10 of 100 files',
+          '  quota602: 02MB of 10MB, 10 of 100 files',
+          '  quota605: 05MB of 10MB, 10 of 100 files') {
+        $self->assert(qr/\Q$expected\E/, $resp_msg,
+          test_msg("Expected response message '$expected', got '$resp_msg'"));
+      }
+
+      $client->cwd('sub');
+      $resp_msg = join("\n", @{ $client->response_msgs() });
+      $expected = 'Group: quota605 05MB of 10MB';
+      $self->assert(qr/$expected/, $resp_msg,
+        test_msg("Expected response message '$expected', got '$resp_msg'"));
+
+      $client->site('FSQUOTA');
+      $client->quit();
+
+      if (open(my $fh, "< $pid_file")) {
+        $daemon_pid = <$fh>;
+        chomp($daemon_pid);
+        close($fh);
+      }
+    };
+
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    $ENV{LD_PRELOAD} = $shim_lib;
+    $ENV{FSQUOTA_SHIM_LOG} = $shim_log;
+
+    eval { server_wait($config_file, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($pid_file);
+
+  $self->assert_child_ok($pid);
+
+  if ($ex) {
+    test_append_logfile($log_file, $ex);
+    unlink($log_file);
+
+    die($ex);
+  }
+
+  eval {
+    # Count the session's group quota queries, per group.
+    my $queries = {};
+    if (open(my $fh, "< $shim_log")) {
+      while (my $line = <$fh>) {
+        chomp($line);
+        my ($call_pid, $call_ppid, $call, $subcmd, $type, $id) =
+          split(' ', $line);
+
+        if (defined($daemon_pid) &&
+            $call_ppid == $daemon_pid &&
+            $call eq 'quotactl' &&
+            defined($subcmd) &&
+            $subcmd eq 'getquota' &&
+            $type == 1) {
+          $queries->{$id}++;
+        }
+      }
+
+      close($fh);
+
+    } else {
+      die("Can't read $shim_log: $!");
+    }
+
+    # Within the TTL, each group is queried once, however often its values
+    # are shown.
+    foreach my $id ($gid, values(%$supp_groups)) {
+      my $count = $queries->{$id} || 0;
+      $self->assert($count == 1,
+        test_msg("Expected 1 quota query for group ID $id, got $count"));
+    }
+  };
+  if ($@) {
+    $ex = $@;
+  }
+
+  if ($ex) {
+    test_append_logfile($log_file, $ex);
+    unlink($log_file);
+
+    die($ex);
+  }
+
+  unlink($log_file);
+}
+
+sub fsquota_statvfs_hook {
+  my $self = shift;
+  my $tmpdir = $self->{tmpdir};
+
+  unless (feature_have_module_compiled('mod_dso.c')) {
+    print STDERR " + mod_dso not compiled, skipping\n";
+    return;
+  }
+
+  # The hook is called by a test module, standing in for e.g. mod_sftp; it is
+  # built against the proftpd source tree in which the tests run.
+  my $module_src = File::Spec->rel2abs(
+    't/etc/modules/mod_fsquota/mod_fsquota_statvfs.c');
+  my $module_dir = File::Spec->rel2abs($tmpdir);
+  my $module_lib = "$module_dir/mod_fsquota_statvfs.so";
+  my $res = system("cc -shared -fPIC -DPR_SHARED_MODULE -I. -Iinclude -o $module_lib $module_src");
+  if ($res != 0) {
+    print STDERR " + can't compile $module_src, skipping\n";
+    return;
+  }
+
+  my $config_file = "$tmpdir/fsquota.conf";
+  my $pid_file = File::Spec->rel2abs("$tmpdir/fsquota.pid");
+  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/fsquota.scoreboard");
+
+  my $log_file = test_get_logfile();
+
+  my $auth_user_file = File::Spec->rel2abs("$tmpdir/fsquota.passwd");
+  my $auth_group_file = File::Spec->rel2abs("$tmpdir/fsquota.group");
+
+  my $user = 'proftpd';
+  my $passwd = 'test';
+  my $group = 'ftpd';
+  my $home_dir = File::Spec->rel2abs($tmpdir);
+  my $uid = 500;
+  my $gid = 500;
+
+  # Make sure that, if we're running as root, that the home directory has
+  # permissions/privs set for the account we create
+  if ($< == 0) {
+    unless (chmod(0755, $home_dir)) {
+      die("Can't set perms on $home_dir to 0755: $!");
+    }
+
+    unless (chown($uid, $gid, $home_dir)) {
+      die("Can't set owner of $home_dir to $uid/$gid: $!");
+    }
+  }
+
+  auth_user_write($auth_user_file, $user, $passwd, $uid, $gid, $home_dir,
+    '/bin/bash');
+
+  # The primary group has the canned 1 MB of 10 MB used; the shim gives the
+  # supplementary group 5 MB, so that it has the least left.
+  if (open(my $fh, "> $auth_group_file")) {
+    print $fh "$group:*:$gid:$user\n";
+    print $fh "quota605:*:605:$user\n";
+
+    unless (close($fh)) {
+      die("Can't write $auth_group_file: $!");
+    }
+
+  } else {
+    die("Can't open $auth_group_file: $!");
+  }
+
+  my $shim_lib = fsquota_shim_lib($tmpdir);
+  my $shim_log = File::Spec->rel2abs("$tmpdir/syscalls.log");
+
+  my $config = {
+    PidFile => $pid_file,
+    ScoreboardFile => $scoreboard_file,
+    SystemLog => $log_file,
+    TraceLog => $log_file,
+    Trace => 'DEFAULT:10 event:0 lock:0 scoreboard:0 signal:0 fsquota:20',
+
+    AuthUserFile => $auth_user_file,
+    AuthGroupFile => $auth_group_file,
+    SocketBindTight => 'on',
+    DefaultRoot => '~',
+
+    IfModules => {
+      'mod_fsquota.c' => {
+        FSQuotaEngine => 'on',
+        FSQuotaCacheTTL => 60,
+      },
+
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($config_file, $config);
+
+  # ModulePath has to precede LoadModule.
+  if (open(my $fh, ">> $config_file")) {
+    print $fh <<EOC;
+<IfModule mod_dso.c>
+  ModulePath $module_dir
+  LoadModule mod_fsquota_statvfs.c
+</IfModule>
+EOC
+    unless (close($fh)) {
+      die("Can't write $config_file: $!");
+    }
+
+  } else {
+    die("Can't open $config_file: $!");
+  }
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($user, $passwd);
+
+      my ($resp_code, $resp_msg) = $client->site('STATVFS');
+
+      my $expected = 200;
+      $self->assert($expected == $resp_code,
+        test_msg("Expected response code $expected, got $resp_code"));
+
+      unless ($resp_msg =~ /^bavail (\d+) (\d+) favail (\d+) (\d+) frsize (\d+)$/) {
+        die("Unexpected response message '$resp_msg'");
+      }
+
+      my ($bavail, $clamped_bavail, $favail, $clamped_favail, $frsize) =
+        ($1, $2, $3, $4, $5);
+
+      # The most constrained of the user and all of the groups wins: the
+      # supplementary group, with 5 MB and 90 files left.
+      my $blocks_left = int((5120 * 1024) / $frsize);
+      $expected = ($bavail < $blocks_left ? $bavail : $blocks_left);
+      $self->assert($expected == $clamped_bavail,
+        test_msg("Expected f_bavail $expected (from $bavail), got $clamped_bavail"));
+
+      $expected = ($favail < 90 ? $favail : 90);
+      $self->assert($expected == $clamped_favail,
+        test_msg("Expected f_favail $expected (from $favail), got $clamped_favail"));
+
+      $client->quit();
+    };
+
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    $ENV{LD_PRELOAD} = $shim_lib;
+    $ENV{FSQUOTA_SHIM_LOG} = $shim_log;
+
+    eval { server_wait($config_file, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($pid_file);
+
+  $self->assert_child_ok($pid);
+
+  if ($ex) {
+    test_append_logfile($log_file, $ex);
+    unlink($log_file);
+
+    die($ex);
+  }
+
+  unlink($log_file);
+}
+
+# Runs a login, and a SITE FSQUOTA, against a server with the syscall shim
+# preloaded, as if on btrfs, with the given qgroup sysfs values; returns the
+# login and SITE FSQUOTA response messages.
+sub fsquota_btrfs_run {
+  my $self = shift;
+  my $qgroup_values = shift;
+  my $tmpdir = $self->{tmpdir};
+
+  my $config_file = "$tmpdir/fsquota.conf";
+  my $pid_file = File::Spec->rel2abs("$tmpdir/fsquota.pid");
+  my $scoreboard_file = File::Spec->rel2abs("$tmpdir/fsquota.scoreboard");
+
+  my $log_file = test_get_logfile();
+
+  my $auth_user_file = File::Spec->rel2abs("$tmpdir/fsquota.passwd");
+  my $auth_group_file = File::Spec->rel2abs("$tmpdir/fsquota.group");
+
+  my $user = 'proftpd';
+  my $passwd = 'test';
+  my $group = 'ftpd';
+  my $home_dir = File::Spec->rel2abs($tmpdir);
+  my $uid = 500;
+  my $gid = 500;
+
+  # Make sure that, if we're running as root, that the home directory has
+  # permissions/privs set for the account we create
+  if ($< == 0) {
+    unless (chmod(0755, $home_dir)) {
+      die("Can't set perms on $home_dir to 0755: $!");
+    }
+
+    unless (chown($uid, $gid, $home_dir)) {
+      die("Can't set owner of $home_dir to $uid/$gid: $!");
+    }
+  }
+
+  auth_user_write($auth_user_file, $user, $passwd, $uid, $gid, $home_dir,
+    '/bin/bash');
+  auth_group_write($auth_group_file, $group, $gid, $user);
+
+  # The shim puts every path in subvolume 257 of a filesystem with a fixed
+  # fsid.
+  my $sysfs_dir = File::Spec->rel2abs("$tmpdir/sysfs");
+  my $qgroup_dir = "$sysfs_dir/00010203-0405-0607-0809-0a0b0c0d0e0f/qgroups/0_257";
+  mkpath($qgroup_dir);
+
+  foreach my $name (keys(%$qgroup_values)) {
+    my $path = "$qgroup_dir/$name";
+
+    if (open(my $fh, "> $path")) {
+      print $fh "$qgroup_values->{$name}\n";
+      unless (close($fh)) {
+        die("Can't write $path: $!");
+      }
+
+    } else {
+      die("Can't open $path: $!");
+    }
+  }
+
+  my $shim_lib = fsquota_shim_lib($tmpdir);
+
+  my $login_file = File::Spec->rel2abs("$tmpdir/login.txt");
+  if (open(my $fh, "> $login_file")) {
+    print $fh <<EOD;
+User: %{fsquota.user.kb.used} of %{fsquota.user.kb.total}
+Group: %{fsquota.group.kb.used} of %{fsquota.group.kb.total} (%{fsquota.group.enabled})
+EOD
+    unless (close($fh)) {
+      die("Can't write $login_file: $!");
+    }
+
+  } else {
+    die("Can't open $login_file: $!");
+  }
+
+  my $config = {
+    PidFile => $pid_file,
+    ScoreboardFile => $scoreboard_file,
+    SystemLog => $log_file,
+    TraceLog => $log_file,
+    Trace => 'DEFAULT:10 event:0 lock:0 scoreboard:0 signal:0 fsquota:20',
+
+    AuthUserFile => $auth_user_file,
+    AuthGroupFile => $auth_group_file,
+    SocketBindTight => 'on',
+
+    DisplayLogin => $login_file,
+
+    IfModules => {
+      'mod_fsquota.c' => {
+        FSQuotaEngine => 'on',
+        FSQuotaCacheTTL => 60,
+      },
+
+      'mod_delay.c' => {
+        DelayEngine => 'off',
+      },
+    },
+  };
+
+  my ($port, $config_user, $config_group) = config_write($config_file, $config);
+
+  # Open pipes, for use between the parent and child processes.  Specifically,
+  # the child will indicate when it's done with its test by writing a message
+  # to the parent.
+  my ($rfh, $wfh);
+  unless (pipe($rfh, $wfh)) {
+    die("Can't open pipe: $!");
+  }
+
+  my $ex;
+  my $login_msg = '';
+  my $site_msg = '';
+
+  # Fork child
+  $self->handle_sigchld();
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    eval {
+      my $client = ProFTPD::TestSuite::FTP->new('127.0.0.1', $port);
+      $client->login($user, $passwd);
+      $login_msg = join("\n", @{ $client->response_msgs() });
+
+      $client->site('FSQUOTA');
+      $site_msg = join("\n", @{ $client->response_msgs() });
+
+      $client->quit();
+    };
+
+    if ($@) {
+      $ex = $@;
+    }
+
+    $wfh->print("done\n");
+    $wfh->flush();
+
+  } else {
+    $ENV{LD_PRELOAD} = $shim_lib;
+    $ENV{FSQUOTA_SHIM_BTRFS_SYSFS} = $sysfs_dir;
+
+    eval { server_wait($config_file, $rfh) };
+    if ($@) {
+      warn($@);
+      exit 1;
+    }
+
+    exit 0;
+  }
+
+  # Stop server
+  server_stop($pid_file);
+
+  $self->assert_child_ok($pid);
+
+  if ($ex) {
+    test_append_logfile($log_file, $ex);
+    unlink($log_file);
+
+    die($ex);
+  }
+
+  unlink($log_file);
+
+  return ($login_msg, $site_msg);
+}
+
+sub fsquota_btrfs_qgroups {
+  my $self = shift;
+
+  unless ($^O eq 'linux') {
+    print STDERR " + btrfs qgroups are Linux-only, skipping\n";
+    return;
+  }
+
+  # The referenced values, when there is a referenced limit.
+  my ($login_msg, $site_msg) = fsquota_btrfs_run($self, {
+    referenced => 3 * 1024 * 1024,
+    max_referenced => 10 * 1024 * 1024,
+    exclusive => 2 * 1024 * 1024,
+    max_exclusive => 8 * 1024 * 1024,
+  });
+
+  # Btrfs has no group quotas, which is said rather than failing.
+  foreach my $expected (
+      'User: 03MB of 10MB',
+      'Group: none of none (false)') {
+    $self->assert(qr/\Q$expected\E/, $login_msg,
+      test_msg("Expected response message '$expected', got '$login_msg'"));
+  }
+
+  foreach my $expected (
+      'User proftpd: 03MB of 10MB, 0 of unlimited files',
+      'Groups: none, this filesystem has no group quotas') {
+    $self->assert(qr/\Q$expected\E/, $site_msg,
+      test_msg("Expected response message '$expected', got '$site_msg'"));
+  }
+
+  # The exclusive values, when only the exclusive limit is set.
+  ($login_msg, $site_msg) = fsquota_btrfs_run($self, {
+    referenced => 3 * 1024 * 1024,
+    max_referenced => 'none',
+    exclusive => 2 * 1024 * 1024,
+    max_exclusive => 8 * 1024 * 1024,
+  });
+
+  my $expected = 'User: 02MB of 08MB';
+  $self->assert(qr/\Q$expected\E/, $login_msg,
+    test_msg("Expected response message '$expected', got '$login_msg'"));
+
+  $expected = 'User proftpd: 02MB of 08MB, 0 of unlimited files';
+  $self->assert(qr/\Q$expected\E/, $site_msg,
+    test_msg("Expected response message '$expected', got '$site_msg'"));
+}
+
 1;
@@ -0,0 +1,325 @@
+#!/usr/bin/env perl
+
+# Login storm harness for mod_fsquota: starts proftpd with the syscall shim
+# preloaded as the quota backend, then has a number of clients log in at the
+# same moment, each rendering a DisplayLogin file full of quota variables,
+# changing directory, and issuing SITE FSQUOTA.  Reports the login latency
+# percentiles, and the quotactl(2) calls made by the sessions.
+#
+# Run from the top of the source tree, like the tests:
+#
+#  perl t/modules/mod_fsquota-load.pl --clients 500 --latency 20000 \
+#    --set FSQuotaCacheTTL=60
+
+use lib qw(t/lib);
+use strict;
+
+use File::Path qw(mkpath);
+use File::Spec;
+use File::Temp qw(tempdir);
+use Getopt::Long;
+use IO::Handle;
+use Net::FTP;
+use Time::HiRes qw(sleep time);
+
+use ProFTPD::TestSuite::Utils qw(:auth :config :running :test :testsuite);
+use ProFTPD::Tests::Modules::mod_fsquota;
+
+$| = 1;
+
+my $clients = 100;
+my $latency = 0;
+my $settings = [];
+my $keep = 0;
+
+GetOptions(
+  'clients=i' => \$clients,
+  'latency=i' => \$latency,
+  'set=s' => $settings,
+  'keep' => \$keep,
+) or die("Usage: $0 [--clients count] [--latency usecs] " .
+  "[--set Directive=value ...] [--keep]\n");
+
+my $tmpdir = tempdir('fsquota-load-XXXXXX', TMPDIR => 1, CLEANUP => !$keep);
+
+my $config_file = "$tmpdir/fsquota.conf";
+my $pid_file = File::Spec->rel2abs("$tmpdir/fsquota.pid");
+my $scoreboard_file = File::Spec->rel2abs("$tmpdir/fsquota.scoreboard");
+my $log_file = File::Spec->rel2abs("$tmpdir/fsquota.log");
+
+my $auth_user_file = File::Spec->rel2abs("$tmpdir/fsquota.passwd");
+my $auth_group_file = File::Spec->rel2abs("$tmpdir/fsquota.group");
+
+my $user = 'proftpd';
+my $passwd = 'test';
+my $group = 'ftpd';
+my $home_dir = File::Spec->rel2abs($tmpdir);
+my $uid = 500;
+my $gid = 500;
+
+my $sub_dir = File::Spec->rel2abs("$tmpdir/sub");
+mkpath($sub_dir);
+
+if ($< == 0) {
+  unless (chmod(0755, $home_dir, $sub_dir)) {
+    die("Can't set perms on $home_dir to 0755: $!");
+  }
+
+  unless (chown($uid, $gid, $home_dir, $sub_dir)) {
+    die("Can't set owner of $home_dir to $uid/$gid: $!");
+  }
+}
+
+auth_user_write($auth_user_file, $user, $passwd, $uid, $gid, $home_dir,
+  '/bin/bash');
+auth_group_write($auth_group_file, $group, $gid, $user);
+
+my $shim_lib = ProFTPD::Tests::Modules::mod_fsquota::fsquota_shim_lib($tmpdir);
+my $shim_log = File::Spec->rel2abs("$tmpdir/syscalls.log");
+
+my $display = <<EOD;
+User quota: %{fsquota.user.enabled}
+  Bytes: %{fsquota.user.kb.used} of %{fsquota.user.kb.total}
+  Files: %{fsquota.user.files.used} of %{fsquota.user.files.total}
+Group quota: %{fsquota.group.enabled} (%{fsquota.group.name})
+  Bytes: %{fsquota.group.kb.used} of %{fsquota.group.kb.total}
+  Files: %{fsquota.group.files.used} of %{fsquota.group.files.total}
+EOD
+
+my $login_file = File::Spec->rel2abs("$tmpdir/login.txt");
+my $chdir_file = File::Spec->rel2abs("$sub_dir/.message");
+foreach my $file ($login_file, $chdir_file) {
+  if (open(my $fh, "> $file")) {
+    print $fh $display;
+    unless (close($fh)) {
+      die("Can't write $file: $!");
+    }
+
+  } else {
+    die("Can't open $file: $!");
+  }
+}
+
+my $fsquota_config = {
+  FSQuotaEngine => 'on',
+  FSQuotaOptions => 'ShowQuota',
+};
+
+foreach my $setting (@$settings) {
+  my ($name, $value) = split(/=/, $setting, 2);
+  unless (defined($value)) {
+    die("Badly formatted --set '$setting', expected Directive=value\n");
+  }
+
+  $fsquota_config->{$name} = $value;
+}
+
+my $config = {
+  PidFile => $pid_file,
+  ScoreboardFile => $scoreboard_file,
+  SystemLog => $log_file,
+
+  AuthUserFile => $auth_user_file,
+  AuthGroupFile => $auth_group_file,
+  SocketBindTight => 'on',
+  DefaultRoot => '~',
+
+  # Let the storm in, all at once.
+  MaxInstances => $clients + 10,
+  TcpBackLog => $clients,
+
+  DisplayLogin => $login_file,
+  DisplayChdir => '.message',
+
+  IfModules => {
+    'mod_fsquota.c' => $fsquota_config,
+
+    'mod_delay.c' => {
+      DelayEngine => 'off',
+    },
+  },
+};
+
+my ($port, $config_user, $config_group) = config_write($config_file, $config);
+
+my ($rfh, $wfh);
+unless (pipe($rfh, $wfh)) {
+  die("Can't open pipe: $!");
+}
+
+defined(my $server_pid = fork()) or die("Can't fork: $!");
+unless ($server_pid) {
+  close($wfh);
+
+  $ENV{LD_PRELOAD} = $shim_lib;
+  $ENV{FSQUOTA_SHIM_LOG} = $shim_log;
+  $ENV{FSQUOTA_SHIM_LATENCY} = $latency;
+
+  eval { server_wait($config_file, $rfh) };
+  if ($@) {
+    warn($@);
+    exit 1;
+  }
+
+  exit 0;
+}
+
+close($rfh);
+
+# Give the daemon time to start listening.
+sleep(2);
+
+my $daemon_pid;
+if (open(my $fh, "< $pid_file")) {
+  $daemon_pid = <$fh>;
+  chomp($daemon_pid);
+  close($fh);
+
+} else {
+  die("Can't read $pid_file: $!");
+}
+
+# Each client reports "ok login-secs" or "error message" on one line, which
+# is short enough to be written to the pipe atomically.
+my ($results_rfh, $results_wfh);
+unless (pipe($results_rfh, $results_wfh)) {
+  die("Can't open pipe: $!");
+}
+
+my $start = time() + 1;
+my $client_pids = [];
+
+for (my $i = 0; $i < $clients; $i++) {
+  defined(my $pid = fork()) or die("Can't fork: $!");
+  if ($pid) {
+    push(@$client_pids, $pid);
+    next;
+  }
+
+  close($results_rfh);
+  $results_wfh->autoflush(1);
+
+  my $now = time();
+  if ($now < $start) {
+    sleep($start - $now);
+  }
+
+  my $result;
+  eval {
+    my $t0 = time();
+
+    my $client = Net::FTP->new('127.0.0.1', Port => $port, Timeout => 60);
+    unless ($client) {
+      die("connect: $@\n");
+    }
+
+    unless ($client->login($user, $passwd)) {
+      die("login: " . $client->message());
+    }
+
+    my $elapsed = time() - $t0;
+
+    unless ($client->cwd('sub')) {
+      die("CWD: " . $client->message());
+    }
+
+    unless ($client->site('FSQUOTA') == 2) {
+      die("SITE FSQUOTA: " . $client->message());
+    }
+
+    $client->quit();
+    $result = sprintf("ok %.6f", $elapsed);
+  };
+
+  if ($@) {
+    $result = "error $@";
+    $result =~ s/\s+/ /g;
+  }
+
+  print $results_wfh "$result\n";
+  exit 0;
+}
+
+close($results_wfh);
+
+my $latencies = [];
+my $errors = {};
+
+while (my $line = <$results_rfh>) {
+  chomp($line);
+
+  if ($line =~ /^ok (\S+)$/) {
+    push(@$latencies, $1);
+
+  } else {
+    $line =~ s/^error //;
+    $errors->{$line}++;
+  }
+}
+
+close($results_rfh);
+
+foreach my $pid (@$client_pids) {
+  waitpid($pid, 0);
+}
+
+print $wfh "done\n";
+$wfh->flush();
+server_stop($pid_file);
+waitpid($server_pid, 0);
+
+# Only count the calls made by the sessions, i.e. the daemon's children.
+my $quotactls = 0;
+my $sessions = {};
+if (open(my $fh, "< $shim_log")) {
+  while (my $line = <$fh>) {
+    chomp($line);
+    my ($call_pid, $call_ppid, $call) = split(' ', $line);
+
+    if ($call eq 'quotactl' &&
+        $call_ppid == $daemon_pid) {
+      $quotactls++;
+      $sessions->{$call_pid} = 1;
+    }
+  }
+
+  close($fh);
+
+} else {
+  die("Can't read $shim_log: $!");
+}
+
+sub percentile {
+  my $sorted = shift;
+  my $pct = shift;
+
+  return 0 unless scalar(@$sorted);
+
+  my $idx = int(($pct / 100) * scalar(@$sorted) + 0.5) - 1;
+  $idx = 0 if $idx < 0;
+  $idx = $#$sorted if $idx > $#$sorted;
+
+  return $sorted->[$idx] * 1000;
+}
+
+my @sorted = sort { $a <=> $b } @$latencies;
+
+printf("clients: %d, quotactl latency: %d usecs\n", $clients, $latency);
+printf("logins: %d ok, %d failed\n", scalar(@sorted),
+  $clients - scalar(@sorted));
+printf("login latency (ms): p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n",
+  percentile(\@sorted, 50), percentile(\@sorted, 90),
+  percentile(\@sorted, 99), percentile(\@sorted, 100));
+printf("quotactl calls: %d total, %.2f per login, from %d sessions\n",
+  $quotactls, scalar(@sorted) ? $quotactls / scalar(@sorted) : 0,
+  scalar(keys(%$sessions)));
+
+foreach my $error (sort keys(%$errors)) {
+  printf("error (x%d): %s\n", $errors->{$error}, $error);
+}
+
+if ($keep) {
+  print "files kept in $tmpdir\n";
+}
+
+exit(scalar(keys(%$errors)) ? 1 : 0);